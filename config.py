@@ -22,6 +22,7 @@ def get_doc_classes():
     "VoxelStreamFile",
     "VoxelStreamBlockFiles",
     "VoxelStreamRegionFiles",
+    "VoxelStreamWorldFile",
 
     "VoxelGenerator",
     "VoxelGeneratorHeightmap",
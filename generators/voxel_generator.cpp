@@ -29,6 +29,12 @@ void VoxelGenerator::generate_block(VoxelBlockRequest &input) {
 	}
 }
 
+void VoxelGenerator::generate_blocks(Vector<VoxelBlockRequest> &requests) {
+	for (int i = 0; i < requests.size(); ++i) {
+		generate_block(requests.write[i]);
+	}
+}
+
 //bool VoxelGenerator::is_thread_safe() const {
 //	return false;
 //}
@@ -42,6 +48,10 @@ void VoxelGenerator::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_i
 	generate_block(r);
 }
 
+void VoxelGenerator::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
+	generate_blocks(p_blocks);
+}
+
 void VoxelGenerator::_b_generate_block(Ref<VoxelBuffer> out_buffer, Vector3 origin_in_voxels, int lod) {
 	ERR_FAIL_COND(lod < 0);
 	VoxelBlockRequest r = { out_buffer, Vector3i(origin_in_voxels), lod };
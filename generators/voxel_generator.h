@@ -18,11 +18,16 @@ public:
 	virtual void generate_block(VoxelBlockRequest &input);
 	// TODO Single sample
 
+	// Generates several blocks at once. Generators can override this to share work between blocks,
+	// for example when some of them are stacked in the same column. Don't reorder the vector.
+	virtual void generate_blocks(Vector<VoxelBlockRequest> &requests);
+
 	//	virtual bool is_thread_safe() const;
 	//	virtual bool is_cloneable() const;
 
 private:
 	void emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) override;
+	void emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) override;
 
 protected:
 	static void _bind_methods();
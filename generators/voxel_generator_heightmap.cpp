@@ -47,6 +47,60 @@ float VoxelGeneratorHeightmap::get_iso_scale() const {
 	return _iso_scale;
 }
 
+void VoxelGeneratorHeightmap::fill_below_heights(VoxelBuffer &out_buffer) const {
+	const bool use_sdf = _channel == VoxelBuffer::CHANNEL_SDF;
+	out_buffer.clear_channel(_channel, use_sdf ? 0 : _matter_type);
+}
+
+void VoxelGeneratorHeightmap::generate_from_heights(
+		VoxelBuffer &out_buffer, const float *heights, Vector3i origin, int lod) const {
+
+	const int channel = _channel;
+	const Vector3i bs = out_buffer.get_size();
+	const bool use_sdf = channel == VoxelBuffer::CHANNEL_SDF;
+	const int stride = 1 << lod;
+
+	if (use_sdf) {
+
+		for (int z = 0; z < bs.z; ++z) {
+			const float *row = heights + z * bs.x;
+
+			for (int x = 0; x < bs.x; ++x) {
+
+				const float h = row[x];
+				int gy = origin.y;
+				for (int y = 0; y < bs.y; ++y, gy += stride) {
+					float sdf = _iso_scale * (gy - h);
+					out_buffer.set_voxel_f(sdf, x, y, z, channel);
+				}
+
+			} // for x
+		} // for z
+
+	} else {
+		// Blocky
+
+		for (int z = 0; z < bs.z; ++z) {
+			const float *row = heights + z * bs.x;
+
+			for (int x = 0; x < bs.x; ++x) {
+
+				// Output is blocky, so we can go for just one sample
+				float h = row[x];
+				h -= origin.y;
+				int ih = int(h);
+				if (ih > 0) {
+					if (ih > bs.y) {
+						ih = bs.y;
+					}
+					out_buffer.fill_area(_matter_type, Vector3i(x, 0, z), Vector3i(x + 1, ih, z + 1), channel);
+				}
+
+			} // for x
+		} // for z
+	} // use_sdf
+}
+
 void VoxelGeneratorHeightmap::_bind_methods() {
 
 	ClassDB::bind_method(D_METHOD("set_channel", "channel"), &VoxelGeneratorHeightmap::set_channel);
@@ -1,9 +1,15 @@
 #ifndef VOXEL_GENERATOR_HEIGHTMAP_H
 #define VOXEL_GENERATOR_HEIGHTMAP_H
 
+#include "../math/vector3i.h"
+#include "../util/utility.h"
 #include "../voxel_buffer.h"
+#include "../voxel_constants.h"
 #include "voxel_generator.h"
+#include <core/hash_map.h>
 #include <core/image.h>
+#include <algorithm>
+#include <vector>
 
 namespace Voxel {
 
@@ -29,65 +35,167 @@ protected:
 	template <typename Height_F>
 	void generate(VoxelBuffer &out_buffer, Height_F height_func, Vector3i origin, int lod) {
 
-		const int channel = _channel;
 		const Vector3i bs = out_buffer.get_size();
-		bool use_sdf = channel == VoxelBuffer::CHANNEL_SDF;
 
-		if (origin.y > get_height_start() + get_height_range()) {
-			// The bottom of the block is above the highest ground can go (default is air)
+		if (is_above_heights(origin)) {
 			return;
 		}
-		if (origin.y + (bs.y << lod) < get_height_start()) {
-			// The top of the block is below the lowest ground can go
-			out_buffer.clear_channel(_channel, use_sdf ? 0 : _matter_type);
+		if (is_below_heights(origin, bs.y, lod)) {
+			fill_below_heights(out_buffer);
 			return;
 		}
 
-		const int stride = 1 << lod;
+		std::vector<float> heights;
+		heights.resize(bs.x * bs.z);
+		sample_heights(heights.data(), height_func, origin, bs, lod, nullptr, Vector3i(), 0);
 
-		if (use_sdf) {
+		generate_from_heights(out_buffer, heights.data(), origin, lod);
+	}
 
-			int gz = origin.z;
-			for (int z = 0; z < bs.z; ++z, gz += stride) {
+	// Generates multiple blocks, sampling heights only once per column of blocks.
+	// Heights of a column are also reused by columns of lower LOD index within the same area.
+	template <typename Height_F>
+	void generate_series(Vector<VoxelBlockRequest> &requests, Height_F height_func) {
+		VOXEL_PROFILE_SCOPE(profile_scope);
+
+		// Process coarse LODs first, so finer ones can reuse their samples
+		std::vector<int> order;
+		order.resize(requests.size());
+		for (unsigned int i = 0; i < order.size(); ++i) {
+			order[i] = i;
+		}
+		std::sort(order.begin(), order.end(), [&requests](int a, int b) {
+			const VoxelBlockRequest &ra = requests[a];
+			const VoxelBlockRequest &rb = requests[b];
+			if (ra.lod != rb.lod) {
+				return ra.lod > rb.lod;
+			}
+			if (ra.origin_in_voxels.z != rb.origin_in_voxels.z) {
+				return ra.origin_in_voxels.z < rb.origin_in_voxels.z;
+			}
+			return ra.origin_in_voxels.x < rb.origin_in_voxels.x;
+		});
+
+		// Heights sampled for each column, by (origin.x, lod, origin.z)
+		HashMap<Vector3i, HeightColumn, Vector3iHasher> columns;
+
+		for (unsigned int i = 0; i < order.size(); ++i) {
+			VoxelBlockRequest &r = requests.write[order[i]];
+			ERR_CONTINUE(r.voxel_buffer.is_null());
+			VoxelBuffer &out_buffer = **r.voxel_buffer;
+			const Vector3i origin = r.origin_in_voxels;
+			const Vector3i bs = out_buffer.get_size();
+
+			if (is_above_heights(origin)) {
+				continue;
+			}
+			if (is_below_heights(origin, bs.y, r.lod)) {
+				fill_below_heights(out_buffer);
+				continue;
+			}
+
+			const Vector3i column_key(origin.x, r.lod, origin.z);
+			HeightColumn *column = columns.getptr(column_key);
+
+			if (column == nullptr || column->size_x != bs.x || column->size_z != bs.z) {
+				HeightColumn new_column;
+				new_column.size_x = bs.x;
+				new_column.size_z = bs.z;
+				new_column.heights.resize(bs.x * bs.z);
+
+				// Find samples already taken by a coarser LOD covering this column
+				const HeightColumn *parent = nullptr;
+				Vector3i parent_origin;
+				int parent_lod = 0;
+				for (int plod = r.lod + 1; plod < (int)VoxelConstants::MAX_LOD && parent == nullptr; ++plod) {
+					const int pbs_x = bs.x << plod;
+					const int pbs_z = bs.z << plod;
+					parent_origin = Vector3i(udiv(origin.x, pbs_x) * pbs_x, 0, udiv(origin.z, pbs_z) * pbs_z);
+					const int parent_stride = 1 << plod;
+					if ((origin.x - parent_origin.x) % parent_stride != 0 || (origin.z - parent_origin.z) % parent_stride != 0) {
+						// Samples no longer line up, and won't with coarser LODs either
+						break;
+					}
+					parent = columns.getptr(Vector3i(parent_origin.x, plod, parent_origin.z));
+					if (parent != nullptr && (parent->size_x != bs.x || parent->size_z != bs.z)) {
+						parent = nullptr;
+					}
+					parent_lod = plod;
+				}
 
-				int gx = origin.x;
-				for (int x = 0; x < bs.x; ++x, gx += stride) {
+				sample_heights(new_column.heights.data(), height_func, origin, bs, r.lod, parent, parent_origin, parent_lod);
 
-					float h = _range.xform(height_func(gx, gz));
-					int gy = origin.y;
-					for (int y = 0; y < bs.y; ++y, gy += stride) {
-						float sdf = _iso_scale * (gy - h);
-						out_buffer.set_voxel_f(sdf, x, y, z, channel);
-					}
+				columns.set(column_key, new_column);
+				column = columns.getptr(column_key);
+			}
+
+			generate_from_heights(out_buffer, column->heights.data(), origin, r.lod);
+		}
+	}
 
-				} // for x
-			} // for z
+	// Heights sampled over the XZ area of a block, with the range already applied.
+	// Indexed by x + z * size_x.
+	struct HeightColumn {
+		std::vector<float> heights;
+		int size_x = 0;
+		int size_z = 0;
+	};
 
-		} else {
-			// Blocky
+	template <typename Height_F>
+	void sample_heights(float *heights, Height_F height_func, Vector3i origin, Vector3i bs, int lod,
+			const HeightColumn *parent, Vector3i parent_origin, int parent_lod) const {
 
+		const int stride = 1 << lod;
+
+		if (parent == nullptr) {
 			int gz = origin.z;
 			for (int z = 0; z < bs.z; ++z, gz += stride) {
-
+				float *row = heights + z * bs.x;
 				int gx = origin.x;
 				for (int x = 0; x < bs.x; ++x, gx += stride) {
+					row[x] = _range.xform(height_func(gx, gz));
+				}
+			}
+			return;
+		}
 
-					// Output is blocky, so we can go for just one sample
-					float h = _range.xform(height_func(gx, gz));
-					h -= origin.y;
-					int ih = int(h);
-					if (ih > 0) {
-						if (ih > bs.y) {
-							ih = bs.y;
-						}
-						out_buffer.fill_area(_matter_type, Vector3i(x, 0, z), Vector3i(x + 1, ih, z + 1), channel);
-					}
+		// Every few samples fall on those of the parent
+		const int parent_stride = 1 << parent_lod;
+		const int ratio = parent_stride / stride;
+		const int parent_x0 = (origin.x - parent_origin.x) / parent_stride;
+		const int parent_z0 = (origin.z - parent_origin.z) / parent_stride;
 
-				} // for x
-			} // for z
-		} // use_sdf
+		int gz = origin.z;
+		for (int z = 0; z < bs.z; ++z, gz += stride) {
+			float *row = heights + z * bs.x;
+			int gx = origin.x;
+
+			if (z % ratio == 0) {
+				const float *parent_row = parent->heights.data() + (parent_z0 + z / ratio) * parent->size_x + parent_x0;
+				for (int x = 0; x < bs.x; ++x, gx += stride) {
+					row[x] = x % ratio == 0 ? parent_row[x / ratio] : _range.xform(height_func(gx, gz));
+				}
+			} else {
+				for (int x = 0; x < bs.x; ++x, gx += stride) {
+					row[x] = _range.xform(height_func(gx, gz));
+				}
+			}
+		}
+	}
+
+	inline bool is_above_heights(Vector3i origin) const {
+		// The bottom of the block is above the highest ground can go (default is air)
+		return origin.y > get_height_start() + get_height_range();
 	}
 
+	inline bool is_below_heights(Vector3i origin, int size_y, int lod) const {
+		// The top of the block is below the lowest ground can go
+		return origin.y + (size_y << lod) < get_height_start();
+	}
+
+	void fill_below_heights(VoxelBuffer &out_buffer) const;
+	void generate_from_heights(VoxelBuffer &out_buffer, const float *heights, Vector3i origin, int lod) const;
+
 private:
 	static void _bind_methods();
 
@@ -60,6 +60,26 @@ void VoxelGeneratorImage::generate_block(VoxelBlockRequest &input) {
 	out_buffer.compress_uniform_channels();
 }
 
+void VoxelGeneratorImage::generate_blocks(Vector<VoxelBlockRequest> &requests) {
+
+	ERR_FAIL_COND(_image.is_null());
+
+	Image &image = **_image;
+
+	if (_blur_enabled) {
+		VoxelGeneratorHeightmap::generate_series(requests,
+				[&image](int x, int z) { return get_height_blurred(image, x, z); });
+	} else {
+		VoxelGeneratorHeightmap::generate_series(requests,
+				[&image](int x, int z) { return get_height_repeat(image, x, z); });
+	}
+
+	for (int i = 0; i < requests.size(); ++i) {
+		ERR_CONTINUE(requests[i].voxel_buffer.is_null());
+		requests.write[i].voxel_buffer->compress_uniform_channels();
+	}
+}
+
 void VoxelGeneratorImage::_bind_methods() {
 
 	ClassDB::bind_method(D_METHOD("set_image", "image"), &VoxelGeneratorImage::set_image);
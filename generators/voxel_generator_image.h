@@ -20,6 +20,7 @@ public:
 	bool is_blur_enabled() const;
 
 	void generate_block(VoxelBlockRequest &input) override;
+	void generate_blocks(Vector<VoxelBlockRequest> &requests) override;
 
 private:
 	static void _bind_methods();
@@ -42,6 +42,27 @@ void VoxelGeneratorNoise2D::generate_block(VoxelBlockRequest &input) {
 	out_buffer.compress_uniform_channels();
 }
 
+void VoxelGeneratorNoise2D::generate_blocks(Vector<VoxelBlockRequest> &requests) {
+
+	ERR_FAIL_COND(_noise.is_null());
+
+	OpenSimplexNoise &noise = **_noise;
+
+	if (_curve.is_null()) {
+		VoxelGeneratorHeightmap::generate_series(requests,
+				[&noise](int x, int z) { return 0.5 + 0.5 * noise.get_noise_2d(x, z); });
+	} else {
+		Curve &curve = **_curve;
+		VoxelGeneratorHeightmap::generate_series(requests,
+				[&noise, &curve](int x, int z) { return curve.interpolate_baked(0.5 + 0.5 * noise.get_noise_2d(x, z)); });
+	}
+
+	for (int i = 0; i < requests.size(); ++i) {
+		ERR_CONTINUE(requests[i].voxel_buffer.is_null());
+		requests.write[i].voxel_buffer->compress_uniform_channels();
+	}
+}
+
 void VoxelGeneratorNoise2D::_bind_methods() {
 
 	ClassDB::bind_method(D_METHOD("set_noise", "noise"), &VoxelGeneratorNoise2D::set_noise);
@@ -19,6 +19,7 @@ public:
 	Ref<Curve> get_curve() const;
 
 	void generate_block(VoxelBlockRequest &input) override;
+	void generate_blocks(Vector<VoxelBlockRequest> &requests) override;
 
 private:
 	static void _bind_methods();
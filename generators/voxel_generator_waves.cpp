@@ -24,6 +24,19 @@ void VoxelGeneratorWaves::generate_block(VoxelBlockRequest &input) {
 			input.origin_in_voxels, input.lod);
 }
 
+void VoxelGeneratorWaves::generate_blocks(Vector<VoxelBlockRequest> &requests) {
+
+	const Vector2 freq(
+			Math_PI / static_cast<float>(_pattern_size.x),
+			Math_PI / static_cast<float>(_pattern_size.y));
+	const Vector2 offset = _pattern_offset;
+
+	VoxelGeneratorHeightmap::generate_series(requests,
+			[freq, offset](int x, int z) {
+				return 0.5 + 0.25 * (Math::cos((x + offset.x) * freq.x) + Math::sin((z + offset.y) * freq.y));
+			});
+}
+
 void VoxelGeneratorWaves::set_pattern_size(Vector2 size) {
 	size.x = max(size.x, 0.1f);
 	size.y = max(size.y, 0.1f);
@@ -15,6 +15,7 @@ public:
 	VoxelBuffer::ChannelId get_channel() const;
 
 	void generate_block(VoxelBlockRequest &input) override;
+	void generate_blocks(Vector<VoxelBlockRequest> &requests) override;
 
 	Vector2 get_pattern_size() const { return _pattern_size; }
 	void set_pattern_size(Vector2 size);
@@ -1,6 +1,7 @@
 #ifndef VOXEL_VECTOR3I_H
 #define VOXEL_VECTOR3I_H
 
+#include "../util/morton.h"
 #include "../util/utility.h"
 #include <core/hashfuncs.h>
 #include <core/math/vector3.h>
@@ -251,6 +252,16 @@ struct Vector3iHasher {
 	}
 };
 
+// 64-bit hash for open-addressing maps, which need all bits to be well distributed.
+// The Morton code gives a different value to every position within 2^21 blocks,
+// and the multiplication spreads its bits to the high ones.
+struct Vector3iMortonHasher {
+	static _FORCE_INLINE_ uint64_t hash(const Vector3i &v) {
+		const uint64_t h = morton_encode_3(v.x, v.y, v.z) * 0x9e3779b97f4a7c15ull;
+		return h ^ (h >> 32);
+	}
+};
+
 }
 
 #endif // VOXEL_VECTOR3I_H
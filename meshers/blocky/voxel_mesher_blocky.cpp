@@ -487,6 +487,29 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelMesher::In
 	output.primitive_type = Mesh::PRIMITIVE_TRIANGLES;
 }
 
+void VoxelMesherBlocky::build_from_neighborhood(
+		VoxelMesher::Output &output, const VoxelBufferNeighborhood &neighborhood, int lod) {
+
+	const VoxelBuffer *voxels = neighborhood.get_central_buffer();
+	ERR_FAIL_COND(voxels == nullptr);
+
+	// Only voxels of the central block produce geometry.
+	// If it's all air, there is no need to gather its neighbors.
+	const int channel = VoxelBuffer::CHANNEL_TYPE;
+	if (voxels->is_uniform(channel)) {
+		const uint64_t voxel_id = voxels->get_voxel(0, 0, 0, channel);
+		if (voxel_id == 0 || (_library.is_valid() && !_library->has_voxel(voxel_id))) {
+			return;
+		}
+	}
+
+	VoxelMesher::build_from_neighborhood(output, neighborhood, lod);
+}
+
+uint32_t VoxelMesherBlocky::get_used_channels_mask() const {
+	return 1 << VoxelBuffer::CHANNEL_TYPE;
+}
+
 VoxelMesher *VoxelMesherBlocky::clone() {
 	VoxelMesherBlocky *c = memnew(VoxelMesherBlocky);
 	c->set_library(_library);
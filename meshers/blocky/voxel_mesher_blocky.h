@@ -29,6 +29,8 @@ public:
 	bool get_occlusion_enabled() const { return _bake_occlusion; }
 
 	void build(VoxelMesher::Output &output, const VoxelMesher::Input &input) override;
+	void build_from_neighborhood(VoxelMesher::Output &output, const VoxelBufferNeighborhood &neighborhood, int lod) override;
+	uint32_t get_used_channels_mask() const override;
 
 	VoxelMesher *clone() override;
 
@@ -104,6 +104,7 @@ public:
 	SeamMode get_seam_mode() const;
 
 	void build(VoxelMesher::Output &output, const VoxelMesher::Input &input) override;
+	uint32_t get_used_channels_mask() const override;
 
 	Dictionary get_statistics() const;
 
@@ -953,6 +953,10 @@ int VoxelMesherTransvoxel::emit_vertex(Vector3 primary, Vector3 normal, uint16_t
 	return vi;
 }
 
+uint32_t VoxelMesherTransvoxel::get_used_channels_mask() const {
+	return 1 << VoxelBuffer::CHANNEL_SDF;
+}
+
 VoxelMesher *VoxelMesherTransvoxel::clone() {
 	return memnew(VoxelMesherTransvoxel);
 }
@@ -18,6 +18,7 @@ public:
 	VoxelMesherTransvoxel();
 
 	void build(VoxelMesher::Output &output, const VoxelMesher::Input &input) override;
+	uint32_t get_used_channels_mask() const override;
 
 	VoxelMesher *clone() override;
 
@@ -1,4 +1,5 @@
 #include "voxel_mesher.h"
+#include "../util/utility.h"
 
 namespace Voxel {
 
@@ -29,6 +30,72 @@ void VoxelMesher::build(Output &output, const Input &input) {
 	ERR_PRINT("Not implemented");
 }
 
+void VoxelMesher::build_from_neighborhood(Output &output, const VoxelBufferNeighborhood &neighborhood, int lod) {
+
+	const Vector3i padded_size(neighborhood.get_block_size() + _minimum_padding + _maximum_padding);
+
+	if (_padded_voxels.is_null()) {
+		_padded_voxels.instance();
+	}
+	if (_padded_voxels->get_size() != padded_size) {
+		_padded_voxels->create(padded_size);
+	}
+
+	// Every voxel of the used channels gets overwritten, so the previous contents don't need clearing
+	neighborhood.copy_to(**_padded_voxels, Vector3i(-_minimum_padding), get_used_channels_mask());
+
+	Input input = { **_padded_voxels, lod };
+	build(output, input);
+}
+
+uint32_t VoxelMesher::get_used_channels_mask() const {
+	return VoxelBuffer::ALL_CHANNELS_MASK;
+}
+
+namespace {
+
+void pack_surface_arrays(const Vector<Array> &surfaces, Mesh::PrimitiveType primitive, unsigned int compression_flags,
+		Vector<RenderingServer::SurfaceData> &out_packed_surfaces) {
+
+	RenderingServer &rs = *RenderingServer::get_singleton();
+
+	out_packed_surfaces.resize(surfaces.size());
+
+	for (int i = 0; i < surfaces.size(); ++i) {
+		RenderingServer::SurfaceData &packed_surface = out_packed_surfaces.write[i];
+		packed_surface = RenderingServer::SurfaceData();
+
+		const Array &surface = surfaces[i];
+		if (surface.empty()) {
+			continue;
+		}
+		CRASH_COND(surface.size() != Mesh::ARRAY_MAX);
+		if (!is_surface_triangulated(surface)) {
+			continue;
+		}
+
+		// This doesn't create any resource, it only formats vertices
+		const Error err = rs.mesh_create_surface_data_from_arrays(&packed_surface,
+				RenderingServer::PrimitiveType(primitive), surface, Array(), Dictionary(), compression_flags);
+
+		if (err != OK) {
+			ERR_PRINT(String("Could not pack mesh surface: error {0}").format(varray(err)));
+			packed_surface = RenderingServer::SurfaceData();
+		}
+	}
+}
+
+} // namespace
+
+void VoxelMesher::pack_surfaces(Output &output) {
+	pack_surface_arrays(output.surfaces, output.primitive_type, output.compression_flags, output.packed_surfaces);
+
+	for (unsigned int i = 0; i < output.transition_surfaces.size(); ++i) {
+		pack_surface_arrays(output.transition_surfaces[i], output.primitive_type, output.compression_flags,
+				output.packed_transition_surfaces[i]);
+	}
+}
+
 int VoxelMesher::get_minimum_padding() const {
 	return _minimum_padding;
 }
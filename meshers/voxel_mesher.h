@@ -4,7 +4,9 @@
 #include "../cube_tables.h"
 #include "../util/fixed_array.h"
 #include "../voxel_buffer.h"
+#include "../voxel_buffer_neighborhood.h"
 #include <scene/resources/mesh.h>
+#include <servers/rendering_server.h>
 
 namespace Voxel {
 
@@ -22,10 +24,26 @@ public:
 		FixedArray<Vector<Array>, Cube::SIDE_COUNT> transition_surfaces;
 		Mesh::PrimitiveType primitive_type = Mesh::PRIMITIVE_TRIANGLES;
 		unsigned int compression_flags = Mesh::ARRAY_COMPRESS_DEFAULT;
+
+		// Same surfaces in the format of the rendering server, with compression applied. Filled by pack_surfaces().
+		// Surfaces which have nothing to render are left with no vertices.
+		Vector<RenderingServer::SurfaceData> packed_surfaces;
+		FixedArray<Vector<RenderingServer::SurfaceData>, Cube::SIDE_COUNT> packed_transition_surfaces;
 	};
 
 	virtual void build(Output &output, const Input &voxels);
 
+	// Converts surfaces so the main thread only has to upload them. Can be called from any thread.
+	static void pack_surfaces(Output &output);
+
+	// Builds the mesh of the central block of a neighborhood, which provides padding voxels around it.
+	// By default, voxels are gathered in a single padded buffer and passed to build().
+	// That buffer is kept for the next call, so a mesher must not be used by more than one thread at a time.
+	virtual void build_from_neighborhood(Output &output, const VoxelBufferNeighborhood &neighborhood, int lod);
+
+	// Channels the mesher reads voxels from
+	virtual uint32_t get_used_channels_mask() const;
+
 	// Get how many neighbor voxels need to be accessed around the meshed area.
 	// If this is not respected, the mesher might produce seams at the edges, or an error
 	int get_minimum_padding() const;
@@ -44,6 +62,8 @@ protected:
 private:
 	int _minimum_padding = 0;
 	int _maximum_padding = 0;
+
+	Ref<VoxelBuffer> _padded_voxels;
 };
 
 }
@@ -13,6 +13,7 @@
 #include "streams/voxel_stream_block_files.h"
 #include "streams/voxel_stream_file.h"
 #include "streams/voxel_stream_region_files.h"
+#include "streams/voxel_stream_world_file.h"
 #include "terrain/voxel_box_mover.h"
 #include "terrain/voxel_lod_terrain.h"
 #include "terrain/voxel_map.h"
@@ -41,6 +42,7 @@ void register_voxel_types() {
 	ClassDB::register_class<VoxelStreamFile>();
 	ClassDB::register_class<VoxelStreamBlockFiles>();
 	ClassDB::register_class<VoxelStreamRegionFiles>();
+	ClassDB::register_class<VoxelStreamWorldFile>();
 
 	// Generators
 	ClassDB::register_class<VoxelGenerator>();
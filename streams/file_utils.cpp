@@ -1,4 +1,9 @@
 #include "file_utils.h"
+#include <core/project_settings.h>
+
+#ifdef UNIX_ENABLED
+#include <unistd.h>
+#endif
 
 namespace Voxel {
 
@@ -66,4 +71,16 @@ Error check_directory_created(const String &directory_path) {
 	return OK;
 }
 
+Error truncate_file(const String &fpath, uint64_t new_size) {
+#ifdef UNIX_ENABLED
+	const String path = ProjectSettings::get_singleton()->globalize_path(fpath);
+	if (truncate(path.utf8().get_data(), new_size) != 0) {
+		return ERR_FILE_CANT_WRITE;
+	}
+	return OK;
+#else
+	return ERR_UNAVAILABLE;
+#endif
+}
+
 }
@@ -48,6 +48,10 @@ const char *to_string(VoxelFileResult res);
 VoxelFileResult check_magic_and_version(FileAccess *f, uint8_t expected_version, const char *expected_magic, uint8_t &out_version);
 Error check_directory_created(const String &directory_path);
 
+// Shortens a file which is not currently open. FileAccess has no way to do this.
+// Returns ERR_UNAVAILABLE on platforms where this is not implemented.
+Error truncate_file(const String &fpath, uint64_t new_size);
+
 }
 
 #endif // FILE_UTILS_H
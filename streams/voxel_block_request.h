@@ -12,6 +12,9 @@ struct VoxelBlockRequest {
 	Ref<VoxelBuffer> voxel_buffer;
 	Vector3i origin_in_voxels;
 	int lod;
+	// Channels the requester cares about. Streams may leave out the others when loading or saving.
+	// Terrains use channels of their meshers, and those they were asked to save.
+	uint32_t channels_mask = VoxelBuffer::ALL_CHANNELS_MASK;
 };
 
 }
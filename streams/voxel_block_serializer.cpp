@@ -1,209 +1,1044 @@
 #include "voxel_block_serializer.h"
 #include "../math/vector3i.h"
 #include "../thirdparty/lz4/lz4.h"
+#include "../util/checksum.h"
 #include "../voxel_buffer.h"
 #include "../voxel_memory_pool.h"
+#include <core/io/marshalls.h>
 #include <core/os/file_access.h>
 
+#include <zstd.h>
+
 namespace Voxel {
 
 namespace {
-// TODO Introduce versionning
 const unsigned int BLOCK_TRAILING_MAGIC = 0x900df00d;
 const int BLOCK_TRAILING_MAGIC_SIZE = 4;
-} // namespace
 
-unsigned int VoxelBlockSerializer::get_size_in_bytes(const VoxelBuffer &buffer) {
+// Compressed blocks start with a header.
+// Legacy blocks only had the decompressed size there, which can't have the highest bit set.
+const uint32_t COMPRESSED_FORMAT_VERSIONED_BIT = 0x80000000;
+// Version 1 compresses the whole serialized block at once.
+// Version 2 compresses it in pieces, straight from channel memory.
+// Version 3 only stores some of the channels.
+// Version 4 stores a checksum of each reference channel in deltas.
+const uint32_t COMPRESSED_FORMAT_VERSION = 4;
+// format + codec + dictionary ID + decompressed size + channels mask
+const unsigned int COMPRESSED_HEADER_SIZE = 4 + 1 + 4 + 4 + 1;
+// Versions before 3 don't have the channels mask
+const unsigned int COMPRESSED_HEADER_SIZE_V2 = 4 + 1 + 4 + 4;
+const unsigned int LEGACY_COMPRESSED_HEADER_SIZE = 4;
+const unsigned int LZ4_CHUNK_HEADER_SIZE = 4;
+// Set in the format field when the block was saved as a difference from a reference block
+const uint32_t COMPRESSED_FORMAT_DELTA_BIT = 0x40000000;
+const uint32_t COMPRESSED_FORMAT_FLAGS_MASK = COMPRESSED_FORMAT_VERSIONED_BIT | COMPRESSED_FORMAT_DELTA_BIT;
 
-	uint32_t size = 0;
-	Vector3i size_in_voxels = buffer.get_size();
+// How each channel is stored in a delta
+enum DeltaMode {
+	DELTA_SAME = 0, // Identical to the reference
+	DELTA_UNIFORM, // Single value follows
+	DELTA_RUNS, // Runs of voxels to overwrite follow
+	DELTA_FULL, // The whole channel follows
+	DELTA_MODE_COUNT
+};
+
+// Start index and length
+const unsigned int DELTA_RUN_HEADER_SIZE = 4 + 4;
+
+// Values found between channel arrays: compression mode and uniform value of channels, and the trailing magic
+const unsigned int MAX_STAGED_SIZE = VoxelBuffer::MAX_CHANNELS * (1 + sizeof(uint64_t)) + BLOCK_TRAILING_MAGIC_SIZE;
+
+inline unsigned int get_depth_byte_count(VoxelBuffer::Depth depth) {
+	return VoxelBuffer::get_depth_bit_count(depth) >> 3;
+}
+
+inline unsigned int encode_voxel_value(uint64_t v, VoxelBuffer::Depth depth, uint8_t *dst) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			*dst = v;
+			return 1;
+		case VoxelBuffer::DEPTH_16_BIT:
+			return encode_uint16(v, dst);
+		case VoxelBuffer::DEPTH_32_BIT:
+			return encode_uint32(v, dst);
+		case VoxelBuffer::DEPTH_64_BIT:
+			return encode_uint64(v, dst);
+		default:
+			CRASH_NOW();
+	}
+	return 0;
+}
+
+inline uint64_t decode_voxel_value(const uint8_t *src, VoxelBuffer::Depth depth) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			return *src;
+		case VoxelBuffer::DEPTH_16_BIT:
+			return decode_uint16(src);
+		case VoxelBuffer::DEPTH_32_BIT:
+			return decode_uint32(src);
+		case VoxelBuffer::DEPTH_64_BIT:
+			return decode_uint64(src);
+		default:
+			CRASH_NOW();
+	}
+	return 0;
+}
+
+// Writes channels of a block in serialized order.
+// Small values are gathered in a staging buffer, so channel arrays can be given to the output without being copied.
+template <typename Output_T>
+bool write_block(const VoxelBuffer &buffer, Output_T &output, uint32_t channels_mask) {
+
+	uint8_t staging[MAX_STAGED_SIZE];
+	unsigned int staged_size = 0;
 
 	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+		if ((channels_mask & (1 << channel_index)) == 0) {
+			continue;
+		}
 
-		VoxelBuffer::Compression compression = buffer.get_channel_compression(channel_index);
-		size += 1;
+		const VoxelBuffer::Compression compression = buffer.get_channel_compression(channel_index);
+		staging[staged_size++] = static_cast<uint8_t>(compression);
 
 		switch (compression) {
 
 			case VoxelBuffer::COMPRESSION_NONE: {
-				size += size_in_voxels.volume() * sizeof(uint8_t);
+				ArraySlice<uint8_t> data;
+				CRASH_COND(!buffer.get_channel_raw(channel_index, data));
+				if (!output.write(staging, staged_size)) {
+					return false;
+				}
+				staged_size = 0;
+				if (!output.write(data.data(), data.size())) {
+					return false;
+				}
 			} break;
 
 			case VoxelBuffer::COMPRESSION_UNIFORM: {
-				size += 1;
+				const uint64_t v = buffer.get_voxel(Vector3i(), channel_index);
+				staged_size += encode_voxel_value(v, buffer.get_channel_depth(channel_index), staging + staged_size);
 			} break;
 
 			default:
 				ERR_PRINT("Unhandled compression mode");
-				CRASH_NOW();
+				return false;
 		}
 	}
 
-	return size + BLOCK_TRAILING_MAGIC_SIZE;
+	staged_size += encode_uint32(BLOCK_TRAILING_MAGIC, staging + staged_size);
+	return output.write(staging, staged_size);
 }
 
-const std::vector<uint8_t> &VoxelBlockSerializer::serialize(VoxelBuffer &voxel_buffer) {
-
-	unsigned int data_size = get_size_in_bytes(voxel_buffer);
-	_data.resize(data_size);
-
-	CRASH_COND(_file_access_memory.open_custom(_data.data(), _data.size()) != OK);
-	FileAccessMemory *f = &_file_access_memory;
+// Reads channels of a block in serialized order.
+// Channel arrays are read from the input directly into channel memory.
+// Stored channels which are not requested are read into a scratch buffer and dropped.
+template <typename Input_T>
+bool read_block(VoxelBuffer &out_buffer, Input_T &input, uint32_t stored_mask, uint32_t load_mask, std::vector<uint8_t> &scratch) {
 
 	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+		if ((stored_mask & (1 << channel_index)) == 0) {
+			continue;
+		}
+		const bool load = (load_mask & (1 << channel_index)) != 0;
 
-		VoxelBuffer::Compression compression = voxel_buffer.get_channel_compression(channel_index);
-		f->store_8(static_cast<uint8_t>(compression));
+		uint8_t compression_value;
+		if (!input.read_small(&compression_value, 1)) {
+			return false;
+		}
+		ERR_FAIL_COND_V_MSG(compression_value >= VoxelBuffer::COMPRESSION_COUNT, false,
+				String("Invalid compression mode {0} in channel {1}").format(varray(compression_value, channel_index)));
+		const VoxelBuffer::Compression compression = (VoxelBuffer::Compression)compression_value;
 
 		switch (compression) {
 
 			case VoxelBuffer::COMPRESSION_NONE: {
-				ArraySlice<uint8_t> data;
-				CRASH_COND(!voxel_buffer.get_channel_raw(channel_index, data));
-				f->store_buffer(data.data(), data.size());
+				if (load) {
+					out_buffer.decompress_channel(channel_index);
+					ArraySlice<uint8_t> data;
+					ERR_FAIL_COND_V(!out_buffer.get_channel_raw(channel_index, data), false);
+					if (!input.read_large(data.data(), data.size())) {
+						return false;
+					}
+				} else {
+					scratch.resize(VoxelBuffer::get_size_in_bytes_for_volume(
+							out_buffer.get_size(), out_buffer.get_channel_depth(channel_index)));
+					if (!input.read_large(scratch.data(), scratch.size())) {
+						return false;
+					}
+				}
 			} break;
 
 			case VoxelBuffer::COMPRESSION_UNIFORM: {
-				uint64_t v = voxel_buffer.get_voxel(Vector3i(), channel_index);
-				switch (voxel_buffer.get_channel_depth(channel_index)) {
-					case VoxelBuffer::DEPTH_8_BIT:
-						f->store_8(v);
-						break;
-					case VoxelBuffer::DEPTH_16_BIT:
-						f->store_16(v);
-						break;
-					case VoxelBuffer::DEPTH_32_BIT:
-						f->store_32(v);
-						break;
-					case VoxelBuffer::DEPTH_64_BIT:
-						f->store_64(v);
-						break;
-					default:
-						CRASH_NOW();
+				const VoxelBuffer::Depth depth = out_buffer.get_channel_depth(channel_index);
+				uint8_t value[sizeof(uint64_t)];
+				if (!input.read_small(value, get_depth_byte_count(depth))) {
+					return false;
+				}
+				if (load) {
+					out_buffer.clear_channel(channel_index, decode_voxel_value(value, depth));
 				}
 			} break;
 
 			default:
-				CRASH_COND("Unhandled compression mode");
+				ERR_PRINT("Unhandled compression mode");
+				return false;
 		}
 	}
 
-	f->store_32(BLOCK_TRAILING_MAGIC);
+	uint8_t magic[BLOCK_TRAILING_MAGIC_SIZE];
+	if (!input.read_small(magic, BLOCK_TRAILING_MAGIC_SIZE)) {
+		return false;
+	}
+	// Failure at this indicates file corruption
+	ERR_FAIL_COND_V_MSG(decode_uint32(magic) != BLOCK_TRAILING_MAGIC, false, "Block trailing magic doesn't match");
+	return true;
+}
 
-	return _data;
+class VectorOutput {
+public:
+	VectorOutput(std::vector<uint8_t> &dst) :
+			_dst(dst) {}
+
+	bool write(const uint8_t *src, unsigned int size) {
+		_dst.insert(_dst.end(), src, src + size);
+		return true;
+	}
+
+private:
+	std::vector<uint8_t> &_dst;
+};
+
+class MemoryInput {
+public:
+	MemoryInput(const uint8_t *src, unsigned int size) :
+			_src(src),
+			_size(size) {}
+
+	bool read_small(uint8_t *dst, unsigned int size) {
+		ERR_FAIL_COND_V_MSG(size > _size - _pos, false, "Unexpected end of data");
+		memcpy(dst, _src + _pos, size);
+		_pos += size;
+		return true;
+	}
+
+	bool read_large(uint8_t *dst, unsigned int size) {
+		return read_small(dst, size);
+	}
+
+	bool skip(unsigned int size) {
+		ERR_FAIL_COND_V_MSG(size > _size - _pos, false, "Unexpected end of data");
+		_pos += size;
+		return true;
+	}
+
+private:
+	const uint8_t *_src;
+	unsigned int _size;
+	unsigned int _pos = 0;
+};
+
+// Each piece is compressed into an LZ4 block preceded by its compressed size.
+// Blocks are chained with the streaming API, so a piece can still refer to the one before it.
+class LZ4Output {
+public:
+	LZ4Output(LZ4_stream_t *stream, std::vector<uint8_t> &dst) :
+			_stream(stream),
+			_dst(dst) {}
+
+	bool write(const uint8_t *src, unsigned int size) {
+		const unsigned int pos = _dst.size();
+		_dst.resize(pos + LZ4_CHUNK_HEADER_SIZE + LZ4_compressBound(size));
+
+		const int compressed_size = LZ4_compress_fast_continue(_stream,
+				(const char *)src, (char *)_dst.data() + pos + LZ4_CHUNK_HEADER_SIZE,
+				size, _dst.size() - pos - LZ4_CHUNK_HEADER_SIZE, 1);
+		ERR_FAIL_COND_V(compressed_size <= 0, false);
+
+		encode_uint32(compressed_size, _dst.data() + pos);
+		_dst.resize(pos + LZ4_CHUNK_HEADER_SIZE + compressed_size);
+		return true;
+	}
+
+private:
+	LZ4_stream_t *_stream;
+	std::vector<uint8_t> &_dst;
+};
+
+class LZ4Input {
+public:
+	LZ4Input(LZ4_streamDecode_t *stream, const uint8_t *src, unsigned int size) :
+			_stream(stream),
+			_src(src),
+			_size(size) {}
+
+	bool read_small(uint8_t *dst, unsigned int size) {
+		if (_staged_pos == _staged_size) {
+			const int staged_size = decompress_next(_staging, MAX_STAGED_SIZE);
+			if (staged_size < 0) {
+				return false;
+			}
+			_staged_size = staged_size;
+			_staged_pos = 0;
+		}
+		ERR_FAIL_COND_V_MSG(size > _staged_size - _staged_pos, false, "Unexpected end of data");
+		memcpy(dst, _staging + _staged_pos, size);
+		_staged_pos += size;
+		return true;
+	}
+
+	bool read_large(uint8_t *dst, unsigned int size) {
+		// Channel arrays are compressed on their own, right after the values preceding them
+		ERR_FAIL_COND_V_MSG(_staged_pos != _staged_size, false, "Unexpected data before channel array");
+		const int decompressed_size = decompress_next(dst, size);
+		ERR_FAIL_COND_V_MSG(decompressed_size != (int)size, false,
+				String("Expected {0} bytes, obtained {1}").format(varray(size, decompressed_size)));
+		return true;
+	}
+
+private:
+	int decompress_next(uint8_t *dst, unsigned int capacity) {
+		ERR_FAIL_COND_V_MSG(LZ4_CHUNK_HEADER_SIZE > _size - _pos, -1, "Unexpected end of data");
+		const uint32_t compressed_size = decode_uint32(_src + _pos);
+		_pos += LZ4_CHUNK_HEADER_SIZE;
+		ERR_FAIL_COND_V_MSG(compressed_size > _size - _pos, -1, "Unexpected end of data");
+
+		const int decompressed_size = LZ4_decompress_safe_continue(_stream,
+				(const char *)_src + _pos, (char *)dst, compressed_size, capacity);
+		ERR_FAIL_COND_V_MSG(decompressed_size < 0, -1,
+				String("LZ4 decompression error {0}").format(varray(decompressed_size)));
+
+		_pos += compressed_size;
+		return decompressed_size;
+	}
+
+	LZ4_streamDecode_t *_stream;
+	const uint8_t *_src;
+	unsigned int _size;
+	unsigned int _pos = 0;
+	uint8_t _staging[MAX_STAGED_SIZE];
+	unsigned int _staged_size = 0;
+	unsigned int _staged_pos = 0;
+};
+
+// Pieces all go into a single zstd frame
+class ZstdOutput {
+public:
+	ZstdOutput(ZSTD_CCtx *cctx, std::vector<uint8_t> &dst, unsigned int src_size) :
+			_cctx(cctx),
+			_dst(dst),
+			_size(dst.size()) {
+		_dst.resize(_size + ZSTD_compressBound(src_size));
+	}
+
+	bool write(const uint8_t *src, unsigned int size) {
+		return compress(src, size, ZSTD_e_continue);
+	}
+
+	bool finish() {
+		if (!compress(nullptr, 0, ZSTD_e_end)) {
+			return false;
+		}
+		_dst.resize(_size);
+		return true;
+	}
+
+private:
+	bool compress(const uint8_t *src, unsigned int size, ZSTD_EndDirective directive) {
+		ZSTD_inBuffer input = { src, size, 0 };
+		while (true) {
+			if (_size == _dst.size()) {
+				_dst.resize(_size + ZSTD_CStreamOutSize());
+			}
+			ZSTD_outBuffer output = { _dst.data() + _size, _dst.size() - _size, 0 };
+
+			const size_t remaining = ZSTD_compressStream2(_cctx, &output, &input, directive);
+			ERR_FAIL_COND_V_MSG(ZSTD_isError(remaining), false,
+					String("Zstd compression error: {0}").format(varray(ZSTD_getErrorName(remaining))));
+			_size += output.pos;
+
+			if (directive == ZSTD_e_end ? remaining == 0 : input.pos == input.size) {
+				return true;
+			}
+		}
+	}
+
+	ZSTD_CCtx *_cctx;
+	std::vector<uint8_t> &_dst;
+	unsigned int _size;
+};
+
+class ZstdInput {
+public:
+	ZstdInput(ZSTD_DCtx *dctx, const uint8_t *src, unsigned int size) :
+			_dctx(dctx) {
+		_input = { src, size, 0 };
+	}
+
+	bool read_small(uint8_t *dst, unsigned int size) {
+		ZSTD_outBuffer output = { dst, size, 0 };
+		while (output.pos < output.size) {
+			const size_t prev_input_pos = _input.pos;
+			const size_t prev_output_pos = output.pos;
+
+			const size_t res = ZSTD_decompressStream(_dctx, &output, &_input);
+			ERR_FAIL_COND_V_MSG(ZSTD_isError(res), false,
+					String("Zstd decompression error: {0}").format(varray(ZSTD_getErrorName(res))));
+
+			ERR_FAIL_COND_V_MSG(_input.pos == prev_input_pos && output.pos == prev_output_pos, false,
+					"Unexpected end of data");
+		}
+		return true;
+	}
+
+	bool read_large(uint8_t *dst, unsigned int size) {
+		return read_small(dst, size);
+	}
+
+private:
+	ZSTD_DCtx *_dctx;
+	ZSTD_inBuffer _input;
+};
+
+// Identifies the contents of a channel, so a delta can tell whether it is applied to the same reference it was saved against
+uint32_t get_channel_checksum(const VoxelBuffer &buffer, unsigned int channel_index) {
+	ArraySlice<uint8_t> data;
+	if (buffer.get_channel_raw(channel_index, data)) {
+		return crc32c(data.data(), data.size());
+	}
+	uint8_t value[sizeof(uint64_t)];
+	const unsigned int size = encode_voxel_value(
+			buffer.get_voxel(Vector3i(), channel_index), buffer.get_channel_depth(channel_index), value);
+	return crc32c(value, size);
 }
 
-bool VoxelBlockSerializer::deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer) {
+// Appends a channel of the buffer as a difference from the same channel in the reference
+void write_channel_delta(const VoxelBuffer &buffer, const VoxelBuffer &reference, unsigned int channel_index, std::vector<uint8_t> &dst) {
 
-	CRASH_COND(_file_access_memory.open_custom(p_data.data(), p_data.size()) != OK);
-	FileAccessMemory *f = &_file_access_memory;
+	const VoxelBuffer::Depth depth = buffer.get_channel_depth(channel_index);
+	uint8_t value[sizeof(uint64_t)];
 
-	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+	const size_t checksum_pos = dst.size();
+	dst.resize(checksum_pos + sizeof(uint32_t));
+	encode_uint32(get_channel_checksum(reference, channel_index), dst.data() + checksum_pos);
+
+	if (buffer.get_channel_compression(channel_index) == VoxelBuffer::COMPRESSION_UNIFORM) {
+		const uint64_t v = buffer.get_voxel(Vector3i(), channel_index);
+		if (reference.get_channel_compression(channel_index) == VoxelBuffer::COMPRESSION_UNIFORM &&
+				reference.get_voxel(Vector3i(), channel_index) == v) {
+			dst.push_back(DELTA_SAME);
+		} else {
+			dst.push_back(DELTA_UNIFORM);
+			dst.insert(dst.end(), value, value + encode_voxel_value(v, depth, value));
+		}
+		return;
+	}
 
-		uint8_t compression_value = f->get_8();
-		ERR_FAIL_COND_V_MSG(compression_value >= VoxelBuffer::COMPRESSION_COUNT, false, "At offset 0x" + String::num_int64(f->get_position() - 1, 16));
-		VoxelBuffer::Compression compression = (VoxelBuffer::Compression)compression_value;
+	ArraySlice<uint8_t> data;
+	CRASH_COND(!buffer.get_channel_raw(channel_index, data));
 
-		switch (compression) {
+	const unsigned int voxel_size = get_depth_byte_count(depth);
+	const unsigned int volume = data.size() / voxel_size;
 
-			case VoxelBuffer::COMPRESSION_NONE: {
+	// A uniform reference is compared as if all its voxels were at the same address
+	const uint8_t *ref_data;
+	unsigned int ref_stride;
+	ArraySlice<uint8_t> ref_slice;
+	if (reference.get_channel_raw(channel_index, ref_slice)) {
+		CRASH_COND(ref_slice.size() != data.size());
+		ref_data = ref_slice.data();
+		ref_stride = voxel_size;
+	} else {
+		encode_voxel_value(reference.get_voxel(Vector3i(), channel_index), depth, value);
+		ref_data = value;
+		ref_stride = 0;
+	}
 
-				out_voxel_buffer.decompress_channel(channel_index);
+	const size_t begin = dst.size();
+	dst.push_back(DELTA_RUNS);
+	const size_t run_count_pos = dst.size();
+	dst.resize(dst.size() + sizeof(uint32_t));
+	uint32_t run_count = 0;
 
-				ArraySlice<uint8_t> buffer;
-				CRASH_COND(!out_voxel_buffer.get_channel_raw(channel_index, buffer));
+	unsigned int i = 0;
+	while (i < volume) {
+		if (memcmp(data.data() + i * voxel_size, ref_data + i * ref_stride, voxel_size) == 0) {
+			++i;
+			continue;
+		}
+
+		// Extend the run until the next gap of identical voxels long enough to be worth a new run
+		const unsigned int run_begin = i;
+		unsigned int run_end = i + 1;
+		for (unsigned int j = run_end; j < volume; ++j) {
+			if (memcmp(data.data() + j * voxel_size, ref_data + j * ref_stride, voxel_size) != 0) {
+				run_end = j + 1;
+			} else if ((j + 1 - run_end) * voxel_size >= DELTA_RUN_HEADER_SIZE) {
+				break;
+			}
+		}
+
+		const size_t pos = dst.size();
+		dst.resize(pos + DELTA_RUN_HEADER_SIZE);
+		encode_uint32(run_begin, dst.data() + pos);
+		encode_uint32(run_end - run_begin, dst.data() + pos + 4);
+		dst.insert(dst.end(), data.data() + run_begin * voxel_size, data.data() + run_end * voxel_size);
+		++run_count;
+
+		if (dst.size() - begin >= 1 + data.size()) {
+			// Too many differences, storing the whole channel is smaller
+			dst.resize(begin);
+			dst.push_back(DELTA_FULL);
+			dst.insert(dst.end(), data.data(), data.data() + data.size());
+			return;
+		}
+
+		i = run_end;
+	}
+
+	if (run_count == 0) {
+		dst.resize(begin);
+		dst.push_back(DELTA_SAME);
+	} else {
+		encode_uint32(run_count, dst.data() + run_count_pos);
+	}
+}
+
+// Applies the difference of one channel to the buffer, which must contain the reference.
+// If `apply` is false, the difference is only skipped.
+bool read_channel_delta(MemoryInput &input, VoxelBuffer &out_buffer, unsigned int channel_index, bool apply, bool has_checksum) {
+
+	if (has_checksum) {
+		uint8_t checksum[sizeof(uint32_t)];
+		if (!input.read_small(checksum, sizeof(uint32_t))) {
+			return false;
+		}
+		// The reference is generated again when loading, so it changes if the fallback stream was modified
+		ERR_FAIL_COND_V_MSG(apply && decode_uint32(checksum) != get_channel_checksum(out_buffer, channel_index), false,
+				String("Delta of channel {0} was saved against a different reference, "
+					   "the fallback stream might have changed since")
+						.format(varray(channel_index)));
+	}
+
+	uint8_t mode;
+	if (!input.read_small(&mode, 1)) {
+		return false;
+	}
+
+	const VoxelBuffer::Depth depth = out_buffer.get_channel_depth(channel_index);
+	const unsigned int voxel_size = get_depth_byte_count(depth);
 
-				uint32_t read_len = f->get_buffer(buffer.data(), buffer.size());
-				if (read_len != buffer.size()) {
-					ERR_PRINT("Unexpected end of file");
+	switch (mode) {
+		case DELTA_SAME:
+			break;
+
+		case DELTA_UNIFORM: {
+			uint8_t value[sizeof(uint64_t)];
+			if (!input.read_small(value, voxel_size)) {
+				return false;
+			}
+			if (apply) {
+				out_buffer.clear_channel(channel_index, decode_voxel_value(value, depth));
+			}
+		} break;
+
+		case DELTA_RUNS:
+		case DELTA_FULL: {
+			const unsigned int channel_size = VoxelBuffer::get_size_in_bytes_for_volume(out_buffer.get_size(), depth);
+			ArraySlice<uint8_t> data;
+			if (apply) {
+				out_buffer.decompress_channel(channel_index);
+				ERR_FAIL_COND_V(!out_buffer.get_channel_raw(channel_index, data), false);
+			}
+
+			if (mode == DELTA_FULL) {
+				return apply ? input.read_large(data.data(), data.size()) : input.skip(channel_size);
+			}
+
+			uint8_t header[DELTA_RUN_HEADER_SIZE];
+			if (!input.read_small(header, sizeof(uint32_t))) {
+				return false;
+			}
+			const uint32_t run_count = decode_uint32(header);
+			const uint64_t volume = channel_size / voxel_size;
+
+			for (uint32_t i = 0; i < run_count; ++i) {
+				if (!input.read_small(header, DELTA_RUN_HEADER_SIZE)) {
+					return false;
+				}
+				const uint32_t run_begin = decode_uint32(header);
+				const uint32_t run_length = decode_uint32(header + 4);
+				ERR_FAIL_COND_V_MSG((uint64_t)run_begin + run_length > volume, false, "Delta run out of bounds");
+				const bool read = apply ?
+										  input.read_large(data.data() + run_begin * voxel_size, run_length * voxel_size) :
+										  input.skip(run_length * voxel_size);
+				if (!read) {
 					return false;
 				}
+			}
+		} break;
+
+		default:
+			ERR_PRINT(String("Invalid delta mode {0} in channel {1}").format(varray(mode, channel_index)));
+			return false;
+	}
+
+	return true;
+}
+
+} // namespace
+
+const char *VoxelBlockSerializer::CODEC_HINT_STRING = "LZ4,Zstd";
 
+VoxelBlockSerializer::VoxelBlockSerializer() {
+}
+
+VoxelBlockSerializer::~VoxelBlockSerializer() {
+	clear_zstd_dictionaries();
+	if (_zstd_cctx != nullptr) {
+		ZSTD_freeCCtx(_zstd_cctx);
+	}
+	if (_zstd_dctx != nullptr) {
+		ZSTD_freeDCtx(_zstd_dctx);
+	}
+	if (_lz4_stream != nullptr) {
+		LZ4_freeStream(_lz4_stream);
+	}
+}
+
+void VoxelBlockSerializer::set_codec(Codec codec, int level) {
+	ERR_FAIL_INDEX(codec, CODEC_COUNT);
+	_codec = codec;
+	_level = level;
+}
+
+void VoxelBlockSerializer::set_dictionary(const std::vector<uint8_t> &dictionary) {
+	clear_zstd_dictionaries();
+	_dictionary = dictionary;
+	if (_dictionary.empty()) {
+		_dictionary_id = 0;
+	} else {
+		_dictionary_id = crc32c(_dictionary.data(), _dictionary.size());
+		if (_dictionary_id == 0) {
+			// 0 means no dictionary
+			_dictionary_id = 1;
+		}
+	}
+}
+
+bool VoxelBlockSerializer::has_dictionary() const {
+	return !_dictionary.empty();
+}
+
+void VoxelBlockSerializer::clear_zstd_dictionaries() {
+	if (_zstd_cdict != nullptr) {
+		ZSTD_freeCDict(_zstd_cdict);
+		_zstd_cdict = nullptr;
+	}
+	if (_zstd_ddict != nullptr) {
+		ZSTD_freeDDict(_zstd_ddict);
+		_zstd_ddict = nullptr;
+	}
+}
+
+unsigned int VoxelBlockSerializer::get_size_in_bytes(const VoxelBuffer &buffer, uint32_t channels_mask) {
+
+	uint32_t size = 0;
+	Vector3i size_in_voxels = buffer.get_size();
+
+	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+		if ((channels_mask & (1 << channel_index)) == 0) {
+			continue;
+		}
+
+		VoxelBuffer::Compression compression = buffer.get_channel_compression(channel_index);
+		VoxelBuffer::Depth depth = buffer.get_channel_depth(channel_index);
+		size += 1;
+
+		switch (compression) {
+
+			case VoxelBuffer::COMPRESSION_NONE: {
+				size += VoxelBuffer::get_size_in_bytes_for_volume(size_in_voxels, depth);
 			} break;
 
 			case VoxelBuffer::COMPRESSION_UNIFORM: {
-				uint64_t v;
-				switch (out_voxel_buffer.get_channel_depth(channel_index)) {
-					case VoxelBuffer::DEPTH_8_BIT:
-						v = f->get_8();
-						break;
-					case VoxelBuffer::DEPTH_16_BIT:
-						v = f->get_16();
-						break;
-					case VoxelBuffer::DEPTH_32_BIT:
-						v = f->get_32();
-						break;
-					case VoxelBuffer::DEPTH_64_BIT:
-						v = f->get_64();
-						break;
-					default:
-						CRASH_NOW();
-				}
-				out_voxel_buffer.clear_channel(channel_index, v);
+				size += get_depth_byte_count(depth);
 			} break;
 
 			default:
 				ERR_PRINT("Unhandled compression mode");
-				return false;
+				CRASH_NOW();
 		}
 	}
 
-	// Failure at this indicates file corruption
-	ERR_FAIL_COND_V_MSG(f->get_32() != BLOCK_TRAILING_MAGIC, false, "At offset 0x" + String::num_int64(f->get_position() - 4, 16));
+	return size + BLOCK_TRAILING_MAGIC_SIZE;
+}
+
+const std::vector<uint8_t> &VoxelBlockSerializer::serialize(VoxelBuffer &voxel_buffer) {
+
+	_data.clear();
+	_data.reserve(get_size_in_bytes(voxel_buffer, VoxelBuffer::ALL_CHANNELS_MASK));
+
+	VectorOutput output(_data);
+	CRASH_COND(!write_block(voxel_buffer, output, VoxelBuffer::ALL_CHANNELS_MASK));
+
+	return _data;
+}
+
+bool VoxelBlockSerializer::deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer) {
+	return deserialize(p_data.data(), p_data.size(), out_voxel_buffer, VoxelBuffer::ALL_CHANNELS_MASK);
+}
+
+bool VoxelBlockSerializer::deserialize(const uint8_t *p_data, unsigned int p_size, VoxelBuffer &out_voxel_buffer, uint32_t channels_mask) {
+	MemoryInput input(p_data, p_size);
+	return read_block(out_voxel_buffer, input, VoxelBuffer::ALL_CHANNELS_MASK, channels_mask, _scratch);
+}
+
+LZ4_stream_t *VoxelBlockSerializer::begin_lz4_compression() {
+
+	if (_lz4_stream == nullptr) {
+		_lz4_stream = LZ4_createStream();
+		CRASH_COND(_lz4_stream == nullptr);
+	}
+
+	if (_dictionary.empty()) {
+		LZ4_resetStream_fast(_lz4_stream);
+	} else {
+		LZ4_loadDict(_lz4_stream, (const char *)_dictionary.data(), _dictionary.size());
+	}
+
+	return _lz4_stream;
+}
+
+ZSTD_CCtx *VoxelBlockSerializer::begin_zstd_compression(unsigned int src_size) {
+
+	if (_zstd_cctx == nullptr) {
+		_zstd_cctx = ZSTD_createCCtx();
+		ERR_FAIL_COND_V(_zstd_cctx == nullptr, nullptr);
+	}
+
+	ZSTD_CCtx_reset(_zstd_cctx, ZSTD_reset_session_only);
+
+	const int level = _level == 0 ? ZSTD_CLEVEL_DEFAULT : _level;
+
+	if (_dictionary.empty()) {
+		ZSTD_CCtx_refCDict(_zstd_cctx, nullptr);
+		ZSTD_CCtx_setParameter(_zstd_cctx, ZSTD_c_compressionLevel, level);
+
+	} else {
+		if (_zstd_cdict != nullptr && _zstd_cdict_level != level) {
+			ZSTD_freeCDict(_zstd_cdict);
+			_zstd_cdict = nullptr;
+		}
+		if (_zstd_cdict == nullptr) {
+			_zstd_cdict = ZSTD_createCDict(_dictionary.data(), _dictionary.size(), level);
+			ERR_FAIL_COND_V(_zstd_cdict == nullptr, nullptr);
+			_zstd_cdict_level = level;
+		}
+		// The level of the dictionary is used
+		ZSTD_CCtx_refCDict(_zstd_cctx, _zstd_cdict);
+	}
+
+	ZSTD_CCtx_setPledgedSrcSize(_zstd_cctx, src_size);
+	return _zstd_cctx;
+}
+
+ZSTD_DCtx *VoxelBlockSerializer::begin_zstd_decompression(bool use_dictionary) {
+
+	if (_zstd_dctx == nullptr) {
+		_zstd_dctx = ZSTD_createDCtx();
+		ERR_FAIL_COND_V(_zstd_dctx == nullptr, nullptr);
+	}
+
+	ZSTD_DCtx_reset(_zstd_dctx, ZSTD_reset_session_only);
+
+	if (use_dictionary) {
+		if (_zstd_ddict == nullptr) {
+			_zstd_ddict = ZSTD_createDDict(_dictionary.data(), _dictionary.size());
+			ERR_FAIL_COND_V(_zstd_ddict == nullptr, nullptr);
+		}
+		ZSTD_DCtx_refDDict(_zstd_dctx, _zstd_ddict);
+	} else {
+		ZSTD_DCtx_refDDict(_zstd_dctx, nullptr);
+	}
+
+	return _zstd_dctx;
+}
+
+// Used for blocks saved before compression was done in pieces
+bool VoxelBlockSerializer::decompress(Codec codec, bool use_dictionary, const uint8_t *src, unsigned int src_size, uint8_t *dst, unsigned int dst_size) {
+
+	switch (codec) {
+		case CODEC_LZ4: {
+			int actually_decompressed_size;
+			if (use_dictionary) {
+				actually_decompressed_size = LZ4_decompress_safe_usingDict(
+						(const char *)src, (char *)dst, src_size, dst_size,
+						(const char *)_dictionary.data(), _dictionary.size());
+			} else {
+				actually_decompressed_size = LZ4_decompress_safe((const char *)src, (char *)dst, src_size, dst_size);
+			}
+
+			ERR_FAIL_COND_V_MSG(actually_decompressed_size < 0, false,
+					String("LZ4 decompression error {0}").format(varray(actually_decompressed_size)));
+
+			ERR_FAIL_COND_V_MSG(actually_decompressed_size != (int)dst_size, false,
+					String("Expected {0} bytes, obtained {1}").format(varray(dst_size, actually_decompressed_size)));
+		} break;
+
+		case CODEC_ZSTD: {
+			ZSTD_DCtx *dctx = begin_zstd_decompression(use_dictionary);
+			ERR_FAIL_COND_V(dctx == nullptr, false);
+
+			const size_t res = ZSTD_decompressDCtx(dctx, dst, dst_size, src, src_size);
+
+			ERR_FAIL_COND_V_MSG(ZSTD_isError(res), false,
+					String("Zstd decompression error: {0}").format(varray(ZSTD_getErrorName(res))));
+
+			ERR_FAIL_COND_V_MSG(res != dst_size, false,
+					String("Expected {0} bytes, obtained {1}").format(varray(dst_size, (int64_t)res)));
+		} break;
+
+		default:
+			ERR_PRINT("Unhandled codec");
+			return false;
+	}
+
 	return true;
 }
 
-const std::vector<uint8_t> &VoxelBlockSerializer::serialize_and_compress(VoxelBuffer &voxel_buffer) {
+void VoxelBlockSerializer::write_header(uint32_t flags, unsigned int decompressed_size, uint32_t channels_mask) {
+	_compressed_data.resize(COMPRESSED_HEADER_SIZE);
+	uint8_t *header = _compressed_data.data();
+	encode_uint32(COMPRESSED_FORMAT_VERSIONED_BIT | flags | COMPRESSED_FORMAT_VERSION, header);
+	header[4] = _codec;
+	encode_uint32(_dictionary_id, header + 5);
+	encode_uint32(decompressed_size, header + 9);
+	header[13] = channels_mask;
+}
 
-	const std::vector<uint8_t> &data = serialize(voxel_buffer);
+const std::vector<uint8_t> &VoxelBlockSerializer::serialize_and_compress(VoxelBuffer &voxel_buffer, uint32_t channels_mask) {
 
-	unsigned int header_size = sizeof(unsigned int);
-	_compressed_data.resize(header_size + LZ4_compressBound(data.size()));
+	channels_mask &= VoxelBuffer::ALL_CHANNELS_MASK;
+	const unsigned int data_size = get_size_in_bytes(voxel_buffer, channels_mask);
+	write_header(0, data_size, channels_mask);
 
-	// Write header
-	CRASH_COND(_file_access_memory.open_custom(_compressed_data.data(), _compressed_data.size()) != OK);
-	_file_access_memory.store_32(data.size());
-	_file_access_memory.close();
+	// Channels are compressed from where they are, without serializing them into an intermediary buffer first
+	switch (_codec) {
+		case CODEC_LZ4: {
+			LZ4Output output(begin_lz4_compression(), _compressed_data);
+			CRASH_COND(!write_block(voxel_buffer, output, channels_mask));
+		} break;
 
-	int compressed_size = LZ4_compress_default(
-			(const char *)data.data(),
-			(char *)_compressed_data.data() + header_size,
-			data.size(),
-			_compressed_data.size() - header_size);
+		case CODEC_ZSTD: {
+			ZSTD_CCtx *cctx = begin_zstd_compression(data_size);
+			CRASH_COND(cctx == nullptr);
+			ZstdOutput output(cctx, _compressed_data, data_size);
+			CRASH_COND(!write_block(voxel_buffer, output, channels_mask));
+			CRASH_COND(!output.finish());
+		} break;
 
-	CRASH_COND(compressed_size < 0);
-	CRASH_COND(compressed_size == 0);
+		default:
+			CRASH_NOW();
+	}
 
-	_compressed_data.resize(header_size + compressed_size);
 	return _compressed_data;
 }
 
-bool VoxelBlockSerializer::decompress_and_deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer) {
+const std::vector<uint8_t> &VoxelBlockSerializer::serialize_delta_and_compress(
+		VoxelBuffer &voxel_buffer, const VoxelBuffer &reference, uint32_t channels_mask) {
+
+	CRASH_COND(voxel_buffer.get_size() != reference.get_size());
+	channels_mask &= VoxelBuffer::ALL_CHANNELS_MASK;
+
+	_data.clear();
+	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+		if ((channels_mask & (1 << channel_index)) == 0) {
+			continue;
+		}
+		CRASH_COND(voxel_buffer.get_channel_depth(channel_index) != reference.get_channel_depth(channel_index));
+		write_channel_delta(voxel_buffer, reference, channel_index, _data);
+	}
+	uint8_t magic[BLOCK_TRAILING_MAGIC_SIZE];
+	encode_uint32(BLOCK_TRAILING_MAGIC, magic);
+	_data.insert(_data.end(), magic, magic + BLOCK_TRAILING_MAGIC_SIZE);
+
+	// Deltas are usually small, so they are compressed as a single piece
+	write_header(COMPRESSED_FORMAT_DELTA_BIT, _data.size(), channels_mask);
+
+	switch (_codec) {
+		case CODEC_LZ4: {
+			LZ4Output output(begin_lz4_compression(), _compressed_data);
+			CRASH_COND(!output.write(_data.data(), _data.size()));
+		} break;
+
+		case CODEC_ZSTD: {
+			ZSTD_CCtx *cctx = begin_zstd_compression(_data.size());
+			CRASH_COND(cctx == nullptr);
+			ZstdOutput output(cctx, _compressed_data, _data.size());
+			CRASH_COND(!output.write(_data.data(), _data.size()));
+			CRASH_COND(!output.finish());
+		} break;
+
+		default:
+			CRASH_NOW();
+	}
+
+	return _compressed_data;
+}
+
+bool VoxelBlockSerializer::is_delta(const uint8_t *p_data, unsigned int p_size) {
+	if (p_size < LEGACY_COMPRESSED_HEADER_SIZE) {
+		return false;
+	}
+	const uint32_t format = decode_uint32(p_data);
+	return (format & COMPRESSED_FORMAT_VERSIONED_BIT) != 0 && (format & COMPRESSED_FORMAT_DELTA_BIT) != 0;
+}
+
+bool VoxelBlockSerializer::decompress_and_deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer, uint32_t channels_mask) {
+	return decompress_and_deserialize(p_data.data(), p_data.size(), out_voxel_buffer, channels_mask);
+}
+
+bool VoxelBlockSerializer::decompress_and_deserialize(const uint8_t *p_data, unsigned int p_size, VoxelBuffer &out_voxel_buffer, uint32_t channels_mask) {
+
+	ERR_FAIL_COND_V(p_data == nullptr, false);
+	ERR_FAIL_COND_V(p_size < LEGACY_COMPRESSED_HEADER_SIZE, false);
 
 	// Read header
-	unsigned int header_size = sizeof(unsigned int);
-	ERR_FAIL_COND_V(_file_access_memory.open_custom(p_data.data(), p_data.size()) != OK, false);
-	unsigned int decompressed_size = _file_access_memory.get_32();
-	_file_access_memory.close();
+	const uint32_t format = decode_uint32(p_data);
+	unsigned int header_size;
+	unsigned int decompressed_size;
+	uint32_t version;
+	Codec codec;
+	bool use_dictionary;
+	bool delta = false;
+	uint32_t stored_channels_mask = VoxelBuffer::ALL_CHANNELS_MASK;
+
+	if ((format & COMPRESSED_FORMAT_VERSIONED_BIT) == 0) {
+		// Legacy block, always LZ4
+		header_size = LEGACY_COMPRESSED_HEADER_SIZE;
+		decompressed_size = format;
+		version = 0;
+		codec = CODEC_LZ4;
+		use_dictionary = false;
+
+	} else {
+		version = format & ~COMPRESSED_FORMAT_FLAGS_MASK;
+		ERR_FAIL_COND_V_MSG(version < 1 || version > COMPRESSED_FORMAT_VERSION, false,
+				String("Unsupported compressed block version {0}").format(varray(version)));
+		delta = (format & COMPRESSED_FORMAT_DELTA_BIT) != 0;
+		ERR_FAIL_COND_V(delta && version < 2, false);
+		header_size = version < 3 ? COMPRESSED_HEADER_SIZE_V2 : COMPRESSED_HEADER_SIZE;
+		ERR_FAIL_COND_V(p_size < header_size, false);
+
+		const uint8_t codec_id = p_data[4];
+		ERR_FAIL_COND_V_MSG(codec_id >= CODEC_COUNT, false, String("Unknown codec {0}").format(varray(codec_id)));
+		codec = (Codec)codec_id;
+
+		const uint32_t dictionary_id = decode_uint32(p_data + 5);
+		use_dictionary = dictionary_id != 0;
+		ERR_FAIL_COND_V_MSG(use_dictionary && _dictionary.empty(), false,
+				"Block was compressed with a dictionary, but none is loaded");
+		ERR_FAIL_COND_V_MSG(use_dictionary && dictionary_id != _dictionary_id, false,
+				"Block was compressed with a different dictionary than the one loaded");
+
+		decompressed_size = decode_uint32(p_data + 9);
+		if (version >= 3) {
+			stored_channels_mask = p_data[13];
+		}
+	}
+
+	const uint8_t *src = p_data + header_size;
+	const unsigned int src_size = p_size - header_size;
+
+	if (version < 2) {
+		// The whole block was compressed at once
+		_data.resize(decompressed_size);
+		if (!decompress(codec, use_dictionary, src, src_size, _data.data(), _data.size())) {
+			return false;
+		}
+		return deserialize(_data.data(), _data.size(), out_voxel_buffer, channels_mask);
+	}
 
-	_data.resize(decompressed_size);
+	if (delta) {
+		// Deltas are compressed as a single piece
+		_data.resize(decompressed_size);
+		bool decompressed = false;
 
-	unsigned int actually_decompressed_size = LZ4_decompress_safe(
-			(const char *)p_data.data() + header_size,
-			(char *)_data.data(),
-			p_data.size() - header_size,
-			_data.size());
+		switch (codec) {
+			case CODEC_LZ4: {
+				LZ4_streamDecode_t stream;
+				if (use_dictionary) {
+					LZ4_setStreamDecode(&stream, (const char *)_dictionary.data(), _dictionary.size());
+				} else {
+					LZ4_setStreamDecode(&stream, nullptr, 0);
+				}
+				LZ4Input input(&stream, src, src_size);
+				decompressed = input.read_large(_data.data(), _data.size());
+			} break;
 
-	ERR_FAIL_COND_V_MSG(actually_decompressed_size < 0, false,
-			String("LZ4 decompression error {0}").format(varray(actually_decompressed_size)));
+			case CODEC_ZSTD: {
+				ZSTD_DCtx *dctx = begin_zstd_decompression(use_dictionary);
+				ERR_FAIL_COND_V(dctx == nullptr, false);
+				ZstdInput input(dctx, src, src_size);
+				decompressed = input.read_large(_data.data(), _data.size());
+			} break;
 
-	ERR_FAIL_COND_V_MSG(actually_decompressed_size != decompressed_size, false,
-			String("Expected {0} bytes, obtained {1}").format(varray(decompressed_size, actually_decompressed_size)));
+			default:
+				ERR_PRINT("Unhandled codec");
+				break;
+		}
 
-	return deserialize(_data, out_voxel_buffer);
+		if (!decompressed) {
+			return false;
+		}
+
+		MemoryInput input(_data.data(), _data.size());
+		for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+			if ((stored_channels_mask & (1 << channel_index)) == 0) {
+				continue;
+			}
+			const bool apply = (channels_mask & (1 << channel_index)) != 0;
+			if (!read_channel_delta(input, out_voxel_buffer, channel_index, apply, version >= 4)) {
+				return false;
+			}
+		}
+		uint8_t magic[BLOCK_TRAILING_MAGIC_SIZE];
+		if (!input.read_small(magic, BLOCK_TRAILING_MAGIC_SIZE)) {
+			return false;
+		}
+		// Failure at this indicates file corruption
+		ERR_FAIL_COND_V_MSG(decode_uint32(magic) != BLOCK_TRAILING_MAGIC, false, "Block trailing magic doesn't match");
+		return true;
+	}
+
+	// Channels are decompressed directly into the buffer
+	switch (codec) {
+		case CODEC_LZ4: {
+			LZ4_streamDecode_t stream;
+			if (use_dictionary) {
+				LZ4_setStreamDecode(&stream, (const char *)_dictionary.data(), _dictionary.size());
+			} else {
+				LZ4_setStreamDecode(&stream, nullptr, 0);
+			}
+			LZ4Input input(&stream, src, src_size);
+			return read_block(out_voxel_buffer, input, stored_channels_mask, channels_mask, _scratch);
+		}
+
+		case CODEC_ZSTD: {
+			ZSTD_DCtx *dctx = begin_zstd_decompression(use_dictionary);
+			ERR_FAIL_COND_V(dctx == nullptr, false);
+			ZstdInput input(dctx, src, src_size);
+			return read_block(out_voxel_buffer, input, stored_channels_mask, channels_mask, _scratch);
+		}
+
+		default:
+			ERR_PRINT("Unhandled codec");
+			return false;
+	}
 }
 
-bool VoxelBlockSerializer::decompress_and_deserialize(FileAccess *f, unsigned int size_to_read, VoxelBuffer &out_voxel_buffer) {
+bool VoxelBlockSerializer::decompress_and_deserialize(FileAccess *f, unsigned int size_to_read, VoxelBuffer &out_voxel_buffer, uint32_t channels_mask) {
 
 	ERR_FAIL_COND_V(f == nullptr, false);
 
@@ -211,7 +1046,7 @@ bool VoxelBlockSerializer::decompress_and_deserialize(FileAccess *f, unsigned in
 	unsigned int read_size = f->get_buffer(_compressed_data.data(), size_to_read);
 	ERR_FAIL_COND_V(read_size != size_to_read, false);
 
-	return decompress_and_deserialize(_compressed_data, out_voxel_buffer);
+	return decompress_and_deserialize(_compressed_data, out_voxel_buffer, channels_mask);
 }
 
 }
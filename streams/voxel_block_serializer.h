@@ -1,28 +1,99 @@
 #ifndef VOXEL_BLOCK_SERIALIZER_H
 #define VOXEL_BLOCK_SERIALIZER_H
 
-#include <core/io/file_access_memory.h>
+#include "../voxel_buffer.h"
 #include <vector>
 
-namespace Voxel {
+class FileAccess;
+
+union LZ4_stream_u;
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
 
-class VoxelBuffer;
+namespace Voxel {
 
 class VoxelBlockSerializer {
 public:
+	// Algorithm used to compress blocks.
+	// Each compressed block records which one was used, so changing it doesn't invalidate existing data.
+	enum Codec {
+		CODEC_LZ4 = 0,
+		CODEC_ZSTD,
+		CODEC_COUNT
+	};
+
+	static const char *CODEC_HINT_STRING;
+
+	VoxelBlockSerializer();
+	~VoxelBlockSerializer();
+
+	// Level only applies to zstd. 0 means default level.
+	void set_codec(Codec codec, int level);
+
+	// Sets a raw content dictionary, which improves compression of small blocks looking like its contents.
+	// Blocks compressed with a dictionary can only be decompressed with the same dictionary.
+	void set_dictionary(const std::vector<uint8_t> &dictionary);
+	bool has_dictionary() const;
+	const std::vector<uint8_t> &get_dictionary() const { return _dictionary; }
+
+	// Serializes all channels, uncompressed
 	const std::vector<uint8_t> &serialize(VoxelBuffer &voxel_buffer);
 	bool deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer);
 
-	const std::vector<uint8_t> &serialize_and_compress(VoxelBuffer &voxel_buffer);
-	bool decompress_and_deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer);
-	bool decompress_and_deserialize(FileAccess *f, unsigned int size_to_read, VoxelBuffer &out_voxel_buffer);
+	// Only channels in the mask are saved.
+	const std::vector<uint8_t> &serialize_and_compress(VoxelBuffer &voxel_buffer,
+			uint32_t channels_mask = VoxelBuffer::ALL_CHANNELS_MASK);
+
+	// Only saves voxels differing from the reference block, which must have the same size and depths.
+	// This is much smaller when the block is a lightly modified version of the reference.
+	const std::vector<uint8_t> &serialize_delta_and_compress(VoxelBuffer &voxel_buffer, const VoxelBuffer &reference,
+			uint32_t channels_mask = VoxelBuffer::ALL_CHANNELS_MASK);
+	static bool is_delta(const uint8_t *p_data, unsigned int p_size);
+
+	// Only channels in the mask are loaded, others are left untouched.
+	// If the data is a delta, the output buffer must contain the same reference block it was saved against.
+	bool decompress_and_deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer,
+			uint32_t channels_mask = VoxelBuffer::ALL_CHANNELS_MASK);
+	// Decompresses directly from the given memory, without copying it first. Useful with mapped files.
+	bool decompress_and_deserialize(const uint8_t *p_data, unsigned int p_size, VoxelBuffer &out_voxel_buffer,
+			uint32_t channels_mask = VoxelBuffer::ALL_CHANNELS_MASK);
+	bool decompress_and_deserialize(FileAccess *f, unsigned int size_to_read, VoxelBuffer &out_voxel_buffer,
+			uint32_t channels_mask = VoxelBuffer::ALL_CHANNELS_MASK);
 
 private:
-	unsigned int get_size_in_bytes(const VoxelBuffer &buffer);
+	VoxelBlockSerializer(const VoxelBlockSerializer &) = delete;
+	VoxelBlockSerializer &operator=(const VoxelBlockSerializer &) = delete;
 
+	unsigned int get_size_in_bytes(const VoxelBuffer &buffer, uint32_t channels_mask);
+	void write_header(uint32_t flags, unsigned int decompressed_size, uint32_t channels_mask);
+	bool deserialize(const uint8_t *p_data, unsigned int p_size, VoxelBuffer &out_voxel_buffer, uint32_t channels_mask);
+	bool decompress(Codec codec, bool use_dictionary, const uint8_t *src, unsigned int src_size, uint8_t *dst, unsigned int dst_size);
+	LZ4_stream_u *begin_lz4_compression();
+	ZSTD_CCtx_s *begin_zstd_compression(unsigned int src_size);
+	ZSTD_DCtx_s *begin_zstd_decompression(bool use_dictionary);
+	void clear_zstd_dictionaries();
+
+	// Only used for uncompressed data, and blocks saved before compression was done in pieces
 	std::vector<uint8_t> _data;
 	std::vector<uint8_t> _compressed_data;
-	FileAccessMemory _file_access_memory;
+	// Receives stored channels which were not requested
+	std::vector<uint8_t> _scratch;
+
+	Codec _codec = CODEC_LZ4;
+	int _level = 0;
+
+	std::vector<uint8_t> _dictionary;
+	uint32_t _dictionary_id = 0;
+
+	LZ4_stream_u *_lz4_stream = nullptr;
+
+	ZSTD_CCtx_s *_zstd_cctx = nullptr;
+	ZSTD_DCtx_s *_zstd_dctx = nullptr;
+	ZSTD_CDict_s *_zstd_cdict = nullptr;
+	ZSTD_DDict_s *_zstd_ddict = nullptr;
+	int _zstd_cdict_level = 0;
 };
 
 }
@@ -16,6 +16,9 @@ public:
 	struct Stats {
 		int file_openings = 0;
 		int time_spent_opening_files = 0;
+		// When a stream keeps files open, tells how often it could reuse them
+		int file_cache_hits = 0;
+		int file_cache_misses = 0;
 	};
 
 	VoxelStream();
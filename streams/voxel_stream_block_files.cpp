@@ -75,7 +75,7 @@ void VoxelStreamBlockFiles::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i o
 		}
 
 		uint32_t size_to_read = f->get_32();
-		ERR_FAIL_COND(!_block_serializer.decompress_and_deserialize(f, size_to_read, **out_buffer));
+		ERR_FAIL_COND(!deserialize_block(f, size_to_read, out_buffer, origin_in_voxels, lod, VoxelBuffer::ALL_CHANNELS_MASK));
 	}
 
 	f->close();
@@ -137,7 +137,7 @@ void VoxelStreamBlockFiles::immerge_block(Ref<VoxelBuffer> buffer, Vector3i orig
 		f->store_buffer((uint8_t *)FORMAT_BLOCK_MAGIC, 4);
 		f->store_8(FORMAT_VERSION);
 
-		const std::vector<uint8_t> &data = _block_serializer.serialize_and_compress(**buffer);
+		const std::vector<uint8_t> &data = serialize_block(buffer, origin_in_voxels, lod, VoxelBuffer::ALL_CHANNELS_MASK);
 		f->store_32(data.size());
 		f->store_buffer(data.data(), data.size());
 
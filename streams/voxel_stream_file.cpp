@@ -21,6 +21,34 @@ void VoxelStreamFile::set_fallback_stream(Ref<VoxelStream> stream) {
 	_fallback_stream = stream;
 }
 
+void VoxelStreamFile::set_save_fallback_delta(bool enabled) {
+	_save_fallback_delta = enabled;
+}
+
+bool VoxelStreamFile::get_save_fallback_delta() const {
+	return _save_fallback_delta;
+}
+
+void VoxelStreamFile::set_compression_codec(int codec) {
+	ERR_FAIL_INDEX(codec, VoxelBlockSerializer::CODEC_COUNT);
+	_compression_codec = (VoxelBlockSerializer::Codec)codec;
+	_block_serializer.set_codec(_compression_codec, _compression_level);
+}
+
+int VoxelStreamFile::get_compression_codec() const {
+	return _compression_codec;
+}
+
+void VoxelStreamFile::set_compression_level(int level) {
+	ERR_FAIL_COND(level < 0);
+	_compression_level = level;
+	_block_serializer.set_codec(_compression_codec, _compression_level);
+}
+
+int VoxelStreamFile::get_compression_level() const {
+	return _compression_level;
+}
+
 void VoxelStreamFile::emerge_block_fallback(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
 
 	// This function is just a helper around the true thing, really. I might remove it in the future.
@@ -43,7 +71,8 @@ void VoxelStreamFile::emerge_blocks_fallback(Vector<VoxelBlockRequest> &requests
 
 		_fallback_stream->emerge_blocks(requests);
 
-		if (_save_fallback_output) {
+		// With deltas, saving untouched blocks would only make them load slower
+		if (_save_fallback_output && !_save_fallback_delta) {
 			immerge_blocks(requests);
 		}
 	}
@@ -59,6 +88,64 @@ FileAccess *VoxelStreamFile::open_file(const String &fpath, int mode_flags, Erro
 	return f;
 }
 
+Ref<VoxelBuffer> VoxelStreamFile::generate_reference_block(const VoxelBuffer &like, Vector3i origin_in_voxels, int lod) {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	// Always start from a new buffer, so the result only depends on the fallback stream
+	Ref<VoxelBuffer> reference;
+	reference.instance();
+	reference->create(like.get_size());
+	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+		reference->set_channel_depth(channel_index, like.get_channel_depth(channel_index));
+	}
+
+	_fallback_stream->emerge_block(reference, origin_in_voxels, lod);
+	return reference;
+}
+
+const std::vector<uint8_t> &VoxelStreamFile::serialize_block(
+		Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels, int lod, uint32_t channels_mask) {
+
+	if (_save_fallback_delta && _fallback_stream.is_valid()) {
+		Ref<VoxelBuffer> reference = generate_reference_block(**buffer, origin_in_voxels, lod);
+		return _block_serializer.serialize_delta_and_compress(**buffer, **reference, channels_mask);
+	}
+	return _block_serializer.serialize_and_compress(**buffer, channels_mask);
+}
+
+bool VoxelStreamFile::deserialize_block(const uint8_t *p_data, unsigned int p_size, Ref<VoxelBuffer> out_buffer,
+		Vector3i origin_in_voxels, int lod, uint32_t channels_mask) {
+
+	if (VoxelBlockSerializer::is_delta(p_data, p_size)) {
+		ERR_FAIL_COND_V_MSG(_fallback_stream.is_null(), false,
+				"Block was saved as a difference with the fallback stream, which is not set");
+		Ref<VoxelBuffer> reference = generate_reference_block(**out_buffer, origin_in_voxels, lod);
+		for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+			if (channels_mask & (1 << channel_index)) {
+				out_buffer->copy_from(**reference, channel_index);
+			}
+		}
+	}
+	return _block_serializer.decompress_and_deserialize(p_data, p_size, **out_buffer, channels_mask);
+}
+
+bool VoxelStreamFile::deserialize_block(FileAccess *f, unsigned int size_to_read, Ref<VoxelBuffer> out_buffer,
+		Vector3i origin_in_voxels, int lod, uint32_t channels_mask) {
+
+	ERR_FAIL_COND_V(f == nullptr, false);
+	_read_buffer.resize(size_to_read);
+	const unsigned int read_size = f->get_buffer(_read_buffer.data(), size_to_read);
+	ERR_FAIL_COND_V(read_size != size_to_read, false);
+	return deserialize_block(_read_buffer.data(), _read_buffer.size(), out_buffer, origin_in_voxels, lod, channels_mask);
+}
+
+int VoxelStreamFile::get_used_channels_mask() const {
+	if (_fallback_stream.is_valid()) {
+		return _fallback_stream->get_used_channels_mask();
+	}
+	return VoxelStream::get_used_channels_mask();
+}
+
 int VoxelStreamFile::get_block_size_po2() const {
 	return 4;
 }
@@ -79,10 +166,24 @@ void VoxelStreamFile::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_fallback_stream", "stream"), &VoxelStreamFile::set_fallback_stream);
 	ClassDB::bind_method(D_METHOD("get_fallback_stream"), &VoxelStreamFile::get_fallback_stream);
 
+	ClassDB::bind_method(D_METHOD("set_save_fallback_delta", "enabled"), &VoxelStreamFile::set_save_fallback_delta);
+	ClassDB::bind_method(D_METHOD("get_save_fallback_delta"), &VoxelStreamFile::get_save_fallback_delta);
+
+	ClassDB::bind_method(D_METHOD("set_compression_codec", "codec"), &VoxelStreamFile::set_compression_codec);
+	ClassDB::bind_method(D_METHOD("get_compression_codec"), &VoxelStreamFile::get_compression_codec);
+
+	ClassDB::bind_method(D_METHOD("set_compression_level", "level"), &VoxelStreamFile::set_compression_level);
+	ClassDB::bind_method(D_METHOD("get_compression_level"), &VoxelStreamFile::get_compression_level);
+
 	ClassDB::bind_method(D_METHOD("get_block_size"), &VoxelStreamFile::_get_block_size);
 
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "fallback_stream", PROPERTY_HINT_RESOURCE_TYPE, "VoxelStream"), "set_fallback_stream", "get_fallback_stream");
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "save_fallback_output"), "set_save_fallback_output", "get_save_fallback_output");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "save_fallback_delta"), "set_save_fallback_delta", "get_save_fallback_delta");
+
+	ADD_GROUP("Compression", "compression_");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "compression_codec", PROPERTY_HINT_ENUM, VoxelBlockSerializer::CODEC_HINT_STRING), "set_compression_codec", "get_compression_codec");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "compression_level", PROPERTY_HINT_RANGE, "0,22"), "set_compression_level", "get_compression_level");
 }
 
 }
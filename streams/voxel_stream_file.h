@@ -21,6 +21,24 @@ public:
 	Ref<VoxelStream> get_fallback_stream() const;
 	void set_fallback_stream(Ref<VoxelStream> stream);
 
+	// When enabled, blocks are saved as their difference with what the fallback stream produces.
+	// Loading them requires to run the fallback stream again, but saves of lightly edited worlds become much smaller.
+	void set_save_fallback_delta(bool enabled);
+	bool get_save_fallback_delta() const;
+
+	// Codec used when saving blocks. Blocks saved with another codec can still be loaded.
+	// Derived streams using the serializer from another thread must override these to take their lock.
+	virtual void set_compression_codec(int codec);
+	int get_compression_codec() const;
+
+	// Only used by codecs supporting levels. 0 means the codec's default.
+	virtual void set_compression_level(int level);
+	int get_compression_level() const;
+
+	// Channels produced by the fallback stream, if any. This tells terrains which meshers to use,
+	// it is not a limit on what gets saved, since other channels may have been edited.
+	int get_used_channels_mask() const override;
+
 	// File streams are likely to impose a specific block size,
 	// and changing it can be very expensive so the API is usually specific too
 	virtual int get_block_size_po2() const;
@@ -34,13 +52,26 @@ protected:
 
 	FileAccess *open_file(const String &fpath, int mode_flags, Error *err);
 
+	// Compresses channels of a block to be saved, as a delta if enabled
+	const std::vector<uint8_t> &serialize_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels, int lod, uint32_t channels_mask);
+	// Loads channels of a block saved with serialize_block
+	bool deserialize_block(const uint8_t *p_data, unsigned int p_size, Ref<VoxelBuffer> out_buffer,
+			Vector3i origin_in_voxels, int lod, uint32_t channels_mask);
+	bool deserialize_block(FileAccess *f, unsigned int size_to_read, Ref<VoxelBuffer> out_buffer,
+			Vector3i origin_in_voxels, int lod, uint32_t channels_mask);
+
 	VoxelBlockSerializer _block_serializer;
 
 private:
 	Vector3 _get_block_size() const;
+	Ref<VoxelBuffer> generate_reference_block(const VoxelBuffer &like, Vector3i origin_in_voxels, int lod);
 
 	Ref<VoxelStream> _fallback_stream;
 	bool _save_fallback_output = true;
+	bool _save_fallback_delta = false;
+	std::vector<uint8_t> _read_buffer;
+	VoxelBlockSerializer::Codec _compression_codec = VoxelBlockSerializer::CODEC_LZ4;
+	int _compression_level = 0;
 };
 
 }
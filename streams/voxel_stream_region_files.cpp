@@ -1,19 +1,106 @@
 #include "voxel_stream_region_files.h"
 #include "../math/rect3i.h"
+#include "../util/checksum.h"
 #include "../util/utility.h"
 #include <core/io/json.h>
+#include <core/io/marshalls.h>
 #include <core/os/os.h>
+#include <core/os/thread.h>
 #include <algorithm>
+#include <functional>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
 
 namespace Voxel {
 
 namespace {
 const uint8_t FORMAT_VERSION = 2;
 const uint8_t FORMAT_VERSION_LEGACY_1 = 1;
+// Region files have their own version since checksums were added.
+// Files written with previous versions are still read, but their blocks can't be verified.
+const uint8_t REGION_FORMAT_VERSION = 3;
+const uint8_t REGION_FORMAT_VERSION_NO_CHECKSUMS = 2;
 const char *FORMAT_REGION_MAGIC = "VXR_";
 const char *META_FILE_NAME = "meta.vxrm";
 const int MAGIC_AND_VERSION_SIZE = 4 + 1;
 const char *REGION_FILE_EXTENSION = "vxr";
+// Where data failing to load is moved when quarantine is enabled
+const char *QUARANTINE_FOLDER_NAME = "quarantine";
+// Regions having more free sectors than this ratio are compacted when closed
+const float MAX_FREE_SECTORS_RATIO = 0.25f;
+// How many regions can remain cached after their file has been closed
+const unsigned int MAX_CLOSED_REGIONS = 256;
+// File descriptors left to the rest of the process when checking how many regions can be open
+const unsigned int RESERVED_FILE_DESCRIPTORS = 64;
+
+const char *DICTIONARY_FILE_NAME = "dictionary.vxrd";
+const char *FORMAT_DICTIONARY_MAGIC = "VXRD";
+const uint8_t DICTIONARY_FORMAT_VERSION = 1;
+const unsigned int MAX_DICTIONARY_SIZE = 1024 * 1024;
+// How many blocks are sampled at most when building a dictionary
+const unsigned int MAX_DICTIONARY_SAMPLES = 256;
+
+const char *JOURNAL_FILE_NAME = "journal.vxrj";
+// The journal gets renamed to this while the checkpointer merges it, and new saves go to a new journal
+const char *CHECKPOINT_JOURNAL_FILE_NAME = "journal_checkpoint.vxrj";
+const char *FORMAT_JOURNAL_MAGIC = "VXRJ";
+const uint8_t JOURNAL_FORMAT_VERSION = 1;
+const uint32_t JOURNAL_RECORD_MAGIC = 0x4b4c4258; // "XBLK"
+// magic + lod + position + data size
+const int JOURNAL_RECORD_HEADER_SIZE = 4 + 1 + 3 * 4 + 4;
+// Journaled blocks get merged into regions when the journal gets bigger than this
+const uint64_t JOURNAL_CHECKPOINT_SIZE = 8 * 1024 * 1024;
+
+struct ParallelForContext {
+	const std::function<void(unsigned int)> *func = nullptr;
+	unsigned int count = 0;
+	unsigned int next_index = 0;
+	Mutex mutex;
+};
+
+void parallel_for_thread_func(void *p_context) {
+	ParallelForContext *ctx = reinterpret_cast<ParallelForContext *>(p_context);
+	CRASH_COND(ctx == nullptr);
+
+	while (true) {
+		unsigned int index;
+		{
+			MutexLock lock(ctx->mutex);
+			if (ctx->next_index == ctx->count) {
+				break;
+			}
+			index = ctx->next_index;
+			++ctx->next_index;
+		}
+		(*ctx->func)(index);
+	}
+}
+
+// Runs func(i) for every i in [0, count), spread over threads which pick the next index when they are done.
+void parallel_for(unsigned int count, int thread_count, const std::function<void(unsigned int)> &func) {
+	ParallelForContext ctx;
+	ctx.func = &func;
+	ctx.count = count;
+
+	std::vector<Thread *> threads;
+	for (int i = 0; i < thread_count; ++i) {
+		threads.push_back(Thread::create(parallel_for_thread_func, &ctx));
+	}
+	for (unsigned int i = 0; i < threads.size(); ++i) {
+		Thread::wait_to_finish(threads[i]);
+		memdelete(threads[i]);
+	}
+}
+
+int get_worker_thread_count(int requested_count, unsigned int task_count) {
+	if (requested_count <= 0) {
+		requested_count = OS::get_singleton()->get_processor_count();
+	}
+	return CLAMP(requested_count, 1, MAX((int)task_count, 1));
+}
+
 } // namespace
 
 VoxelStreamRegionFiles::VoxelStreamRegionFiles() {
@@ -26,6 +113,9 @@ VoxelStreamRegionFiles::VoxelStreamRegionFiles() {
 }
 
 VoxelStreamRegionFiles::~VoxelStreamRegionFiles() {
+	stop_checkpointer();
+	MutexLock lock(_mutex);
+	_checkpoint();
 	close_all_regions();
 }
 
@@ -64,17 +154,94 @@ void VoxelStreamRegionFiles::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks)
 
 	Vector<VoxelBlockRequest> fallback_requests;
 
-	for (int i = 0; i < sorted_blocks.size(); ++i) {
-		VoxelBlockRequest &r = sorted_blocks.write[i];
-		EmergeResult result = _emerge_block(r.voxel_buffer, r.origin_in_voxels, r.lod);
-		if (result == EMERGE_OK_FALLBACK) {
-			fallback_requests.push_back(r);
+	{
+		MutexLock lock(_mutex);
+		int group_end = 0;
+
+		for (int i = 0; i < sorted_blocks.size(); ++i) {
+			VoxelBlockRequest &r = sorted_blocks.write[i];
+
+			if (i == group_end && _meta_loaded) {
+				// Requests of the same region are next to each other.
+				// Ask to load all of them at once, so the device can work while we decompress.
+				const Vector3i region_pos = get_region_position_from_request(r);
+				group_end = i + 1;
+				while (group_end < sorted_blocks.size()) {
+					const VoxelBlockRequest &r2 = sorted_blocks[group_end];
+					if (r2.lod != r.lod || get_region_position_from_request(r2) != region_pos) {
+						break;
+					}
+					++group_end;
+				}
+				prefetch_blocks(sorted_blocks, i, group_end);
+			}
+
+			EmergeResult result = _emerge_block(r.voxel_buffer, r.origin_in_voxels, r.lod, r.channels_mask);
+			if (result == EMERGE_OK_FALLBACK) {
+				fallback_requests.push_back(r);
+			}
 		}
 	}
 
 	emerge_blocks_fallback(fallback_requests);
 }
 
+Vector3i VoxelStreamRegionFiles::get_region_position_from_request(const VoxelBlockRequest &r) const {
+	return get_region_position_from_blocks(get_block_position_from_voxels(r.origin_in_voxels) >> r.lod);
+}
+
+void VoxelStreamRegionFiles::prefetch_blocks(const Vector<VoxelBlockRequest> &p_blocks, int begin, int end) {
+	// Only applies to regions which can be read through a mapping.
+	// Pages requested here get loaded asynchronously by the OS. Mappings are not read ahead as a whole,
+	// so this is what gets the device working on the batch before we need it.
+
+	VOXEL_PROFILE_SCOPE(profile_scope);
+	CRASH_COND(begin >= end);
+
+	const VoxelBlockRequest &first = p_blocks[begin];
+	if (first.lod < 0 || first.lod >= _meta.lod_count) {
+		return;
+	}
+
+	CachedRegion *cache = open_region(get_region_position_from_request(first), first.lod, false);
+	if (cache == nullptr || !map_region(cache)) {
+		return;
+	}
+
+	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
+	const int blocks_begin_offset = get_region_header_size(cache->header.version, _meta.region_size_po2);
+
+	// Blocks close in space are often next to each other in the file, so ranges are merged when they touch
+	_prefetch_sectors.clear();
+	for (int i = begin; i < end; ++i) {
+		const VoxelBlockRequest &r = p_blocks[i];
+		const Vector3i block_pos = get_block_position_from_voxels(r.origin_in_voxels) >> r.lod;
+		const BlockInfo &block_info = cache->header.blocks[get_block_index_in_header(block_pos.wrap(region_size))];
+		if (block_info.data == 0) {
+			continue;
+		}
+		_prefetch_sectors.push_back(block_info);
+	}
+
+	std::sort(_prefetch_sectors.begin(), _prefetch_sectors.end(), [](const BlockInfo &a, const BlockInfo &b) {
+		return a.get_sector_index() < b.get_sector_index();
+	});
+
+	size_t i = 0;
+	while (i < _prefetch_sectors.size()) {
+		const unsigned int sector_begin = _prefetch_sectors[i].get_sector_index();
+		unsigned int sector_end = sector_begin + _prefetch_sectors[i].get_sector_count();
+		++i;
+		while (i < _prefetch_sectors.size() && _prefetch_sectors[i].get_sector_index() <= sector_end) {
+			sector_end = max(sector_end, _prefetch_sectors[i].get_sector_index() + _prefetch_sectors[i].get_sector_count());
+			++i;
+		}
+		cache->mapping.prefetch(
+				blocks_begin_offset + (size_t)sector_begin * _meta.sector_size,
+				(size_t)(sector_end - sector_begin) * _meta.sector_size);
+	}
+}
+
 void VoxelStreamRegionFiles::immerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
 	VOXEL_PROFILE_SCOPE(profile_scope);
 
@@ -86,13 +253,26 @@ void VoxelStreamRegionFiles::immerge_blocks(Vector<VoxelBlockRequest> &p_blocks)
 	sorter.compare.self = this;
 	sorter.sort(sorted_blocks.ptrw(), sorted_blocks.size());
 
+	MutexLock lock(_mutex);
+
 	for (int i = 0; i < sorted_blocks.size(); ++i) {
 		VoxelBlockRequest &r = sorted_blocks.write[i];
-		_immerge_block(r.voxel_buffer, r.origin_in_voxels, r.lod);
+		_immerge_block(r.voxel_buffer, r.origin_in_voxels, r.lod, r.channels_mask);
+	}
+
+	if (_journal_file != nullptr) {
+		// Make sure the batch reaches the file
+		_journal_file->flush();
+
+		if (_journal_size >= JOURNAL_CHECKPOINT_SIZE) {
+			start_checkpointer();
+			_checkpointer_semaphore.post();
+		}
 	}
 }
 
-VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
+VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(
+		Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod, uint32_t channels_mask) {
 
 	VOXEL_PROFILE_SCOPE(profile_scope);
 	ERR_FAIL_COND_V(out_buffer.is_null(), EMERGE_FAILED);
@@ -124,6 +304,7 @@ VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(Ref<V
 
 	// Configure depths, as they currently are only specified in the meta file.
 	// Regions are expected to contain such depths, and use those in the buffer to know how much data to read.
+	// This is also needed for channels which are not loaded, to know how much data to skip. It doesn't allocate anything.
 	for (unsigned int channel_index = 0; channel_index < _meta.channel_depths.size(); ++channel_index) {
 		out_buffer->set_channel_depth(channel_index, _meta.channel_depths[channel_index]);
 	}
@@ -131,6 +312,19 @@ VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(Ref<V
 	Vector3i block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
 	Vector3i region_pos = get_region_position_from_blocks(block_pos);
 
+	// Blocks saved in the journal are more recent than those in regions
+	const std::vector<uint8_t> *journaled_data = _journaled_blocks[lod].getptr(block_pos);
+	if (journaled_data == nullptr) {
+		journaled_data = _checkpoint_blocks[lod].getptr(block_pos);
+	}
+	if (journaled_data != nullptr) {
+		ERR_FAIL_COND_V_MSG(!deserialize_block(
+									journaled_data->data(), journaled_data->size(), out_buffer, origin_in_voxels, lod, channels_mask),
+				EMERGE_FAILED,
+				String("Failed to read journaled block {0}").format(varray(block_pos.to_vec3())));
+		return EMERGE_OK;
+	}
+
 	CachedRegion *cache = open_region(region_pos, lod, false);
 	if (cache == nullptr || !cache->file_exists) {
 		return EMERGE_OK_FALLBACK;
@@ -144,38 +338,154 @@ VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(Ref<V
 		return EMERGE_OK_FALLBACK;
 	}
 
-	unsigned int sector_index = block_info.get_sector_index();
-	//unsigned int sector_count = block_info.get_sector_count();
-	int blocks_begin_offset = get_region_header_size();
+	// Copy because quarantining the block clears it from the header
+	const BlockInfo block_info_copy = block_info;
+	const uint8_t *block_data = nullptr;
+	uint32_t block_data_size = 0;
+	const char *error = nullptr;
 
-	FileAccess *f = cache->file_access;
+	if (!read_block_data(cache, block_info_copy, block_data, block_data_size)) {
+		error = "out of file bounds";
+
+	} else if (cache->header.checksums.size() != 0 &&
+			   crc32c(block_data, block_data_size) != cache->header.checksums[lut_index]) {
+		// Checked before decoding, so corrupted data never reaches the decompressor
+		error = "checksum mismatch";
+
+	} else if (!deserialize_block(block_data, block_data_size, out_buffer, origin_in_voxels, lod, channels_mask)) {
+		error = "could not be decoded";
+	}
+
+	if (error == nullptr) {
+		return EMERGE_OK;
+	}
+
+	ERR_PRINT(String("Failed to read block {0} at region {1} lod {2}: {3}")
+					  .format(varray(block_pos.to_vec3(), region_pos.to_vec3(), lod, error)));
+
+	if (!_quarantine_enabled) {
+		return EMERGE_FAILED;
+	}
+
+	quarantine_block(cache, lut_index, block_pos, lod, block_data, block_data_size);
+
+	// Decoding may have stopped halfway, so the fallback starts from a clean buffer
+	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+		if ((channels_mask & (1 << channel_index)) == 0) {
+			continue;
+		}
+		if (channel_index == VoxelBuffer::CHANNEL_SDF) {
+			out_buffer->clear_channel_f(channel_index, 1.f);
+		} else {
+			out_buffer->clear_channel(channel_index, 0);
+		}
+	}
+
+	return EMERGE_OK_FALLBACK;
+}
+
+bool VoxelStreamRegionFiles::get_block_data_in_file(const uint8_t *file_data, size_t file_size, unsigned int header_size,
+		int sector_size, BlockInfo block_info, const uint8_t *&out_data, uint32_t &out_size) {
 
-	f->seek(blocks_begin_offset + sector_index * _meta.sector_size);
+	const size_t block_offset = header_size + (size_t)block_info.get_sector_index() * sector_size;
+	if (block_offset + sizeof(uint32_t) > file_size) {
+		return false;
+	}
+
+	// TODO Deal with endianess
+	uint32_t block_data_size;
+	memcpy(&block_data_size, file_data + block_offset, sizeof(uint32_t));
+	const size_t data_offset = block_offset + sizeof(uint32_t);
+
+	// The size must fit in the sectors the header allocated to the block
+	if (sizeof(uint32_t) + (size_t)block_data_size > (size_t)block_info.get_sector_count() * sector_size) {
+		return false;
+	}
+	if (data_offset + block_data_size > file_size) {
+		return false;
+	}
 
-	unsigned int block_data_size = f->get_32();
-	CRASH_COND(f->eof_reached());
+	out_data = file_data + data_offset;
+	out_size = block_data_size;
+	return true;
+}
 
-	ERR_FAIL_COND_V_MSG(!_block_serializer.decompress_and_deserialize(f, block_data_size, **out_buffer), EMERGE_FAILED,
-			String("Failed to read block {0} at region {1}").format(varray(block_pos.to_vec3(), region_pos.to_vec3())));
+bool VoxelStreamRegionFiles::read_block_data(
+		CachedRegion *region, BlockInfo block_info, const uint8_t *&out_data, uint32_t &out_size) {
+
+	VOXEL_PROFILE_SCOPE(profile_scope);
+	const unsigned int header_size = get_region_header_size(region->header.version, _meta.region_size_po2);
+
+	if (map_region(region)) {
+		// Fast path: decode straight from mapped pages
+		const FileMapping &mapping = region->mapping;
+		return get_block_data_in_file(
+				mapping.get_data(), mapping.get_size(), header_size, _meta.sector_size, block_info, out_data, out_size);
+	}
+
+	FileAccess *f = region->file_access;
+	const size_t block_offset = header_size + (size_t)block_info.get_sector_index() * _meta.sector_size;
+	const size_t max_size = (size_t)block_info.get_sector_count() * _meta.sector_size;
+
+	f->seek(block_offset);
+	_block_read_buffer.resize(max_size);
+	const size_t read_size = f->get_buffer(_block_read_buffer.data(), max_size);
+
+	// The last block of the file may not be padded, so the buffer is seen as a file containing only that block
+	BlockInfo block_info_in_buffer;
+	block_info_in_buffer.set_sector_count(block_info.get_sector_count());
+	return get_block_data_in_file(_block_read_buffer.data(), read_size, 0, _meta.sector_size,
+			block_info_in_buffer, out_data, out_size);
+}
+
+bool VoxelStreamRegionFiles::map_region(CachedRegion *p_region) {
+	if (p_region->mapping.is_open() && !p_region->mapping_stale) {
+		return true;
+	}
+	if (p_region->mapping_failed) {
+		return false;
+	}
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	CRASH_COND(p_region->file_access == nullptr);
+	// Make sure pending writes reached the file, so they are visible in the mapping
+	p_region->file_access->flush();
+	p_region->mapping_stale = false;
+
+	if (p_region->mapping.is_open()) {
+		// Region files don't shrink while they are open, they can only have grown
+		const size_t file_size = p_region->file_access->get_len();
+		if (file_size <= p_region->mapping.get_size() || p_region->mapping.resize(file_size)) {
+			return true;
+		}
+		p_region->mapping.close();
+	}
 
-	return EMERGE_OK;
+	if (!p_region->mapping.open(get_region_file_path(p_region->position, p_region->lod))) {
+		// Don't retry on every block, FileAccess will be used for this region
+		p_region->mapping_failed = true;
+		return false;
+	}
+	return true;
 }
 
-void VoxelStreamRegionFiles::pad_to_sector_size(FileAccess *f) {
-	int blocks_begin_offset = get_region_header_size();
+void VoxelStreamRegionFiles::pad_to_sector_size(FileAccess *f, int blocks_begin_offset) {
 	int rpos = f->get_position() - blocks_begin_offset;
 	if (rpos == 0) {
 		return;
 	}
 	CRASH_COND(rpos < 0);
 	int pad = _meta.sector_size - (rpos - 1) % _meta.sector_size - 1;
-	for (int i = 0; i < pad; ++i) {
-		// TODO Virtual function called many times, hmmmm...
-		f->store_8(0);
+	static const uint8_t zeros[256] = { 0 };
+	while (pad > 0) {
+		const int count = MIN(pad, (int)sizeof(zeros));
+		f->store_buffer(zeros, count);
+		pad -= count;
 	}
 }
 
-void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vector3i origin_in_voxels, int lod) {
+void VoxelStreamRegionFiles::_immerge_block(
+		Ref<VoxelBuffer> voxel_buffer, Vector3i origin_in_voxels, int lod, uint32_t channels_mask) {
 
 	VOXEL_PROFILE_SCOPE(profile_scope);
 
@@ -207,11 +517,29 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 	const Vector3i block_size = Vector3i(1 << _meta.block_size_po2);
 	ERR_FAIL_COND(voxel_buffer->get_size() != block_size);
 	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
-		ERR_FAIL_COND(voxel_buffer->get_channel_depth(i) != _meta.channel_depths[i]);
+		if (channels_mask & (1 << i)) {
+			ERR_FAIL_COND(voxel_buffer->get_channel_depth(i) != _meta.channel_depths[i]);
+		}
 	}
 
-	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
+	ERR_FAIL_COND(lod < 0 || lod >= _meta.lod_count);
+
 	Vector3i block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
+
+	const std::vector<uint8_t> &data = serialize_block(voxel_buffer, origin_in_voxels, lod, channels_mask);
+
+	if (_journal_enabled) {
+		append_to_journal(block_pos, lod, data);
+	} else {
+		write_block(block_pos, lod, data);
+	}
+}
+
+void VoxelStreamRegionFiles::write_block(const Vector3i &block_pos, int lod, const std::vector<uint8_t> &data) {
+
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
 	Vector3i region_pos = get_region_position_from_blocks(block_pos);
 	Vector3i block_rpos = block_pos.wrap(region_size);
 	//print_line(String("Immerging block {0} r {1}").format(varray(block_pos.to_vec3(), region_pos.to_vec3())));
@@ -220,184 +548,684 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 	ERR_FAIL_COND(cache == nullptr);
 	FileAccess *f = cache->file_access;
 
+	// The file is going to change, possibly in size. The mapping will be updated next time we read from it.
+	cache->mapping_stale = true;
+
 	int lut_index = get_block_index_in_header(block_rpos);
 	BlockInfo &block_info = cache->header.blocks[lut_index];
-	int blocks_begin_offset = get_region_header_size();
+	const int blocks_begin_offset = get_region_header_size(cache->header.version, _meta.region_size_po2);
 
-	if (block_info.data == 0) {
-		// The block isn't in the file yet, append at the end
+	const int written_size = sizeof(int) + data.size();
 
-		int end_offset = blocks_begin_offset + cache->sectors.size() * _meta.sector_size;
-		f->seek(end_offset);
-		int block_offset = f->get_position();
-		// Check position matches the sectors rule
-		CRASH_COND((block_offset - blocks_begin_offset) % _meta.sector_size != 0);
+	const unsigned int new_sector_count = get_sector_count_from_bytes(written_size);
+	CRASH_COND(new_sector_count < 1);
 
-		const std::vector<uint8_t> &data = _block_serializer.serialize_and_compress(**voxel_buffer);
-		f->store_32(data.size());
-		int written_size = sizeof(int) + data.size();
-		f->store_buffer(data.data(), data.size());
+	unsigned int sector_index;
 
-		int end_pos = f->get_position();
-		CRASH_COND(written_size != (end_pos - block_offset));
-		pad_to_sector_size(f);
+	if (block_info.data != 0) {
+		// The block is already in the file
 
-		block_info.set_sector_index((block_offset - blocks_begin_offset) / _meta.sector_size);
-		block_info.set_sector_count(get_sector_count_from_bytes(written_size));
+		const unsigned int old_sector_index = block_info.get_sector_index();
+		const unsigned int old_sector_count = block_info.get_sector_count();
+		CRASH_COND(old_sector_count < 1);
 
-		for (unsigned int i = 0; i < block_info.get_sector_count(); ++i) {
-			cache->sectors.push_back(block_rpos);
+		if (new_sector_count <= old_sector_count) {
+			// We can write the block at the same spot.
+			// If it now uses less sectors, the remaining ones become free.
+			if (new_sector_count < old_sector_count) {
+				free_sectors(cache, old_sector_index + new_sector_count, old_sector_count - new_sector_count);
+				block_info.set_sector_count(new_sector_count);
+				cache->header_modified = true;
+			}
+			sector_index = old_sector_index;
+
+		} else {
+			// The block now uses more sectors. Rather than moving other blocks, we relocate it.
+			// Free its sectors first, so it can grow into free sectors directly following it.
+			free_sectors(cache, old_sector_index, old_sector_count);
+			sector_index = allocate_sectors(cache, new_sector_count);
+			block_info.set_sector_index(sector_index);
+			block_info.set_sector_count(new_sector_count);
+			cache->header_modified = true;
 		}
 
+	} else {
+		// The block isn't in the file yet
+		sector_index = allocate_sectors(cache, new_sector_count);
+		block_info.set_sector_index(sector_index);
+		block_info.set_sector_count(new_sector_count);
 		cache->header_modified = true;
+	}
 
-		//print_line(String("Block saved flen={0}").format(varray(f->get_len())));
+	const int block_offset = blocks_begin_offset + sector_index * _meta.sector_size;
+	f->seek(block_offset);
 
-	} else {
-		// The block is already in the file
+	f->store_32(data.size());
+	f->store_buffer(data.data(), data.size());
 
-		CRASH_COND(cache->sectors.size() == 0);
+	int end_pos = f->get_position();
+	CRASH_COND(written_size != (end_pos - block_offset));
 
-		int old_sector_index = block_info.get_sector_index();
-		int old_sector_count = block_info.get_sector_count();
-		CRASH_COND(old_sector_count < 1);
+	if (cache->header.checksums.size() != 0) {
+		cache->header.checksums[lut_index] = crc32c(data.data(), data.size());
+		cache->header_modified = true;
+	}
 
-		const std::vector<uint8_t> &data = _block_serializer.serialize_and_compress(**voxel_buffer);
-		int written_size = sizeof(int) + data.size();
+	if (sector_index + new_sector_count == cache->sectors.size()) {
+		// The block is the last one in the file
+		pad_to_sector_size(f, blocks_begin_offset);
+	}
+}
 
-		int new_sector_count = get_sector_count_from_bytes(written_size);
-		CRASH_COND(new_sector_count < 1);
+unsigned int VoxelStreamRegionFiles::allocate_sectors(CachedRegion *p_region, unsigned int p_sector_count) {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+	CRASH_COND(p_sector_count == 0);
 
-		if (new_sector_count <= old_sector_count) {
-			// We can write the block at the same spot
+	DynamicBitset &sectors = p_region->sectors;
 
-			if (new_sector_count < old_sector_count) {
-				// The block now uses less sectors, we can compact others.
-				remove_sectors_from_block(cache, block_rpos, old_sector_count - new_sector_count);
-				cache->header_modified = true;
+	if (p_region->free_sector_count >= p_sector_count) {
+		// Look for the first hole big enough
+		unsigned int run = 0;
+		for (unsigned int i = 0; i < sectors.size(); ++i) {
+			if (sectors.get(i)) {
+				run = 0;
+				continue;
+			}
+			++run;
+			if (run == p_sector_count) {
+				const unsigned int begin = i + 1 - run;
+				for (unsigned int j = begin; j <= i; ++j) {
+					sectors.set(j);
+				}
+				p_region->free_sector_count -= p_sector_count;
+				return begin;
 			}
+		}
+	}
 
-			int block_offset = blocks_begin_offset + old_sector_index * _meta.sector_size;
-			f->seek(block_offset);
+	// No hole found, append at the end of the file.
+	// Free sectors are never at the end, they get trimmed when freed.
+	const unsigned int begin = sectors.size();
+	sectors.resize(begin + p_sector_count);
+	for (unsigned int i = begin; i < sectors.size(); ++i) {
+		sectors.set(i);
+	}
+	return begin;
+}
 
-			f->store_32(data.size());
-			f->store_buffer(data.data(), data.size());
+void VoxelStreamRegionFiles::free_sectors(CachedRegion *p_region, unsigned int p_sector_index, unsigned int p_sector_count) {
+	DynamicBitset &sectors = p_region->sectors;
+	CRASH_COND(p_sector_index + p_sector_count > sectors.size());
 
-			int end_pos = f->get_position();
-			CRASH_COND(written_size != (end_pos - block_offset));
+	for (unsigned int i = p_sector_index; i < p_sector_index + p_sector_count; ++i) {
+#ifdef DEBUG_ENABLED
+		CRASH_COND(!sectors.get(i));
+#endif
+		sectors.unset(i);
+	}
+	p_region->free_sector_count += p_sector_count;
 
-		} else {
-			// The block now uses more sectors, we have to move others.
-			// Note: we could shift blocks forward, but we can also remove the block entirely and rewrite it at the end.
-			// Need to investigate if it's worth implementing forward shift instead.
+	// Trim free sectors at the end, so appending blocks can reuse them
+	unsigned int size = sectors.size();
+	while (size > 0 && !sectors.get(size - 1)) {
+		--size;
+		--p_region->free_sector_count;
+	}
+	sectors.resize(size);
+}
+
+void VoxelStreamRegionFiles::compact_region(CachedRegion *p_region) {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	// Moves blocks towards the beginning of the file so there are no free sectors left between them.
+	// Blocks keep their relative order, so each of them only moves backwards.
+
+	if (p_region->free_sector_count == 0) {
+		return;
+	}
+
+	FileAccess *f = p_region->file_access;
+	CRASH_COND(f == nullptr);
+	p_region->mapping_stale = true;
+
+	RegionHeader &header = p_region->header;
+	std::vector<unsigned int> blocks_sorted_by_offset;
+	for (unsigned int i = 0; i < header.blocks.size(); ++i) {
+		if (header.blocks[i].data != 0) {
+			blocks_sorted_by_offset.push_back(i);
+		}
+	}
 
-			remove_sectors_from_block(cache, block_rpos, old_sector_count);
+	std::sort(blocks_sorted_by_offset.begin(), blocks_sorted_by_offset.end(),
+			[&header](unsigned int a, unsigned int b) {
+				return header.blocks[a].get_sector_index() < header.blocks[b].get_sector_index();
+			});
 
-			int block_offset = blocks_begin_offset + cache->sectors.size() * _meta.sector_size;
-			f->seek(block_offset);
+	const int blocks_begin_offset = get_region_header_size(header.version, _meta.region_size_po2);
+	std::vector<uint8_t> temp;
+	unsigned int next_sector_index = 0;
 
-			f->store_32(data.size());
-			f->store_buffer(data.data(), data.size());
+	const int region_size = 1 << _meta.region_size_po2;
 
-			int end_pos = f->get_position();
-			CRASH_COND(written_size != (end_pos - block_offset));
+	for (unsigned int i = 0; i < blocks_sorted_by_offset.size(); ++i) {
+		const unsigned int lut_index = blocks_sorted_by_offset[i];
+		BlockInfo &block_info = header.blocks[lut_index];
+		const unsigned int sector_index = block_info.get_sector_index();
+		const unsigned int sector_count = block_info.get_sector_count();
+
+		unsigned int read_bytes = 0;
+		if (sector_index != next_sector_index) {
+			const unsigned int size_in_bytes = sector_count * _meta.sector_size;
+			temp.resize(size_in_bytes);
+
+			f->seek(blocks_begin_offset + sector_index * _meta.sector_size);
+			// The last block of the file may not be padded if it was written by an older version
+			read_bytes = f->get_buffer(temp.data(), size_in_bytes);
+		}
 
-			pad_to_sector_size(f);
+		// The header comes from disk, so it can be corrupted
+		const char *error = nullptr;
+		if (sector_index < next_sector_index) {
+			error = "overlaps another block";
+		} else if (sector_index != next_sector_index && read_bytes == 0) {
+			error = "out of file bounds";
+		}
 
-			block_info.set_sector_index(cache->sectors.size());
-			for (int i = 0; i < new_sector_count; ++i) {
-				cache->sectors.push_back(block_rpos);
+		if (error != nullptr) {
+			// Leaving it would point to sectors now used by other blocks, so it is removed either way.
+			// Its sectors don't need to be freed, they are rebuilt after compaction.
+			const Vector3i block_pos = p_region->position * region_size + Vector3i::from_zxy_index(lut_index, region_size);
+			ERR_PRINT(String("Dropped block {0} at region {1} lod {2} while compacting: {3}")
+							  .format(varray(block_pos.to_vec3(), p_region->position.to_vec3(), p_region->lod, error)));
+			if (_quarantine_enabled && read_bytes > 0) {
+				save_quarantined_block(block_pos, p_region->lod, temp.data(), read_bytes);
+			}
+			block_info.data = 0;
+			if (header.checksums.size() != 0) {
+				header.checksums[lut_index] = 0;
 			}
+			p_region->header_modified = true;
+			continue;
+		}
 
-			cache->header_modified = true;
+		if (sector_index != next_sector_index) {
+			f->seek(blocks_begin_offset + next_sector_index * _meta.sector_size);
+			f->store_buffer(temp.data(), read_bytes);
+
+			block_info.set_sector_index(next_sector_index);
+			p_region->header_modified = true;
 		}
 
-		block_info.set_sector_count(new_sector_count);
+		next_sector_index += sector_count;
 	}
+
+	p_region->sectors.resize(next_sector_index);
+	p_region->sectors.fill(true);
+	p_region->free_sector_count = 0;
 }
 
-void VoxelStreamRegionFiles::remove_sectors_from_block(CachedRegion *p_region, Vector3i block_rpos, unsigned int p_sector_count) {
+String VoxelStreamRegionFiles::get_journal_file_path() const {
+	return _directory_path.plus_file(JOURNAL_FILE_NAME);
+}
+
+String VoxelStreamRegionFiles::get_checkpoint_journal_file_path() const {
+	return _directory_path.plus_file(CHECKPOINT_JOURNAL_FILE_NAME);
+}
+
+void VoxelStreamRegionFiles::append_to_journal(const Vector3i &block_pos, int lod, const std::vector<uint8_t> &data) {
 	VOXEL_PROFILE_SCOPE(profile_scope);
 
-	// Removes sectors from a block, starting from the last ones.
-	// So if a block has 5 sectors and we remove 2, the first 3 will be preserved.
-	// Then all following sectors are moved earlier in the file to fill the gap.
+	if (_journal_file == nullptr) {
+		// Any previous journal has been replayed when meta was loaded, so it's fine to overwrite it
+		Error err;
+		_journal_file = open_file(get_journal_file_path(), FileAccess::WRITE, &err);
+		ERR_FAIL_COND_MSG(_journal_file == nullptr, String("Could not open journal, error {0}").format(varray(err)));
+		_journal_file->store_buffer((const uint8_t *)FORMAT_JOURNAL_MAGIC, 4);
+		_journal_file->store_8(JOURNAL_FORMAT_VERSION);
+		_journal_size = MAGIC_AND_VERSION_SIZE;
+	}
 
-	//print_line(String("Removing {0} sectors from region {1}").format(varray(p_sector_count, p_region->position.to_vec3())));
+	uint8_t header[JOURNAL_RECORD_HEADER_SIZE];
+	encode_uint32(JOURNAL_RECORD_MAGIC, header);
+	header[4] = lod;
+	encode_uint32(block_pos.x, header + 5);
+	encode_uint32(block_pos.y, header + 9);
+	encode_uint32(block_pos.z, header + 13);
+	encode_uint32(data.size(), header + 17);
+
+	uint32_t checksum = crc32c(header, JOURNAL_RECORD_HEADER_SIZE);
+	checksum = crc32c(data.data(), data.size(), checksum);
+
+	// JournalRecord
+	// - header
+	// - checksum: uint32_t
+	// - data
+	FileAccess *f = _journal_file;
+	f->store_buffer(header, JOURNAL_RECORD_HEADER_SIZE);
+	f->store_32(checksum);
+	f->store_buffer(data.data(), data.size());
+
+	_journal_size += JOURNAL_RECORD_HEADER_SIZE + sizeof(uint32_t) + data.size();
+
+	// Previous versions of the block will not be needed anymore
+	_journaled_blocks[lod][block_pos] = data;
+}
 
-	FileAccess *f = p_region->file_access;
-	int blocks_begin_offset = get_region_header_size();
-	int old_end_offset = blocks_begin_offset + p_region->sectors.size() * _meta.sector_size;
+void VoxelStreamRegionFiles::reset_journal() {
+	if (_journal_file != nullptr) {
+		memdelete(_journal_file);
+		_journal_file = nullptr;
+	}
+	_journal_size = 0;
 
-	unsigned int block_index = get_block_index_in_header(block_rpos);
-	BlockInfo &block_info = p_region->header.blocks[block_index];
+	// Empty the file rather than removing it, so its records are never replayed again
+	String fpath = get_journal_file_path();
+	if (FileAccess::exists(fpath)) {
+		Error err;
+		FileAccessRef f = open_file(fpath, FileAccess::WRITE, &err);
+		ERR_FAIL_COND_MSG(!f, String("Could not reset journal, error {0}").format(varray(err)));
+		f->store_buffer((const uint8_t *)FORMAT_JOURNAL_MAGIC, 4);
+		f->store_8(JOURNAL_FORMAT_VERSION);
+	}
 
-	int src_offset = blocks_begin_offset + (block_info.get_sector_index() + block_info.get_sector_count()) * _meta.sector_size;
-	int dst_offset = src_offset - p_sector_count * _meta.sector_size;
+	// Everything it contained is older than what was just merged
+	remove_checkpoint_journal();
+}
 
-	// Note: removing the last block from a region doesn't make the file invalid, but is not a known use case
-	CRASH_COND(p_region->sectors.size() - p_sector_count <= 0);
-	CRASH_COND(f == nullptr);
-	CRASH_COND(p_sector_count <= 0);
-	CRASH_COND(src_offset - _meta.sector_size < dst_offset);
-	CRASH_COND(block_info.get_sector_index() + p_sector_count > p_region->sectors.size());
-	CRASH_COND(p_sector_count > block_info.get_sector_count());
-	CRASH_COND(dst_offset < blocks_begin_offset);
+void VoxelStreamRegionFiles::remove_checkpoint_journal() {
+	const String fpath = get_checkpoint_journal_file_path();
+	if (FileAccess::exists(fpath)) {
+		DirAccessRef da = DirAccess::create(DirAccess::ACCESS_FILESYSTEM);
+		const Error err = da->remove(fpath);
+		ERR_FAIL_COND_MSG(err != OK, String("Could not remove journal {0}, error {1}").format(varray(fpath, err)));
+	}
+}
 
-	uint8_t *temp = (uint8_t *)memalloc(_meta.sector_size);
+void VoxelStreamRegionFiles::replay_journal() {
+	// Merges blocks left in journals by a previous session, which may have ended abruptly.
+	// A checkpoint may have been interrupted, in which case its journal is older than the current one.
 
-	// TODO There might be a faster way to shrink a file
-	// Erase sectors from file
-	while (src_offset < old_end_offset) {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+	CRASH_COND(!_meta_loaded);
+
+	unsigned int replayed_count = replay_journal_file(get_checkpoint_journal_file_path());
+	replayed_count += replay_journal_file(get_journal_file_path());
+
+	if (replayed_count > 0) {
+		print_line(String("Replayed {0} blocks from region journal").format(varray(replayed_count)));
+	}
 
-		f->seek(src_offset);
-		int read_bytes = f->get_buffer(temp, _meta.sector_size);
-		CRASH_COND(read_bytes != _meta.sector_size); // Corrupted file
+	// Regions must be written before the journal is reset
+	close_all_regions();
+	reset_journal();
+}
 
-		f->seek(dst_offset);
-		f->store_buffer(temp, _meta.sector_size);
+unsigned int VoxelStreamRegionFiles::replay_journal_file(const String &fpath) {
+	// Records are applied in the order they were written, so the latest version of a block wins.
+	// A record that fails to read is assumed to be an incomplete write, which ends the journal.
 
-		src_offset += _meta.sector_size;
-		dst_offset += _meta.sector_size;
+	if (!FileAccess::exists(fpath)) {
+		return 0;
 	}
 
-	memfree(temp);
-	// TODO We need to truncate the end of the file since we effectively shortened it,
-	// but FileAccess doesn't have any function to do that... so can't rely on EOF either
+	unsigned int replayed_count = 0;
+
+	{
+		Error err;
+		FileAccessRef f = open_file(fpath, FileAccess::READ, &err);
+		if (!f) {
+			ERR_PRINT(String("Could not open journal {0}, error {1}").format(varray(fpath, err)));
+			return 0;
+		}
 
-	// Erase sectors from cache
-	p_region->sectors.erase(
-			p_region->sectors.begin() + (block_info.get_sector_index() + block_info.get_sector_count() - p_sector_count),
-			p_region->sectors.begin() + (block_info.get_sector_index() + block_info.get_sector_count()));
+		uint8_t version;
+		const VoxelFileResult check_result = check_magic_and_version(f, JOURNAL_FORMAT_VERSION, FORMAT_JOURNAL_MAGIC, version);
+		if (check_result != VOXEL_FILE_OK) {
+			ERR_PRINT(String("Could not read journal {0}, {1}").format(varray(fpath, Voxel::to_string(check_result))));
+			return 0;
+		}
 
-	unsigned int old_sector_index = block_info.get_sector_index();
+		std::vector<uint8_t> data;
 
-	// Reduce sectors of current block in header.
-	if (block_info.get_sector_count() > p_sector_count) {
-		block_info.set_sector_count(block_info.get_sector_count() - p_sector_count);
-	} else {
-		// Block removed
-		block_info.data = 0;
+		while (true) {
+			uint8_t header[JOURNAL_RECORD_HEADER_SIZE];
+			if (f->get_buffer(header, JOURNAL_RECORD_HEADER_SIZE) != JOURNAL_RECORD_HEADER_SIZE) {
+				break;
+			}
+			if (decode_uint32(header) != JOURNAL_RECORD_MAGIC) {
+				break;
+			}
+
+			const int lod = header[4];
+			const Vector3i block_pos(
+					(int32_t)decode_uint32(header + 5),
+					(int32_t)decode_uint32(header + 9),
+					(int32_t)decode_uint32(header + 13));
+			const uint32_t data_size = decode_uint32(header + 17);
+			const uint32_t expected_checksum = f->get_32();
+
+			if (data_size > f->get_len() - f->get_position()) {
+				break;
+			}
+			data.resize(data_size);
+			if (f->get_buffer(data.data(), data_size) != (int)data_size) {
+				break;
+			}
+
+			uint32_t checksum = crc32c(header, JOURNAL_RECORD_HEADER_SIZE);
+			checksum = crc32c(data.data(), data.size(), checksum);
+			if (checksum != expected_checksum) {
+				WARN_PRINT(String("Journal record {0} is corrupted, ignoring the rest").format(varray(replayed_count)));
+				break;
+			}
+
+			if (lod >= _meta.lod_count) {
+				ERR_PRINT(String("Journal record {0} has invalid LOD {1}").format(varray(replayed_count, lod)));
+				continue;
+			}
+
+			write_block(block_pos, lod, data);
+			++replayed_count;
+		}
+	}
+
+	return replayed_count;
+}
+
+void VoxelStreamRegionFiles::flush_regions() {
+	for (unsigned int i = 0; i < _region_cache.size(); ++i) {
+		CachedRegion *region = _region_cache[i];
+		if (region->file_access == nullptr) {
+			continue;
+		}
+		if (region->header_modified) {
+			region->file_access->seek(MAGIC_AND_VERSION_SIZE);
+			save_header(region);
+		}
+		region->file_access->flush();
+	}
+}
+
+void VoxelStreamRegionFiles::_checkpoint() {
+	// Writes the latest version of every journaled block into region files.
+	// The journal is reset only after regions have been written, so it can be replayed if this gets interrupted.
+
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	bool has_blocks = false;
+	for (unsigned int lod = 0; lod < _journaled_blocks.size(); ++lod) {
+		if (_journaled_blocks[lod].size() > 0 || _checkpoint_blocks[lod].size() > 0) {
+			has_blocks = true;
+			break;
+		}
+	}
+	if (!has_blocks) {
+		return;
+	}
+
+	// Blocks the checkpointer didn't merge yet go first, because they are older
+	for (unsigned int lod = 0; lod < _checkpoint_blocks.size(); ++lod) {
+		HashMap<Vector3i, std::vector<uint8_t>, Vector3iHasher> &blocks = _checkpoint_blocks[lod];
+		const Vector3i *key = nullptr;
+		while ((key = blocks.next(key))) {
+			write_block(*key, lod, blocks[*key]);
+		}
+	}
+
+	for (unsigned int lod = 0; lod < _journaled_blocks.size(); ++lod) {
+		HashMap<Vector3i, std::vector<uint8_t>, Vector3iHasher> &blocks = _journaled_blocks[lod];
+		const Vector3i *key = nullptr;
+		while ((key = blocks.next(key))) {
+			write_block(*key, lod, blocks[*key]);
+		}
+	}
+
+	flush_regions();
+	reset_journal();
+
+	for (unsigned int lod = 0; lod < _journaled_blocks.size(); ++lod) {
+		_journaled_blocks[lod].clear();
+		_checkpoint_blocks[lod].clear();
+	}
+}
+
+bool VoxelStreamRegionFiles::begin_background_checkpoint() {
+	// Takes the current journal aside, so saves can go on in a new one while its blocks get merged.
+	// The old journal is kept until its blocks are written, so it can be replayed if this gets interrupted.
+
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	if (_journal_file == nullptr) {
+		return false;
+	}
+	for (unsigned int lod = 0; lod < _checkpoint_blocks.size(); ++lod) {
+		// The previous checkpoint must be finished first
+		if (_checkpoint_blocks[lod].size() > 0) {
+			return false;
+		}
+	}
+
+	memdelete(_journal_file);
+	_journal_file = nullptr;
+
+	DirAccessRef da = DirAccess::create(DirAccess::ACCESS_FILESYSTEM);
+	const Error err = da->rename(get_journal_file_path(), get_checkpoint_journal_file_path());
+	if (err != OK) {
+		ERR_PRINT(String("Could not rename journal, error {0}. Merging it now.").format(varray(err)));
+		_checkpoint();
+		return false;
+	}
+
+	for (unsigned int lod = 0; lod < _journaled_blocks.size(); ++lod) {
+		_checkpoint_blocks[lod] = _journaled_blocks[lod];
+		_journaled_blocks[lod].clear();
+	}
+	_journal_size = 0;
+	return true;
+}
+
+bool VoxelStreamRegionFiles::merge_next_checkpoint_block() {
+	// Returns false when there is no block left to merge
+	for (unsigned int lod = 0; lod < _checkpoint_blocks.size(); ++lod) {
+		HashMap<Vector3i, std::vector<uint8_t>, Vector3iHasher> &blocks = _checkpoint_blocks[lod];
+		const Vector3i *key = blocks.next(nullptr);
+		if (key != nullptr) {
+			const Vector3i block_pos = *key;
+			write_block(block_pos, lod, blocks[block_pos]);
+			blocks.erase(block_pos);
+			return true;
+		}
+	}
+	return false;
+}
+
+void VoxelStreamRegionFiles::finish_background_checkpoint() {
+	// Regions must be written before the journal is removed
+	flush_regions();
+	remove_checkpoint_journal();
+}
+
+void VoxelStreamRegionFiles::checkpoint() {
+	MutexLock lock(_mutex);
+	_checkpoint();
+}
+
+// Must be called with the mutex locked
+void VoxelStreamRegionFiles::start_checkpointer() {
+	// Don't start while the previous thread is stopping, it would see the exit flag reset.
+	// Saves will try again with their next batch.
+	if (_checkpointer_thread != nullptr || _checkpointer_exit) {
+		return;
+	}
+	_checkpointer_thread = Thread::create(_checkpointer_thread_func, this);
+}
+
+// Must be called without the mutex locked, because the thread needs it to finish
+void VoxelStreamRegionFiles::stop_checkpointer() {
+	Thread *thread = nullptr;
+	{
+		MutexLock lock(_mutex);
+		if (_checkpointer_thread == nullptr) {
+			return;
+		}
+		thread = _checkpointer_thread;
+		_checkpointer_thread = nullptr;
+		_checkpointer_exit = true;
 	}
 
-	// Shift sector index of following blocks
-	if (old_sector_index < p_region->sectors.size()) {
-		RegionHeader &header = p_region->header;
-		for (unsigned int i = 0; i < header.blocks.size(); ++i) {
-			BlockInfo &b = header.blocks[i];
-			if (b.data != 0 && b.get_sector_index() > old_sector_index) {
-				b.set_sector_index(b.get_sector_index() - p_sector_count);
+	_checkpointer_semaphore.post();
+	Thread::wait_to_finish(thread);
+	memdelete(thread);
+
+	MutexLock lock(_mutex);
+	_checkpointer_exit = false;
+}
+
+void VoxelStreamRegionFiles::_checkpointer_thread_func(void *p_self) {
+	VoxelStreamRegionFiles *self = reinterpret_cast<VoxelStreamRegionFiles *>(p_self);
+	CRASH_COND(self == nullptr);
+
+	while (true) {
+		self->_checkpointer_semaphore.wait();
+
+		{
+			MutexLock lock(self->_mutex);
+			if (self->_checkpointer_exit) {
+				break;
+			}
+			if (self->_journal_size < JOURNAL_CHECKPOINT_SIZE || !self->begin_background_checkpoint()) {
+				continue;
+			}
+		}
+
+		// Blocks are merged one at a time, so loading and saving only have to wait for one block to be written
+		while (true) {
+			MutexLock lock(self->_mutex);
+			if (self->_checkpointer_exit) {
+				// Blocks left are merged by the full checkpoint following the stop
+				return;
+			}
+			if (!self->merge_next_checkpoint_block()) {
+				self->finish_background_checkpoint();
+				break;
 			}
 		}
 	}
 }
 
+void VoxelStreamRegionFiles::set_journal_enabled(bool enabled) {
+	{
+		// Read by the streaming thread when saving
+		MutexLock lock(_mutex);
+		if (_journal_enabled == enabled) {
+			return;
+		}
+		if (!enabled) {
+			// Blocks of the journal must reach regions before saves start going there directly
+			_checkpoint();
+		}
+		_journal_enabled = enabled;
+	}
+	if (!enabled) {
+		// Nothing goes to the journal anymore, so the checkpointer won't start again
+		stop_checkpointer();
+	}
+}
+
+bool VoxelStreamRegionFiles::is_journal_enabled() const {
+	MutexLock lock(_mutex);
+	return _journal_enabled;
+}
+
+void VoxelStreamRegionFiles::set_quarantine_enabled(bool enabled) {
+	MutexLock lock(_mutex);
+	_quarantine_enabled = enabled;
+}
+
+bool VoxelStreamRegionFiles::is_quarantine_enabled() const {
+	return _quarantine_enabled;
+}
+
+static String get_quarantine_folder_path_in(const String &directory_path, int lod) {
+	return directory_path.plus_file(QUARANTINE_FOLDER_NAME).plus_file("lod") + String::num_int64(lod);
+}
+
+String VoxelStreamRegionFiles::get_quarantine_folder_path(int lod) const {
+	return get_quarantine_folder_path_in(_directory_path, lod);
+}
+
+// Doesn't use the stream, so it can be called from conversion tasks
+static void save_quarantined_block_in(const String &directory_path, Vector3i block_pos, int lod,
+		const uint8_t *data, uint32_t size) {
+
+	const String folder = get_quarantine_folder_path_in(directory_path, lod);
+	const String fpath = folder.plus_file(String("b.{0}.{1}.{2}.{3}.bin")
+												  .format(varray(block_pos.x, block_pos.y, block_pos.z,
+														  OS::get_singleton()->get_unix_time())));
+	Error err = check_directory_created(folder);
+	if (err == OK) {
+		FileAccess *f = FileAccess::open(fpath, FileAccess::WRITE, &err);
+		if (f != nullptr) {
+			f->store_buffer(data, size);
+			memdelete(f);
+		}
+	}
+	if (err != OK) {
+		ERR_PRINT(String("Could not quarantine block to {0}, error {1}").format(varray(fpath, err)));
+	}
+}
+
+void VoxelStreamRegionFiles::save_quarantined_block(Vector3i block_pos, int lod, const uint8_t *data, uint32_t size) {
+	save_quarantined_block_in(_directory_path, block_pos, lod, data, size);
+}
+
+void VoxelStreamRegionFiles::quarantine_block(CachedRegion *region, unsigned int lut_index, Vector3i block_pos, int lod,
+		const uint8_t *data, uint32_t size) {
+
+	// Keep the raw data around so it can be inspected or recovered,
+	// and remove the block from its region so it gets generated again.
+	// Its sectors are freed, it will be overwritten by the next block saved there.
+
+	if (data != nullptr) {
+		save_quarantined_block(block_pos, lod, data, size);
+	}
+
+	BlockInfo &block_info = region->header.blocks[lut_index];
+	free_sectors(region, block_info.get_sector_index(), block_info.get_sector_count());
+	block_info.data = 0;
+	if (region->header.checksums.size() != 0) {
+		region->header.checksums[lut_index] = 0;
+	}
+	region->header_modified = true;
+	region->mapping_stale = true;
+}
+
+bool VoxelStreamRegionFiles::quarantine_region_file(const String &fpath, int lod) {
+	const String folder = get_quarantine_folder_path(lod);
+	Error err = check_directory_created(folder);
+	if (err == OK) {
+		const String dst_path = folder.plus_file(fpath.get_file() + "." + String::num_int64(OS::get_singleton()->get_unix_time()));
+		DirAccessRef da = DirAccess::create(DirAccess::ACCESS_FILESYSTEM);
+		err = da->rename(fpath, dst_path);
+	}
+	if (err != OK) {
+		ERR_PRINT(String("Could not quarantine region file {0}, error {1}").format(varray(fpath, err)));
+		return false;
+	}
+	return true;
+}
+
 String VoxelStreamRegionFiles::get_directory() const {
 	return _directory_path;
 }
 
 void VoxelStreamRegionFiles::set_directory(String dirpath) {
 	if (_directory_path != dirpath) {
+		MutexLock lock(_mutex);
+		// Finish writing into the previous directory
+		_checkpoint();
+		close_all_regions();
+		_block_serializer.set_dictionary(std::vector<uint8_t>());
 		_directory_path = dirpath.strip_edges();
 		_meta_loaded = false;
 		_meta_saved = false;
@@ -560,9 +1388,153 @@ VoxelFileResult VoxelStreamRegionFiles::load_meta() {
 	_meta_loaded = true;
 	_meta_saved = true;
 
+	// Must be done before reading any block
+	load_dictionary();
+	replay_journal();
+
+	return VOXEL_FILE_OK;
+}
+
+VoxelFileResult VoxelStreamRegionFiles::save_dictionary(const std::vector<uint8_t> &dictionary) {
+
+	ERR_FAIL_COND_V(_directory_path == "", VOXEL_FILE_CANT_OPEN);
+	ERR_FAIL_COND_V(dictionary.size() > MAX_DICTIONARY_SIZE, VOXEL_FILE_INVALID_DATA);
+
+	String fpath = _directory_path.plus_file(DICTIONARY_FILE_NAME);
+	Error err;
+	FileAccessRef f = open_file(fpath, FileAccess::WRITE, &err);
+	if (!f) {
+		ERR_PRINT(String("Could not save {0}").format(varray(fpath)));
+		return VOXEL_FILE_CANT_OPEN;
+	}
+
+	f->store_buffer((const uint8_t *)FORMAT_DICTIONARY_MAGIC, 4);
+	f->store_8(DICTIONARY_FORMAT_VERSION);
+	f->store_32(dictionary.size());
+	f->store_buffer(dictionary.data(), dictionary.size());
+
 	return VOXEL_FILE_OK;
 }
 
+VoxelFileResult VoxelStreamRegionFiles::load_dictionary() {
+
+	ERR_FAIL_COND_V(_directory_path == "", VOXEL_FILE_CANT_OPEN);
+
+	// Saves without dictionary are common
+	_block_serializer.set_dictionary(std::vector<uint8_t>());
+
+	String fpath = _directory_path.plus_file(DICTIONARY_FILE_NAME);
+	if (!FileAccess::exists(fpath)) {
+		return VOXEL_FILE_CANT_OPEN;
+	}
+
+	Error err;
+	FileAccessRef f = open_file(fpath, FileAccess::READ, &err);
+	if (!f) {
+		ERR_PRINT(String("Could not open {0}").format(varray(fpath)));
+		return VOXEL_FILE_CANT_OPEN;
+	}
+
+	uint8_t version;
+	const VoxelFileResult check_result = check_magic_and_version(f, DICTIONARY_FORMAT_VERSION, FORMAT_DICTIONARY_MAGIC, version);
+	if (check_result != VOXEL_FILE_OK) {
+		ERR_PRINT(String("Could not read {0}, {1}").format(varray(fpath, Voxel::to_string(check_result))));
+		return check_result;
+	}
+
+	const uint32_t size = f->get_32();
+	ERR_FAIL_COND_V(size > MAX_DICTIONARY_SIZE, VOXEL_FILE_INVALID_DATA);
+
+	std::vector<uint8_t> dictionary;
+	dictionary.resize(size);
+	if (f->get_buffer(dictionary.data(), size) != (int)size) {
+		ERR_PRINT(String("Could not read {0}, {1}").format(varray(fpath, Voxel::to_string(VOXEL_FILE_UNEXPECTED_EOF))));
+		return VOXEL_FILE_UNEXPECTED_EOF;
+	}
+
+	_block_serializer.set_dictionary(dictionary);
+	return VOXEL_FILE_OK;
+}
+
+void VoxelStreamRegionFiles::build_compression_dictionary(int max_size_in_bytes) {
+
+	ERR_FAIL_COND(max_size_in_bytes <= 0 || max_size_in_bytes > (int)MAX_DICTIONARY_SIZE);
+	ERR_FAIL_COND(_directory_path.empty());
+
+	MutexLock lock(_mutex);
+
+	if (!_meta_loaded) {
+		ERR_FAIL_COND(load_meta() != VOXEL_FILE_OK);
+	}
+	ERR_FAIL_COND_MSG(_block_serializer.has_dictionary(),
+			"The save already has a dictionary. Changing it would make blocks saved with it impossible to load.");
+
+	_checkpoint();
+
+	struct BlockLocation {
+		Vector3i position;
+		int lod;
+	};
+
+	// Gather locations of all saved blocks
+	std::vector<BlockLocation> blocks;
+	{
+		std::vector<PositionAndLod> regions;
+		get_region_list(regions);
+		const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
+
+		for (unsigned int i = 0; i < regions.size(); ++i) {
+			const PositionAndLod &region_info = regions[i];
+			const CachedRegion *region = open_region(region_info.position, region_info.lod, false);
+			if (region == nullptr) {
+				continue;
+			}
+			const RegionHeader &header = region->header;
+			for (unsigned int j = 0; j < header.blocks.size(); ++j) {
+				if (header.blocks[j].data != 0) {
+					BlockLocation loc;
+					loc.position = get_block_position_from_index(j) + region_info.position * region_size;
+					loc.lod = region_info.lod;
+					blocks.push_back(loc);
+				}
+			}
+		}
+	}
+
+	ERR_FAIL_COND_MSG(blocks.size() == 0, "There are no saved blocks to build a dictionary from");
+
+	// The dictionary is made of raw blocks picked across the whole save.
+	// Codecs use it as a source of matches, so common patterns end up costing very little in each block.
+	const unsigned int sample_count = MIN(blocks.size(), MAX_DICTIONARY_SAMPLES);
+	const unsigned int step = blocks.size() / sample_count;
+	const Vector3i block_size = Vector3i(1 << _meta.block_size_po2);
+
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	buffer->create(block_size.x, block_size.y, block_size.z);
+
+	std::vector<uint8_t> dictionary;
+
+	for (unsigned int i = 0; i < sample_count; ++i) {
+		const BlockLocation &loc = blocks[i * step];
+		if (_emerge_block(buffer, (loc.position * block_size) << loc.lod, loc.lod, VoxelBuffer::ALL_CHANNELS_MASK) != EMERGE_OK) {
+			continue;
+		}
+		const std::vector<uint8_t> &data = _block_serializer.serialize(**buffer);
+		dictionary.insert(dictionary.end(), data.begin(), data.end());
+	}
+
+	if (dictionary.size() > (unsigned int)max_size_in_bytes) {
+		// Codecs favor the end of dictionaries, keep that part
+		dictionary.erase(dictionary.begin(), dictionary.begin() + (dictionary.size() - max_size_in_bytes));
+	}
+
+	ERR_FAIL_COND(save_dictionary(dictionary) != VOXEL_FILE_OK);
+	_block_serializer.set_dictionary(dictionary);
+
+	print_line(String("Built compression dictionary of {0} bytes from {1} blocks").format(varray((int)dictionary.size(), sample_count)));
+}
+
 bool VoxelStreamRegionFiles::check_meta(const Meta &meta) {
 	ERR_FAIL_COND_V(meta.block_size_po2 < 1 || meta.block_size_po2 > 8, false);
 	ERR_FAIL_COND_V(meta.region_size_po2 < 1 || meta.region_size_po2 > 8, false);
@@ -586,10 +1558,14 @@ void VoxelStreamRegionFiles::close_all_regions() {
 		memdelete(cache);
 	}
 	_region_cache.clear();
-}
 
-String VoxelStreamRegionFiles::get_region_file_path(const Vector3i &region_pos, unsigned int lod) const {
+	for (unsigned int i = 0; i < _closed_region_cache.size(); ++i) {
+		memdelete(_closed_region_cache[i]);
+	}
+	_closed_region_cache.clear();
+}
 
+static String get_region_file_path_in(const String &directory_path, const Vector3i &region_pos, unsigned int lod) {
 	Array a;
 	a.resize(5);
 	a[0] = lod;
@@ -597,19 +1573,33 @@ String VoxelStreamRegionFiles::get_region_file_path(const Vector3i &region_pos,
 	a[2] = region_pos.y;
 	a[3] = region_pos.z;
 	a[4] = REGION_FILE_EXTENSION;
-	return _directory_path.plus_file(String("regions/lod{0}/r.{1}.{2}.{3}.{4}").format(a));
+	return directory_path.plus_file(String("regions/lod{0}/r.{1}.{2}.{3}.{4}").format(a));
 }
 
-VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::get_region_from_cache(const Vector3i pos, int lod) const {
+String VoxelStreamRegionFiles::get_region_file_path(const Vector3i &region_pos, unsigned int lod) const {
+	return get_region_file_path_in(_directory_path, region_pos, lod);
+}
+
+int VoxelStreamRegionFiles::find_region_in_cache(const std::vector<CachedRegion *> &cache, const Vector3i pos, int lod) const {
 	// A linear search might be better than a Map data structure,
-	// because it's unlikely to have more than about 10 regions cached at a time
-	for (unsigned int i = 0; i < _region_cache.size(); ++i) {
-		CachedRegion *r = _region_cache[i];
+	// because it's unlikely to have more than about 10 regions cached at a time.
+	// Search from the end, because recently used regions are more likely to be used again.
+	for (int i = cache.size() - 1; i >= 0; --i) {
+		const CachedRegion *r = cache[i];
 		if (r->position == pos && r->lod == lod) {
-			return r;
+			return i;
 		}
 	}
-	return nullptr;
+	return -1;
+}
+
+void VoxelStreamRegionFiles::add_to_closed_regions(CachedRegion *p_region) {
+	CRASH_COND(p_region->file_access != nullptr);
+	if (_closed_region_cache.size() >= MAX_CLOSED_REGIONS) {
+		memdelete(_closed_region_cache[0]);
+		_closed_region_cache.erase(_closed_region_cache.begin());
+	}
+	_closed_region_cache.push_back(p_region);
 }
 
 VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const Vector3i region_pos, unsigned int lod, bool create_if_not_found) {
@@ -618,28 +1608,92 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 	ERR_FAIL_COND_V(!_meta_loaded, nullptr);
 	ERR_FAIL_COND_V(lod < 0, nullptr);
 
-	CachedRegion *cache = get_region_from_cache(region_pos, lod);
-	if (cache != nullptr) {
+	int cache_index = find_region_in_cache(_region_cache, region_pos, lod);
+	if (cache_index != -1) {
+		++_stats.file_cache_hits;
+		CachedRegion *cache = _region_cache[cache_index];
+		if (cache_index + 1 != (int)_region_cache.size()) {
+			// Mark as most recently used
+			_region_cache.erase(_region_cache.begin() + cache_index);
+			_region_cache.push_back(cache);
+		}
 		return cache;
 	}
 
+	String fpath = get_region_file_path(region_pos, lod);
+
+	cache_index = find_region_in_cache(_closed_region_cache, region_pos, lod);
+	if (cache_index != -1) {
+		CachedRegion *closed = _closed_region_cache[cache_index];
+
+		if (!closed->file_exists) {
+			if (!create_if_not_found) {
+				// We already know there is no file
+				++_stats.file_cache_hits;
+				if (cache_index + 1 != (int)_closed_region_cache.size()) {
+					// Mark as most recently used, so regions queried often stay known as missing
+					_closed_region_cache.erase(_closed_region_cache.begin() + cache_index);
+					_closed_region_cache.push_back(closed);
+				}
+				return nullptr;
+			}
+			_closed_region_cache.erase(_closed_region_cache.begin() + cache_index);
+			memdelete(closed);
+
+		} else {
+			// Reopen the file, but we already have its header
+			++_stats.file_cache_misses;
+
+			while (_region_cache.size() > _max_open_regions - 1) {
+				close_oldest_region();
+			}
+
+			_closed_region_cache.erase(_closed_region_cache.begin() + cache_index);
+
+			Error err;
+			FileAccess *f = open_file(fpath, FileAccess::READ_WRITE, &err);
+			if (f != nullptr && err == OK) {
+				closed->file_access = f;
+				closed->mapping_failed = false;
+				_region_cache.push_back(closed);
+				return closed;
+			}
+
+			// The file vanished, proceed as if we never had it
+			if (f != nullptr) {
+				memdelete(f);
+			}
+			memdelete(closed);
+		}
+	}
+
+	++_stats.file_cache_misses;
+
 	while (_region_cache.size() > _max_open_regions - 1) {
 		close_oldest_region();
 	}
 
 	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
 
-	String fpath = get_region_file_path(region_pos, lod);
+	CachedRegion *cache = nullptr;
+
 	Error existing_file_err;
 	FileAccess *existing_f = open_file(fpath, FileAccess::READ_WRITE, &existing_file_err);
-	// TODO Cache the fact the file doesnt exist, so we won't need to do a system call to actually check it every time
-	// TODO No need to read the header again when it has been read once, we assume no other process will modify region files
 
 	if (existing_f == nullptr || existing_file_err != OK) {
 		// Write new file
 
 		if (!create_if_not_found) {
 			//print_error(String("Could not open file {0}").format(varray(fpath)));
+			if (existing_f != nullptr) {
+				memdelete(existing_f);
+			}
+			// Remember the file doesn't exist, so we won't need to do a system call to check it every time
+			CachedRegion *missing = memnew(CachedRegion);
+			missing->position = region_pos;
+			missing->lod = lod;
+			missing->file_exists = false;
+			add_to_closed_regions(missing);
 			return nullptr;
 		}
 
@@ -656,7 +1710,7 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 		ERR_FAIL_COND_V_MSG(file_err != OK, nullptr, "Error " + String::num_int64(file_err));
 
 		f->store_buffer((uint8_t *)FORMAT_REGION_MAGIC, 4);
-		f->store_8(FORMAT_VERSION);
+		f->store_8(REGION_FORMAT_VERSION);
 
 		cache = memnew(CachedRegion);
 		cache->file_exists = true;
@@ -666,7 +1720,9 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 		_region_cache.push_back(cache);
 		RegionHeader &header = cache->header;
 
+		header.version = REGION_FORMAT_VERSION;
 		header.blocks.resize(region_size.volume());
+		header.checksums.resize(region_size.volume(), 0);
 
 		save_header(cache);
 
@@ -674,74 +1730,65 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 		// Read existing
 		VOXEL_PROFILE_SCOPE(profile_read_existing);
 
-		uint8_t version;
-		const VoxelFileResult check_result = check_magic_and_version(existing_f, FORMAT_VERSION, FORMAT_REGION_MAGIC, version);
-
-		if (check_result == VOXEL_FILE_INVALID_VERSION) {
-			if (version != FORMAT_VERSION_LEGACY_1) {
-				memdelete(existing_f);
-				ERR_PRINT(String("Could not open file {0}, invalid version {1}").format(varray(fpath, version)));
-				return nullptr;
-			}
-
-		} else if (check_result != VOXEL_FILE_OK) {
-			memdelete(existing_f);
-			ERR_PRINT(String("Could not open file {0}, {1}").format(varray(fpath, Voxel::to_string(check_result))));
-			return nullptr;
-		}
-
-		// Versions 1 and 2 are the same
-
 		cache = memnew(CachedRegion);
 		cache->file_exists = true;
 		cache->file_access = existing_f;
 		cache->position = region_pos;
 		cache->lod = lod;
-		_region_cache.push_back(cache);
-		RegionHeader &header = cache->header;
 
-		header.blocks.resize(region_size.volume());
+		VoxelFileResult header_result;
+		if (map_region(cache)) {
+			header_result = parse_region_header(
+					cache->mapping.get_data(), cache->mapping.get_size(), _meta.region_size_po2, cache->header);
+		} else {
+			const size_t max_header_size = get_region_header_size(REGION_FORMAT_VERSION, _meta.region_size_po2);
+			_block_read_buffer.resize(max_header_size);
+			existing_f->seek(0);
+			const size_t read_size = existing_f->get_buffer(_block_read_buffer.data(), max_header_size);
+			header_result = parse_region_header(_block_read_buffer.data(), read_size, _meta.region_size_po2, cache->header);
+		}
 
-		// TODO Deal with endianess
-		existing_f->get_buffer((uint8_t *)header.blocks.data(), header.blocks.size() * sizeof(BlockInfo));
-	}
+		if (header_result != VOXEL_FILE_OK) {
+			cache->mapping.close();
+			memdelete(existing_f);
+			memdelete(cache);
+			ERR_PRINT(String("Could not open file {0}, {1}").format(varray(fpath, Voxel::to_string(header_result))));
+
+			if (_quarantine_enabled && quarantine_region_file(fpath, lod)) {
+				// Start over as if the file never existed
+				return open_region(region_pos, lod, create_if_not_found);
+			}
+			return nullptr;
+		}
 
-	// Precalculate location of sectors and which block they contain.
-	// This will be useful to know when sectors get moved on insertion and removal
+		_region_cache.push_back(cache);
+	}
 
-	struct BlockInfoAndIndex {
-		BlockInfo b;
-		int i;
-	};
+	// Precalculate which sectors are used, so we can find free ones when saving blocks
 
-	// Filter only present blocks and keep the index around because it represents the 3D position of the block
 	RegionHeader &header = cache->header;
-	std::vector<BlockInfoAndIndex> blocks_sorted_by_offset;
+	unsigned int sector_count = 0;
 	for (unsigned int i = 0; i < header.blocks.size(); ++i) {
 		const BlockInfo b = header.blocks[i];
 		if (b.data != 0) {
-			BlockInfoAndIndex p;
-			p.b = b;
-			p.i = i;
-			blocks_sorted_by_offset.push_back(p);
+			sector_count = MAX(sector_count, b.get_sector_index() + b.get_sector_count());
 		}
 	}
 
-	std::sort(blocks_sorted_by_offset.begin(), blocks_sorted_by_offset.end(),
-			[](const BlockInfoAndIndex &a, const BlockInfoAndIndex &b) {
-				return a.b.get_sector_index() < b.b.get_sector_index();
-			});
+	cache->sectors.resize(sector_count);
+	cache->sectors.fill(false);
+	cache->free_sector_count = sector_count;
 
-	for (unsigned int i = 0; i < blocks_sorted_by_offset.size(); ++i) {
-		const BlockInfoAndIndex b = blocks_sorted_by_offset[i];
-		Vector3i bpos = get_block_position_from_index(b.i);
-		for (unsigned int j = 0; j < b.b.get_sector_count(); ++j) {
-			cache->sectors.push_back(bpos);
+	for (unsigned int i = 0; i < header.blocks.size(); ++i) {
+		const BlockInfo b = header.blocks[i];
+		if (b.data != 0) {
+			for (unsigned int j = b.get_sector_index(); j < b.get_sector_index() + b.get_sector_count(); ++j) {
+				cache->sectors.set(j);
+			}
+			cache->free_sector_count -= b.get_sector_count();
 		}
 	}
 
-	cache->last_opened = OS::get_singleton()->get_ticks_usec();
-
 	return cache;
 }
 
@@ -750,55 +1797,149 @@ void VoxelStreamRegionFiles::save_header(CachedRegion *p_region) {
 	VOXEL_PROFILE_SCOPE(profile_scope);
 	CRASH_COND(p_region->file_access == nullptr);
 
-	RegionHeader &header = p_region->header;
-	CRASH_COND(header.blocks.size() == 0);
+	CRASH_COND(p_region->header.blocks.size() == 0);
 
-	// TODO Deal with endianess
-	p_region->file_access->store_buffer((const uint8_t *)header.blocks.data(), header.blocks.size() * sizeof(BlockInfo));
+	store_region_header(p_region->file_access, p_region->header);
 	p_region->header_modified = false;
 }
 
+void VoxelStreamRegionFiles::store_region_header(FileAccess *f, const RegionHeader &header) {
+	// TODO Deal with endianess
+	const size_t blocks_size_in_bytes = header.blocks.size() * sizeof(BlockInfo);
+	f->store_buffer((const uint8_t *)header.blocks.data(), blocks_size_in_bytes);
+
+	if (header.version >= REGION_FORMAT_VERSION) {
+		CRASH_COND(header.checksums.size() != header.blocks.size());
+		const size_t checksums_size_in_bytes = header.checksums.size() * sizeof(uint32_t);
+		f->store_buffer((const uint8_t *)header.checksums.data(), checksums_size_in_bytes);
+
+		// The header itself is checked, so a damaged table can't send reads at random places in the file
+		uint32_t crc = crc32c((const uint8_t *)header.blocks.data(), blocks_size_in_bytes);
+		crc = crc32c((const uint8_t *)header.checksums.data(), checksums_size_in_bytes, crc);
+		f->store_32(crc);
+	}
+}
+
+VoxelFileResult VoxelStreamRegionFiles::parse_region_header(
+		const uint8_t *data, size_t size, uint8_t region_size_po2, RegionHeader &out_header) {
+
+	if (size < (size_t)MAGIC_AND_VERSION_SIZE) {
+		return VOXEL_FILE_UNEXPECTED_EOF;
+	}
+	if (memcmp(data, FORMAT_REGION_MAGIC, 4) != 0) {
+		return VOXEL_FILE_INVALID_MAGIC;
+	}
+
+	// Versions 1 and 2 are the same
+	const uint8_t version = data[4];
+	if (version != REGION_FORMAT_VERSION &&
+			version != REGION_FORMAT_VERSION_NO_CHECKSUMS &&
+			version != FORMAT_VERSION_LEGACY_1) {
+		return VOXEL_FILE_INVALID_VERSION;
+	}
+
+	if (size < get_region_header_size(version, region_size_po2)) {
+		return VOXEL_FILE_UNEXPECTED_EOF;
+	}
+
+	const unsigned int block_count = 1 << (3 * region_size_po2);
+	const size_t blocks_size_in_bytes = block_count * sizeof(BlockInfo);
+	const uint8_t *blocks_data = data + MAGIC_AND_VERSION_SIZE;
+
+	out_header.version = version;
+	out_header.blocks.resize(block_count);
+	// TODO Deal with endianess
+	memcpy(out_header.blocks.data(), blocks_data, blocks_size_in_bytes);
+
+	if (version < REGION_FORMAT_VERSION) {
+		out_header.checksums.clear();
+		return VOXEL_FILE_OK;
+	}
+
+	const size_t checksums_size_in_bytes = block_count * sizeof(uint32_t);
+	const uint8_t *checksums_data = blocks_data + blocks_size_in_bytes;
+
+	uint32_t expected_crc;
+	memcpy(&expected_crc, checksums_data + checksums_size_in_bytes, sizeof(uint32_t));
+	const uint32_t crc = crc32c(blocks_data, blocks_size_in_bytes + checksums_size_in_bytes);
+	if (crc != expected_crc) {
+		return VOXEL_FILE_INVALID_DATA;
+	}
+
+	out_header.checksums.resize(block_count);
+	memcpy(out_header.checksums.data(), checksums_data, checksums_size_in_bytes);
+	return VOXEL_FILE_OK;
+}
+
 void VoxelStreamRegionFiles::close_region(CachedRegion *region) {
 	VOXEL_PROFILE_SCOPE(profile_scope);
 
+	region->mapping.close();
+
 	if (region->file_access) {
 		FileAccess *f = region->file_access;
 
+		if (region->free_sector_count > MAX_FREE_SECTORS_RATIO * region->sectors.size()) {
+			compact_region(region);
+		}
+
 		// This is really important because the OS can optimize file closing if we didn't write anything
 		if (region->header_modified) {
 			f->seek(MAGIC_AND_VERSION_SIZE);
 			save_header(region);
 		}
 
+		const uint64_t used_size = get_region_header_size(region->header.version, _meta.region_size_po2) +
+								   region->sectors.size() * _meta.sector_size;
+		const bool needs_truncation = f->get_len() > used_size;
+
 		memdelete(region->file_access);
 		region->file_access = nullptr;
+
+		if (needs_truncation) {
+			// Trailing sectors are no longer used by any block
+			const Error err = truncate_file(get_region_file_path(region->position, region->lod), used_size);
+			if (err != OK && err != ERR_UNAVAILABLE) {
+				ERR_PRINT(String("Could not truncate region file, error {0}").format(varray(err)));
+			}
+		}
 	}
 }
 
 void VoxelStreamRegionFiles::close_oldest_region() {
-	// Close region assumed to be the least recently used
+	// Close the least recently used region, but keep its header around
 
 	if (_region_cache.size() == 0) {
 		return;
 	}
 
-	int oldest_index = -1;
-	uint64_t oldest_time = 0;
-	uint64_t now = OS::get_singleton()->get_ticks_usec();
+	CachedRegion *region = _region_cache[0];
+	_region_cache.erase(_region_cache.begin());
 
-	for (unsigned int i = 0; i < _region_cache.size(); ++i) {
-		CachedRegion *r = _region_cache[i];
-		uint64_t time = now - r->last_opened;
-		if (time >= oldest_time) {
-			oldest_index = i;
-		}
-	}
+	close_region(region);
+	add_to_closed_regions(region);
+}
 
-	CachedRegion *region = _region_cache[oldest_index];
-	_region_cache.erase(_region_cache.begin() + oldest_index);
+void VoxelStreamRegionFiles::set_max_open_regions(int count) {
+	ERR_FAIL_COND(count < 1);
+#ifdef __linux__
+	// Each open region holds a file descriptor. Mappings don't keep theirs.
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+		ERR_FAIL_COND_MSG((uint64_t)count + RESERVED_FILE_DESCRIPTORS > (uint64_t)limit.rlim_cur,
+				String("Cannot keep {0} regions open, the process is limited to {1} files")
+						.format(varray(count, (int64_t)limit.rlim_cur)));
+	}
+#endif
+	MutexLock lock(_mutex);
+	_max_open_regions = count;
+	while (_region_cache.size() > _max_open_regions) {
+		close_oldest_region();
+	}
+}
 
-	close_region(region);
-	memdelete(region);
+int VoxelStreamRegionFiles::get_max_open_regions() const {
+	return _max_open_regions;
 }
 
 unsigned int VoxelStreamRegionFiles::get_block_index_in_header(const Vector3i &rpos) const {
@@ -815,11 +1956,15 @@ int VoxelStreamRegionFiles::get_sector_count_from_bytes(int size_in_bytes) const
 	return (size_in_bytes - 1) / _meta.sector_size + 1;
 }
 
-int VoxelStreamRegionFiles::get_region_header_size() const {
+unsigned int VoxelStreamRegionFiles::get_region_header_size(uint8_t version, uint8_t region_size_po2) {
 	// Which file offset blocks data is starting
-	// magic + version + blockinfos
-	const Vector3i region_size(1 << _meta.region_size_po2);
-	return MAGIC_AND_VERSION_SIZE + region_size.volume() * sizeof(BlockInfo);
+	const unsigned int block_count = 1 << (3 * region_size_po2);
+	if (version < REGION_FORMAT_VERSION) {
+		// magic + version + blockinfos
+		return MAGIC_AND_VERSION_SIZE + block_count * sizeof(BlockInfo);
+	}
+	// magic + version + blockinfos + checksums + header checksum
+	return MAGIC_AND_VERSION_SIZE + block_count * (sizeof(BlockInfo) + sizeof(uint32_t)) + sizeof(uint32_t);
 }
 
 static inline int convert_block_coordinate(int p_x, int old_size, int new_size) {
@@ -833,7 +1978,7 @@ static Vector3i convert_block_coordinates(Vector3i pos, Vector3i old_size, Vecto
 			convert_block_coordinate(pos.z, old_size.z, new_size.z));
 }
 
-void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
+void VoxelStreamRegionFiles::_convert_files(Meta new_meta, int thread_count) {
 	// TODO Converting across different block sizes is untested.
 	// I wrote it because it would be too bad to loose large voxel worlds because of a setting change, so one day we may need it
 
@@ -843,12 +1988,15 @@ void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 	ERR_FAIL_COND(!_meta_saved);
 	ERR_FAIL_COND(!_meta_loaded);
 
+	_checkpoint();
 	close_all_regions();
 
 	Ref<VoxelStreamRegionFiles> old_stream;
 	old_stream.instance();
 	// Keep file cache to a minimum for the old stream, we'll query all blocks once anyways
-	old_stream->_max_open_regions = MAX(1, FOPEN_MAX);
+	old_stream->_max_open_regions = 1;
+	// Blocks saved as deltas need the same fallback to be loaded
+	old_stream->set_fallback_stream(get_fallback_stream());
 
 	// Backup current folder by renaming it, leaving the current name vacant
 	{
@@ -877,68 +2025,49 @@ void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 		print_line("Data backed up as " + old_dir);
 	}
 
-	struct PositionAndLod {
-		Vector3i position;
-		int lod;
-	};
-
 	ERR_FAIL_COND(old_stream->load_meta() != VOXEL_FILE_OK);
 
 	std::vector<PositionAndLod> old_region_list;
 	Meta old_meta = old_stream->_meta;
 
 	// Get list of all regions from the old stream
-	{
-		for (int lod = 0; lod < old_meta.lod_count; ++lod) {
-
-			String lod_folder = old_stream->_directory_path.plus_file("regions").plus_file("lod") + String::num_int64(lod);
-			String ext = String(".") + REGION_FILE_EXTENSION;
-
-			DirAccessRef da = DirAccess::open(lod_folder);
-			if (!da) {
-				continue;
-			}
-
-			da->list_dir_begin();
-
-			while (true) {
-				String fname = da->get_next();
-				if (fname == "") {
-					break;
-				}
-				if (da->current_is_dir()) {
-					continue;
-				}
-				if (fname.ends_with(ext)) {
-					Vector<String> parts = fname.split(".");
-					// r.x.y.z.ext
-					ERR_FAIL_COND_MSG(parts.size() < 4, String("Found invalid region file: '{0}'").format(varray(fname)));
-					PositionAndLod p;
-					p.position.x = parts[1].to_int();
-					p.position.y = parts[2].to_int();
-					p.position.z = parts[3].to_int();
-					p.lod = lod;
-					old_region_list.push_back(p);
-				}
-			}
-
-			da->list_dir_end();
-		}
-	}
+	old_stream->get_region_list(old_region_list);
 
+	// Conversion doesn't change the format of voxels
+	new_meta.channel_depths = old_meta.channel_depths;
 	_meta = new_meta;
 	ERR_FAIL_COND(save_meta() != VOXEL_FILE_OK);
+	if (_block_serializer.has_dictionary()) {
+		// Converted blocks keep using the same dictionary
+		ERR_FAIL_COND(save_dictionary(_block_serializer.get_dictionary()) != VOXEL_FILE_OK);
+	}
+
+	if (old_meta.block_size_po2 == _meta.block_size_po2) {
+		// Blocks keep the same size, so their compressed data can be copied as-is into the new layout
+		rewrite_regions(old_stream->_directory_path, old_meta, old_region_list, _directory_path, _meta, thread_count);
+		print_line("Done converting region files");
+		return;
+	}
 
 	const Vector3i old_block_size = Vector3i(1 << old_meta.block_size_po2);
 	const Vector3i new_block_size = Vector3i(1 << _meta.block_size_po2);
 
 	const Vector3i old_region_size = Vector3i(1 << old_meta.region_size_po2);
 
-	// Read all blocks from the old stream and write them into the new one
+	// Read all blocks from the old stream and write them into the new one.
+	// Blocks have to be decompressed and split or merged, which is done on this thread only.
+
+	reset_conversion_progress(old_region_list.size());
 
 	for (unsigned int i = 0; i < old_region_list.size(); ++i) {
 		PositionAndLod region_info = old_region_list[i];
 
+		advance_conversion_progress();
+
+		if (region_info.lod >= _meta.lod_count) {
+			continue;
+		}
+
 		const CachedRegion *region = old_stream->open_region(region_info.position, region_info.lod, false);
 		if (region == nullptr) {
 			continue;
@@ -1017,11 +2146,629 @@ void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 		}
 	}
 
+	_checkpoint();
 	close_all_regions();
 
+	// Blocks were saved in random order, some of them several times. Pack them.
+	std::vector<PositionAndLod> new_region_list;
+	get_region_list(new_region_list);
+	rewrite_regions(_directory_path, _meta, new_region_list, _directory_path, _meta, thread_count);
+
 	print_line("Done converting region files");
 }
 
+void VoxelStreamRegionFiles::get_region_list(std::vector<PositionAndLod> &out_regions) const {
+	for (int lod = 0; lod < _meta.lod_count; ++lod) {
+
+		String lod_folder = _directory_path.plus_file("regions").plus_file("lod") + String::num_int64(lod);
+		String ext = String(".") + REGION_FILE_EXTENSION;
+
+		DirAccessRef da = DirAccess::open(lod_folder);
+		if (!da) {
+			continue;
+		}
+
+		da->list_dir_begin();
+
+		while (true) {
+			String fname = da->get_next();
+			if (fname == "") {
+				break;
+			}
+			if (da->current_is_dir()) {
+				continue;
+			}
+			if (fname.ends_with(ext)) {
+				Vector<String> parts = fname.split(".");
+				// r.x.y.z.ext
+				if (parts.size() < 4) {
+					ERR_PRINT(String("Found invalid region file: '{0}'").format(varray(fname)));
+					continue;
+				}
+				PositionAndLod p;
+				p.position.x = parts[1].to_int();
+				p.position.y = parts[2].to_int();
+				p.position.z = parts[3].to_int();
+				p.lod = lod;
+				out_regions.push_back(p);
+			}
+		}
+
+		da->list_dir_end();
+	}
+}
+
+void VoxelStreamRegionFiles::compact(int thread_count) {
+	// Rewrites all region files so they take as little space as possible.
+	// This can be a long operation.
+
+	ERR_FAIL_COND(_directory_path.empty());
+	MutexLock lock(_mutex);
+	if (!_meta_loaded) {
+		ERR_FAIL_COND(load_meta() != VOXEL_FILE_OK);
+	}
+	_checkpoint();
+
+	// Files are going to be replaced, so cached headers would become wrong
+	close_all_regions();
+
+	std::vector<PositionAndLod> regions;
+	get_region_list(regions);
+
+	rewrite_regions(_directory_path, _meta, regions, _directory_path, _meta, thread_count);
+}
+
+Dictionary VoxelStreamRegionFiles::verify_world(int thread_count) {
+	// Checks files as they are on disk, without going through cached regions.
+	// Blocks are not decompressed, so this is a lot faster than loading them.
+
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	Dictionary report;
+	ERR_FAIL_COND_V(_directory_path.empty(), report);
+	MutexLock lock(_mutex);
+	if (!_meta_loaded) {
+		ERR_FAIL_COND_V(load_meta() != VOXEL_FILE_OK, report);
+	}
+	_checkpoint();
+	// Headers of open regions must be up to date in files
+	flush_regions();
+
+	const uint64_t time_before = OS::get_singleton()->get_ticks_msec();
+
+	std::vector<PositionAndLod> regions;
+	get_region_list(regions);
+
+	std::vector<RegionVerifyResult> results;
+	results.resize(regions.size());
+
+	thread_count = get_worker_thread_count(thread_count, regions.size());
+	reset_conversion_progress(regions.size());
+
+	parallel_for(regions.size(), thread_count, [this, &regions, &results](unsigned int i) {
+		const PositionAndLod &r = regions[i];
+		verify_region_file(get_region_file_path(r.position, r.lod), _meta, r.position, results[i]);
+		advance_conversion_progress();
+	});
+
+	unsigned int block_count = 0;
+	unsigned int unchecked_block_count = 0;
+	Array corrupted_regions;
+	Array corrupted_blocks;
+
+	for (unsigned int i = 0; i < results.size(); ++i) {
+		const RegionVerifyResult &result = results[i];
+		const PositionAndLod &r = regions[i];
+		block_count += result.block_count;
+		unchecked_block_count += result.unchecked_block_count;
+
+		if (!result.error.empty()) {
+			Dictionary d;
+			d["lod"] = r.lod;
+			d["position"] = r.position.to_vec3();
+			d["reason"] = result.error;
+			corrupted_regions.append(d);
+		}
+
+		for (unsigned int j = 0; j < result.corrupted_blocks.size(); ++j) {
+			const CorruptedBlock &cb = result.corrupted_blocks[j];
+			Dictionary d;
+			d["lod"] = r.lod;
+			d["position"] = cb.position.to_vec3();
+			d["reason"] = cb.reason;
+			corrupted_blocks.append(d);
+		}
+	}
+
+	report["region_count"] = (int)regions.size();
+	report["block_count"] = block_count;
+	report["unchecked_block_count"] = unchecked_block_count;
+	report["corrupted_regions"] = corrupted_regions;
+	report["corrupted_blocks"] = corrupted_blocks;
+
+	print_line(String("Verified {0} blocks in {1} region files in {2} ms, {3} corrupted regions, {4} corrupted blocks")
+					   .format(varray(block_count, (int)regions.size(), OS::get_singleton()->get_ticks_msec() - time_before,
+							   corrupted_regions.size(), corrupted_blocks.size())));
+
+	return report;
+}
+
+void VoxelStreamRegionFiles::verify_region_file(
+		const String &fpath, const Meta &meta, const Vector3i &region_pos, RegionVerifyResult &result) {
+
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	std::vector<uint8_t> data;
+	{
+		Error err;
+		FileAccess *f = FileAccess::open(fpath, FileAccess::READ, &err);
+		if (f == nullptr || err != OK) {
+			if (f != nullptr) {
+				memdelete(f);
+			}
+			result.error = String("could not open file, error {0}").format(varray(err));
+			return;
+		}
+		data.resize(f->get_len());
+		const uint64_t read_size = f->get_buffer(data.data(), data.size());
+		data.resize(read_size);
+		memdelete(f);
+	}
+
+	RegionHeader header;
+	const VoxelFileResult header_result = parse_region_header(data.data(), data.size(), meta.region_size_po2, header);
+	if (header_result != VOXEL_FILE_OK) {
+		result.error = Voxel::to_string(header_result);
+		return;
+	}
+
+	const Vector3i region_size(1 << meta.region_size_po2);
+	const unsigned int header_size = get_region_header_size(header.version, meta.region_size_po2);
+	const unsigned int max_sector_count = (data.size() - header_size) / meta.sector_size + 1;
+
+	// Blocks must not share sectors
+	DynamicBitset used_sectors;
+	used_sectors.resize(max_sector_count);
+	used_sectors.fill(false);
+
+	for (unsigned int lut_index = 0; lut_index < header.blocks.size(); ++lut_index) {
+		const BlockInfo bi = header.blocks[lut_index];
+		if (bi.data == 0) {
+			continue;
+		}
+		++result.block_count;
+
+		const char *error = nullptr;
+		const uint8_t *block_data;
+		uint32_t block_data_size;
+
+		if (!get_block_data_in_file(data.data(), data.size(), header_size, meta.sector_size, bi, block_data, block_data_size)) {
+			error = "out of file bounds";
+
+		} else {
+			for (unsigned int i = bi.get_sector_index(); i < bi.get_sector_index() + bi.get_sector_count(); ++i) {
+				if (i >= max_sector_count || used_sectors.get(i)) {
+					error = "overlaps another block";
+					break;
+				}
+				used_sectors.set(i);
+			}
+
+			if (error == nullptr) {
+				if (header.checksums.size() == 0) {
+					++result.unchecked_block_count;
+				} else if (crc32c(block_data, block_data_size) != header.checksums[lut_index]) {
+					error = "checksum mismatch";
+				}
+			}
+		}
+
+		if (error != nullptr) {
+			CorruptedBlock cb;
+			cb.position = region_pos * region_size + Vector3i::from_zxy_index(lut_index, region_size);
+			cb.reason = error;
+			result.corrupted_blocks.push_back(cb);
+		}
+	}
+}
+
+bool VoxelStreamRegionFiles::rewrite_regions(
+		const String &src_directory, const Meta &src_meta, const std::vector<PositionAndLod> &src_regions,
+		const String &dst_directory, const Meta &dst_meta, int thread_count) {
+
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	ERR_FAIL_COND_V(src_meta.block_size_po2 != dst_meta.block_size_po2, false);
+
+	const uint64_t time_before = OS::get_singleton()->get_ticks_msec();
+
+	RegionRewriteContext ctx;
+	ctx.src_directory = src_directory;
+	ctx.src_meta = src_meta;
+	ctx.dst_directory = dst_directory;
+	ctx.dst_meta = dst_meta;
+
+	// If destination regions are larger, several source regions get merged by the same task
+	const int task_shift = MAX(dst_meta.region_size_po2 - src_meta.region_size_po2, 0);
+
+	std::vector<PositionAndLod> sorted_regions;
+	for (unsigned int i = 0; i < src_regions.size(); ++i) {
+		if (src_regions[i].lod < dst_meta.lod_count) {
+			sorted_regions.push_back(src_regions[i]);
+		}
+	}
+	std::sort(sorted_regions.begin(), sorted_regions.end(),
+			[task_shift](const PositionAndLod &a, const PositionAndLod &b) {
+				if (a.lod != b.lod) {
+					return a.lod < b.lod;
+				}
+				const Vector3i ta = a.position >> task_shift;
+				const Vector3i tb = b.position >> task_shift;
+				if (ta != tb) {
+					return ta < tb;
+				}
+				return a.position < b.position;
+			});
+
+	for (unsigned int i = 0; i < sorted_regions.size(); ++i) {
+		const PositionAndLod &r = sorted_regions[i];
+		if (ctx.tasks.size() == 0 ||
+				ctx.tasks.back().lod != r.lod ||
+				(ctx.tasks.back().src_regions[0] >> task_shift) != (r.position >> task_shift)) {
+			RegionRewriteTask task;
+			task.lod = r.lod;
+			ctx.tasks.push_back(task);
+		}
+		ctx.tasks.back().src_regions.push_back(r.position);
+	}
+
+	// Create folders up-front, threads will only create files
+	for (int lod = 0; lod < dst_meta.lod_count; ++lod) {
+		const String lod_folder = dst_directory.plus_file("regions").plus_file("lod") + String::num_int64(lod);
+		ERR_FAIL_COND_V(check_directory_created(lod_folder) != OK, false);
+	}
+
+	thread_count = get_worker_thread_count(thread_count, ctx.tasks.size());
+
+	print_line(String("Rewriting {0} region files using {1} threads").format(varray((int)sorted_regions.size(), thread_count)));
+	reset_conversion_progress(ctx.tasks.size());
+
+	parallel_for(ctx.tasks.size(), thread_count, [this, &ctx](unsigned int task_index) {
+		RegionRewriteStats task_stats;
+		rewrite_region_task(ctx, ctx.tasks[task_index], task_stats);
+
+		{
+			MutexLock lock(ctx.mutex);
+			RegionRewriteStats &stats = ctx.stats;
+			stats.block_count += task_stats.block_count;
+			stats.region_count += task_stats.region_count;
+			stats.error_count += task_stats.error_count;
+			stats.src_size_in_bytes += task_stats.src_size_in_bytes;
+			stats.dst_size_in_bytes += task_stats.dst_size_in_bytes;
+		}
+
+		advance_conversion_progress();
+	});
+
+	const RegionRewriteStats &stats = ctx.stats;
+	print_line(String("Rewrote {0} blocks into {1} region files in {2} ms, from {3} to {4} bytes")
+					   .format(varray(stats.block_count, stats.region_count, OS::get_singleton()->get_ticks_msec() - time_before,
+							   stats.src_size_in_bytes, stats.dst_size_in_bytes)));
+
+	if (stats.error_count != 0) {
+		ERR_PRINT(String("{0} errors occurred while rewriting region files").format(varray(stats.error_count)));
+		return false;
+	}
+	return true;
+}
+
+void VoxelStreamRegionFiles::rewrite_region_task(
+		const RegionRewriteContext &ctx, const RegionRewriteTask &task, RegionRewriteStats &stats) {
+
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	// Only uses files of this task, and nothing from the stream itself, because other tasks run at the same time
+
+	const Meta &src_meta = ctx.src_meta;
+	const Meta &dst_meta = ctx.dst_meta;
+	const Vector3i src_region_size(1 << src_meta.region_size_po2);
+	const Vector3i dst_region_size(1 << dst_meta.region_size_po2);
+	const bool same_regions = ctx.src_directory == ctx.dst_directory && src_region_size == dst_region_size;
+
+	struct PendingBlock {
+		unsigned int writer_index;
+		unsigned int lut_index;
+		size_t offset;
+		uint32_t size;
+		uint32_t checksum;
+	};
+
+	// If destination regions are larger, there is only one writer. Otherwise, each source region spreads over several.
+	std::vector<RegionWriter> writers;
+	HashMap<Vector3i, unsigned int, Vector3iHasher> writer_indices;
+	std::vector<uint8_t> src_data;
+	RegionHeader src_header;
+	std::vector<PendingBlock> pending_blocks;
+
+	for (unsigned int region_index = 0; region_index < task.src_regions.size(); ++region_index) {
+		const Vector3i src_region_pos = task.src_regions[region_index];
+		const String src_path = get_region_file_path_in(ctx.src_directory, src_region_pos, task.lod);
+
+		// Read the whole file at once rather than seeking to each block
+		{
+			Error err;
+			FileAccess *f = FileAccess::open(src_path, FileAccess::READ, &err);
+			if (f == nullptr || err != OK) {
+				if (f != nullptr) {
+					memdelete(f);
+				}
+				ERR_PRINT(String("Could not open region file {0}, error {1}").format(varray(src_path, err)));
+				++stats.error_count;
+				continue;
+			}
+			src_data.resize(f->get_len());
+			const uint64_t read_size = f->get_buffer(src_data.data(), src_data.size());
+			src_data.resize(read_size);
+			memdelete(f);
+		}
+
+		stats.src_size_in_bytes += src_data.size();
+
+		const VoxelFileResult header_result =
+				parse_region_header(src_data.data(), src_data.size(), src_meta.region_size_po2, src_header);
+		if (header_result != VOXEL_FILE_OK) {
+			ERR_PRINT(String("Skipping invalid region file {0}, {1}").format(varray(src_path, Voxel::to_string(header_result))));
+			++stats.error_count;
+			continue;
+		}
+		const unsigned int src_header_size = get_region_header_size(src_header.version, src_meta.region_size_po2);
+
+		if (same_regions) {
+			// Rewrite the file even if it has no valid block left
+			RegionWriter writer;
+			writer.position = src_region_pos;
+			writer_indices.set(src_region_pos, writers.size());
+			writers.push_back(writer);
+		}
+
+		pending_blocks.clear();
+
+		for (unsigned int lut_index = 0; lut_index < src_header.blocks.size(); ++lut_index) {
+			const BlockInfo bi = src_header.blocks[lut_index];
+			if (bi.data == 0) {
+				continue;
+			}
+
+			const Vector3i block_pos = src_region_pos * src_region_size + Vector3i::from_zxy_index(lut_index, src_region_size);
+
+			const char *error = nullptr;
+			const uint8_t *block_data;
+			uint32_t block_data_size;
+			uint32_t checksum = 0;
+			if (!get_block_data_in_file(src_data.data(), src_data.size(), src_header_size, src_meta.sector_size, bi,
+						block_data, block_data_size)) {
+				error = "out of file bounds";
+				// Keep whatever its sectors contain
+				const size_t begin = src_header_size + (size_t)bi.get_sector_index() * src_meta.sector_size;
+				const size_t end = MIN(begin + (size_t)bi.get_sector_count() * src_meta.sector_size, src_data.size());
+				block_data = src_data.data() + MIN(begin, src_data.size());
+				block_data_size = begin < end ? end - begin : 0;
+
+			} else {
+				checksum = crc32c(block_data, block_data_size);
+				if (src_header.checksums.size() != 0 && checksum != src_header.checksums[lut_index]) {
+					// Don't carry corrupted blocks over with a valid checksum
+					error = "checksum mismatch";
+				}
+			}
+
+			if (error != nullptr) {
+				// The source may get overwritten, so the raw data is kept aside even if quarantine is disabled
+				ERR_PRINT(String("Quarantined block {0} of region file {1} lod {2}: {3}")
+								  .format(varray(block_pos.to_vec3(), src_path, task.lod, error)));
+				if (block_data_size > 0) {
+					save_quarantined_block_in(ctx.dst_directory, block_pos, task.lod, block_data, block_data_size);
+				}
+				++stats.error_count;
+				continue;
+			}
+
+			const Vector3i dst_region_pos = block_pos >> dst_meta.region_size_po2;
+
+			const unsigned int *pwriter_index = writer_indices.getptr(dst_region_pos);
+			unsigned int writer_index;
+			if (pwriter_index == nullptr) {
+				writer_index = writers.size();
+				RegionWriter writer;
+				writer.position = dst_region_pos;
+				writers.push_back(writer);
+				writer_indices.set(dst_region_pos, writer_index);
+			} else {
+				writer_index = *pwriter_index;
+			}
+
+			PendingBlock pb;
+			pb.writer_index = writer_index;
+			pb.lut_index = block_pos.wrap(dst_region_size).get_zxy_index(dst_region_size);
+			pb.offset = block_data - src_data.data();
+			pb.size = block_data_size;
+			pb.checksum = checksum;
+			pending_blocks.push_back(pb);
+		}
+
+		// Append blocks in the order of the destination header, so blocks close in space remain close in files
+		std::sort(pending_blocks.begin(), pending_blocks.end(),
+				[](const PendingBlock &a, const PendingBlock &b) {
+					if (a.writer_index != b.writer_index) {
+						return a.writer_index < b.writer_index;
+					}
+					return a.lut_index < b.lut_index;
+				});
+
+		for (unsigned int i = 0; i < pending_blocks.size(); ++i) {
+			const PendingBlock &pb = pending_blocks[i];
+			RegionWriter &writer = writers[pb.writer_index];
+
+			if (writer.file == nullptr && !open_region_writer(ctx, writer, task.lod)) {
+				++stats.error_count;
+				continue;
+			}
+
+			if (append_to_region_writer(ctx, writer, pb.lut_index, src_data.data() + pb.offset, pb.size, pb.checksum)) {
+				++stats.block_count;
+			} else {
+				++stats.error_count;
+			}
+		}
+
+		if (dst_meta.region_size_po2 <= src_meta.region_size_po2) {
+			// Destination regions can't receive blocks from other source regions, they are complete
+			for (unsigned int i = 0; i < writers.size(); ++i) {
+				RegionWriter &writer = writers[i];
+				if (writer.file == nullptr && same_regions && !open_region_writer(ctx, writer, task.lod)) {
+					++stats.error_count;
+					continue;
+				}
+				close_region_writer(writer, stats);
+			}
+			writers.clear();
+			writer_indices.clear();
+		}
+	}
+
+	for (unsigned int i = 0; i < writers.size(); ++i) {
+		close_region_writer(writers[i], stats);
+	}
+}
+
+bool VoxelStreamRegionFiles::open_region_writer(const RegionRewriteContext &ctx, RegionWriter &writer, int lod) {
+	CRASH_COND(writer.file != nullptr);
+
+	const Vector3i region_size(1 << ctx.dst_meta.region_size_po2);
+
+	writer.path = get_region_file_path_in(ctx.dst_directory, writer.position, lod);
+	if (ctx.src_directory == ctx.dst_directory) {
+		// The original file may still be needed if we get interrupted
+		writer.temp_path = writer.path + ".tmp";
+	}
+
+	Error err;
+	writer.file = FileAccess::open(writer.temp_path.empty() ? writer.path : writer.temp_path, FileAccess::WRITE, &err);
+	if (writer.file == nullptr || err != OK) {
+		if (writer.file != nullptr) {
+			memdelete(writer.file);
+			writer.file = nullptr;
+		}
+		ERR_PRINT(String("Could not write region file {0}, error {1}").format(varray(writer.path, err)));
+		return false;
+	}
+
+	// Rewritten files always get checksums
+	writer.header.version = REGION_FORMAT_VERSION;
+	writer.header.blocks.clear();
+	writer.header.blocks.resize(region_size.volume());
+	writer.header.checksums.clear();
+	writer.header.checksums.resize(region_size.volume(), 0);
+	writer.sector_count = 0;
+
+	writer.file->store_buffer((const uint8_t *)FORMAT_REGION_MAGIC, 4);
+	writer.file->store_8(REGION_FORMAT_VERSION);
+	// Reserve the header, it will be written when all blocks are
+	store_region_header(writer.file, writer.header);
+
+	return true;
+}
+
+bool VoxelStreamRegionFiles::append_to_region_writer(const RegionRewriteContext &ctx, RegionWriter &writer,
+		unsigned int lut_index, const uint8_t *data, uint32_t size, uint32_t checksum) {
+
+	CRASH_COND(writer.file == nullptr);
+
+	const unsigned int sector_size = ctx.dst_meta.sector_size;
+	const unsigned int written_size = sizeof(uint32_t) + size;
+	const unsigned int sector_count = (written_size - 1) / sector_size + 1;
+
+	// Limits of BlockInfo
+	ERR_FAIL_COND_V_MSG(sector_count > 0xff, false,
+			String("Block is too big ({0} bytes) for sectors of {1} bytes").format(varray(size, sector_size)));
+	ERR_FAIL_COND_V(writer.sector_count + sector_count > 0xffffff, false);
+
+	BlockInfo &bi = writer.header.blocks[lut_index];
+	CRASH_COND(bi.data != 0);
+	bi.set_sector_index(writer.sector_count);
+	bi.set_sector_count(sector_count);
+	writer.header.checksums[lut_index] = checksum;
+	writer.sector_count += sector_count;
+
+	FileAccess *f = writer.file;
+	f->store_32(size);
+	f->store_buffer(data, size);
+
+	unsigned int pad = sector_count * sector_size - written_size;
+	static const uint8_t zeros[256] = { 0 };
+	while (pad > 0) {
+		const unsigned int count = MIN(pad, (unsigned int)sizeof(zeros));
+		f->store_buffer(zeros, count);
+		pad -= count;
+	}
+
+	return true;
+}
+
+void VoxelStreamRegionFiles::close_region_writer(RegionWriter &writer, RegionRewriteStats &stats) {
+	if (writer.file == nullptr) {
+		return;
+	}
+
+	FileAccess *f = writer.file;
+	f->seek(MAGIC_AND_VERSION_SIZE);
+	store_region_header(f, writer.header);
+	stats.dst_size_in_bytes += f->get_len();
+	memdelete(f);
+	writer.file = nullptr;
+
+	if (!writer.temp_path.empty()) {
+		DirAccessRef da = DirAccess::create(DirAccess::ACCESS_FILESYSTEM);
+		const Error err = da->rename(writer.temp_path, writer.path);
+		if (err != OK) {
+			ERR_PRINT(String("Could not replace region file {0}, error {1}").format(varray(writer.path, err)));
+			++stats.error_count;
+			return;
+		}
+	}
+
+	++stats.region_count;
+}
+
+void VoxelStreamRegionFiles::reset_conversion_progress(unsigned int total) {
+	MutexLock lock(_conversion_mutex);
+	_conversion_total = total;
+	_conversion_done = 0;
+}
+
+void VoxelStreamRegionFiles::advance_conversion_progress() {
+	unsigned int done;
+	unsigned int total;
+	{
+		MutexLock lock(_conversion_mutex);
+		++_conversion_done;
+		done = _conversion_done;
+		total = _conversion_total;
+	}
+	// Print every 10%
+	if (total > 0 && (done * 10) / total != ((done - 1) * 10) / total) {
+		print_line(String("Region files progress: {0}%").format(varray((done * 100) / total)));
+	}
+}
+
+float VoxelStreamRegionFiles::get_conversion_progress() const {
+	MutexLock lock(_conversion_mutex);
+	if (_conversion_total == 0) {
+		return 1.f;
+	}
+	return static_cast<float>(_conversion_done) / _conversion_total;
+}
+
 Vector3i VoxelStreamRegionFiles::get_region_size() const {
 	return Vector3i(1 << _meta.region_size_po2);
 }
@@ -1042,6 +2789,17 @@ int VoxelStreamRegionFiles::get_lod_count() const {
 	return _meta.lod_count;
 }
 
+void VoxelStreamRegionFiles::set_compression_codec(int codec) {
+	// The serializer is in use while loading or saving blocks
+	MutexLock lock(_mutex);
+	VoxelStreamFile::set_compression_codec(codec);
+}
+
+void VoxelStreamRegionFiles::set_compression_level(int level) {
+	MutexLock lock(_mutex);
+	VoxelStreamFile::set_compression_level(level);
+}
+
 int VoxelStreamRegionFiles::get_sector_size() const {
 	return _meta.sector_size;
 }
@@ -1097,6 +2855,10 @@ void VoxelStreamRegionFiles::set_lod_count(int p_lod_count) {
 
 void VoxelStreamRegionFiles::convert_files(Dictionary d) {
 
+	MutexLock lock(_mutex);
+
+	const int thread_count = d.has("thread_count") ? int(d["thread_count"]) : 0;
+
 	Meta meta;
 	meta.version = _meta.version;
 	meta.block_size_po2 = int(d["block_size_po2"]);
@@ -1114,12 +2876,12 @@ void VoxelStreamRegionFiles::convert_files(Dictionary d) {
 
 		} else {
 			// Just opened existing stream
-			_convert_files(meta);
+			_convert_files(meta, thread_count);
 		}
 
 	} else {
 		// That stream was previously used
-		_convert_files(meta);
+		_convert_files(meta, thread_count);
 	}
 
 	emit_changed();
@@ -1142,8 +2904,26 @@ void VoxelStreamRegionFiles::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_sector_size"), &VoxelStreamRegionFiles::set_sector_size);
 
 	ClassDB::bind_method(D_METHOD("convert_files", "new_settings"), &VoxelStreamRegionFiles::convert_files);
+	ClassDB::bind_method(D_METHOD("compact", "thread_count"), &VoxelStreamRegionFiles::compact, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("get_conversion_progress"), &VoxelStreamRegionFiles::get_conversion_progress);
+	ClassDB::bind_method(D_METHOD("verify_world", "thread_count"), &VoxelStreamRegionFiles::verify_world, DEFVAL(0));
+
+	ClassDB::bind_method(D_METHOD("set_quarantine_enabled", "enabled"), &VoxelStreamRegionFiles::set_quarantine_enabled);
+	ClassDB::bind_method(D_METHOD("is_quarantine_enabled"), &VoxelStreamRegionFiles::is_quarantine_enabled);
+
+	ClassDB::bind_method(D_METHOD("set_journal_enabled", "enabled"), &VoxelStreamRegionFiles::set_journal_enabled);
+	ClassDB::bind_method(D_METHOD("is_journal_enabled"), &VoxelStreamRegionFiles::is_journal_enabled);
+	ClassDB::bind_method(D_METHOD("checkpoint"), &VoxelStreamRegionFiles::checkpoint);
+
+	ClassDB::bind_method(D_METHOD("build_compression_dictionary", "max_size_in_bytes"), &VoxelStreamRegionFiles::build_compression_dictionary);
+
+	ClassDB::bind_method(D_METHOD("set_max_open_regions", "count"), &VoxelStreamRegionFiles::set_max_open_regions);
+	ClassDB::bind_method(D_METHOD("get_max_open_regions"), &VoxelStreamRegionFiles::get_max_open_regions);
 
 	ADD_PROPERTY(PropertyInfo(Variant::STRING, "directory", PROPERTY_HINT_DIR), "set_directory", "get_directory");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "journal_enabled"), "set_journal_enabled", "is_journal_enabled");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "quarantine_enabled"), "set_quarantine_enabled", "is_quarantine_enabled");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "max_open_regions"), "set_max_open_regions", "get_max_open_regions");
 
 	ADD_GROUP("Dimensions", "");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "lod_count"), "set_lod_count", "get_lod_count");
@@ -1,11 +1,14 @@
 #ifndef VOXEL_STREAM_REGION_H
 #define VOXEL_STREAM_REGION_H
 
+#include "../util/file_mapping.h"
+#include "../util/dynamic_bitset.h"
 #include "../util/fixed_array.h"
 #include "file_utils.h"
 #include "voxel_stream_file.h"
 
 class FileAccess;
+class Thread;
 
 namespace Voxel {
 
@@ -40,13 +43,52 @@ public:
 	int get_block_size_po2() const override;
 	int get_lod_count() const override;
 
+	void set_compression_codec(int codec) override;
+	void set_compression_level(int level) override;
+
 	void set_block_size_po2(int p_block_size_po2);
 	void set_region_size_po2(int p_region_size_po2);
 	void set_sector_size(int p_sector_size);
 	void set_lod_count(int p_lod_count);
 
+	// Converts existing files to new dimensions. Regions are processed in parallel.
+	// The number of threads can be specified with a `thread_count` key, by default one per processor is used.
 	void convert_files(Dictionary d);
 
+	// Rewrites region files so blocks are packed without free sectors between them.
+	// Regions are processed in parallel, using `thread_count` threads, or one per processor if 0.
+	void compact(int thread_count = 0);
+
+	// Progress of the current call to convert_files(), compact() or verify_world(), from 0 to 1.
+	// These can take a long time, so they may be run in a thread while this is polled from another.
+	float get_conversion_progress() const;
+
+	// Checks all blocks saved in region files against their checksum, without decompressing them.
+	// Blocks saved in files older than checksums can only be checked for consistency.
+	// Returns a report of corrupted regions and blocks.
+	Dictionary verify_world(int thread_count = 0);
+
+	// When enabled, blocks failing to load are moved to a quarantine folder, and the fallback stream is used instead.
+	// Otherwise, they are reported as errors and left empty.
+	void set_quarantine_enabled(bool enabled);
+	bool is_quarantine_enabled() const;
+
+	// When enabled, saved blocks are appended to a journal file instead of being written into regions directly.
+	// They get merged into regions later in the background, only keeping the latest version of each block.
+	void set_journal_enabled(bool enabled);
+	bool is_journal_enabled() const;
+
+	// Merges all journaled blocks into region files
+	void checkpoint();
+
+	// Samples saved blocks to build a compression dictionary, which is then stored with the save and used for new blocks.
+	// This can only be done once, because blocks saved with a dictionary need it to be loaded.
+	void build_compression_dictionary(int max_size_in_bytes);
+
+	// How many region files can be kept open at once
+	void set_max_open_regions(int count);
+	int get_max_open_regions() const;
+
 protected:
 	static void _bind_methods();
 
@@ -60,11 +102,16 @@ private:
 		EMERGE_FAILED
 	};
 
-	EmergeResult _emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod);
-	void _immerge_block(Ref<VoxelBuffer> voxel_buffer, Vector3i origin_in_voxels, int lod);
+	EmergeResult _emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod, uint32_t channels_mask);
+	void prefetch_blocks(const Vector<VoxelBlockRequest> &p_blocks, int begin, int end);
+	Vector3i get_region_position_from_request(const VoxelBlockRequest &r) const;
+	void _immerge_block(Ref<VoxelBuffer> voxel_buffer, Vector3i origin_in_voxels, int lod, uint32_t channels_mask);
+	void write_block(const Vector3i &block_pos, int lod, const std::vector<uint8_t> &data);
 
 	VoxelFileResult save_meta();
 	VoxelFileResult load_meta();
+	VoxelFileResult save_dictionary(const std::vector<uint8_t> &dictionary);
+	VoxelFileResult load_dictionary();
 	Vector3i get_block_position_from_voxels(const Vector3i &origin_in_voxels) const;
 	Vector3i get_region_position_from_blocks(const Vector3i &block_position) const;
 	void close_all_regions();
@@ -74,13 +121,31 @@ private:
 	unsigned int get_block_index_in_header(const Vector3i &rpos) const;
 	Vector3i get_block_position_from_index(int i) const;
 	int get_sector_count_from_bytes(int size_in_bytes) const;
-	int get_region_header_size() const;
-	CachedRegion *get_region_from_cache(const Vector3i pos, int lod) const;
-	void remove_sectors_from_block(CachedRegion *p_region, Vector3i block_rpos, unsigned int p_sector_count);
-	int get_sectors_count(const RegionHeader &header) const;
+	int find_region_in_cache(const std::vector<CachedRegion *> &cache, const Vector3i pos, int lod) const;
+	void add_to_closed_regions(CachedRegion *p_region);
+	unsigned int allocate_sectors(CachedRegion *p_region, unsigned int p_sector_count);
+	void free_sectors(CachedRegion *p_region, unsigned int p_sector_index, unsigned int p_sector_count);
+	void compact_region(CachedRegion *p_region);
 	void close_oldest_region();
 	void save_header(CachedRegion *p_region);
-	void pad_to_sector_size(FileAccess *f);
+	void pad_to_sector_size(FileAccess *f, int blocks_begin_offset);
+	bool map_region(CachedRegion *p_region);
+	void flush_regions();
+
+	String get_journal_file_path() const;
+	String get_checkpoint_journal_file_path() const;
+	void append_to_journal(const Vector3i &block_pos, int lod, const std::vector<uint8_t> &data);
+	void reset_journal();
+	void remove_checkpoint_journal();
+	void replay_journal();
+	unsigned int replay_journal_file(const String &fpath);
+	void _checkpoint();
+	bool begin_background_checkpoint();
+	bool merge_next_checkpoint_block();
+	void finish_background_checkpoint();
+	void start_checkpointer();
+	void stop_checkpointer();
+	static void _checkpointer_thread_func(void *p_self);
 
 	struct Meta {
 		uint8_t version = -1;
@@ -91,8 +156,14 @@ private:
 		int sector_size = 0; // Blocks are stored at offsets multiple of that size
 	};
 
+	struct PositionAndLod {
+		Vector3i position;
+		int lod;
+	};
+
 	static bool check_meta(const Meta &meta);
-	void _convert_files(Meta new_meta);
+	void _convert_files(Meta new_meta, int thread_count);
+	void get_region_list(std::vector<PositionAndLod> &out_regions) const;
 
 	// Orders block requests so those querying the same regions get grouped together
 	struct BlockRequestComparator {
@@ -141,6 +212,8 @@ private:
 		// This table always has the same size,
 		// and the same index always corresponds to the same 3D position.
 		std::vector<BlockInfo> blocks;
+		// CRC-32C of the data of each block, indexed like blocks. Empty in files older than checksums.
+		std::vector<uint32_t> checksums;
 	};
 
 	struct CachedRegion {
@@ -151,21 +224,137 @@ private:
 		RegionHeader header;
 		bool header_modified = false;
 
-		// List of sectors in the order they appear in the file,
-		// and which position their block is. The same block can span multiple sectors.
-		// This is essentially a reverse table of `header->blocks`.
-		std::vector<Vector3i> sectors;
+		// Which sectors of the file are used by a block, in the order they appear in the file.
+		// Free sectors are holes left by blocks which moved or shrank, and can be reused by others,
+		// so saving a block never requires to move other blocks.
+		// The size of this bitset is where the next appended block would start. Free sectors at the end are trimmed,
+		// in which case the file is truncated when closed.
+		DynamicBitset sectors;
+		unsigned int free_sector_count = 0;
+
+		// Read-only mapping of the file, used to read blocks without going through FileAccess.
+		// Writes go to the same pages, so it remains valid when the file gets modified. It only needs to be
+		// extended if the file grew, which is checked before the next read.
+		FileMapping mapping;
+		bool mapping_failed = false;
+		bool mapping_stale = false;
+	};
+
+	struct RegionRewriteStats {
+		unsigned int block_count = 0;
+		unsigned int region_count = 0;
+		unsigned int error_count = 0;
+		uint64_t src_size_in_bytes = 0;
+		uint64_t dst_size_in_bytes = 0;
+	};
+
+	// Source regions rewritten by the same thread. They cover a cubic area aligned to both the source and destination
+	// region grids, so destination regions are never written by more than one task.
+	struct RegionRewriteTask {
+		int lod = 0;
+		std::vector<Vector3i> src_regions;
+	};
+
+	// Shared by threads rewriting regions
+	struct RegionRewriteContext {
+		String src_directory;
+		Meta src_meta;
+		String dst_directory;
+		Meta dst_meta;
+		std::vector<RegionRewriteTask> tasks;
+		Mutex mutex;
+		RegionRewriteStats stats;
+	};
+
+	// Region file written sequentially. Blocks are appended one after the other, and the header is saved last.
+	struct RegionWriter {
+		Vector3i position;
+		FileAccess *file = nullptr;
+		// When rewriting files in place, a temporary file replaces the original once complete
+		String temp_path;
+		String path;
+		RegionHeader header;
+		unsigned int sector_count = 0;
+	};
 
-		uint64_t last_opened = 0;
-		//uint64_t last_accessed;
+	struct CorruptedBlock {
+		Vector3i position;
+		String reason;
+	};
+
+	struct RegionVerifyResult {
+		unsigned int block_count = 0;
+		// Blocks without a checksum
+		unsigned int unchecked_block_count = 0;
+		// Set if the whole region can't be read
+		String error;
+		std::vector<CorruptedBlock> corrupted_blocks;
 	};
 
+	static unsigned int get_region_header_size(uint8_t version, uint8_t region_size_po2);
+	static VoxelFileResult parse_region_header(const uint8_t *data, size_t size, uint8_t region_size_po2, RegionHeader &out_header);
+	static void store_region_header(FileAccess *f, const RegionHeader &header);
+	static bool get_block_data_in_file(const uint8_t *file_data, size_t file_size, unsigned int header_size, int sector_size,
+			BlockInfo block_info, const uint8_t *&out_data, uint32_t &out_size);
+	bool read_block_data(CachedRegion *region, BlockInfo block_info, const uint8_t *&out_data, uint32_t &out_size);
+
+	static void verify_region_file(const String &fpath, const Meta &meta, const Vector3i &region_pos, RegionVerifyResult &result);
+
+	String get_quarantine_folder_path(int lod) const;
+	void save_quarantined_block(Vector3i block_pos, int lod, const uint8_t *data, uint32_t size);
+	void quarantine_block(CachedRegion *region, unsigned int lut_index, Vector3i block_pos, int lod,
+			const uint8_t *data, uint32_t size);
+	bool quarantine_region_file(const String &fpath, int lod);
+
+	bool rewrite_regions(const String &src_directory, const Meta &src_meta, const std::vector<PositionAndLod> &src_regions,
+			const String &dst_directory, const Meta &dst_meta, int thread_count);
+	static void rewrite_region_task(const RegionRewriteContext &ctx, const RegionRewriteTask &task, RegionRewriteStats &stats);
+	static bool open_region_writer(const RegionRewriteContext &ctx, RegionWriter &writer, int lod);
+	static bool append_to_region_writer(const RegionRewriteContext &ctx, RegionWriter &writer, unsigned int lut_index,
+			const uint8_t *data, uint32_t size, uint32_t checksum);
+	static void close_region_writer(RegionWriter &writer, RegionRewriteStats &stats);
+
+	void reset_conversion_progress(unsigned int total);
+	void advance_conversion_progress();
+
 	String _directory_path;
 	Meta _meta;
 	bool _meta_loaded = false;
 	bool _meta_saved = false;
+	// Regions with an open file, ordered from least to most recently used
 	std::vector<CachedRegion *> _region_cache;
-	unsigned int _max_open_regions = MIN(8, FOPEN_MAX);
+	unsigned int _max_open_regions = 8;
+	// Regions whose file was closed, or which don't have a file, ordered from least to most recently used.
+	// Their header is kept so we don't have to read it again, or check if the file exists, when they get used again.
+	// We assume no other process modifies region files while the stream uses them.
+	std::vector<CachedRegion *> _closed_region_cache;
+
+	// Members of the journal and the checkpointer are only accessed under the mutex
+	bool _journal_enabled = false;
+	FileAccess *_journal_file = nullptr;
+	uint64_t _journal_size = 0;
+	// Latest compressed data of blocks saved in the journal and not merged into regions yet, per LOD
+	FixedArray<HashMap<Vector3i, std::vector<uint8_t>, Vector3iHasher>, VoxelConstants::MAX_LOD> _journaled_blocks;
+	// Blocks of the previous journal, being merged into regions by the checkpointer. Older than journaled blocks.
+	FixedArray<HashMap<Vector3i, std::vector<uint8_t>, Vector3iHasher>, VoxelConstants::MAX_LOD> _checkpoint_blocks;
+
+	Thread *_checkpointer_thread = nullptr;
+	Semaphore _checkpointer_semaphore;
+	bool _checkpointer_exit = false;
+
+	bool _quarantine_enabled = false;
+	// Blocks read from files which can't be mapped
+	std::vector<uint8_t> _block_read_buffer;
+	// Blocks of a batch to prefetch, sorted by position in the file
+	std::vector<BlockInfo> _prefetch_sectors;
+
+	// Region files and the journal may be accessed by the streaming thread and the checkpointer
+	mutable Mutex _mutex;
+
+	// Counted in conversion tasks
+	unsigned int _conversion_total = 0;
+	unsigned int _conversion_done = 0;
+	mutable Mutex _conversion_mutex;
 };
 
 }
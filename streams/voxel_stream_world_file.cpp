@@ -0,0 +1,893 @@
+#include "voxel_stream_world_file.h"
+#include "../util/checksum.h"
+#include "../util/morton.h"
+#include "../util/utility.h"
+#include <core/io/marshalls.h>
+#include <core/os/file_access.h>
+#include <algorithm>
+
+namespace Voxel {
+
+namespace {
+const uint8_t FORMAT_VERSION = 1;
+const char *FORMAT_MAGIC = "VXWF";
+const uint32_t PAGE_SIZE = 512;
+// magic + version + page size + lod count + block size + channel depths
+const unsigned int HEADER_SIZE = 4 + 1 + 4 + 1 + 1 + VoxelBuffer::MAX_CHANNELS;
+
+// Two slots are used alternately, so the previous superblock remains intact if writing the new one gets interrupted
+const unsigned int SUPERBLOCK_OFFSETS[2] = { 64, 128 };
+const uint32_t SUPERBLOCK_MAGIC = 0x53575856; // "VXWS"
+// magic + sequence + index page + index size + end page + checksum
+const unsigned int SUPERBLOCK_SIZE = 4 + 8 + 4 + 4 + 4 + 4;
+
+const uint32_t INDEX_SEGMENT_MAGIC = 0x49575856; // "VXWI"
+const uint8_t INDEX_SEGMENT_FULL = 0;
+const uint8_t INDEX_SEGMENT_DELTA = 1;
+// magic + kind + previous segment page + previous segment size + entry count
+const unsigned int INDEX_SEGMENT_HEADER_SIZE = 4 + 1 + 4 + 4 + 4;
+// key + page + size
+const unsigned int INDEX_ENTRY_SIZE = 8 + 4 + 4;
+// The whole index is saved again when it has more segments than this,
+// or when segments contain more entries than twice the number of blocks
+const unsigned int MAX_INDEX_SEGMENTS = 32;
+
+// Block positions are stored with 19 bits per axis in keys, and LOD index in the remaining high bits
+const unsigned int KEY_COORD_BITS = 19;
+const unsigned int KEY_LOD_SHIFT = 3 * KEY_COORD_BITS;
+
+// When loading blocks, those separated by less than this are read at once, reading what's between them too
+const uint64_t MAX_READ_GAP = 8 * PAGE_SIZE;
+const uint64_t MAX_READ_SIZE = 1024 * 1024;
+
+// Used before handing a block which failed to load to the fallback stream.
+// Decoding may have stopped halfway, so the fallback starts from a clean buffer.
+void clear_channels(VoxelBuffer &buffer, uint32_t channels_mask) {
+	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+		if ((channels_mask & (1 << channel_index)) == 0) {
+			continue;
+		}
+		if (channel_index == VoxelBuffer::CHANNEL_SDF) {
+			buffer.clear_channel_f(channel_index, 1.f);
+		} else {
+			buffer.clear_channel(channel_index, 0);
+		}
+	}
+}
+
+} // namespace
+
+VoxelStreamWorldFile::VoxelStreamWorldFile() {
+	_meta.version = FORMAT_VERSION;
+	_meta.block_size_po2 = 4;
+	_meta.lod_count = 1;
+	_meta.channel_depths.fill(VoxelBuffer::DEFAULT_CHANNEL_DEPTH);
+}
+
+VoxelStreamWorldFile::~VoxelStreamWorldFile() {
+	MutexLock lock(_mutex);
+	close();
+}
+
+void VoxelStreamWorldFile::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
+	VoxelBlockRequest r;
+	r.voxel_buffer = out_buffer;
+	r.origin_in_voxels = origin_in_voxels;
+	r.lod = lod;
+	Vector<VoxelBlockRequest> requests;
+	requests.push_back(r);
+	emerge_blocks(requests);
+}
+
+void VoxelStreamWorldFile::immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels, int lod) {
+	VoxelBlockRequest r;
+	r.voxel_buffer = buffer;
+	r.origin_in_voxels = origin_in_voxels;
+	r.lod = lod;
+	Vector<VoxelBlockRequest> requests;
+	requests.push_back(r);
+	immerge_blocks(requests);
+}
+
+void VoxelStreamWorldFile::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	struct BlockRead {
+		unsigned int request_index;
+		BlockLocation location;
+	};
+
+	Vector<VoxelBlockRequest> fallback_requests;
+
+	{
+		MutexLock lock(_mutex);
+
+		if (!open(false, nullptr)) {
+			// Nothing was saved yet
+			fallback_requests = p_blocks;
+
+		} else {
+			const Vector3i block_size(1 << _meta.block_size_po2);
+
+			std::vector<BlockRead> reads;
+			reads.reserve(p_blocks.size());
+
+			for (int i = 0; i < p_blocks.size(); ++i) {
+				const VoxelBlockRequest &r = p_blocks[i];
+				ERR_CONTINUE(r.voxel_buffer.is_null());
+				ERR_CONTINUE(r.lod < 0 || r.lod >= _meta.lod_count);
+				ERR_CONTINUE(r.voxel_buffer->get_size() != block_size);
+
+				uint64_t key;
+				if (!get_block_key(r.origin_in_voxels, r.lod, key)) {
+					// Can't have been saved
+					fallback_requests.push_back(r);
+					continue;
+				}
+
+				const Map<uint64_t, BlockLocation>::Element *e = _index.find(key);
+				if (e == nullptr) {
+					fallback_requests.push_back(r);
+					continue;
+				}
+
+				BlockRead br;
+				br.request_index = i;
+				br.location = e->get();
+				reads.push_back(br);
+			}
+
+			// Read blocks in the order they are in the file.
+			// Because they are saved in key order, blocks close to each other in space are often next to each other,
+			// so they can be read in a few large reads rather than many small ones.
+			std::sort(reads.begin(), reads.end(), [](const BlockRead &a, const BlockRead &b) {
+				return a.location.page < b.location.page;
+			});
+
+			size_t run_begin = 0;
+			while (run_begin < reads.size()) {
+				const uint64_t begin_offset = uint64_t(reads[run_begin].location.page) * PAGE_SIZE;
+				uint64_t end_offset = begin_offset + reads[run_begin].location.size;
+
+				size_t run_end = run_begin + 1;
+				while (run_end < reads.size()) {
+					const BlockLocation &location = reads[run_end].location;
+					const uint64_t offset = uint64_t(location.page) * PAGE_SIZE;
+					if (offset > end_offset + MAX_READ_GAP || offset + location.size - begin_offset > MAX_READ_SIZE) {
+						break;
+					}
+					end_offset = MAX(end_offset, offset + location.size);
+					++run_end;
+				}
+
+				_read_run_buffer.resize(end_offset - begin_offset);
+				_file->seek(begin_offset);
+				const uint64_t read_size = _file->get_buffer(_read_run_buffer.data(), _read_run_buffer.size());
+
+				for (size_t j = run_begin; j < run_end; ++j) {
+					const BlockRead &br = reads[j];
+					VoxelBlockRequest &r = p_blocks.write[br.request_index];
+					const uint64_t offset = uint64_t(br.location.page) * PAGE_SIZE - begin_offset;
+
+					if (offset + br.location.size > read_size) {
+						ERR_PRINT(String("Block {0} lod {1} is beyond the end of the file")
+										  .format(varray(r.origin_in_voxels.to_vec3(), r.lod)));
+						clear_channels(**r.voxel_buffer, r.channels_mask);
+						fallback_requests.push_back(r);
+						continue;
+					}
+
+					// Configure depths, as they are only specified in the file header.
+					// This is also needed for channels which are not loaded, to know how much data to skip.
+					for (unsigned int channel_index = 0; channel_index < _meta.channel_depths.size(); ++channel_index) {
+						r.voxel_buffer->set_channel_depth(channel_index, _meta.channel_depths[channel_index]);
+					}
+
+					if (!deserialize_block(_read_run_buffer.data() + offset, br.location.size, r.voxel_buffer,
+								r.origin_in_voxels, r.lod, r.channels_mask)) {
+						ERR_PRINT(String("Failed to read block {0} lod {1}").format(varray(r.origin_in_voxels.to_vec3(), r.lod)));
+						clear_channels(**r.voxel_buffer, r.channels_mask);
+						fallback_requests.push_back(r);
+					}
+				}
+
+				run_begin = run_end;
+			}
+		}
+	}
+
+	emerge_blocks_fallback(fallback_requests);
+}
+
+void VoxelStreamWorldFile::immerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	if (p_blocks.size() == 0) {
+		return;
+	}
+
+	ERR_FAIL_COND(_file_path.empty());
+	ERR_FAIL_COND(p_blocks[0].voxel_buffer.is_null());
+
+	struct KeyAndRequest {
+		uint64_t key;
+		unsigned int request_index;
+	};
+
+	MutexLock lock(_mutex);
+
+	// If the file doesn't exist yet, its format is initialized from the first block
+	if (!open(true, p_blocks[0].voxel_buffer.ptr())) {
+		return;
+	}
+
+	const Vector3i block_size(1 << _meta.block_size_po2);
+
+	std::vector<KeyAndRequest> keys;
+	keys.reserve(p_blocks.size());
+
+	for (int i = 0; i < p_blocks.size(); ++i) {
+		const VoxelBlockRequest &r = p_blocks[i];
+		ERR_CONTINUE(r.voxel_buffer.is_null());
+		ERR_CONTINUE(r.lod < 0 || r.lod >= _meta.lod_count);
+		ERR_CONTINUE(r.voxel_buffer->get_size() != block_size);
+
+		bool valid_depths = true;
+		for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
+			if ((r.channels_mask & (1 << channel_index)) &&
+					r.voxel_buffer->get_channel_depth(channel_index) != _meta.channel_depths[channel_index]) {
+				valid_depths = false;
+				break;
+			}
+		}
+		ERR_CONTINUE_MSG(!valid_depths, "Block channel depths don't match those of the file");
+
+		KeyAndRequest kr;
+		if (!get_block_key(r.origin_in_voxels, r.lod, kr.key)) {
+			continue;
+		}
+		kr.request_index = i;
+		keys.push_back(kr);
+	}
+
+	// Save blocks in key order, so blocks close to each other in space also get close to each other in the file
+	std::sort(keys.begin(), keys.end(), [](const KeyAndRequest &a, const KeyAndRequest &b) {
+		return a.key < b.key;
+	});
+
+	for (size_t i = 0; i < keys.size(); ++i) {
+		const uint64_t key = keys[i].key;
+		const VoxelBlockRequest &r = p_blocks[keys[i].request_index];
+
+		const std::vector<uint8_t> &data = serialize_block(r.voxel_buffer, r.origin_in_voxels, r.lod, r.channels_mask);
+		ERR_CONTINUE(data.size() == 0);
+
+		// Blocks are never overwritten in place, so the committed version remains valid until the next commit
+		BlockLocation location;
+		location.size = data.size();
+		location.page = allocate_pages(get_page_count(location.size));
+
+		_file->seek(uint64_t(location.page) * PAGE_SIZE);
+		_file->store_buffer(data.data(), data.size());
+
+		Map<uint64_t, BlockLocation>::Element *e = _index.find(key);
+		if (e != nullptr) {
+			PageExtent previous_extent;
+			previous_extent.page = e->get().page;
+			previous_extent.count = get_page_count(e->get().size);
+
+			if (_uncommitted_blocks.has(key)) {
+				// The block was saved twice in the same batch, the first version was never committed
+				free_pages(previous_extent);
+			} else {
+				_pages_freed_before_commit.push_back(previous_extent);
+			}
+			e->get() = location;
+
+		} else {
+			_index.insert(key, location);
+		}
+
+		_uncommitted_blocks[key] = location;
+	}
+
+	commit();
+}
+
+void VoxelStreamWorldFile::commit() {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	if (_uncommitted_blocks.size() == 0 && _end_page == _superblock.end_page) {
+		return;
+	}
+
+	CRASH_COND(_file == nullptr);
+
+	Superblock superblock = _superblock;
+	++superblock.sequence;
+
+	bool full_index = false;
+
+	if (_uncommitted_blocks.size() > 0) {
+		// Save the index as a delta of the previous segments if possible, because it's much smaller to write.
+		// Once there are too many segments, the whole index is saved instead, so they don't take long to load.
+		full_index = _index_segments.size() == 0 ||
+					 _index_segments.size() >= MAX_INDEX_SEGMENTS ||
+					 _index_segments_entry_count + _uncommitted_blocks.size() > 2 * _index.size();
+
+		const Map<uint64_t, BlockLocation> &entries = full_index ? _index : _uncommitted_blocks;
+
+		IndexSegment segment;
+		segment.entry_count = entries.size();
+		segment.size = INDEX_SEGMENT_HEADER_SIZE + segment.entry_count * INDEX_ENTRY_SIZE + sizeof(uint32_t);
+
+		_index_buffer.resize(segment.size);
+		uint8_t *dst = _index_buffer.data();
+
+		dst += encode_uint32(INDEX_SEGMENT_MAGIC, dst);
+		*dst++ = full_index ? INDEX_SEGMENT_FULL : INDEX_SEGMENT_DELTA;
+		if (full_index) {
+			dst += encode_uint32(0, dst);
+			dst += encode_uint32(0, dst);
+		} else {
+			const IndexSegment &previous_segment = _index_segments.back();
+			dst += encode_uint32(previous_segment.page, dst);
+			dst += encode_uint32(previous_segment.size, dst);
+		}
+		dst += encode_uint32(segment.entry_count, dst);
+
+		for (const Map<uint64_t, BlockLocation>::Element *e = entries.front(); e != nullptr; e = e->next()) {
+			dst += encode_uint64(e->key(), dst);
+			dst += encode_uint32(e->get().page, dst);
+			dst += encode_uint32(e->get().size, dst);
+		}
+
+		const uint32_t checksum = crc32c(_index_buffer.data(), dst - _index_buffer.data());
+		dst += encode_uint32(checksum, dst);
+		CRASH_COND(dst != _index_buffer.data() + _index_buffer.size());
+
+		segment.page = allocate_pages(get_page_count(segment.size));
+		_file->seek(uint64_t(segment.page) * PAGE_SIZE);
+		_file->store_buffer(_index_buffer.data(), _index_buffer.size());
+
+		superblock.index = segment;
+	}
+
+	superblock.end_page = _end_page;
+
+	// Everything the new superblock refers to must be written before it.
+	// Note: this only flushes to the OS, so the file is protected against the application stopping,
+	// but protection against power loss depends on the OS and device writing in order.
+	_file->flush();
+	write_superblock(superblock);
+	_file->flush();
+
+	_superblock = superblock;
+
+	if (_uncommitted_blocks.size() > 0) {
+		if (full_index) {
+			// Previous segments are no longer referenced
+			for (size_t i = 0; i < _index_segments.size(); ++i) {
+				const IndexSegment &old_segment = _index_segments[i];
+				PageExtent extent;
+				extent.page = old_segment.page;
+				extent.count = get_page_count(old_segment.size);
+				free_pages(extent);
+			}
+			_index_segments.clear();
+			_index_segments_entry_count = 0;
+		}
+
+		_index_segments.push_back(superblock.index);
+		_index_segments_entry_count += superblock.index.entry_count;
+	}
+
+	// Old versions of saved blocks are no longer referenced either
+	for (size_t i = 0; i < _pages_freed_before_commit.size(); ++i) {
+		free_pages(_pages_freed_before_commit[i]);
+	}
+	_pages_freed_before_commit.clear();
+
+	_uncommitted_blocks.clear();
+}
+
+bool VoxelStreamWorldFile::open(bool create, const VoxelBuffer *format) {
+	if (_file != nullptr) {
+		return true;
+	}
+	if (_file_path.empty()) {
+		return false;
+	}
+	if (!create && _file_checked && !_file_exists) {
+		return false;
+	}
+
+	Error err;
+	FileAccess *f = open_file(_file_path, FileAccess::READ_WRITE, &err);
+
+	if (f == nullptr) {
+		// Had to add ERR_FILE_CANT_OPEN because that's what Godot actually returns when the file doesn't exist...
+		ERR_FAIL_COND_V_MSG(err != ERR_FILE_NOT_FOUND && err != ERR_FILE_CANT_OPEN, false,
+				String("Could not open {0}").format(varray(_file_path)));
+
+		_file_checked = true;
+		_file_exists = false;
+
+		if (!create) {
+			return false;
+		}
+
+		CRASH_COND(format == nullptr);
+		ERR_FAIL_COND_V(check_directory_created(_file_path.get_base_dir()) != OK, false);
+
+		f = open_file(_file_path, FileAccess::WRITE_READ, &err);
+		ERR_FAIL_COND_V_MSG(f == nullptr, false, String("Could not create {0}").format(varray(_file_path)));
+
+		_file = f;
+		_file_exists = true;
+
+		// Initialize the format from the first block we save
+		for (unsigned int i = 0; i < _meta.channel_depths.size(); ++i) {
+			_meta.channel_depths[i] = format->get_channel_depth(i);
+		}
+		save_header();
+
+		_superblock = Superblock();
+		_end_page = 1;
+		rebuild_free_pages();
+		return true;
+	}
+
+	_file = f;
+	_file_checked = true;
+	_file_exists = true;
+
+	VoxelFileResult res = load_header();
+
+	Superblock superblock;
+	if (res == VOXEL_FILE_OK) {
+		// Use the most recent superblock which was completely written
+		Superblock superblocks[2];
+		const bool valid0 = read_superblock(0, superblocks[0]);
+		const bool valid1 = read_superblock(1, superblocks[1]);
+		if (valid0 && valid1) {
+			superblock = superblocks[0].sequence > superblocks[1].sequence ? superblocks[0] : superblocks[1];
+		} else if (valid0) {
+			superblock = superblocks[0];
+		} else if (valid1) {
+			superblock = superblocks[1];
+		} else {
+			// Nothing was committed yet
+			superblock.end_page = 1;
+		}
+
+		res = load_index(superblock);
+	}
+
+	if (res != VOXEL_FILE_OK) {
+		// Don't touch a file we can't read
+		ERR_PRINT(String("Could not read {0}: {1}").format(varray(_file_path, Voxel::to_string(res))));
+		memdelete(_file);
+		_file = nullptr;
+		_index.clear();
+		_index_segments.clear();
+		_index_segments_entry_count = 0;
+		return false;
+	}
+
+	_superblock = superblock;
+	_end_page = superblock.end_page;
+	rebuild_free_pages();
+	return true;
+}
+
+void VoxelStreamWorldFile::close() {
+	if (_file == nullptr) {
+		return;
+	}
+
+	commit();
+
+	// Free pages at the end of the file are not needed anymore
+	const uint64_t used_size = uint64_t(_end_page) * PAGE_SIZE;
+	const uint64_t file_size = _file->get_len();
+
+	memdelete(_file);
+	_file = nullptr;
+
+	if (file_size > used_size) {
+		// It's fine if the platform doesn't support it, the file will just remain bigger
+		truncate_file(_file_path, used_size);
+	}
+
+	_index.clear();
+	_uncommitted_blocks.clear();
+	_index_segments.clear();
+	_index_segments_entry_count = 0;
+	_free_pages.clear();
+	_pages_freed_before_commit.clear();
+	_end_page = 0;
+	_superblock = Superblock();
+	_file_checked = false;
+	_file_exists = false;
+}
+
+VoxelFileResult VoxelStreamWorldFile::save_header() {
+	CRASH_COND(_file == nullptr);
+
+	_meta.version = FORMAT_VERSION;
+
+	_file->seek(0);
+	_file->store_buffer((const uint8_t *)FORMAT_MAGIC, 4);
+	_file->store_8(_meta.version);
+	_file->store_32(PAGE_SIZE);
+	_file->store_8(_meta.lod_count);
+	_file->store_8(_meta.block_size_po2);
+
+	for (unsigned int i = 0; i < _meta.channel_depths.size(); ++i) {
+		_file->store_8(_meta.channel_depths[i]);
+	}
+
+	// The rest of the first page is reserved for superblocks, which remain empty until the first commit
+	static const uint8_t zeros[PAGE_SIZE] = { 0 };
+	_file->store_buffer(zeros, PAGE_SIZE - HEADER_SIZE);
+
+	return VOXEL_FILE_OK;
+}
+
+VoxelFileResult VoxelStreamWorldFile::load_header() {
+	CRASH_COND(_file == nullptr);
+
+	_file->seek(0);
+
+	Meta meta;
+	VoxelFileResult check_result = check_magic_and_version(_file, FORMAT_VERSION, FORMAT_MAGIC, meta.version);
+	if (check_result != VOXEL_FILE_OK) {
+		return check_result;
+	}
+
+	const uint32_t page_size = _file->get_32();
+	ERR_FAIL_COND_V(page_size != PAGE_SIZE, VOXEL_FILE_INVALID_DATA);
+
+	meta.lod_count = _file->get_8();
+	meta.block_size_po2 = _file->get_8();
+
+	for (unsigned int i = 0; i < meta.channel_depths.size(); ++i) {
+		uint8_t depth = _file->get_8();
+		ERR_FAIL_COND_V(depth >= VoxelBuffer::DEPTH_COUNT, VOXEL_FILE_INVALID_DATA);
+		meta.channel_depths[i] = (VoxelBuffer::Depth)depth;
+	}
+
+	ERR_FAIL_COND_V(_file->eof_reached(), VOXEL_FILE_UNEXPECTED_EOF);
+	ERR_FAIL_COND_V(meta.lod_count < 1 || meta.lod_count > 32, VOXEL_FILE_INVALID_DATA);
+	ERR_FAIL_COND_V(meta.block_size_po2 < 1 || meta.block_size_po2 > 8, VOXEL_FILE_INVALID_DATA);
+
+	_meta = meta;
+	return VOXEL_FILE_OK;
+}
+
+bool VoxelStreamWorldFile::read_superblock(unsigned int slot, Superblock &out_superblock) {
+	uint8_t data[SUPERBLOCK_SIZE];
+
+	_file->seek(SUPERBLOCK_OFFSETS[slot]);
+	if (_file->get_buffer(data, SUPERBLOCK_SIZE) != (int)SUPERBLOCK_SIZE) {
+		return false;
+	}
+
+	// An empty or partially written slot is not an error, it just doesn't count
+	if (decode_uint32(data) != SUPERBLOCK_MAGIC) {
+		return false;
+	}
+	const uint32_t checksum = decode_uint32(data + SUPERBLOCK_SIZE - sizeof(uint32_t));
+	if (crc32c(data, SUPERBLOCK_SIZE - sizeof(uint32_t)) != checksum) {
+		return false;
+	}
+
+	out_superblock.sequence = decode_uint64(data + 4);
+	out_superblock.index.page = decode_uint32(data + 12);
+	out_superblock.index.size = decode_uint32(data + 16);
+	out_superblock.end_page = decode_uint32(data + 20);
+	return true;
+}
+
+void VoxelStreamWorldFile::write_superblock(const Superblock &superblock) {
+	uint8_t data[SUPERBLOCK_SIZE];
+	uint8_t *dst = data;
+
+	dst += encode_uint32(SUPERBLOCK_MAGIC, dst);
+	dst += encode_uint64(superblock.sequence, dst);
+	dst += encode_uint32(superblock.index.page, dst);
+	dst += encode_uint32(superblock.index.size, dst);
+	dst += encode_uint32(superblock.end_page, dst);
+	const uint32_t checksum = crc32c(data, dst - data);
+	dst += encode_uint32(checksum, dst);
+	CRASH_COND(dst != data + SUPERBLOCK_SIZE);
+
+	_file->seek(SUPERBLOCK_OFFSETS[superblock.sequence % 2]);
+	_file->store_buffer(data, SUPERBLOCK_SIZE);
+}
+
+VoxelFileResult VoxelStreamWorldFile::load_index(const Superblock &superblock) {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	_index.clear();
+	_uncommitted_blocks.clear();
+	_index_segments.clear();
+	_index_segments_entry_count = 0;
+
+	if (superblock.index.size == 0) {
+		return VOXEL_FILE_OK;
+	}
+
+	// Go through segments from the most recent one, until the one containing the whole index
+	std::vector<IndexSegment> segments;
+	std::vector<std::vector<uint8_t> > segments_data;
+	IndexSegment segment = superblock.index;
+
+	while (true) {
+		ERR_FAIL_COND_V(segments.size() >= MAX_INDEX_SEGMENTS, VOXEL_FILE_INVALID_DATA);
+		ERR_FAIL_COND_V(segment.page == 0, VOXEL_FILE_INVALID_DATA);
+		ERR_FAIL_COND_V(segment.size < INDEX_SEGMENT_HEADER_SIZE + sizeof(uint32_t), VOXEL_FILE_INVALID_DATA);
+		ERR_FAIL_COND_V(uint64_t(segment.page) + get_page_count(segment.size) > superblock.end_page, VOXEL_FILE_INVALID_DATA);
+
+		segments_data.push_back(std::vector<uint8_t>());
+		std::vector<uint8_t> &data = segments_data.back();
+		data.resize(segment.size);
+
+		_file->seek(uint64_t(segment.page) * PAGE_SIZE);
+		if (_file->get_buffer(data.data(), data.size()) != (int)data.size()) {
+			return VOXEL_FILE_UNEXPECTED_EOF;
+		}
+
+		ERR_FAIL_COND_V(decode_uint32(data.data()) != INDEX_SEGMENT_MAGIC, VOXEL_FILE_INVALID_MAGIC);
+		const uint32_t checksum = decode_uint32(data.data() + data.size() - sizeof(uint32_t));
+		ERR_FAIL_COND_V_MSG(crc32c(data.data(), data.size() - sizeof(uint32_t)) != checksum, VOXEL_FILE_INVALID_DATA,
+				"Index checksum mismatch");
+
+		const uint8_t kind = data[4];
+		ERR_FAIL_COND_V(kind != INDEX_SEGMENT_FULL && kind != INDEX_SEGMENT_DELTA, VOXEL_FILE_INVALID_DATA);
+		segment.entry_count = decode_uint32(data.data() + 13);
+		ERR_FAIL_COND_V(INDEX_SEGMENT_HEADER_SIZE + uint64_t(segment.entry_count) * INDEX_ENTRY_SIZE + sizeof(uint32_t) !=
+								segment.size,
+				VOXEL_FILE_INVALID_DATA);
+
+		segments.push_back(segment);
+
+		if (kind == INDEX_SEGMENT_FULL) {
+			break;
+		}
+
+		segment = IndexSegment();
+		segment.page = decode_uint32(data.data() + 5);
+		segment.size = decode_uint32(data.data() + 9);
+	}
+
+	// Apply segments from the oldest
+	for (int i = segments.size() - 1; i >= 0; --i) {
+		const IndexSegment &s = segments[i];
+		const uint8_t *src = segments_data[i].data() + INDEX_SEGMENT_HEADER_SIZE;
+
+		for (uint32_t j = 0; j < s.entry_count; ++j) {
+			const uint64_t key = decode_uint64(src);
+			BlockLocation location;
+			location.page = decode_uint32(src + 8);
+			location.size = decode_uint32(src + 12);
+			src += INDEX_ENTRY_SIZE;
+
+			ERR_FAIL_COND_V(location.page == 0 || location.size == 0, VOXEL_FILE_INVALID_DATA);
+
+			_index[key] = location;
+		}
+
+		_index_segments.push_back(s);
+		_index_segments_entry_count += s.entry_count;
+	}
+
+	// Only checked once merged: entries superseded by a later segment may point to pages which were freed
+	// and cut off the end of the file since then
+	for (const Map<uint64_t, BlockLocation>::Element *e = _index.front(); e != nullptr; e = e->next()) {
+		const BlockLocation &location = e->value();
+		ERR_FAIL_COND_V(uint64_t(location.page) + get_page_count(location.size) > superblock.end_page,
+				VOXEL_FILE_INVALID_DATA);
+	}
+
+	return VOXEL_FILE_OK;
+}
+
+void VoxelStreamWorldFile::rebuild_free_pages() {
+	_free_pages.clear();
+	_pages_freed_before_commit.clear();
+
+	// Pages not used by the committed index or blocks are free
+	std::vector<PageExtent> used;
+	used.reserve(_index.size() + _index_segments.size() + 1);
+
+	PageExtent header_extent;
+	header_extent.page = 0;
+	header_extent.count = 1;
+	used.push_back(header_extent);
+
+	for (size_t i = 0; i < _index_segments.size(); ++i) {
+		PageExtent extent;
+		extent.page = _index_segments[i].page;
+		extent.count = get_page_count(_index_segments[i].size);
+		used.push_back(extent);
+	}
+
+	for (const Map<uint64_t, BlockLocation>::Element *e = _index.front(); e != nullptr; e = e->next()) {
+		PageExtent extent;
+		extent.page = e->get().page;
+		extent.count = get_page_count(e->get().size);
+		used.push_back(extent);
+	}
+
+	std::sort(used.begin(), used.end(), [](const PageExtent &a, const PageExtent &b) {
+		return a.page < b.page;
+	});
+
+	uint32_t next_page = 0;
+	for (size_t i = 0; i < used.size(); ++i) {
+		const PageExtent &extent = used[i];
+		if (extent.page > next_page) {
+			PageExtent free_extent;
+			free_extent.page = next_page;
+			free_extent.count = extent.page - next_page;
+			_free_pages.push_back(free_extent);
+		}
+		next_page = MAX(next_page, extent.page + extent.count);
+	}
+
+	// Free pages at the end are not needed
+	_end_page = next_page;
+}
+
+uint32_t VoxelStreamWorldFile::allocate_pages(uint32_t count) {
+	// First fit
+	for (size_t i = 0; i < _free_pages.size(); ++i) {
+		PageExtent &extent = _free_pages[i];
+		if (extent.count >= count) {
+			const uint32_t page = extent.page;
+			extent.page += count;
+			extent.count -= count;
+			if (extent.count == 0) {
+				_free_pages.erase(_free_pages.begin() + i);
+			}
+			return page;
+		}
+	}
+
+	const uint32_t page = _end_page;
+	CRASH_COND(uint64_t(_end_page) + count > 0xffffffff);
+	_end_page += count;
+	return page;
+}
+
+void VoxelStreamWorldFile::free_pages(PageExtent extent) {
+	if (extent.count == 0) {
+		return;
+	}
+
+	std::vector<PageExtent>::iterator it = std::lower_bound(_free_pages.begin(), _free_pages.end(), extent,
+			[](const PageExtent &a, const PageExtent &b) {
+				return a.page < b.page;
+			});
+	size_t i = _free_pages.insert(it, extent) - _free_pages.begin();
+
+	// Merge with neighbors
+	if (i + 1 < _free_pages.size() && _free_pages[i].page + _free_pages[i].count == _free_pages[i + 1].page) {
+		_free_pages[i].count += _free_pages[i + 1].count;
+		_free_pages.erase(_free_pages.begin() + i + 1);
+	}
+	if (i > 0 && _free_pages[i - 1].page + _free_pages[i - 1].count == _free_pages[i].page) {
+		_free_pages[i - 1].count += _free_pages[i].count;
+		_free_pages.erase(_free_pages.begin() + i);
+		--i;
+	}
+
+	// The file can shrink if pages at the end are free
+	if (_free_pages[i].page + _free_pages[i].count == _end_page) {
+		_end_page = _free_pages[i].page;
+		_free_pages.erase(_free_pages.begin() + i);
+	}
+}
+
+uint32_t VoxelStreamWorldFile::get_page_count(uint32_t size_in_bytes) {
+	return (size_in_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+bool VoxelStreamWorldFile::get_block_key(Vector3i origin_in_voxels, int lod, uint64_t &out_key) const {
+	const Vector3i block_pos = (origin_in_voxels >> _meta.block_size_po2) >> lod;
+	const int limit = 1 << (KEY_COORD_BITS - 1);
+
+	ERR_FAIL_COND_V_MSG(block_pos.x < -limit || block_pos.y < -limit || block_pos.z < -limit ||
+								block_pos.x >= limit || block_pos.y >= limit || block_pos.z >= limit,
+			false, String("Block {0} is too far to be saved").format(varray(block_pos.to_vec3())));
+
+	out_key = (uint64_t(lod) << KEY_LOD_SHIFT) |
+			  morton_encode_3(block_pos.x + limit, block_pos.y + limit, block_pos.z + limit);
+	return true;
+}
+
+String VoxelStreamWorldFile::get_file_path() const {
+	return _file_path;
+}
+
+void VoxelStreamWorldFile::set_file_path(String fpath) {
+	fpath = fpath.strip_edges();
+	if (_file_path != fpath) {
+		MutexLock lock(_mutex);
+		close();
+		_file_path = fpath;
+		// Get dimensions from the file if it exists
+		open(false, nullptr);
+		_change_notify();
+	}
+}
+
+int VoxelStreamWorldFile::get_block_size_po2() const {
+	return _meta.block_size_po2;
+}
+
+int VoxelStreamWorldFile::get_lod_count() const {
+	return _meta.lod_count;
+}
+
+void VoxelStreamWorldFile::set_compression_codec(int codec) {
+	// The serializer is in use while loading or saving blocks
+	MutexLock lock(_mutex);
+	VoxelStreamFile::set_compression_codec(codec);
+}
+
+void VoxelStreamWorldFile::set_compression_level(int level) {
+	MutexLock lock(_mutex);
+	VoxelStreamFile::set_compression_level(level);
+}
+
+void VoxelStreamWorldFile::set_block_size_po2(int p_block_size_po2) {
+	if (_meta.block_size_po2 == p_block_size_po2) {
+		return;
+	}
+	ERR_FAIL_COND_MSG(_file_exists, "Can't change the block size of an existing file");
+	ERR_FAIL_COND(p_block_size_po2 < 1);
+	ERR_FAIL_COND(p_block_size_po2 > 8);
+	_meta.block_size_po2 = p_block_size_po2;
+	emit_changed();
+}
+
+void VoxelStreamWorldFile::set_lod_count(int p_lod_count) {
+	if (_meta.lod_count == p_lod_count) {
+		return;
+	}
+	ERR_FAIL_COND_MSG(_file_exists, "Can't change the LOD count of an existing file");
+	ERR_FAIL_COND(p_lod_count < 1);
+	ERR_FAIL_COND(p_lod_count > 32);
+	_meta.lod_count = p_lod_count;
+	emit_changed();
+}
+
+int VoxelStreamWorldFile::get_saved_block_count() {
+	MutexLock lock(_mutex);
+	return _index.size();
+}
+
+void VoxelStreamWorldFile::_bind_methods() {
+
+	ClassDB::bind_method(D_METHOD("set_file_path", "path"), &VoxelStreamWorldFile::set_file_path);
+	ClassDB::bind_method(D_METHOD("get_file_path"), &VoxelStreamWorldFile::get_file_path);
+
+	ClassDB::bind_method(D_METHOD("set_block_size_po2", "po2"), &VoxelStreamWorldFile::set_block_size_po2);
+	ClassDB::bind_method(D_METHOD("get_block_size_po2"), &VoxelStreamWorldFile::get_block_size_po2);
+
+	ClassDB::bind_method(D_METHOD("set_lod_count", "count"), &VoxelStreamWorldFile::set_lod_count);
+	ClassDB::bind_method(D_METHOD("get_lod_count"), &VoxelStreamWorldFile::get_lod_count);
+
+	ClassDB::bind_method(D_METHOD("get_saved_block_count"), &VoxelStreamWorldFile::get_saved_block_count);
+
+	ADD_PROPERTY(PropertyInfo(Variant::STRING, "file_path", PROPERTY_HINT_FILE, "*.vxw"), "set_file_path", "get_file_path");
+
+	ADD_GROUP("Dimensions", "");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "lod_count"), "set_lod_count", "get_lod_count");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "block_size_po2"), "set_block_size_po2", "get_block_size_po2");
+}
+
+}
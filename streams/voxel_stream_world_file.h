@@ -0,0 +1,131 @@
+#ifndef VOXEL_STREAM_WORLD_FILE_H
+#define VOXEL_STREAM_WORLD_FILE_H
+
+#include "../util/fixed_array.h"
+#include "file_utils.h"
+#include "voxel_stream_file.h"
+#include <core/map.h>
+
+class FileAccess;
+
+namespace Voxel {
+
+// Loads and saves blocks of all LODs in a single file, which avoids creating thousands of files for big worlds.
+// The file is divided in pages. Blocks are located with an index sorted by LOD and Morton code,
+// so blocks close to each other are likely saved close to each other in the file, and can be loaded with fewer reads.
+// Saves are done in batches, each one being committed atomically: if it gets interrupted,
+// the file is read back as it was after the previous batch.
+class VoxelStreamWorldFile : public VoxelStreamFile {
+	GDCLASS(VoxelStreamWorldFile, VoxelStreamFile)
+public:
+	VoxelStreamWorldFile();
+	~VoxelStreamWorldFile();
+
+	void emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) override;
+	void immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels, int lod) override;
+
+	void emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) override;
+	void immerge_blocks(Vector<VoxelBlockRequest> &p_blocks) override;
+
+	String get_file_path() const;
+	void set_file_path(String fpath);
+
+	int get_block_size_po2() const override;
+	int get_lod_count() const override;
+
+	void set_compression_codec(int codec) override;
+	void set_compression_level(int level) override;
+
+	// Dimensions can only be changed before the file is created
+	void set_block_size_po2(int p_block_size_po2);
+	void set_lod_count(int p_lod_count);
+
+	int get_saved_block_count();
+
+protected:
+	static void _bind_methods();
+
+private:
+	struct Meta {
+		uint8_t version = -1;
+		uint8_t lod_count = 0;
+		uint8_t block_size_po2 = 0;
+		FixedArray<VoxelBuffer::Depth, VoxelBuffer::MAX_CHANNELS> channel_depths;
+	};
+
+	// Where a block is saved. Blocks always start at the beginning of a page.
+	struct BlockLocation {
+		uint32_t page = 0;
+		uint32_t size = 0; // In bytes
+	};
+
+	// Range of contiguous pages
+	struct PageExtent {
+		uint32_t page = 0;
+		uint32_t count = 0;
+	};
+
+	// Location of a segment of the index. The index is saved as a chain of segments:
+	// the first one contains all entries, and the next ones only contain those which changed since.
+	struct IndexSegment {
+		uint32_t page = 0;
+		uint32_t size = 0;
+		uint32_t entry_count = 0;
+	};
+
+	struct Superblock {
+		uint64_t sequence = 0;
+		IndexSegment index;
+		uint32_t end_page = 0;
+	};
+
+	bool open(bool create, const VoxelBuffer *format);
+	void close();
+	VoxelFileResult load_header();
+	VoxelFileResult save_header();
+	bool read_superblock(unsigned int slot, Superblock &out_superblock);
+	void write_superblock(const Superblock &superblock);
+	VoxelFileResult load_index(const Superblock &superblock);
+	void rebuild_free_pages();
+	void commit();
+
+	bool get_block_key(Vector3i origin_in_voxels, int lod, uint64_t &out_key) const;
+	uint32_t allocate_pages(uint32_t count);
+	void free_pages(PageExtent extent);
+	static uint32_t get_page_count(uint32_t size_in_bytes);
+
+	String _file_path;
+	FileAccess *_file = nullptr;
+	Meta _meta;
+	bool _file_exists = false;
+	// When the file doesn't exist, we remember it so we don't try to open it for every block
+	bool _file_checked = false;
+
+	// All saved blocks, by key
+	Map<uint64_t, BlockLocation> _index;
+	// Blocks saved since the last commit. Their pages are not referenced by the file yet.
+	Map<uint64_t, BlockLocation> _uncommitted_blocks;
+	// Segments of the committed index, from oldest to most recent
+	std::vector<IndexSegment> _index_segments;
+	unsigned int _index_segments_entry_count = 0;
+
+	// Pages which can be allocated, sorted by page
+	std::vector<PageExtent> _free_pages;
+	// Pages which are no longer used since the last commit.
+	// They can't be reused until the next commit, because the committed index still points to them.
+	std::vector<PageExtent> _pages_freed_before_commit;
+	// Where the next appended page starts
+	uint32_t _end_page = 0;
+	Superblock _superblock;
+
+	// Blocks next to each other in the file are read together into this buffer
+	std::vector<uint8_t> _read_run_buffer;
+	std::vector<uint8_t> _index_buffer;
+
+	// The file may be accessed by several streaming threads
+	Mutex _mutex;
+};
+
+}
+
+#endif // VOXEL_STREAM_WORLD_FILE_H
@@ -36,6 +36,7 @@ public:
 		Vector3i position; // In LOD-relative block coordinates
 		uint8_t lod = 0;
 		bool can_be_discarded = true; // If false, will always be processed, even if the thread is told to exit
+		bool low_priority = false; // If true, will be processed after all other blocks, for work which isn't needed yet
 		float sort_heuristic = 0;
 	};
 
@@ -67,6 +68,8 @@ public:
 	struct ProcessorStats {
 		int file_openings = 0;
 		int time_spent_opening_files = 0;
+		int file_cache_hits = 0;
+		int file_cache_misses = 0;
 	};
 
 	struct Stats {
@@ -281,6 +284,8 @@ public:
 		d["remaining_blocks_per_thread"] = remaining_blocks;
 		d["file_openings"] = stats.processor.file_openings;
 		d["time_spent_opening_files"] = stats.processor.time_spent_opening_files;
+		d["file_cache_hits"] = stats.processor.file_cache_hits;
+		d["file_cache_misses"] = stats.processor.file_cache_misses;
 		return d;
 	}
 
@@ -323,6 +328,8 @@ private:
 
 		a.processor.file_openings += b.processor.file_openings;
 		a.processor.time_spent_opening_files += b.processor.time_spent_opening_files;
+		a.processor.file_cache_hits += b.processor.file_cache_hits;
+		a.processor.file_cache_misses += b.processor.file_cache_misses;
 	}
 
 	unsigned int push_block_requests(JobData &job, const std::vector<InputBlock> &input_blocks, int begin, int count) {
@@ -479,7 +486,11 @@ private:
 		float dp = viewer_direction.dot(viewer_block_pos.to_vec3() / d);
 		// Higher lod indexes come first to allow the octree to subdivide.
 		// Then comes distance, which is modified by how much in view the block is
-		return (max_lod - a.lod) * 10000.f + d + (1.f - dp) * 4.f * f;
+		float h = (max_lod - a.lod) * 10000.f + d + (1.f - dp) * 4.f * f;
+		if (a.low_priority) {
+			h += 1000000.f;
+		}
+		return h;
 	}
 
 	struct BlockUpdateComparator {
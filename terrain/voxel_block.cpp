@@ -2,59 +2,9 @@
 #include "../util/zprofiling.h"
 #include "../voxel_string_names.h"
 #include <scene/3d/node_3d.h>
-#include <scene/resources/concave_polygon_shape_3d.h>
 
 namespace Voxel {
 
-// Faster version of Mesh::create_trimesh_shape()
-// See https://github.com/Zylann/godot_voxel/issues/54
-//
-static Ref<ConcavePolygonShape3D> create_concave_polygon_shape(Vector<Array> surfaces) {
-
-	Vector<Vector3> face_points;
-	int face_points_size = 0;
-
-	//find the correct size for face_points
-	for(int i = 0; i < surfaces.size(); i++) {
-		const Array &surface_arrays = surfaces[i];
-		Vector<int> indices = surface_arrays[Mesh::ARRAY_INDEX];
-
-		face_points_size += indices.size();
-	}
-	face_points.resize(face_points_size);
-
-	//copy the points into it
-	int face_points_offset = 0;
-	for(int i = 0; i < surfaces.size(); i++) {
-		const Array &surface_arrays = surfaces[i];
-
-		Vector<Vector3> positions = surface_arrays[Mesh::ARRAY_VERTEX];
-		Vector<int> indices = surface_arrays[Mesh::ARRAY_INDEX];
-
-		ERR_FAIL_COND_V(positions.size() < 3, Ref<ConcavePolygonShape3D>());
-		ERR_FAIL_COND_V(indices.size() < 3, Ref<ConcavePolygonShape3D>());
-		ERR_FAIL_COND_V(indices.size() % 3 != 0, Ref<ConcavePolygonShape3D>());
-
-		int face_points_count = face_points_offset + indices.size();
-
-		{
-			Vector3 *w = face_points.ptrw();
-			const int *index_r = indices.ptr();
-			const Vector3 *position_r = positions.ptr();
-
-			for (int p = face_points_offset; p < face_points_count; ++p) {
-				w[p] = position_r[index_r[p - face_points_offset]];
-			}
-		}
-
-		face_points_offset += indices.size();
-	}
-
-	Ref<ConcavePolygonShape3D> shape = memnew(ConcavePolygonShape3D);
-	shape->set_faces(face_points);
-	return shape;
-}
-
 // Helper
 VoxelBlock *VoxelBlock::create(Vector3i bpos, Ref<VoxelBuffer> buffer, unsigned int size, unsigned int p_lod_index) {
 	const int bs = size;
@@ -104,7 +54,7 @@ void VoxelBlock::set_world(Ref<World3D> p_world) {
 	}
 }
 
-void VoxelBlock::set_mesh(Ref<Mesh> mesh, Node3D *node, bool generate_collision, Vector<Array> surface_arrays, bool debug_collision) {
+void VoxelBlock::set_mesh(Ref<Mesh> mesh, Node3D *node, Ref<Shape3D> collision_shape, bool debug_collision) {
 	// TODO Don't add mesh instance to the world if it's not visible.
 	// I suspect Godot is trying to include invisible mesh instances into the culling process,
 	// which is killing performance when LOD is used (i.e many meshes are in pool but hidden)
@@ -134,9 +84,8 @@ void VoxelBlock::set_mesh(Ref<Mesh> mesh, Node3D *node, bool generate_collision,
 		_mesh_instance.set_material_override(_debug_material);
 #endif
 
-		if (generate_collision) {
-			Ref<Shape3D> shape = create_concave_polygon_shape(surface_arrays);
-
+		// The shape was made from triangles gathered by a meshing thread, it only needs to be attached
+		if (collision_shape.is_valid()) {
 			if (!_static_body.is_valid()) {
 				_static_body.create();
 				_static_body.set_world(*_world);
@@ -145,9 +94,13 @@ void VoxelBlock::set_mesh(Ref<Mesh> mesh, Node3D *node, bool generate_collision,
 			} else {
 				_static_body.remove_shape(0);
 			}
-			_static_body.add_shape(shape);
+			_static_body.add_shape(collision_shape);
 			_static_body.set_debug(debug_collision, *_world);
 			_static_body.set_shape_enabled(0, _visible);
+
+		} else if (_static_body.is_valid()) {
+			// Collisions were turned off, or there is nothing to collide with
+			_static_body.destroy();
 		}
 
 	} else {
@@ -296,6 +249,15 @@ void VoxelBlock::set_parent_visible(bool parent_visible) {
 	_set_visible(_visible && _parent_visible);
 }
 
+VoxelBuffer &VoxelBlock::get_voxels_for_write() {
+	CRASH_COND(voxels.is_null());
+	if (are_voxels_shared()) {
+		// Others keep the version they referenced
+		voxels = voxels->duplicate();
+	}
+	return **voxels;
+}
+
 void VoxelBlock::set_needs_lodding(bool need_lodding) {
 	_needs_lodding = need_lodding;
 }
@@ -28,6 +28,8 @@ public:
 	Vector3i position;
 	unsigned int lod_index = 0;
 	bool pending_transition_update = false;
+	// The mesh is being updated because voxels were edited, so it should be shown as soon as possible
+	bool pending_edit_mesh_update = false;
 
 	static VoxelBlock *create(Vector3i bpos, Ref<VoxelBuffer> buffer, unsigned int size, unsigned int p_lod_index);
 
@@ -36,7 +38,7 @@ public:
 	// Visuals and physics
 
 	void set_world(Ref<World3D> p_world);
-	void set_mesh(Ref<Mesh> mesh, Node3D *node, bool generate_collision, Vector<Array> surface_arrays, bool debug_collision);
+	void set_mesh(Ref<Mesh> mesh, Node3D *node, Ref<Shape3D> collision_shape, bool debug_collision);
 	void set_transition_mesh(Ref<Mesh> mesh, int side);
 	bool has_mesh() const;
 
@@ -57,12 +59,46 @@ public:
 
 	// Voxel data
 
+	// Voxels can be referenced by tasks running in other threads (like meshing), which expect them to not change.
+	// So they must be modified through this, which gives the block its own copy if they are shared.
+	VoxelBuffer &get_voxels_for_write();
+
+	inline bool are_voxels_shared() const { return voxels->get_reference_count() > 1; }
+
 	void set_needs_lodding(bool need_lodding);
 	inline bool get_needs_lodding() const { return _needs_lodding; }
 
 	bool is_modified() const;
 	void set_modified(bool modified);
 
+	// Neighbors
+
+	// Bits telling which blocks of the 3x3x3 area centered on this one are present in the map, including itself.
+	// Maintained by VoxelMap when blocks are added or removed.
+	static const uint32_t ALL_NEIGHBORS_MASK = (1 << 27) - 1;
+
+	static inline unsigned int get_neighbor_bit_index(Vector3i offset) {
+		return (offset.x + 1) + 3 * (offset.y + 1) + 9 * (offset.z + 1);
+	}
+
+	inline void set_neighbor_present(Vector3i offset, bool present) {
+		const uint32_t bit = 1 << get_neighbor_bit_index(offset);
+		if (present) {
+			_neighbors_mask |= bit;
+		} else {
+			_neighbors_mask &= ~bit;
+		}
+	}
+
+	inline void reset_neighbors_mask() {
+		_neighbors_mask = 1 << get_neighbor_bit_index(Vector3i());
+	}
+
+	inline uint32_t get_neighbors_mask() const { return _neighbors_mask; }
+
+	// All neighbors are present, which is needed to build a mesh
+	inline bool is_surrounded() const { return _neighbors_mask == ALL_NEIGHBORS_MASK; }
+
 private:
 	VoxelBlock();
 
@@ -102,6 +138,8 @@ private:
 
 	// Indicates if this block is different from the time it was loaded (should be saved)
 	bool _modified = false;
+
+	uint32_t _neighbors_mask = 0;
 };
 
 }
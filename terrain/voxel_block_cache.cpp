@@ -0,0 +1,129 @@
+#include "voxel_block_cache.h"
+#include "../util/zprofiling.h"
+
+namespace Voxel {
+
+VoxelBlockCache::~VoxelBlockCache() {
+	clear();
+}
+
+void VoxelBlockCache::set_max_memory(uint64_t max_bytes) {
+	_max_memory = max_bytes;
+	trim();
+}
+
+void VoxelBlockCache::put(Vector3i bpos, unsigned int lod_index, Ref<VoxelBuffer> voxels) {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	ERR_FAIL_COND(voxels.is_null());
+	ERR_FAIL_COND(lod_index >= _entries.size());
+
+	Entry **existing = _entries[lod_index].getptr(bpos);
+	if (existing != nullptr) {
+		remove(*existing);
+	}
+
+	if (_max_memory == 0) {
+		return;
+	}
+
+	// Blocks are often uniform in some channels, so this is a cheap way to use less memory
+	voxels->compress_uniform_channels();
+
+	Entry *entry = memnew(Entry);
+	entry->voxels = voxels;
+	entry->position = bpos;
+	entry->lod_index = lod_index;
+	entry->memory_usage = sizeof(VoxelBuffer) + voxels->get_memory_usage();
+
+	entry->prev = _newest;
+	if (_newest != nullptr) {
+		_newest->next = entry;
+	} else {
+		_oldest = entry;
+	}
+	_newest = entry;
+
+	_entries[lod_index].set(bpos, entry);
+	++_block_count;
+	_memory_usage += entry->memory_usage;
+
+	trim();
+}
+
+Ref<VoxelBuffer> VoxelBlockCache::take(Vector3i bpos, unsigned int lod_index) {
+	ERR_FAIL_COND_V(lod_index >= _entries.size(), Ref<VoxelBuffer>());
+
+	Entry **pentry = _entries[lod_index].getptr(bpos);
+	if (pentry == nullptr) {
+		++_stats.misses;
+		return Ref<VoxelBuffer>();
+	}
+
+	++_stats.hits;
+	Ref<VoxelBuffer> voxels = (*pentry)->voxels;
+	remove(*pentry);
+	return voxels;
+}
+
+bool VoxelBlockCache::has(Vector3i bpos, unsigned int lod_index) const {
+	ERR_FAIL_COND_V(lod_index >= _entries.size(), false);
+	return _entries[lod_index].has(bpos);
+}
+
+void VoxelBlockCache::clear() {
+	Entry *entry = _oldest;
+	while (entry != nullptr) {
+		Entry *next = entry->next;
+		memdelete(entry);
+		entry = next;
+	}
+	for (unsigned int i = 0; i < _entries.size(); ++i) {
+		_entries[i].clear();
+	}
+	_oldest = nullptr;
+	_newest = nullptr;
+	_block_count = 0;
+	_memory_usage = 0;
+}
+
+void VoxelBlockCache::remove(Entry *entry) {
+	CRASH_COND(entry == nullptr);
+
+	if (entry->prev != nullptr) {
+		entry->prev->next = entry->next;
+	} else {
+		_oldest = entry->next;
+	}
+	if (entry->next != nullptr) {
+		entry->next->prev = entry->prev;
+	} else {
+		_newest = entry->prev;
+	}
+
+	_entries[entry->lod_index].erase(entry->position);
+	--_block_count;
+	_memory_usage -= entry->memory_usage;
+
+	memdelete(entry);
+}
+
+void VoxelBlockCache::trim() {
+	while (_memory_usage > _max_memory && _oldest != nullptr) {
+		remove(_oldest);
+		++_stats.evictions;
+	}
+}
+
+Dictionary VoxelBlockCache::to_dictionary() const {
+	Dictionary d;
+	d["hits"] = _stats.hits;
+	d["misses"] = _stats.misses;
+	d["evictions"] = _stats.evictions;
+	d["block_count"] = _block_count;
+	d["memory_usage"] = _memory_usage;
+	d["max_memory"] = _max_memory;
+	return d;
+}
+
+}
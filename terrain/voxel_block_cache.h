@@ -0,0 +1,71 @@
+#ifndef VOXEL_BLOCK_CACHE_H
+#define VOXEL_BLOCK_CACHE_H
+
+#include "../math/vector3i.h"
+#include "../util/fixed_array.h"
+#include "../voxel_buffer.h"
+#include "../voxel_constants.h"
+#include <core/hash_map.h>
+
+namespace Voxel {
+
+// Keeps voxels of recently unloaded blocks in memory, so if they are needed again shortly after,
+// they can be used directly instead of going through the stream.
+// Least recently unloaded blocks are discarded first when the cache exceeds its memory budget.
+// Not thread-safe, it is meant to be used from the main thread.
+class VoxelBlockCache {
+public:
+	struct Stats {
+		int hits = 0;
+		int misses = 0;
+		int evictions = 0;
+	};
+
+	~VoxelBlockCache();
+
+	void set_max_memory(uint64_t max_bytes);
+	uint64_t get_max_memory() const { return _max_memory; }
+
+	// The cache takes ownership of the buffer, which must not be modified anywhere else afterwards.
+	// Replaces any buffer already cached at the same position.
+	void put(Vector3i bpos, unsigned int lod_index, Ref<VoxelBuffer> voxels);
+
+	// Removes a buffer from the cache and returns it, or null if it is not cached
+	Ref<VoxelBuffer> take(Vector3i bpos, unsigned int lod_index);
+
+	bool has(Vector3i bpos, unsigned int lod_index) const;
+
+	void clear();
+
+	uint64_t get_memory_usage() const { return _memory_usage; }
+	unsigned int get_block_count() const { return _block_count; }
+	const Stats &get_stats() const { return _stats; }
+
+	Dictionary to_dictionary() const;
+
+private:
+	struct Entry {
+		Ref<VoxelBuffer> voxels;
+		Vector3i position;
+		unsigned int lod_index = 0;
+		uint32_t memory_usage = 0;
+		// Doubly-linked list, from least to most recently added
+		Entry *prev = nullptr;
+		Entry *next = nullptr;
+	};
+
+	void remove(Entry *entry);
+	void trim();
+
+	FixedArray<HashMap<Vector3i, Entry *, Vector3iHasher>, VoxelConstants::MAX_LOD> _entries;
+	Entry *_oldest = nullptr;
+	Entry *_newest = nullptr;
+	unsigned int _block_count = 0;
+	uint64_t _memory_usage = 0;
+	uint64_t _max_memory = 16 * 1024 * 1024;
+	Stats _stats;
+};
+
+}
+
+#endif // VOXEL_BLOCK_CACHE_H
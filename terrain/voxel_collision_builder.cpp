@@ -0,0 +1,185 @@
+#include "voxel_collision_builder.h"
+#include "../math/vector3i.h"
+#include "../util/flat_hash_map.h"
+
+#include <scene/resources/concave_polygon_shape_3d.h>
+#include <scene/resources/mesh.h>
+#include <vector>
+
+namespace Voxel {
+
+namespace {
+// Finest grid used to simplify, in cells per block side
+const unsigned int MAX_SUBDIVISION_PO2 = 8;
+// Distance under which a vertex is considered on a border of the block, relative to its size
+const float BORDER_EPSILON_RATIO = 0.0001f;
+} // namespace
+
+void append_collision_faces(Vector<Vector3> &faces, const Vector<Array> &surfaces) {
+
+	//find the correct size for faces
+	int faces_size = faces.size();
+	for (int i = 0; i < surfaces.size(); i++) {
+		const Array &surface_arrays = surfaces[i];
+		if (surface_arrays.size() == 0) {
+			continue;
+		}
+		Vector<int> indices = surface_arrays[Mesh::ARRAY_INDEX];
+		faces_size += indices.size();
+	}
+
+	int faces_offset = faces.size();
+	faces.resize(faces_size);
+
+	//copy the points into it
+	for (int i = 0; i < surfaces.size(); i++) {
+		const Array &surface_arrays = surfaces[i];
+		if (surface_arrays.size() == 0) {
+			continue;
+		}
+
+		Vector<Vector3> positions = surface_arrays[Mesh::ARRAY_VERTEX];
+		Vector<int> indices = surface_arrays[Mesh::ARRAY_INDEX];
+
+		if (indices.size() == 0) {
+			continue;
+		}
+
+		ERR_FAIL_COND(positions.size() < 3);
+		ERR_FAIL_COND(indices.size() < 3);
+		ERR_FAIL_COND(indices.size() % 3 != 0);
+
+		int faces_count = faces_offset + indices.size();
+
+		{
+			Vector3 *w = faces.ptrw();
+			const int *index_r = indices.ptr();
+			const Vector3 *position_r = positions.ptr();
+
+			for (int p = faces_offset; p < faces_count; ++p) {
+				w[p] = position_r[index_r[p - faces_offset]];
+			}
+		}
+
+		faces_offset += indices.size();
+	}
+}
+
+float simplify_collision_faces(Vector<Vector3> &faces, unsigned int max_triangles, float block_size) {
+
+	ERR_FAIL_COND_V(faces.size() % 3 != 0, 0.f);
+	ERR_FAIL_COND_V(block_size <= 0.f, 0.f);
+
+	const unsigned int triangle_count = faces.size() / 3;
+	if (max_triangles == 0 || triangle_count <= max_triangles) {
+		return 0.f;
+	}
+
+	const Vector3 *src = faces.ptr();
+
+	// A surface spanning n*n cells of the grid has about 2*n*n triangles, start from there.
+	// Cells divide the block in powers of two, so grids are aligned with those of neighbor blocks,
+	// even when they use a different subdivision.
+	const float cells_per_axis = Math::sqrt(max_triangles / 2.f);
+	unsigned int subdivision_po2 = 0;
+	while (subdivision_po2 < MAX_SUBDIVISION_PO2 && (1 << (subdivision_po2 + 1)) <= cells_per_axis) {
+		++subdivision_po2;
+	}
+
+	// Vertices on the borders of the block are kept as they are, so the mesh still joins those of neighbors
+	const float border_epsilon = block_size * BORDER_EPSILON_RATIO;
+	const float border_max = block_size - border_epsilon;
+
+	// Vertices of each cell are merged into their average position
+	FlatHashMap<Vector3i, unsigned int, Vector3iMortonHasher> cluster_indices;
+	std::vector<Vector3> cluster_sums;
+	std::vector<unsigned int> cluster_counts;
+	std::vector<unsigned int> triangles;
+
+	float cell_size = 0.f;
+
+	while (true) {
+
+		cluster_indices.clear();
+		cluster_sums.clear();
+		cluster_counts.clear();
+		triangles.clear();
+
+		cell_size = block_size / (1 << subdivision_po2);
+		const float inv_cell_size = 1.f / cell_size;
+
+		for (unsigned int t = 0; t < triangle_count; ++t) {
+
+			unsigned int corners[3];
+
+			for (unsigned int j = 0; j < 3; ++j) {
+				const Vector3 p = src[t * 3 + j];
+
+				if (p.x <= border_epsilon || p.y <= border_epsilon || p.z <= border_epsilon ||
+						p.x >= border_max || p.y >= border_max || p.z >= border_max) {
+					// Pinned, gets a cluster of its own
+					corners[j] = cluster_sums.size();
+					cluster_sums.push_back(p);
+					cluster_counts.push_back(1);
+					continue;
+				}
+
+				// Relative to the origin of the block, which is also on the grid of every other block
+				const Vector3i cell(p * inv_cell_size);
+
+				const unsigned int *cluster_index = cluster_indices.getptr(cell);
+				if (cluster_index == nullptr) {
+					corners[j] = cluster_sums.size();
+					cluster_indices.set(cell, corners[j]);
+					cluster_sums.push_back(p);
+					cluster_counts.push_back(1);
+				} else {
+					corners[j] = *cluster_index;
+					cluster_sums[corners[j]] += p;
+					++cluster_counts[corners[j]];
+				}
+			}
+
+			if (corners[0] == corners[1] || corners[1] == corners[2] || corners[2] == corners[0]) {
+				// The triangle collapsed into a line or a point
+				continue;
+			}
+
+			triangles.push_back(corners[0]);
+			triangles.push_back(corners[1]);
+			triangles.push_back(corners[2]);
+		}
+
+		// Pinned vertices can prevent reaching the budget, in which case the coarsest grid is kept
+		if (triangles.size() / 3 <= max_triangles || subdivision_po2 == 0) {
+			break;
+		}
+
+		--subdivision_po2;
+	}
+
+	for (unsigned int i = 0; i < cluster_sums.size(); ++i) {
+		cluster_sums[i] /= cluster_counts[i];
+	}
+
+	// Source points are no longer used past this point
+	faces.resize(triangles.size());
+	Vector3 *dst = faces.ptrw();
+	for (unsigned int i = 0; i < triangles.size(); ++i) {
+		dst[i] = cluster_sums[triangles[i]];
+	}
+
+	return cell_size;
+}
+
+Ref<Shape3D> create_collision_shape(const Vector<Vector3> &faces) {
+	if (faces.size() == 0) {
+		return Ref<Shape3D>();
+	}
+	Ref<ConcavePolygonShape3D> shape;
+	shape.instance();
+	shape->set_faces(faces);
+	return shape;
+}
+
+}
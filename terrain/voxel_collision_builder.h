@@ -0,0 +1,33 @@
+#ifndef VOXEL_COLLISION_BUILDER_H
+#define VOXEL_COLLISION_BUILDER_H
+
+#include <core/array.h>
+#include <core/math/vector3.h>
+#include <core/vector.h>
+#include <scene/resources/shape_3d.h>
+
+namespace Voxel {
+
+// Helpers building collision geometry from mesher output.
+// Faces are triangle soups, three points per triangle, as ConcavePolygonShape3D expects.
+
+// Appends triangles of mesh surfaces. Faster version of Mesh::create_trimesh_shape().
+// See https://github.com/Zylann/godot_voxel/issues/54
+void append_collision_faces(Vector<Vector3> &faces, const Vector<Array> &surfaces);
+
+// Reduces the number of triangles down to max_triangles, by merging vertices falling in the same cell of a grid.
+// Faces are relative to the origin of a block, and block_size is its size in the same units.
+// The grid divides the block in powers of two, and gets coarser until the budget is met, so details smaller than
+// a cell are lost. Vertices on the borders of the block are never moved, so neighbor blocks still join.
+// 0 means no limit. Returns the size of cells used, or 0 if faces were left untouched.
+float simplify_collision_faces(Vector<Vector3> &faces, unsigned int max_triangles, float block_size);
+
+// Must be called on the main thread, because the physics server isn't guaranteed to accept shapes from other threads.
+// This is where the physics engine builds its acceleration structure, so it remains a main thread cost, which grows with
+// the amount of faces. Simplifying faces beforehand reduces it.
+// Returns null if there are no faces.
+Ref<Shape3D> create_collision_shape(const Vector<Vector3> &faces);
+
+}
+
+#endif // VOXEL_COLLISION_BUILDER_H
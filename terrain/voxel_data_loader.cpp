@@ -67,6 +67,10 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 
 		const InputBlock &ib = inputs[i];
 
+		// Given by the terrain. The stream only knows channels its generator produces,
+		// which doesn't cover edits made in other channels.
+		const uint32_t channels_mask = ib.data.channels_mask != 0 ? ib.data.channels_mask : VoxelBuffer::ALL_CHANNELS_MASK;
+
 		int bs = 1 << _block_size_pow2;
 		Vector3i block_origin_in_voxels = ib.position * (bs << ib.lod);
 
@@ -77,6 +81,7 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 			r.voxel_buffer->create(bs, bs, bs);
 			r.origin_in_voxels = block_origin_in_voxels;
 			r.lod = ib.lod;
+			r.channels_mask = channels_mask;
 			emerge_requests.push_back(r);
 
 		} else {
@@ -85,6 +90,7 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 			r.voxel_buffer = ib.data.voxels_to_save;
 			r.origin_in_voxels = block_origin_in_voxels;
 			r.lod = ib.lod;
+			r.channels_mask = channels_mask;
 			immerge_requests.push_back(r);
 		}
 	}
@@ -95,6 +101,8 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 	VoxelStream::Stats stream_stats = stream->get_statistics();
 	stats.file_openings = stream_stats.file_openings;
 	stats.time_spent_opening_files = stream_stats.time_spent_opening_files;
+	stats.file_cache_hits = stream_stats.file_cache_hits;
+	stats.file_cache_misses = stream_stats.file_cache_misses;
 
 	// Assumes the stream won't change output order
 	int iload = 0;
@@ -12,6 +12,8 @@ class VoxelDataLoader {
 public:
 	struct InputBlockData {
 		Ref<VoxelBuffer> voxels_to_save;
+		// Channels to load or save, other channels are skipped. 0 means all channels.
+		uint32_t channels_mask = 0;
 	};
 
 	enum RequestType {
@@ -4,37 +4,32 @@
 #include "../streams/voxel_stream_file.h"
 #include "../util/profiling_clock.h"
 #include "../voxel_string_names.h"
+#include "voxel_collision_builder.h"
 #include "voxel_map.h"
 
 #include <core/core_string_names.h>
 #include <core/engine.h>
+#include <core/os/os.h>
 
 namespace Voxel {
 
-const uint32_t MAIN_THREAD_MESHING_BUDGET_MS = 8;
-
 namespace {
 
-Ref<ArrayMesh> build_mesh(const Vector<Array> surfaces, Mesh::PrimitiveType primitive, int compression_flags,
-		Ref<Material> material) {
+// Surfaces were packed by meshing threads, so this only uploads them
+Ref<ArrayMesh> build_mesh(const Vector<RenderingServer::SurfaceData> &packed_surfaces, Ref<Material> material) {
 
 	Ref<ArrayMesh> mesh;
 	mesh.instance();
 
 	unsigned int surface_index = 0;
-	for (int i = 0; i < surfaces.size(); ++i) {
-
-		Array surface = surfaces[i];
-		if (surface.empty()) {
-			continue;
-		}
+	for (int i = 0; i < packed_surfaces.size(); ++i) {
 
-		CRASH_COND(surface.size() != Mesh::ARRAY_MAX);
-		if (!is_surface_triangulated(surface)) {
+		const RenderingServer::SurfaceData &surface = packed_surfaces[i];
+		if (surface.vertex_count == 0) {
 			continue;
 		}
 
-		mesh->add_surface_from_arrays(primitive, surface, Array(), Dictionary(), compression_flags);
+		add_packed_surface(**mesh, surface);
 		mesh->surface_set_material(surface_index, material);
 		// No multi-material supported yet
 		++surface_index;
@@ -287,7 +282,7 @@ void VoxelLodTerrain::stop_updater() {
 		_block_updater = NULL;
 	}
 
-	_blocks_pending_main_thread_update.clear();
+	_mesh_upload_scheduler.clear();
 
 	for (unsigned int i = 0; i < _lods.size(); ++i) {
 
@@ -320,6 +315,10 @@ void VoxelLodTerrain::stop_streamer() {
 		Lod &lod = _lods[i];
 		lod.blocks_to_load.clear();
 	}
+
+	_cached_blocks_to_apply.clear();
+	// Cached blocks came from the previous stream
+	_block_cache.clear();
 }
 
 void VoxelLodTerrain::set_lod_split_scale(float p_lod_split_scale) {
@@ -338,6 +337,14 @@ void VoxelLodTerrain::set_lod_split_scale(float p_lod_split_scale) {
 		// Because `set_split_scale` may clamp it...
 		_lod_split_scale = item.octree.get_split_scale();
 	}
+
+	// Each LOD loads blocks in a box of this extent
+	for (int lod_index = 0; lod_index < get_lod_count(); ++lod_index) {
+		Lod &lod = _lods[lod_index];
+		if (lod.map.is_valid()) {
+			lod.map->set_dense_window_extent(get_block_region_extent());
+		}
+	}
 }
 
 float VoxelLodTerrain::get_lod_split_scale() const {
@@ -385,6 +392,7 @@ void VoxelLodTerrain::reset_maps() {
 				lod.map.instance();
 			}
 			lod.map->create(get_block_size_pow2(), lod_index);
+			lod.map->set_dense_window_extent(get_block_region_extent());
 
 		} else {
 
@@ -393,6 +401,8 @@ void VoxelLodTerrain::reset_maps() {
 			}
 		}
 	}
+
+	_block_cache.clear();
 }
 
 int VoxelLodTerrain::get_lod_count() const {
@@ -411,6 +421,34 @@ int VoxelLodTerrain::get_collision_lod_count() const {
 	return _collision_lod_count;
 }
 
+void VoxelLodTerrain::set_collision_max_triangles(int max_triangles) {
+	_collision_max_triangles = MAX(max_triangles, 0);
+}
+
+int VoxelLodTerrain::get_collision_max_triangles() const {
+	return _collision_max_triangles;
+}
+
+void VoxelLodTerrain::set_save_channels(int channels_mask) {
+	_save_channels = channels_mask & VoxelBuffer::ALL_CHANNELS_MASK;
+}
+
+int VoxelLodTerrain::get_save_channels() const {
+	return _save_channels;
+}
+
+uint32_t VoxelLodTerrain::get_streamed_channels_mask() const {
+	// Meshers run on data from the stream, so they tell what is needed
+	if (_block_updater == nullptr) {
+		return VoxelBuffer::ALL_CHANNELS_MASK;
+	}
+	const uint32_t mesher_channels = _block_updater->get_used_channels_mask();
+	if (mesher_channels == 0) {
+		return VoxelBuffer::ALL_CHANNELS_MASK;
+	}
+	return mesher_channels | _save_channels;
+}
+
 void VoxelLodTerrain::set_viewer_path(NodePath path) {
 	_viewer_path = path;
 }
@@ -419,6 +457,15 @@ NodePath VoxelLodTerrain::get_viewer_path() const {
 	return _viewer_path;
 }
 
+void VoxelLodTerrain::set_block_cache_max_memory(int bytes) {
+	ERR_FAIL_COND(bytes < 0);
+	_block_cache.set_max_memory(bytes);
+}
+
+int VoxelLodTerrain::get_block_cache_max_memory() const {
+	return _block_cache.get_max_memory();
+}
+
 int VoxelLodTerrain::get_block_region_extent() const {
 	// This is the radius of blocks around the viewer in which we may load them.
 	// It depends on the LOD split scale, which tells how close to a block we need to be for it to subdivide.
@@ -536,7 +583,20 @@ void VoxelLodTerrain::try_schedule_loading_with_neighbors(const Vector3i &p_bpos
 
 				if (block == nullptr) {
 					if (!lod.loading_blocks.has(bpos)) {
-						lod.blocks_to_load.push_back(bpos);
+						Ref<VoxelBuffer> cached_voxels = _block_cache.take(bpos, lod_index);
+
+						if (cached_voxels.is_valid()) {
+							// It was unloaded recently, no need to ask the stream
+							VoxelDataLoader::OutputBlock ob;
+							ob.position = bpos;
+							ob.lod = lod_index;
+							ob.data.type = VoxelDataLoader::TYPE_LOAD;
+							ob.data.voxels_loaded = cached_voxels;
+							_cached_blocks_to_apply.push_back(ob);
+						} else {
+							lod.blocks_to_load.push_back(bpos);
+						}
+
 						lod.loading_blocks.insert(bpos);
 					}
 				}
@@ -622,6 +682,11 @@ void VoxelLodTerrain::send_block_data_requests() {
 
 	_blocks_to_save.clear();
 
+	const uint32_t channels_mask = get_streamed_channels_mask();
+	for (unsigned int i = 0; i < input.blocks.size(); ++i) {
+		input.blocks[i].data.channels_mask = channels_mask;
+	}
+
 	//print_line(String("Sending {0}").format(varray(input.blocks_to_emerge.size())));
 	_stream_thread->push(input);
 }
@@ -635,8 +700,6 @@ void VoxelLodTerrain::_process() {
 		return;
 	}
 
-	OS &os = *OS::get_singleton();
-
 	// Get viewer location
 	// TODO Transform to local (Spatial Transform)
 	Vector3 viewer_pos;
@@ -975,6 +1038,12 @@ void VoxelLodTerrain::_process() {
 		_stream_thread->pop(output);
 		_stats.stream = output.stats;
 
+		// Blocks taken from the cache are handled like loaded ones
+		for (size_t i = 0; i < _cached_blocks_to_apply.size(); ++i) {
+			output.blocks.push_back(_cached_blocks_to_apply[i]);
+		}
+		_cached_blocks_to_apply.clear();
+
 		//print_line(String("Loaded {0} blocks").format(varray(output.emerged_blocks.size())));
 
 		for (int i = 0; i < output.blocks.size(); ++i) {
@@ -1079,6 +1148,11 @@ void VoxelLodTerrain::_process() {
 			VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates_lod);
 			Lod &lod = _lods[lod_index];
 
+			bool has_collision = _generate_collisions;
+			if (has_collision && _collision_lod_count != -1) {
+				has_collision = lod_index < _collision_lod_count;
+			}
+
 			for (unsigned int i = 0; i < lod.blocks_pending_update.size(); ++i) {
 
 				VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates_block);
@@ -1089,29 +1163,11 @@ void VoxelLodTerrain::_process() {
 				// All blocks we get here must be in the scheduled state
 				CRASH_COND(block->get_mesh_state() != VoxelBlock::MESH_UPDATE_NOT_SENT);
 
-				// TODO Perhaps we could do a bit of early-rejection before spending time in buffer copy?
-
-				// Create buffer padded with neighbor voxels
-				Ref<VoxelBuffer> nbuffer;
-				nbuffer.instance();
-
-				// TODO Make the buffer re-usable, or pool memory
-				unsigned int min_padding = _block_updater->get_minimum_padding();
-				unsigned int max_padding = _block_updater->get_maximum_padding();
-				{
-					VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates_block_alloc);
-					unsigned int block_size = lod.map->get_block_size();
-					nbuffer->create(Vector3i(block_size + min_padding + max_padding));
-				}
-
-				{
-					VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates_block_copy);
-					unsigned int channels_mask = (1 << VoxelBuffer::CHANNEL_SDF);
-					lod.map->get_buffer_copy(lod.map->block_to_voxel(block_pos) - Vector3i(min_padding), **nbuffer, channels_mask);
-				}
-
+				// Voxels are not copied here, the mesher will read them from the block and its neighbors
 				VoxelMeshUpdater::InputBlock iblock;
-				iblock.data.voxels = nbuffer;
+				lod.map->get_neighborhood(block_pos, iblock.data.neighborhood);
+				iblock.data.generate_collision = has_collision;
+				iblock.data.collision_max_triangles = _collision_max_triangles;
 				iblock.position = block_pos;
 				iblock.lod = lod_index;
 				input.blocks.push_back(iblock);
@@ -1149,22 +1205,29 @@ void VoxelLodTerrain::_process() {
 					continue;
 				}
 
-				_blocks_pending_main_thread_update.push_back(ob);
+				const VoxelBlock *block = _lods[ob.lod].map->get_block(ob.position);
+				if (block == NULL) {
+					// That block is no longer loaded, drop the result
+					++_stats.dropped_block_meshs;
+					continue;
+				}
+
+				const unsigned int priority = VoxelMeshUploadScheduler::get_block_priority(
+						ob.position, ob.lod, viewer_block_pos, block->pending_edit_mesh_update);
+				_mesh_upload_scheduler.push(ob, priority);
 			}
 		}
 
-		uint32_t timeout = os.get_ticks_msec() + MAIN_THREAD_MESHING_BUDGET_MS; // Allocate milliseconds max to upload meshes
-		unsigned int queue_index = 0;
-
 		// The following is done on the main thread because Godot doesn't really support multithreaded Mesh allocation.
 		// This also proved to be very slow compared to the meshing process itself...
 		// hopefully Vulkan will allow us to upload graphical resources without stalling rendering as they upload?
 
-		for (; queue_index < _blocks_pending_main_thread_update.size() && os.get_ticks_msec() < timeout; ++queue_index) {
+		_mesh_upload_scheduler.begin_frame();
+		VoxelMeshUpdater::OutputBlock ob;
 
-			VOXEL_PROFILE_SCOPE(profile_process_receive_mesh_updates_block_update);
+		while (_mesh_upload_scheduler.pop(ob)) {
 
-			const VoxelMeshUpdater::OutputBlock &ob = _blocks_pending_main_thread_update[queue_index];
+			VOXEL_PROFILE_SCOPE(profile_process_receive_mesh_updates_block_update);
 
 			if (ob.lod >= get_lod_count()) {
 				// Sorry, LOD configuration changed, drop that mesh
@@ -1195,38 +1258,30 @@ void VoxelLodTerrain::_process() {
 
 			const VoxelMesher::Output mesh_data = ob.data.smooth_surfaces;
 
-			Ref<ArrayMesh> mesh = build_mesh(
-					mesh_data.surfaces,
-					mesh_data.primitive_type,
-					mesh_data.compression_flags,
-					_material);
+			Ref<ArrayMesh> mesh = build_mesh(mesh_data.packed_surfaces, _material);
 
-			bool has_collision = _generate_collisions;
-			if (has_collision && _collision_lod_count != -1) {
-				has_collision = ob.lod < _collision_lod_count;
+			// Creating the shape is where the physics engine builds its acceleration structure
+			const uint64_t collision_time_before = OS::get_singleton()->get_ticks_usec();
+			Ref<Shape3D> collision_shape = create_collision_shape(ob.data.collision_faces);
+			if (collision_shape.is_valid()) {
+				_mesh_upload_scheduler.add_collision_shape_time(OS::get_singleton()->get_ticks_usec() - collision_time_before);
 			}
 
-			block->set_mesh(mesh, this, has_collision, mesh_data.surfaces, get_tree()->is_debugging_collisions_hint());
+			block->set_mesh(mesh, this, collision_shape, get_tree()->is_debugging_collisions_hint());
+			block->pending_edit_mesh_update = false;
 
 			{
 				VOXEL_PROFILE_SCOPE(profile_process_receive_mesh_updates_block_update_transitions);
 				for (unsigned int dir = 0; dir < mesh_data.transition_surfaces.size(); ++dir) {
 
-					Ref<ArrayMesh> transition_mesh = build_mesh(
-							mesh_data.transition_surfaces[dir],
-							mesh_data.primitive_type,
-							mesh_data.compression_flags,
-							_material);
+					Ref<ArrayMesh> transition_mesh = build_mesh(mesh_data.packed_transition_surfaces[dir], _material);
 
 					block->set_transition_mesh(transition_mesh, dir);
 				}
 			}
 		}
 
-		{
-			VOXEL_PROFILE_SCOPE(profile_process_receive_mesh_updates_shift_up);
-			shift_up(_blocks_pending_main_thread_update, queue_index);
-		}
+		_mesh_upload_scheduler.end_frame();
 	}
 
 	_stats.time_process_update_responses = profiling_clock.restart();
@@ -1247,6 +1302,7 @@ void VoxelLodTerrain::flush_pending_lod_edits() {
 				if (block->is_visible()) {
 					// Schedule an update
 					block->set_mesh_state(VoxelBlock::MESH_UPDATE_NOT_SENT);
+					block->pending_edit_mesh_update = true;
 					blocks_pending_update.push_back(block->position);
 				} else {
 					// Just mark it as needing update, so the visibility system will schedule its update when needed
@@ -1304,7 +1360,7 @@ void VoxelLodTerrain::flush_pending_lod_edits() {
 			// Update lower LOD
 			// This must always be done after an edit before it gets saved, otherwise LODs won't match and it will look ugly.
 			// TODO Try to narrow to edited region instead of taking whole block
-			src_block->voxels->downscale_to(**dst_block->voxels, Vector3i(), src_block->voxels->get_size(), rel * half_bs);
+			src_block->voxels->downscale_to(dst_block->get_voxels_for_write(), Vector3i(), src_block->voxels->get_size(), rel * half_bs);
 		}
 
 		src_lod.blocks_pending_lodding.clear();
@@ -1322,9 +1378,18 @@ struct ScheduleSaveAction {
 	std::vector<VoxelDataLoader::InputBlock> &blocks_to_save;
 	std::vector<Ref<ShaderMaterial> > &shader_materials;
 	bool with_copy;
+	// If set, blocks are kept in that cache after being saved
+	VoxelBlockCache *cache;
 
 	void operator()(VoxelBlock *block) {
 
+		if (cache != nullptr) {
+			// Modified blocks are saved without copy, and meshing tasks may still be reading voxels,
+			// so the cache needs its own, because it compresses them
+			cache->put(block->position, block->lod_index,
+					(block->is_modified() && !with_copy) || block->are_voxels_shared() ? block->voxels->duplicate() : block->voxels);
+		}
+
 		Ref<ShaderMaterial> sm = block->get_shader_material();
 		if (sm.is_valid()) {
 			shader_materials.push_back(sm);
@@ -1354,7 +1419,7 @@ void VoxelLodTerrain::immerge_block(Vector3i block_pos, int lod_index) {
 
 	Lod &lod = _lods[lod_index];
 
-	lod.map->remove_block(block_pos, ScheduleSaveAction{ _blocks_to_save, _shader_material_pool, false });
+	lod.map->remove_block(block_pos, ScheduleSaveAction{ _blocks_to_save, _shader_material_pool, false, &_block_cache });
 
 	lod.loading_blocks.erase(block_pos);
 
@@ -1374,7 +1439,7 @@ void VoxelLodTerrain::save_all_modified_blocks(bool with_copy) {
 
 	for (int i = 0; i < _lod_count; ++i) {
 		// That may cause a stutter, so should be used when the player won't notice
-		_lods[i].map->for_all_blocks(ScheduleSaveAction{ _blocks_to_save, _shader_material_pool, with_copy });
+		_lods[i].map->for_all_blocks(ScheduleSaveAction{ _blocks_to_save, _shader_material_pool, with_copy, nullptr });
 	}
 
 	// And flush immediately
@@ -1522,11 +1587,13 @@ Dictionary VoxelLodTerrain::get_statistics() const {
 	d["time_request_blocks_to_update"] = _stats.time_request_blocks_to_update;
 	d["time_process_update_responses"] = _stats.time_process_update_responses;
 
-	d["remaining_main_thread_blocks"] = (int)_blocks_pending_main_thread_update.size();
+	d["remaining_main_thread_blocks"] = _mesh_upload_scheduler.size();
+	d["mesh_upload"] = _mesh_upload_scheduler.to_dictionary();
 	d["dropped_block_loads"] = _stats.dropped_block_loads;
 	d["dropped_block_meshs"] = _stats.dropped_block_meshs;
 	d["updated_blocks"] = _stats.updated_blocks;
 	d["blocked_lods"] = _stats.blocked_lods;
+	d["block_cache"] = _block_cache.to_dictionary();
 
 	return d;
 }
@@ -1652,6 +1719,14 @@ void VoxelLodTerrain::_bind_methods() {
 
 	ClassDB::bind_method(D_METHOD("get_collision_lod_count"), &VoxelLodTerrain::get_collision_lod_count);
 	ClassDB::bind_method(D_METHOD("set_collision_lod_count", "count"), &VoxelLodTerrain::set_collision_lod_count);
+	ClassDB::bind_method(D_METHOD("get_collision_max_triangles"), &VoxelLodTerrain::get_collision_max_triangles);
+	ClassDB::bind_method(D_METHOD("set_collision_max_triangles", "max_triangles"), &VoxelLodTerrain::set_collision_max_triangles);
+
+	ClassDB::bind_method(D_METHOD("set_save_channels", "channels_mask"), &VoxelLodTerrain::set_save_channels);
+	ClassDB::bind_method(D_METHOD("get_save_channels"), &VoxelLodTerrain::get_save_channels);
+
+	ClassDB::bind_method(D_METHOD("set_block_cache_max_memory", "bytes"), &VoxelLodTerrain::set_block_cache_max_memory);
+	ClassDB::bind_method(D_METHOD("get_block_cache_max_memory"), &VoxelLodTerrain::get_block_cache_max_memory);
 
 	ClassDB::bind_method(D_METHOD("get_viewer_path"), &VoxelLodTerrain::get_viewer_path);
 	ClassDB::bind_method(D_METHOD("set_viewer_path", "path"), &VoxelLodTerrain::set_viewer_path);
@@ -1685,6 +1760,10 @@ void VoxelLodTerrain::_bind_methods() {
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "material", PROPERTY_HINT_RESOURCE_TYPE, "Material"), "set_material", "get_material");
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "generate_collisions"), "set_generate_collisions", "get_generate_collisions");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "collision_lod_count"), "set_collision_lod_count", "get_collision_lod_count");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "collision_max_triangles"), "set_collision_max_triangles", "get_collision_max_triangles");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "save_channels", PROPERTY_HINT_FLAGS, VoxelBuffer::CHANNEL_ID_HINT_STRING),
+			"set_save_channels", "get_save_channels");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "block_cache_max_memory"), "set_block_cache_max_memory", "get_block_cache_max_memory");
 }
 
 void VoxelLodTerrain::_b_save_all_modified_blocks() {
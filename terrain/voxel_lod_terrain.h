@@ -2,8 +2,10 @@
 #define VOXEL_LOD_TERRAIN_HPP
 
 #include "lod_octree.h"
+#include "voxel_block_cache.h"
 #include "voxel_data_loader.h"
 #include "voxel_mesh_updater.h"
+#include "voxel_mesh_upload_scheduler.h"
 #include <core/set.h>
 #include <scene/3d/node_3d.h>
 
@@ -48,9 +50,23 @@ public:
 	void set_collision_lod_count(int lod_count);
 	int get_collision_lod_count() const;
 
+	// Collision meshes of each block are simplified to have at most this amount of triangles, whatever their LOD.
+	// 0 means render triangles are used as they are.
+	void set_collision_max_triangles(int max_triangles);
+	int get_collision_max_triangles() const;
+
+	// Channels loaded and saved in addition to those meshers use, as a mask of channel bits.
+	// Edits made in other channels are lost when blocks get unloaded.
+	void set_save_channels(int channels_mask);
+	int get_save_channels() const;
+
 	void set_viewer_path(NodePath path);
 	NodePath get_viewer_path() const;
 
+	// How much memory can be used to keep unloaded blocks, in case they are needed again soon
+	void set_block_cache_max_memory(int bytes);
+	int get_block_cache_max_memory() const;
+
 	int get_block_region_extent() const;
 	Vector3 voxel_to_block_position(Vector3 vpos, int lod_index) const;
 
@@ -112,6 +128,7 @@ private:
 	void flush_pending_lod_edits();
 	void save_all_modified_blocks(bool with_copy);
 	void send_block_data_requests();
+	uint32_t get_streamed_channels_mask() const;
 
 	void add_transition_update(VoxelBlock *block);
 	void add_transition_updates_around(Vector3i block_pos, int lod_index);
@@ -136,9 +153,14 @@ private:
 	Ref<VoxelStream> _stream;
 	VoxelDataLoader *_stream_thread = nullptr;
 	VoxelMeshUpdater *_block_updater = nullptr;
-	std::vector<VoxelMeshUpdater::OutputBlock> _blocks_pending_main_thread_update;
+	VoxelMeshUploadScheduler _mesh_upload_scheduler;
 	std::vector<VoxelDataLoader::InputBlock> _blocks_to_save;
 
+	// Recently unloaded blocks, of all LODs
+	VoxelBlockCache _block_cache;
+	// Blocks taken from the cache, handled with the next load responses
+	std::vector<VoxelDataLoader::OutputBlock> _cached_blocks_to_apply;
+
 	// Only populated and then cleared inside _process, so lifetime of pointers should be valid
 	std::vector<VoxelBlock *> _blocks_pending_transition_update;
 
@@ -147,6 +169,8 @@ private:
 
 	bool _generate_collisions = true;
 	int _collision_lod_count = -1;
+	unsigned int _collision_max_triangles = 0;
+	uint32_t _save_channels = 0;
 
 	// Each LOD works in a set of coordinates spanning 2x more voxels the higher their index is
 	struct Lod {
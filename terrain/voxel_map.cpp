@@ -2,10 +2,16 @@
 #include "../cube_tables.h"
 #include "voxel_block.h"
 
+#include "core/hash_map.h"
 #include "core/os/os.h"
 
 namespace Voxel {
 
+namespace {
+// 64 blocks in each direction, which already takes 2 MB of pointers
+const unsigned int MAX_WINDOW_SIZE_PO2 = 6;
+} // namespace
+
 VoxelMap::VoxelMap() :
 		_last_accessed_block(NULL) {
 
@@ -49,6 +55,45 @@ unsigned int VoxelMap::get_lod_index() const {
 	return _lod_index;
 }
 
+void VoxelMap::set_dense_window_extent(int extent_in_blocks) {
+	ERR_FAIL_COND(extent_in_blocks < 0);
+
+	// The box is centered on the viewer. When it moves, blocks leaving the box are unloaded a bit after new ones
+	// start loading, so there is a margin. Blocks still overlapping don't break anything, they go in the hashmap.
+	unsigned int size_po2 = 0;
+	if (extent_in_blocks > 0) {
+		const unsigned int size = next_power_of_2(2 * extent_in_blocks + 2);
+		while ((1u << size_po2) < size) {
+			++size_po2;
+		}
+		if (size_po2 > MAX_WINDOW_SIZE_PO2) {
+			// Too big to be worth it
+			size_po2 = 0;
+		}
+	}
+
+	if (size_po2 == _window_size_po2) {
+		return;
+	}
+
+	// Blocks are not moved, only the way they are found changes.
+	// Temporarily put all of them in the hashmap, and re-add them with the new layout.
+	std::vector<VoxelBlock *> blocks;
+	for_all_blocks([&blocks](VoxelBlock *block) {
+		blocks.push_back(block);
+	});
+	_blocks.clear();
+	_window_blocks.clear();
+	_window_block_count = 0;
+
+	_window_size_po2 = size_po2;
+	_window_mask = (1 << size_po2) - 1;
+
+	for (unsigned int i = 0; i < blocks.size(); ++i) {
+		set_block(blocks[i]->position, blocks[i]);
+	}
+}
+
 int VoxelMap::get_voxel(Vector3i pos, unsigned int c) const {
 	Vector3i bpos = voxel_to_block(pos);
 	const VoxelBlock *block = get_block(bpos);
@@ -80,7 +125,7 @@ VoxelBlock *VoxelMap::get_or_create_block_at_voxel_pos(Vector3i pos) {
 void VoxelMap::set_voxel(int value, Vector3i pos, unsigned int c) {
 
 	VoxelBlock *block = get_or_create_block_at_voxel_pos(pos);
-	block->voxels->set_voxel(value, to_local(pos), c);
+	block->get_voxels_for_write().set_voxel(value, to_local(pos), c);
 }
 
 float VoxelMap::get_voxel_f(Vector3i pos, unsigned int c) const {
@@ -98,7 +143,7 @@ void VoxelMap::set_voxel_f(real_t value, Vector3i pos, unsigned int c) {
 
 	VoxelBlock *block = get_or_create_block_at_voxel_pos(pos);
 	Vector3i lpos = to_local(pos);
-	block->voxels->set_voxel_f(value, lpos.x, lpos.y, lpos.z, c);
+	block->get_voxels_for_write().set_voxel_f(value, lpos.x, lpos.y, lpos.z, c);
 }
 
 void VoxelMap::set_default_voxel(int value, unsigned int channel) {
@@ -115,27 +160,19 @@ VoxelBlock *VoxelMap::get_block(Vector3i bpos) {
 	if (_last_accessed_block && _last_accessed_block->position == bpos) {
 		return _last_accessed_block;
 	}
-	VoxelBlock **p = _blocks.getptr(bpos);
-	if (p) {
-		_last_accessed_block = *p;
-		CRASH_COND(_last_accessed_block == NULL); // The map should not contain null blocks
-		return _last_accessed_block;
+	VoxelBlock *block = find_block(bpos);
+	if (block) {
+		_last_accessed_block = block;
 	}
-	return NULL;
+	return block;
 }
 
 const VoxelBlock *VoxelMap::get_block(Vector3i bpos) const {
 	if (_last_accessed_block && _last_accessed_block->position == bpos) {
 		return _last_accessed_block;
 	}
-	const VoxelBlock *const *p = _blocks.getptr(bpos);
-	if (p) {
-		// TODO This function can't cache _last_accessed_block, because it's const, so repeated accesses are hashing again...
-		const VoxelBlock *block = *p;
-		CRASH_COND(block == NULL); // The map should not contain null blocks
-		return block;
-	}
-	return NULL;
+	// TODO This function can't cache _last_accessed_block, because it's const, so repeated accesses are hashing again...
+	return find_block(bpos);
 }
 
 void VoxelMap::set_block(Vector3i bpos, VoxelBlock *block) {
@@ -144,11 +181,56 @@ void VoxelMap::set_block(Vector3i bpos, VoxelBlock *block) {
 	if (_last_accessed_block == NULL || _last_accessed_block->position == bpos) {
 		_last_accessed_block = block;
 	}
+
+	// Neighbors are looked up once here, rather than every time we need to know if a block is surrounded
+	block->reset_neighbors_mask();
+	for (unsigned int i = 0; i < Cube::MOORE_NEIGHBORING_3D_COUNT; ++i) {
+		const Vector3i offset = Cube::g_moore_neighboring_3d[i];
+		VoxelBlock *neighbor = find_block(bpos + offset);
+		if (neighbor != NULL) {
+			block->set_neighbor_present(offset, true);
+			neighbor->set_neighbor_present(-offset, true);
+		}
+	}
+
+	if (_window_size_po2 != 0) {
+		if (_window_blocks.size() == 0) {
+			_window_blocks.resize(1 << (3 * _window_size_po2), NULL);
+		}
+		VoxelBlock *&cell = _window_blocks[get_window_index(bpos)];
+		if (cell == NULL) {
+			cell = block;
+			++_window_block_count;
+			return;
+		}
+		// Another block wrapping to the same cell is still loaded
+		CRASH_COND(cell->position == bpos);
+	}
+
 	_blocks.set(bpos, block);
 }
 
-void VoxelMap::remove_block_internal(Vector3i bpos) {
-	// This function assumes the block is already freed
+void VoxelMap::remove_block_internal(Vector3i bpos, VoxelBlock *block) {
+	if (_last_accessed_block == block) {
+		_last_accessed_block = NULL;
+	}
+
+	for (unsigned int i = 0; i < Cube::MOORE_NEIGHBORING_3D_COUNT; ++i) {
+		const Vector3i offset = Cube::g_moore_neighboring_3d[i];
+		if (block->get_neighbors_mask() & (1 << VoxelBlock::get_neighbor_bit_index(offset))) {
+			VoxelBlock *neighbor = find_block(bpos + offset);
+			CRASH_COND(neighbor == NULL);
+			neighbor->set_neighbor_present(-offset, false);
+		}
+	}
+	if (_window_blocks.size() != 0) {
+		VoxelBlock *&cell = _window_blocks[get_window_index(bpos)];
+		if (cell == block) {
+			cell = NULL;
+			--_window_block_count;
+			return;
+		}
+	}
 	_blocks.erase(bpos);
 }
 
@@ -165,11 +247,15 @@ VoxelBlock *VoxelMap::set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer) {
 }
 
 bool VoxelMap::has_block(Vector3i pos) const {
-	return /*(_last_accessed_block != NULL && _last_accessed_block->pos == pos) ||*/ _blocks.has(pos);
+	return /*(_last_accessed_block != NULL && _last_accessed_block->pos == pos) ||*/ find_block(pos) != NULL;
 }
 
 bool VoxelMap::is_block_surrounded(Vector3i pos) const {
-	// TODO If that check proves to be too expensive with all blocks we deal with, cache it in VoxelBlocks
+	const VoxelBlock *block = get_block(pos);
+	if (block != NULL) {
+		return block->is_surrounded();
+	}
+	// The block itself is not loaded, so nothing holds the state of its neighbors
 	for (unsigned int i = 0; i < Cube::MOORE_NEIGHBORING_3D_COUNT; ++i) {
 		Vector3i bpos = pos + Cube::g_moore_neighboring_3d[i];
 		if (!has_block(bpos)) {
@@ -181,40 +267,38 @@ bool VoxelMap::is_block_surrounded(Vector3i pos) const {
 
 void VoxelMap::get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask) {
 
-	Vector3i max_pos = min_pos + dst_buffer.get_size();
+	const Vector3i max_pos = min_pos + dst_buffer.get_size();
+	ERR_FAIL_COND(dst_buffer.get_size().volume() == 0);
 
-	Vector3i min_block_pos = voxel_to_block(min_pos);
-	Vector3i max_block_pos = voxel_to_block(max_pos - Vector3i(1, 1, 1)) + Vector3i(1, 1, 1);
-	// TODO Why is this function limited by this check?
-	ERR_FAIL_COND((max_block_pos - min_block_pos) != Vector3i(3, 3, 3));
+	const Vector3i min_block_pos = voxel_to_block(min_pos);
+	const Vector3i max_block_pos = voxel_to_block(max_pos - Vector3i(1, 1, 1)) + Vector3i(1, 1, 1);
 
 	const Vector3i block_size_v(_block_size, _block_size, _block_size);
 
-	for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+	// Each block is looked up once, and all requested channels are copied from it
+	Vector3i bpos;
+	for (bpos.z = min_block_pos.z; bpos.z < max_block_pos.z; ++bpos.z) {
+		for (bpos.x = min_block_pos.x; bpos.x < max_block_pos.x; ++bpos.x) {
+			for (bpos.y = min_block_pos.y; bpos.y < max_block_pos.y; ++bpos.y) {
 
-		if (((1 << channel) & channels_mask) == 0) {
-			continue;
-		}
+				const VoxelBlock *block = get_block(bpos);
+				const Vector3i offset = block_to_voxel(bpos);
 
-		Vector3i bpos;
-		for (bpos.z = min_block_pos.z; bpos.z < max_block_pos.z; ++bpos.z) {
-			for (bpos.x = min_block_pos.x; bpos.x < max_block_pos.x; ++bpos.x) {
-				for (bpos.y = min_block_pos.y; bpos.y < max_block_pos.y; ++bpos.y) {
+				for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+					if (((1 << channel) & channels_mask) == 0) {
+						continue;
+					}
 
-					VoxelBlock *block = get_block(bpos);
 					if (block) {
-
-						VoxelBuffer &src_buffer = **block->voxels;
-						Vector3i offset = block_to_voxel(bpos);
-						// Note: copy_from takes care of clamping the area if it's on an edge
-						dst_buffer.copy_from(src_buffer,
+						// Note: copy_from takes care of clamping the area if it's on an edge,
+						// and fills it if the source channel is uniform
+						dst_buffer.copy_from(**block->voxels,
 								min_pos - offset,
 								max_pos - offset,
 								offset - min_pos,
 								channel);
 
 					} else {
-						Vector3i offset = block_to_voxel(bpos);
 						dst_buffer.fill_area(
 								_default_voxel[channel],
 								offset - min_pos,
@@ -227,21 +311,36 @@ void VoxelMap::get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsign
 	}
 }
 
-void VoxelMap::clear() {
-	const Vector3i *key = NULL;
-	while ((key = _blocks.next(key))) {
-		VoxelBlock *block_ptr = _blocks.get(*key);
-		if (block_ptr == NULL) {
-			OS::get_singleton()->printerr("Unexpected NULL in VoxelMap::clear()");
+void VoxelMap::get_neighborhood(Vector3i bpos, VoxelBufferNeighborhood &out_neighborhood) const {
+
+	out_neighborhood.create(_block_size_pow2, _default_voxel);
+
+	Vector3i offset;
+	for (offset.z = -1; offset.z <= 1; ++offset.z) {
+		for (offset.x = -1; offset.x <= 1; ++offset.x) {
+			for (offset.y = -1; offset.y <= 1; ++offset.y) {
+				const VoxelBlock *block = find_block(bpos + offset);
+				if (block != NULL) {
+					out_neighborhood.set_buffer(offset, block->voxels);
+				}
+			}
 		}
-		memdelete(block_ptr);
 	}
+}
+
+void VoxelMap::clear() {
+	for_all_blocks([](VoxelBlock *block_ptr) {
+		memdelete(block_ptr);
+	});
 	_blocks.clear();
+	// Will be allocated again if blocks get added
+	_window_blocks.clear();
+	_window_block_count = 0;
 	_last_accessed_block = NULL;
 }
 
 int VoxelMap::get_block_count() const {
-	return _blocks.size();
+	return _window_block_count + _blocks.size();
 }
 
 bool VoxelMap::is_area_fully_loaded(const Rect3i voxels_box) const {
@@ -251,6 +350,93 @@ bool VoxelMap::is_area_fully_loaded(const Rect3i voxels_box) const {
 	});
 }
 
+namespace {
+
+template <typename Map_T>
+void benchmark_block_storage(Map_T &map, const std::vector<Vector3i> &positions, Dictionary &out_results, String prefix) {
+	// Values are never dereferenced
+	VoxelBlock *const dummy_block = reinterpret_cast<VoxelBlock *>(0x10);
+	uint64_t found_count = 0;
+
+	uint64_t time_before = OS::get_singleton()->get_ticks_usec();
+	for (unsigned int i = 0; i < positions.size(); ++i) {
+		map.set(positions[i], dummy_block);
+	}
+	out_results[prefix + "insert"] = OS::get_singleton()->get_ticks_usec() - time_before;
+
+	// Same as checking if blocks are surrounded, which includes lookups of missing blocks at the edges
+	time_before = OS::get_singleton()->get_ticks_usec();
+	for (unsigned int i = 0; i < positions.size(); ++i) {
+		for (unsigned int j = 0; j < Cube::MOORE_NEIGHBORING_3D_COUNT; ++j) {
+			if (map.getptr(positions[i] + Cube::g_moore_neighboring_3d[j]) != nullptr) {
+				++found_count;
+			}
+		}
+	}
+	out_results[prefix + "lookup"] = OS::get_singleton()->get_ticks_usec() - time_before;
+
+	time_before = OS::get_singleton()->get_ticks_usec();
+	for (unsigned int i = 0; i < positions.size(); ++i) {
+		map.erase(positions[i]);
+		map.set(positions[i], dummy_block);
+	}
+	out_results[prefix + "erase_insert"] = OS::get_singleton()->get_ticks_usec() - time_before;
+
+	out_results[prefix + "found"] = found_count;
+}
+
+} // namespace
+
+Dictionary VoxelMap::debug_benchmark_block_storage(int block_count) const {
+	Dictionary results;
+	ERR_FAIL_COND_V(block_count <= 0, results);
+
+	// A cube of blocks centered on the origin, like the area around a viewer
+	const int size = Math::ceil(Math::pow(block_count, 1.0 / 3.0));
+	std::vector<Vector3i> positions;
+	Vector3i pos;
+	for (pos.z = 0; pos.z < size; ++pos.z) {
+		for (pos.x = 0; pos.x < size; ++pos.x) {
+			for (pos.y = 0; pos.y < size; ++pos.y) {
+				positions.push_back(pos - Vector3i(size / 2));
+			}
+		}
+	}
+
+	{
+		HashMap<Vector3i, VoxelBlock *, Vector3iHasher> map;
+		benchmark_block_storage(map, positions, results, "hash_map_");
+
+		uint64_t time_before = OS::get_singleton()->get_ticks_usec();
+		unsigned int count = 0;
+		const Vector3i *key = NULL;
+		while ((key = map.next(key))) {
+			if (map.get(*key) != nullptr) {
+				++count;
+			}
+		}
+		results["hash_map_iterate"] = OS::get_singleton()->get_ticks_usec() - time_before;
+		CRASH_COND(count != positions.size());
+	}
+	{
+		FlatHashMap<Vector3i, VoxelBlock *, Vector3iMortonHasher> map;
+		benchmark_block_storage(map, positions, results, "flat_hash_map_");
+
+		uint64_t time_before = OS::get_singleton()->get_ticks_usec();
+		unsigned int count = 0;
+		map.for_each([&count](const Vector3i &bpos, VoxelBlock *block) {
+			if (block != nullptr) {
+				++count;
+			}
+		});
+		results["flat_hash_map_iterate"] = OS::get_singleton()->get_ticks_usec() - time_before;
+		CRASH_COND(count != positions.size());
+	}
+
+	results["block_count"] = (int)positions.size();
+	return results;
+}
+
 void VoxelMap::_bind_methods() {
 
 	ClassDB::bind_method(D_METHOD("get_voxel", "x", "y", "z", "c"), &VoxelMap::_b_get_voxel, DEFVAL(0));
@@ -267,11 +453,14 @@ void VoxelMap::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("voxel_to_block", "voxel_pos"), &VoxelMap::_b_voxel_to_block);
 	ClassDB::bind_method(D_METHOD("block_to_voxel", "block_pos"), &VoxelMap::_b_block_to_voxel);
 	ClassDB::bind_method(D_METHOD("get_block_size"), &VoxelMap::get_block_size);
+
+	ClassDB::bind_method(D_METHOD("debug_benchmark_block_storage", "block_count"), &VoxelMap::debug_benchmark_block_storage);
 }
 
 void VoxelMap::_b_get_buffer_copy(Vector3 pos, Ref<VoxelBuffer> dst_buffer_ref, unsigned int channel) {
 	ERR_FAIL_COND(dst_buffer_ref.is_null());
-	get_buffer_copy(Vector3i(pos), **dst_buffer_ref, channel);
+	ERR_FAIL_INDEX(channel, VoxelBuffer::MAX_CHANNELS);
+	get_buffer_copy(Vector3i(pos), **dst_buffer_ref, 1 << channel);
 }
 
 }
@@ -2,9 +2,10 @@
 #define VOXEL_MAP_H
 
 #include "../util/fixed_array.h"
+#include "../util/flat_hash_map.h"
+#include "../voxel_buffer_neighborhood.h"
 #include "voxel_block.h"
 
-#include <core/hash_map.h>
 #include <scene/main/node.h>
 
 namespace Voxel {
@@ -47,6 +48,12 @@ public:
 	void set_lod_index(int lod_index);
 	unsigned int get_lod_index() const;
 
+	// Terrains keep blocks loaded in a box around the viewer. When the extent of that box is known,
+	// blocks within it are stored in a dense grid which wraps around (as a 3D ring buffer),
+	// so finding them doesn't need hashing, and moving the box doesn't need to move any block.
+	// Blocks which don't fit in the grid are still stored in a hashmap. 0 disables the grid.
+	void set_dense_window_extent(int extent_in_blocks);
+
 	int get_voxel(Vector3i pos, unsigned int c = 0) const;
 	void set_voxel(int value, Vector3i pos, unsigned int c = 0);
 
@@ -57,8 +64,12 @@ public:
 	int get_default_voxel(unsigned int channel = 0);
 
 	// Gets a copy of all voxels in the area starting at min_pos having the same size as dst_buffer.
+	// The area can have any size. Voxels of missing blocks are set to the default value.
 	void get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask = 1);
 
+	// References the voxels of a block and its neighbors, so they can be read without being copied.
+	void get_neighborhood(Vector3i bpos, VoxelBufferNeighborhood &out_neighborhood) const;
+
 	// Moves the given buffer into a block of the map. The buffer is referenced, no copy is made.
 	VoxelBlock *set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer);
 
@@ -71,13 +82,11 @@ public:
 		if (_last_accessed_block && _last_accessed_block->position == bpos) {
 			_last_accessed_block = NULL;
 		}
-		VoxelBlock **pptr = _blocks.getptr(bpos);
-		if (pptr) {
-			VoxelBlock *block = *pptr;
-			ERR_FAIL_COND(block == NULL);
+		VoxelBlock *block = find_block(bpos);
+		if (block) {
 			pre_delete(block);
+			remove_block_internal(bpos, block);
 			memdelete(block);
-			remove_block_internal(bpos);
 		}
 	}
 
@@ -93,21 +102,53 @@ public:
 
 	template <typename Op_T>
 	void for_all_blocks(Op_T op) {
-		const Vector3i *key = NULL;
-		while ((key = _blocks.next(key))) {
-			VoxelBlock *block = _blocks.get(*key);
-			if (block != NULL) {
-				op(block);
+		if (_window_block_count > 0) {
+			for (unsigned int i = 0; i < _window_blocks.size(); ++i) {
+				VoxelBlock *block = _window_blocks[i];
+				if (block != NULL) {
+					op(block);
+				}
 			}
 		}
+		_blocks.for_each([&op](const Vector3i &bpos, VoxelBlock *block) {
+			op(block);
+		});
 	}
 
 	bool is_area_fully_loaded(const Rect3i voxels_box) const;
 
+	// Compares block storage with Godot's HashMap, using the same access patterns as terrains.
+	// Returns timings in microseconds.
+	Dictionary debug_benchmark_block_storage(int block_count) const;
+
 private:
+	_FORCE_INLINE_ unsigned int get_window_index(Vector3i bpos) const {
+		return ((bpos.z & _window_mask) << (2 * _window_size_po2)) |
+			   ((bpos.x & _window_mask) << _window_size_po2) |
+			   (bpos.y & _window_mask);
+	}
+
+	_FORCE_INLINE_ VoxelBlock *find_block(Vector3i bpos) const {
+		if (_window_blocks.size() != 0) {
+			VoxelBlock *block = _window_blocks[get_window_index(bpos)];
+			if (block != NULL && block->position == bpos) {
+				return block;
+			}
+			if (_blocks.size() == 0) {
+				return NULL;
+			}
+		}
+		VoxelBlock *const *p = _blocks.getptr(bpos);
+		if (p) {
+			CRASH_COND(*p == NULL); // The map should not contain null blocks
+			return *p;
+		}
+		return NULL;
+	}
+
 	void set_block(Vector3i bpos, VoxelBlock *block);
 	VoxelBlock *get_or_create_block_at_voxel_pos(Vector3i pos);
-	void remove_block_internal(Vector3i bpos);
+	void remove_block_internal(Vector3i bpos, VoxelBlock *block);
 
 	void set_block_size_pow2(unsigned int p);
 
@@ -130,9 +171,16 @@ private:
 	// Voxel values that will be returned if access is out of map bounds
 	FixedArray<uint64_t, VoxelBuffer::MAX_CHANNELS> _default_voxel;
 
-	// TODO Consider using OAHashMap
-	// Blocks stored with a spatial hash in all 3D directions
-	HashMap<Vector3i, VoxelBlock *, Vector3iHasher> _blocks;
+	// Blocks stored with a spatial hash in all 3D directions.
+	// Lookups happen a lot (neighbor checks, copies for meshing), so they are kept in a flat table.
+	FlatHashMap<Vector3i, VoxelBlock *, Vector3iMortonHasher> _blocks;
+
+	// Dense grid of blocks, indexed by position wrapped within its size. Allocated when the first block is set.
+	// Cells can hold blocks from any position, so their position must be checked.
+	std::vector<VoxelBlock *> _window_blocks;
+	unsigned int _window_size_po2 = 0;
+	unsigned int _window_mask = 0;
+	unsigned int _window_block_count = 0;
 
 	// Voxel access will most frequently be in contiguous areas, so the same blocks are accessed.
 	// To prevent too much hashing, this reference is checked before.
@@ -1,6 +1,7 @@
 #include "voxel_mesh_updater.h"
 #include "../meshers/transvoxel/voxel_mesher_transvoxel.h"
 #include "../util/utility.h"
+#include "voxel_collision_builder.h"
 #include "voxel_lod_terrain.h"
 #include <core/os/os.h>
 
@@ -13,22 +14,22 @@ VoxelMeshUpdater::VoxelMeshUpdater(unsigned int thread_count, MeshingParams para
 	Ref<VoxelMesherBlocky> blocky_mesher;
 	Ref<VoxelMesherTransvoxel> smooth_mesher;
 
-	_minimum_padding = 0;
-	_maximum_padding = 0;
-
 	if (params.library.is_valid()) {
 		blocky_mesher.instance();
 		blocky_mesher->set_library(params.library);
 		blocky_mesher->set_occlusion_enabled(params.baked_ao);
 		blocky_mesher->set_occlusion_darkness(params.baked_ao_darkness);
-		_minimum_padding = max(_minimum_padding, blocky_mesher->get_minimum_padding());
-		_maximum_padding = max(_maximum_padding, blocky_mesher->get_maximum_padding());
 	}
 
 	if (params.smooth_surface) {
 		smooth_mesher.instance();
-		_minimum_padding = max(_minimum_padding, smooth_mesher->get_minimum_padding());
-		_maximum_padding = max(_maximum_padding, smooth_mesher->get_maximum_padding());
+	}
+
+	if (blocky_mesher.is_valid()) {
+		_used_channels_mask |= blocky_mesher->get_used_channels_mask();
+	}
+	if (smooth_mesher.is_valid()) {
+		_used_channels_mask |= smooth_mesher->get_used_channels_mask();
 	}
 
 	FixedArray<Mgr::BlockProcessingFunc, VoxelConstants::MAX_LOD> processors;
@@ -75,15 +76,24 @@ void VoxelMeshUpdater::process_blocks_thread_func(
 		const InputBlockData &block = ib.data;
 		OutputBlockData &output = outputs[i].data;
 
-		CRASH_COND(block.voxels.is_null());
-
-		VoxelMesher::Input input = { **block.voxels, ib.lod };
+		CRASH_COND(block.neighborhood.get_central_buffer() == nullptr);
 
 		if (blocky_mesher.is_valid()) {
-			blocky_mesher->build(output.blocky_surfaces, input);
+			blocky_mesher->build_from_neighborhood(output.blocky_surfaces, block.neighborhood, ib.lod);
+			VoxelMesher::pack_surfaces(output.blocky_surfaces);
 		}
 		if (smooth_mesher.is_valid()) {
-			smooth_mesher->build(output.smooth_surfaces, input);
+			smooth_mesher->build_from_neighborhood(output.smooth_surfaces, block.neighborhood, ib.lod);
+			VoxelMesher::pack_surfaces(output.smooth_surfaces);
+		}
+
+		if (block.generate_collision) {
+			// Only the triangles are prepared here, the shape is created on the main thread
+			append_collision_faces(output.collision_faces, output.blocky_surfaces.surfaces);
+			append_collision_faces(output.collision_faces, output.smooth_surfaces.surfaces);
+			// Meshes are scaled with their LOD
+			const float block_size = block.neighborhood.get_block_size() << ib.lod;
+			simplify_collision_faces(output.collision_faces, block.collision_max_triangles, block_size);
 		}
 	}
 }
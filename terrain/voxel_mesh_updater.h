@@ -6,7 +6,7 @@
 #include <core/vector.h>
 
 #include "../meshers/blocky/voxel_mesher_blocky.h"
-#include "../voxel_buffer.h"
+#include "../voxel_buffer_neighborhood.h"
 
 #include "block_thread_manager.h"
 
@@ -15,12 +15,18 @@ namespace Voxel {
 class VoxelMeshUpdater {
 public:
 	struct InputBlockData {
-		Ref<VoxelBuffer> voxels;
+		// Voxels are gathered by meshers in their thread, with the padding they need
+		VoxelBufferNeighborhood neighborhood;
+		bool generate_collision = false;
+		// Collision is simplified to fit this amount of triangles, 0 means it uses render triangles as they are
+		unsigned int collision_max_triangles = 0;
 	};
 
 	struct OutputBlockData {
 		VoxelMesher::Output blocky_surfaces;
 		VoxelMesher::Output smooth_surfaces;
+		// Triangles of both outputs if collision was requested, three points each
+		Vector<Vector3> collision_faces;
 	};
 
 	struct MeshingParams {
@@ -43,8 +49,8 @@ public:
 	void push(const Input &input) { _mgr->push(input); }
 	void pop(Output &output) { _mgr->pop(output); }
 
-	int get_minimum_padding() const { return _minimum_padding; }
-	int get_maximum_padding() const { return _maximum_padding; }
+	// Channels read by the meshers
+	uint32_t get_used_channels_mask() const { return _used_channels_mask; }
 
 private:
 	void process_blocks_thread_func(const ArraySlice<InputBlock> inputs,
@@ -53,8 +59,7 @@ private:
 			Ref<VoxelMesher> smooth_mesher);
 
 	Mgr *_mgr = nullptr;
-	int _minimum_padding = 0;
-	int _maximum_padding = 0;
+	uint32_t _used_channels_mask = 0;
 };
 
 }
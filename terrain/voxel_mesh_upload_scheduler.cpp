@@ -0,0 +1,197 @@
+#include "voxel_mesh_upload_scheduler.h"
+#include "../util/utility.h"
+
+#include <core/engine.h>
+#include <core/os/os.h>
+
+namespace Voxel {
+
+namespace {
+// Used when the engine doesn't limit its framerate
+const unsigned int DEFAULT_TARGET_FPS = 60;
+// Frames can take a bit longer than the target before uploads get reduced, because frame times are noisy
+const unsigned int FRAME_TIME_TOLERANCE_PERCENT = 10;
+const uint64_t MIN_BUDGET_USEC = 1000;
+const uint64_t MAX_BUDGET_USEC = 8000;
+const uint64_t BUDGET_INCREMENT_USEC = 500;
+// Ignore frame times measured after a long pause, like loading or a breakpoint
+const uint64_t MAX_MEASURED_FRAME_TIME_USEC = 1000000;
+
+uint64_t get_target_frame_time_usec() {
+	const int fps = Engine::get_singleton()->get_target_fps();
+	return 1000000 / (fps > 0 ? fps : DEFAULT_TARGET_FPS);
+}
+} // namespace
+
+VoxelMeshUploadScheduler::VoxelMeshUploadScheduler() {
+	_budget_usec = (MIN_BUDGET_USEC + MAX_BUDGET_USEC) / 2;
+}
+
+unsigned int VoxelMeshUploadScheduler::get_block_priority(
+		Vector3i bpos, unsigned int lod_index, Vector3i viewer_block_pos, bool edited) {
+
+	if (edited) {
+		// Players expect to see their edits right away
+		return PRIORITY_EDIT;
+	}
+
+	// Distance from the viewer to the closest block of the area covered at LOD0
+	const Vector3i min_pos = bpos << lod_index;
+	const Vector3i max_pos = min_pos + Vector3i(1 << lod_index) - Vector3i(1);
+	int distance = 0;
+	for (unsigned int i = 0; i < Vector3i::AXIS_COUNT; ++i) {
+		distance = max(distance, min_pos[i] - viewer_block_pos[i]);
+		distance = max(distance, viewer_block_pos[i] - max_pos[i]);
+	}
+
+	// Each priority covers twice the distance of the previous one
+	unsigned int priority = PRIORITY_EDIT + 1;
+	while (distance > 0 && priority < PRIORITY_COUNT - 1) {
+		distance >>= 1;
+		++priority;
+	}
+	return priority;
+}
+
+void VoxelMeshUploadScheduler::push(const Block &block, unsigned int priority) {
+	ERR_FAIL_COND(priority >= PRIORITY_COUNT);
+	ERR_FAIL_COND(block.lod >= _latest_sequences.size());
+	Item item;
+	item.block = block;
+	item.push_time_usec = OS::get_singleton()->get_ticks_usec();
+	item.sequence = _next_sequence++;
+	_latest_sequences[block.lod].set(block.position, item.sequence);
+	_queues[priority].push_back(item);
+	++_size;
+}
+
+void VoxelMeshUploadScheduler::begin_frame() {
+	const uint64_t now = OS::get_singleton()->get_ticks_usec();
+
+	if (_frame_begin_time_usec != 0) {
+		_stats.frame_time_usec = now - _frame_begin_time_usec;
+
+		if (_stats.frame_time_usec < MAX_MEASURED_FRAME_TIME_USEC) {
+			const uint64_t target = get_target_frame_time_usec();
+
+			if (_stats.frame_time_usec > target + target * FRAME_TIME_TOLERANCE_PERCENT / 100) {
+				// Uploads might not be what made the frame slow, but they are what can be delayed.
+				// Back off quickly, and grow again slowly.
+				_budget_usec = max(MIN_BUDGET_USEC, _budget_usec / 2);
+
+			} else if (_budget_saturated) {
+				_budget_usec = MIN(MAX_BUDGET_USEC, _budget_usec + BUDGET_INCREMENT_USEC);
+			}
+		}
+	}
+
+	_frame_begin_time_usec = now;
+	_budget_saturated = false;
+
+	_stats.upload_time_usec = 0;
+	_stats.uploaded_blocks = 0;
+	_stats.max_wait_usec = 0;
+	_stats.total_wait_usec = 0;
+	_stats.superseded_blocks = 0;
+	_stats.collision_time_usec = 0;
+	_stats.collision_shapes = 0;
+}
+
+bool VoxelMeshUploadScheduler::pop(Block &out_block) {
+	if (_size == 0) {
+		return false;
+	}
+
+	const uint64_t now = OS::get_singleton()->get_ticks_usec();
+
+	if (_stats.uploaded_blocks > 0 && now - _frame_begin_time_usec >= _budget_usec) {
+		_budget_saturated = true;
+		return false;
+	}
+
+	for (unsigned int i = 0; i < _queues.size(); ++i) {
+		RingBuffer<Item> &queue = _queues[i];
+
+		while (!queue.empty()) {
+			Item &item = queue.front();
+			FlatHashMap<Vector3i, uint32_t, Vector3iMortonHasher> &latest_sequences = _latest_sequences[item.block.lod];
+			const uint32_t *latest_sequence = latest_sequences.getptr(item.block.position);
+			CRASH_COND(latest_sequence == nullptr);
+
+			if (*latest_sequence != item.sequence) {
+				// Uploading it would bring back geometry older than the mesh waiting elsewhere
+				queue.pop_front();
+				--_size;
+				++_stats.superseded_blocks;
+				continue;
+			}
+
+			latest_sequences.erase(item.block.position);
+
+			const uint64_t wait_time = now - item.push_time_usec;
+			out_block = item.block;
+			queue.pop_front();
+			--_size;
+
+			++_stats.uploaded_blocks;
+			_stats.total_wait_usec += wait_time;
+			_stats.max_wait_usec = max(_stats.max_wait_usec, wait_time);
+			return true;
+		}
+	}
+
+	// Only superseded meshes were left
+	CRASH_COND(_size != 0);
+	return false;
+}
+
+void VoxelMeshUploadScheduler::add_collision_shape_time(uint64_t usec) {
+	_stats.collision_time_usec += usec;
+	++_stats.collision_shapes;
+}
+
+void VoxelMeshUploadScheduler::end_frame() {
+	_stats.upload_time_usec = OS::get_singleton()->get_ticks_usec() - _frame_begin_time_usec;
+}
+
+void VoxelMeshUploadScheduler::clear() {
+	for (unsigned int i = 0; i < _queues.size(); ++i) {
+		_queues[i].clear();
+	}
+	for (unsigned int i = 0; i < _latest_sequences.size(); ++i) {
+		_latest_sequences[i].clear();
+	}
+	_size = 0;
+}
+
+Dictionary VoxelMeshUploadScheduler::to_dictionary() const {
+	const uint64_t now = OS::get_singleton()->get_ticks_usec();
+
+	Array queue_depths;
+	// Each queue is in push order, so the oldest block is at the front of one of them
+	uint64_t oldest_wait_usec = 0;
+	for (unsigned int i = 0; i < _queues.size(); ++i) {
+		const RingBuffer<Item> &queue = _queues[i];
+		queue_depths.append(queue.size());
+		if (!queue.empty()) {
+			oldest_wait_usec = max(oldest_wait_usec, now - queue.front().push_time_usec);
+		}
+	}
+
+	Dictionary d;
+	d["queue_depth"] = _size;
+	d["queue_depth_per_priority"] = queue_depths;
+	d["oldest_wait_usec"] = oldest_wait_usec;
+	d["budget_usec"] = _budget_usec;
+	d["frame_time_usec"] = _stats.frame_time_usec;
+	d["upload_time_usec"] = _stats.upload_time_usec;
+	d["uploaded_blocks"] = _stats.uploaded_blocks;
+	d["max_wait_usec"] = _stats.max_wait_usec;
+	d["superseded_blocks"] = _stats.superseded_blocks;
+	d["collision_time_usec"] = _stats.collision_time_usec;
+	d["collision_shapes"] = _stats.collision_shapes;
+	d["average_wait_usec"] = _stats.uploaded_blocks > 0 ? _stats.total_wait_usec / _stats.uploaded_blocks : 0;
+	return d;
+}
+
+}
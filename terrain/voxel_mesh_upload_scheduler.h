@@ -0,0 +1,92 @@
+#ifndef VOXEL_MESH_UPLOAD_SCHEDULER_H
+#define VOXEL_MESH_UPLOAD_SCHEDULER_H
+
+#include "../util/fixed_array.h"
+#include "../util/flat_hash_map.h"
+#include "../util/ring_buffer.h"
+#include "../voxel_constants.h"
+#include "voxel_mesh_updater.h"
+
+namespace Voxel {
+
+// Holds meshes produced by threads until they get uploaded on the main thread, and decides how many are uploaded per frame.
+// Meshes following an edit come first, then the closest to the viewer, then the oldest.
+// When a block gets a new mesh before the previous one was uploaded, the previous one is dropped.
+// The time given to uploads each frame adapts to measured frame times: it grows while frames stay within the target
+// duration and meshes are still waiting, and shrinks when frames take longer.
+// Not thread-safe, it is meant to be used from the main thread.
+class VoxelMeshUploadScheduler {
+public:
+	typedef VoxelMeshUpdater::OutputBlock Block;
+
+	static const unsigned int PRIORITY_EDIT = 0;
+	static const unsigned int PRIORITY_COUNT = 8;
+
+	struct Stats {
+		// Measured on the last frame
+		uint64_t frame_time_usec = 0;
+		uint64_t upload_time_usec = 0;
+		unsigned int uploaded_blocks = 0;
+		// Time spent in the queue by blocks uploaded during the last frame
+		uint64_t max_wait_usec = 0;
+		uint64_t total_wait_usec = 0;
+		// Meshes dropped because a more recent one of the same block was pushed
+		unsigned int superseded_blocks = 0;
+		// Part of the upload time spent creating collision shapes
+		uint64_t collision_time_usec = 0;
+		unsigned int collision_shapes = 0;
+	};
+
+	VoxelMeshUploadScheduler();
+
+	// Priority of the mesh of a block, from 0 (most urgent) to PRIORITY_COUNT - 1.
+	// The viewer position is in LOD0 block coordinates.
+	static unsigned int get_block_priority(Vector3i bpos, unsigned int lod_index, Vector3i viewer_block_pos, bool edited);
+
+	void push(const Block &block, unsigned int priority);
+
+	// Uploads of a frame must happen between these calls
+	void begin_frame();
+	void end_frame();
+
+	// Gets the next block to upload, or returns false if the time given to this frame is spent.
+	// At least one block is returned each frame, so the queue always progresses.
+	bool pop(Block &out_block);
+
+	// Reports time spent creating the collision shape of a popped block
+	void add_collision_shape_time(uint64_t usec);
+
+	void clear();
+
+	unsigned int size() const { return _size; }
+	uint64_t get_budget_usec() const { return _budget_usec; }
+	const Stats &get_stats() const { return _stats; }
+
+	Dictionary to_dictionary() const;
+
+private:
+	struct Item {
+		Block block;
+		uint64_t push_time_usec = 0;
+		uint32_t sequence = 0;
+	};
+
+	FixedArray<RingBuffer<Item>, PRIORITY_COUNT> _queues;
+	unsigned int _size = 0;
+
+	// Sequence number of the last mesh pushed for each block still in the queues, per LOD.
+	// Blocks can be in different queues over time, so older meshes could otherwise come out after newer ones.
+	FixedArray<FlatHashMap<Vector3i, uint32_t, Vector3iMortonHasher>, VoxelConstants::MAX_LOD> _latest_sequences;
+	uint32_t _next_sequence = 0;
+
+	uint64_t _budget_usec;
+	uint64_t _frame_begin_time_usec = 0;
+	// The whole budget was used and blocks were still waiting
+	bool _budget_saturated = false;
+
+	Stats _stats;
+};
+
+}
+
+#endif // VOXEL_MESH_UPLOAD_SCHEDULER_H
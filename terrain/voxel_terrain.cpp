@@ -4,6 +4,7 @@
 #include "../util/profiling_clock.h"
 #include "../util/utility.h"
 #include "voxel_block.h"
+#include "voxel_collision_builder.h"
 #include "voxel_map.h"
 
 #include <core/core_string_names.h>
@@ -11,9 +12,14 @@
 #include <core/os/os.h>
 #include <scene/3d/mesh_instance_3d.h>
 
+#include <algorithm>
+
 namespace Voxel {
 
-const uint32_t MAIN_THREAD_MESHING_BUDGET_MS = 8;
+// Limits memory used by prefetched blocks, including those being loaded
+const unsigned int MAX_PREFETCHED_BLOCKS = 1024;
+// How fast the estimated viewer velocity follows the actual one, between 0 and 1
+const float VIEWER_VELOCITY_SMOOTHING = 0.2f;
 
 VoxelTerrain::VoxelTerrain() {
 	// Note: don't do anything heavy in the constructor.
@@ -24,6 +30,7 @@ VoxelTerrain::VoxelTerrain() {
 
 	_view_distance_blocks = 8;
 	_last_view_distance_blocks = 0;
+	_map->set_dense_window_extent(_view_distance_blocks);
 
 	_stream_thread = nullptr;
 	_block_updater = nullptr;
@@ -217,6 +224,34 @@ void VoxelTerrain::set_generate_collisions(bool enabled) {
 	_generate_collisions = enabled;
 }
 
+void VoxelTerrain::set_collision_max_triangles(int max_triangles) {
+	_collision_max_triangles = MAX(max_triangles, 0);
+}
+
+int VoxelTerrain::get_collision_max_triangles() const {
+	return _collision_max_triangles;
+}
+
+void VoxelTerrain::set_save_channels(int channels_mask) {
+	_save_channels = channels_mask & VoxelBuffer::ALL_CHANNELS_MASK;
+}
+
+int VoxelTerrain::get_save_channels() const {
+	return _save_channels;
+}
+
+uint32_t VoxelTerrain::get_streamed_channels_mask() const {
+	// Meshers run on data from the stream, so they tell what is needed
+	if (_block_updater == nullptr) {
+		return VoxelBuffer::ALL_CHANNELS_MASK;
+	}
+	const uint32_t mesher_channels = _block_updater->get_used_channels_mask();
+	if (mesher_channels == 0) {
+		return VoxelBuffer::ALL_CHANNELS_MASK;
+	}
+	return mesher_channels | _save_channels;
+}
+
 int VoxelTerrain::get_view_distance() const {
 	return _view_distance_blocks * _map->get_block_size();
 }
@@ -227,6 +262,7 @@ void VoxelTerrain::set_view_distance(int distance_in_voxels) {
 	if (d != _view_distance_blocks) {
 		print_line(String("View distance changed from ") + String::num(_view_distance_blocks) + String(" blocks to ") + String::num(d));
 		_view_distance_blocks = d;
+		_map->set_dense_window_extent(_view_distance_blocks);
 		// Blocks too far away will be removed in _process, same for blocks to load
 	}
 }
@@ -239,6 +275,36 @@ NodePath VoxelTerrain::get_viewer_path() const {
 	return _viewer_path;
 }
 
+void VoxelTerrain::set_prefetch_time(float seconds) {
+	ERR_FAIL_COND(seconds < 0.f);
+	_prefetch_time = seconds;
+	if (_prefetch_time == 0.f) {
+		clear_prefetch();
+	}
+}
+
+float VoxelTerrain::get_prefetch_time() const {
+	return _prefetch_time;
+}
+
+void VoxelTerrain::set_prefetch_max_blocks_per_second(int count) {
+	ERR_FAIL_COND(count < 0);
+	_prefetch_max_blocks_per_second = count;
+}
+
+int VoxelTerrain::get_prefetch_max_blocks_per_second() const {
+	return _prefetch_max_blocks_per_second;
+}
+
+void VoxelTerrain::set_block_cache_max_memory(int bytes) {
+	ERR_FAIL_COND(bytes < 0);
+	_block_cache.set_max_memory(bytes);
+}
+
+int VoxelTerrain::get_block_cache_max_memory() const {
+	return _block_cache.get_max_memory();
+}
+
 Node3D *VoxelTerrain::get_viewer() const {
 	if (!is_inside_tree()) {
 		return nullptr;
@@ -272,7 +338,43 @@ void VoxelTerrain::make_block_dirty(Vector3i bpos) {
 	if (block == nullptr) {
 		// The block isn't available, we may need to load it
 		if (!_loading_blocks.has(bpos)) {
-			_blocks_pending_load.push_back(bpos);
+			Ref<VoxelBuffer> cached_voxels = _block_cache.take(bpos, 0);
+			Map<Vector3i, Ref<VoxelBuffer> >::Element *E = _prefetched_blocks.find(bpos);
+
+			if (cached_voxels.is_valid()) {
+				// It was unloaded recently. The cached version is the most recent one, so any prefetched version is not needed.
+				VoxelDataLoader::OutputBlock ob;
+				ob.position = bpos;
+				ob.data.type = VoxelDataLoader::TYPE_LOAD;
+				ob.data.voxels_loaded = cached_voxels;
+				_loaded_blocks_to_apply.push_back(ob);
+
+				if (E != nullptr) {
+					_prefetched_blocks.erase(E);
+					++_stats.prefetch_wasted;
+				}
+				// If it is being prefetched, the response will be discarded because the block is loading or loaded
+
+			} else if (E != nullptr) {
+				// It was prefetched already, no need to ask the stream
+				VoxelDataLoader::OutputBlock ob;
+				ob.position = bpos;
+				ob.data.type = VoxelDataLoader::TYPE_LOAD;
+				ob.data.voxels_loaded = E->get();
+				_loaded_blocks_to_apply.push_back(ob);
+				_prefetched_blocks.erase(E);
+				++_stats.prefetch_hits;
+
+			} else {
+				if (_prefetching_blocks.erase(bpos)) {
+					// It is being prefetched, but with low priority so it could still be far in the queue.
+					// Request it normally, which replaces the prefetch request if the loader didn't take it yet.
+					// Otherwise, the second response gets dropped.
+					++_stats.prefetch_late;
+				}
+				_blocks_pending_load.push_back(bpos);
+			}
+
 			_loading_blocks.insert(bpos);
 		}
 
@@ -280,6 +382,7 @@ void VoxelTerrain::make_block_dirty(Vector3i bpos) {
 		// Regardless of if the updater is updating the block already,
 		// the block was modified again so we schedule another update
 		block->set_mesh_state(VoxelBlock::MESH_UPDATE_NOT_SENT);
+		block->pending_edit_mesh_update = true;
 		_blocks_pending_update.push_back(bpos);
 
 		if (!block->is_modified()) {
@@ -299,8 +402,17 @@ struct ScheduleSaveAction {
 
 	std::vector<VoxelDataLoader::InputBlock> &blocks_to_save;
 	bool with_copy;
+	// If set, blocks are kept in that cache after being saved
+	VoxelBlockCache *cache;
 
 	void operator()(VoxelBlock *block) {
+		if (cache != nullptr) {
+			// Modified blocks are saved without copy, and meshing tasks may still be reading voxels,
+			// so the cache needs its own, because it compresses them
+			cache->put(block->position, 0,
+					(block->is_modified() && !with_copy) || block->are_voxels_shared() ? block->voxels->duplicate() : block->voxels);
+		}
+
 		if (block->is_modified()) {
 			//print_line(String("Scheduling save for block {0}").format(varray(block->position.to_vec3())));
 			VoxelDataLoader::InputBlock b;
@@ -319,7 +431,7 @@ void VoxelTerrain::immerge_block(Vector3i bpos) {
 	ERR_FAIL_COND(_map.is_null());
 
 	// Note: no need to copy the block because it gets removed from the map anyways
-	_map->remove_block(bpos, ScheduleSaveAction{ _blocks_to_save, false });
+	_map->remove_block(bpos, ScheduleSaveAction{ _blocks_to_save, false, &_block_cache });
 
 	_loading_blocks.erase(bpos);
 
@@ -332,7 +444,7 @@ void VoxelTerrain::save_all_modified_blocks(bool with_copy) {
 	ERR_FAIL_COND(_stream_thread == nullptr);
 
 	// That may cause a stutter, so should be used when the player won't notice
-	_map->for_all_blocks(ScheduleSaveAction{ _blocks_to_save, with_copy });
+	_map->for_all_blocks(ScheduleSaveAction{ _blocks_to_save, with_copy, nullptr });
 
 	// And flush immediately
 	send_block_data_requests();
@@ -351,11 +463,25 @@ Dictionary VoxelTerrain::get_statistics() const {
 	d["time_request_blocks_to_update"] = _stats.time_request_blocks_to_update;
 	d["time_process_update_responses"] = _stats.time_process_update_responses;
 
-	d["remaining_main_thread_blocks"] = (int)_blocks_pending_main_thread_update.size();
+	d["remaining_main_thread_blocks"] = _mesh_upload_scheduler.size();
+	d["mesh_upload"] = _mesh_upload_scheduler.to_dictionary();
 	d["dropped_block_loads"] = _stats.dropped_block_loads;
 	d["dropped_block_meshs"] = _stats.dropped_block_meshs;
 	d["updated_blocks"] = _stats.updated_blocks;
 
+	Dictionary prefetch;
+	prefetch["requests"] = _stats.prefetch_requests;
+	prefetch["hits"] = _stats.prefetch_hits;
+	prefetch["wasted"] = _stats.prefetch_wasted;
+	prefetch["late"] = _stats.prefetch_late;
+	const int prefetch_done = _stats.prefetch_hits + _stats.prefetch_wasted;
+	prefetch["hit_rate"] = prefetch_done > 0 ? (float)_stats.prefetch_hits / (float)prefetch_done : 0.f;
+	prefetch["pending"] = _prefetching_blocks.size();
+	prefetch["ready"] = _prefetched_blocks.size();
+	d["prefetch"] = prefetch;
+
+	d["block_cache"] = _block_cache.to_dictionary();
+
 	return d;
 }
 
@@ -417,7 +543,7 @@ void VoxelTerrain::stop_updater() {
 		_block_updater = NULL;
 	}
 
-	_blocks_pending_main_thread_update.clear();
+	_mesh_upload_scheduler.clear();
 	_blocks_pending_update.clear();
 
 	ResetMeshStateAction a;
@@ -430,6 +556,11 @@ void VoxelTerrain::start_streamer() {
 	ERR_FAIL_COND(_stream.is_null());
 
 	_stream_thread = memnew(VoxelDataLoader(1, _stream, get_block_size_pow2()));
+
+	_stats.prefetch_requests = 0;
+	_stats.prefetch_hits = 0;
+	_stats.prefetch_wasted = 0;
+	_stats.prefetch_late = 0;
 }
 
 void VoxelTerrain::stop_streamer() {
@@ -441,10 +572,16 @@ void VoxelTerrain::stop_streamer() {
 
 	_loading_blocks.clear();
 	_blocks_pending_load.clear();
+	_loaded_blocks_to_apply.clear();
+	clear_prefetch();
+	// Cached blocks came from the previous stream
+	_block_cache.clear();
 }
 
 void VoxelTerrain::reset_map() {
 	_map->create(get_block_size_pow2(), 0);
+	clear_prefetch();
+	_block_cache.clear();
 }
 
 inline int get_border_index(int x, int max) {
@@ -727,6 +864,18 @@ void VoxelTerrain::send_block_data_requests() {
 		input.blocks.push_back(input_block);
 	}
 
+	for (size_t i = 0; i < _blocks_pending_prefetch.size(); ++i) {
+		if (!_prefetching_blocks.has(_blocks_pending_prefetch[i])) {
+			// Got requested normally meanwhile, don't let the prefetch replace that request
+			continue;
+		}
+		VoxelDataLoader::InputBlock input_block;
+		input_block.position = _blocks_pending_prefetch[i];
+		input_block.lod = 0;
+		input_block.low_priority = true;
+		input.blocks.push_back(input_block);
+	}
+
 	for (unsigned int i = 0; i < _blocks_to_save.size(); ++i) {
 		print_line(String("Requesting save of block {0}").format(varray(_blocks_to_save[i].position.to_vec3())));
 		input.blocks.push_back(_blocks_to_save[i]);
@@ -734,19 +883,113 @@ void VoxelTerrain::send_block_data_requests() {
 
 	//print_line(String("Sending {0} block requests").format(varray(input.blocks_to_emerge.size())));
 	_blocks_pending_load.clear();
+	_blocks_pending_prefetch.clear();
 	_blocks_to_save.clear();
 
+	const uint32_t channels_mask = get_streamed_channels_mask();
+	for (unsigned int i = 0; i < input.blocks.size(); ++i) {
+		input.blocks[i].data.channels_mask = channels_mask;
+	}
+
 	_stream_thread->push(input);
 }
 
+void VoxelTerrain::update_viewer_velocity(Vector3 viewer_pos) {
+	const float delta = get_process_delta_time();
+
+	if (_last_viewer_pos_valid && delta > 0.f) {
+		const Vector3 motion = viewer_pos - _last_viewer_pos;
+
+		if (motion.length() > get_view_distance()) {
+			// The viewer got teleported, it doesn't tell where it's going
+			_viewer_velocity = Vector3();
+		} else {
+			// Smooth out variations, so predictions don't change every frame
+			_viewer_velocity = _viewer_velocity.lerp(motion / delta, VIEWER_VELOCITY_SMOOTHING);
+		}
+	}
+
+	_last_viewer_pos = viewer_pos;
+	_last_viewer_pos_valid = true;
+}
+
+void VoxelTerrain::request_prefetch(Vector3 viewer_pos, Vector3i viewer_block_pos, Rect3i view_box) {
+	VOXEL_PROFILE_SCOPE(profile_scope);
+
+	if (_prefetch_time == 0.f) {
+		return;
+	}
+
+	// Refill the budget, which can't accumulate more than a second worth of requests
+	_prefetch_budget = MIN(_prefetch_budget + get_process_delta_time() * _prefetch_max_blocks_per_second,
+			(float)_prefetch_max_blocks_per_second);
+
+	const Vector3 predicted_pos = viewer_pos + _viewer_velocity * _prefetch_time;
+	const Vector3i predicted_block_pos = _map->voxel_to_block(Vector3i(predicted_pos));
+	const Rect3i predicted_box = Rect3i::from_center_extents(predicted_block_pos, Vector3i(_view_distance_blocks));
+
+	// Discard blocks we no longer expect to need
+	Map<Vector3i, Ref<VoxelBuffer> >::Element *E = _prefetched_blocks.front();
+	while (E != nullptr) {
+		Map<Vector3i, Ref<VoxelBuffer> >::Element *next = E->next();
+		if (!predicted_box.contains(E->key())) {
+			_prefetched_blocks.erase(E);
+			++_stats.prefetch_wasted;
+		}
+		E = next;
+	}
+
+	if (predicted_block_pos == viewer_block_pos) {
+		return;
+	}
+
+	const int max_count = MIN((int)_prefetch_budget,
+			(int)MAX_PREFETCHED_BLOCKS - _prefetching_blocks.size() - _prefetched_blocks.size());
+	if (max_count <= 0) {
+		return;
+	}
+
+	// Blocks in the predicted area which are not in view yet
+	std::vector<Vector3i> candidates;
+	predicted_box.difference(view_box, [this, &candidates](Rect3i box) {
+		box.for_each_cell([this, &candidates](Vector3i bpos) {
+			if (!_prefetching_blocks.has(bpos) && !_prefetched_blocks.has(bpos) && !_loading_blocks.has(bpos) &&
+					!_block_cache.has(bpos, 0)) {
+				candidates.push_back(bpos);
+			}
+		});
+	});
+
+	// The closest ones are going to be needed first
+	std::sort(candidates.begin(), candidates.end(), [viewer_block_pos](const Vector3i &a, const Vector3i &b) {
+		return a.distance_sq(viewer_block_pos) < b.distance_sq(viewer_block_pos);
+	});
+
+	const int count = MIN(max_count, (int)candidates.size());
+	for (int i = 0; i < count; ++i) {
+		const Vector3i bpos = candidates[i];
+		_blocks_pending_prefetch.push_back(bpos);
+		_prefetching_blocks.insert(bpos);
+	}
+
+	_prefetch_budget -= count;
+	_stats.prefetch_requests += count;
+}
+
+void VoxelTerrain::clear_prefetch() {
+	// Blocks being prefetched will be dropped when they arrive
+	_prefetching_blocks.clear();
+	_prefetched_blocks.clear();
+	_blocks_pending_prefetch.clear();
+	_prefetch_budget = 0.f;
+}
+
 void VoxelTerrain::_process() {
 	// TODO Should be able to run without library, tho!
 	if (_library.is_null()) {
 		return;
 	}
 
-	OS &os = *OS::get_singleton();
-
 	ERR_FAIL_COND(_map.is_null());
 
 	ProfilingClock profiling_clock;
@@ -760,10 +1003,12 @@ void VoxelTerrain::_process() {
 	Vector3 viewer_direction;
 	get_viewer_pos_and_direction(viewer_pos, viewer_direction);
 	Vector3i viewer_block_pos = _map->voxel_to_block(Vector3i(viewer_pos));
+	update_viewer_velocity(viewer_pos);
+
+	const Rect3i new_box = Rect3i::from_center_extents(viewer_block_pos, Vector3i(_view_distance_blocks));
 
 	// Find out which blocks need to appear and which need to be unloaded
 	{
-		Rect3i new_box = Rect3i::from_center_extents(viewer_block_pos, Vector3i(_view_distance_blocks));
 		Rect3i prev_box = Rect3i::from_center_extents(_last_viewer_block_pos, Vector3i(_last_view_distance_blocks));
 
 		if (prev_box != new_box) {
@@ -796,6 +1041,7 @@ void VoxelTerrain::_process() {
 
 	// It's possible the user didn't set a stream yet
 	if (_stream_thread != nullptr) {
+		request_prefetch(viewer_pos, viewer_block_pos, new_box);
 		send_block_data_requests();
 	}
 
@@ -811,6 +1057,13 @@ void VoxelTerrain::_process() {
 
 		_stats.stream = output.stats;
 
+		// Prefetched blocks which became needed are handled like loaded ones
+		const int stream_block_count = output.blocks.size();
+		for (size_t i = 0; i < _loaded_blocks_to_apply.size(); ++i) {
+			output.blocks.push_back(_loaded_blocks_to_apply[i]);
+		}
+		_loaded_blocks_to_apply.clear();
+
 		for (int i = 0; i < output.blocks.size(); ++i) {
 
 			const VoxelDataLoader::OutputBlock &ob = output.blocks[i];
@@ -821,6 +1074,19 @@ void VoxelTerrain::_process() {
 
 			Vector3i block_pos = ob.position;
 
+			if (i < stream_block_count && _prefetching_blocks.erase(block_pos)) {
+				// Keep it until it enters the view distance.
+				// If the block got loaded from the cache meanwhile, that version is more recent.
+				if (ob.drop_hint) {
+					// Not counted, it was dropped before being loaded
+				} else if (_map->has_block(block_pos) || _loading_blocks.has(block_pos)) {
+					++_stats.prefetch_wasted;
+				} else {
+					_prefetched_blocks[block_pos] = ob.data.voxels_loaded;
+				}
+				continue;
+			}
+
 			{
 				Set<Vector3i>::Element *E = _loading_blocks.find(block_pos);
 
@@ -870,11 +1136,11 @@ void VoxelTerrain::_process() {
 					for (ndir.x = -1; ndir.x < 2; ++ndir.x) {
 						for (ndir.y = -1; ndir.y < 2; ++ndir.y) {
 							Vector3i npos = block_pos + ndir;
+							VoxelBlock *nblock = _map->get_block(npos);
 							// TODO What if the map is really composed of empty blocks?
-							if (_map->is_block_surrounded(npos)) {
+							if (nblock != nullptr && nblock->is_surrounded()) {
 
-								VoxelBlock *nblock = _map->get_block(npos);
-								if (nblock == nullptr || nblock->get_mesh_state() == VoxelBlock::MESH_UPDATE_NOT_SENT) {
+								if (nblock->get_mesh_state() == VoxelBlock::MESH_UPDATE_NOT_SENT) {
 									// Assuming it is scheduled to be updated already.
 									// In case of BLOCK_UPDATE_SENT, we'll have to resend it.
 									continue;
@@ -909,59 +1175,34 @@ void VoxelTerrain::_process() {
 		for (int i = 0; i < _blocks_pending_update.size(); ++i) {
 			Vector3i block_pos = _blocks_pending_update[i];
 
-			// Check if the block is worth meshing
-			// Smooth meshing works on more neighbors, so checking a single block isn't enough to ignore it,
-			// but that will slow down meshing a lot.
-			// TODO This is one reason to separate terrain systems between blocky and smooth (other reason is LOD)
-			if (!(_stream->get_used_channels_mask() & (1 << VoxelBuffer::CHANNEL_SDF))) {
-				VoxelBlock *block = _map->get_block(block_pos);
-				if (block == nullptr) {
-					continue;
-				} else {
-					CRASH_COND(block->voxels.is_null());
-
-					uint64_t air_type = 0;
-					if (
-							block->voxels->is_uniform(VoxelBuffer::CHANNEL_TYPE) &&
-							block->voxels->is_uniform(VoxelBuffer::CHANNEL_SDF) &&
-							block->voxels->get_voxel(0, 0, 0, VoxelBuffer::CHANNEL_TYPE) == air_type) {
-
-						// If we got here, it must have been because of scheduling an update
-						CRASH_COND(block->get_mesh_state() != VoxelBlock::MESH_UPDATE_NOT_SENT);
-
-						// The block contains empty voxels
-						block->set_mesh(Ref<Mesh>(), this, _generate_collisions, Vector<Array>(), get_tree()->is_debugging_collisions_hint());
-						block->set_mesh_state(VoxelBlock::MESH_UP_TO_DATE);
-
-						// Optional, but I guess it might spare some memory
-						block->voxels->clear_channel(VoxelBuffer::CHANNEL_TYPE, air_type);
-
-						continue;
-					}
-				}
-			}
-
 			VoxelBlock *block = _map->get_block(block_pos);
 
 			// If we got here, it must have been because of scheduling an update
 			CRASH_COND(block == nullptr);
 			CRASH_COND(block->get_mesh_state() != VoxelBlock::MESH_UPDATE_NOT_SENT);
+			CRASH_COND(block->voxels.is_null());
 
-			// Create buffer padded with neighbor voxels
-			Ref<VoxelBuffer> nbuffer;
-			nbuffer.instance();
-
-			// TODO Make the buffer re-usable
-			unsigned int block_size = _map->get_block_size();
-			unsigned int min_padding = _block_updater->get_minimum_padding();
-			unsigned int max_padding = _block_updater->get_maximum_padding();
-			nbuffer->create(Vector3i(block_size + min_padding + max_padding));
+			// Check if the block is worth meshing.
+			// Only done if it's cheap, because checking voxels one by one is left to meshing threads.
+			// Smooth meshing works on more neighbors, so checking a single block isn't enough to ignore it.
+			// TODO This is one reason to separate terrain systems between blocky and smooth (other reason is LOD)
+			if (!(_stream->get_used_channels_mask() & (1 << VoxelBuffer::CHANNEL_SDF))) {
+				const uint64_t air_type = 0;
+				if (block->voxels->get_channel_compression(VoxelBuffer::CHANNEL_TYPE) == VoxelBuffer::COMPRESSION_UNIFORM &&
+						block->voxels->get_voxel(0, 0, 0, VoxelBuffer::CHANNEL_TYPE) == air_type) {
 
-			unsigned int channels_mask = (1 << VoxelBuffer::CHANNEL_TYPE) | (1 << VoxelBuffer::CHANNEL_SDF);
-			_map->get_buffer_copy(_map->block_to_voxel(block_pos) - Vector3i(min_padding), **nbuffer, channels_mask);
+					// The block contains empty voxels
+					block->set_mesh(Ref<Mesh>(), this, Ref<Shape3D>(), get_tree()->is_debugging_collisions_hint());
+					block->set_mesh_state(VoxelBlock::MESH_UP_TO_DATE);
+					continue;
+				}
+			}
 
+			// Voxels are not copied here, the mesher will read them from the block and its neighbors
 			VoxelMeshUpdater::InputBlock iblock;
-			iblock.data.voxels = nbuffer;
+			_map->get_neighborhood(block_pos, iblock.data.neighborhood);
+			iblock.data.generate_collision = _generate_collisions;
+			iblock.data.collision_max_triangles = _collision_max_triangles;
 			iblock.position = block_pos;
 			input.blocks.push_back(iblock);
 
@@ -983,19 +1224,30 @@ void VoxelTerrain::_process() {
 			_stats.updater = output.stats;
 			_stats.updated_blocks = output.blocks.size();
 
-			_blocks_pending_main_thread_update.append_array(output.blocks);
-		}
+			for (int i = 0; i < output.blocks.size(); ++i) {
+				const VoxelMeshUpdater::OutputBlock &ob = output.blocks[i];
+
+				const VoxelBlock *block = _map->get_block(ob.position);
+				if (block == NULL) {
+					// That block is no longer loaded, drop the result
+					++_stats.dropped_block_meshs;
+					continue;
+				}
 
-		uint32_t timeout = os.get_ticks_msec() + MAIN_THREAD_MESHING_BUDGET_MS;
-		int queue_index = 0;
+				const unsigned int priority = VoxelMeshUploadScheduler::get_block_priority(
+						ob.position, 0, viewer_block_pos, block->pending_edit_mesh_update);
+				_mesh_upload_scheduler.push(ob, priority);
+			}
+		}
 
 		// The following is done on the main thread because Godot doesn't really support multithreaded Mesh allocation.
 		// This also proved to be very slow compared to the meshing process itself...
 		// hopefully Vulkan will allow us to upload graphical resources without stalling rendering as they upload?
 
-		for (; queue_index < _blocks_pending_main_thread_update.size() && os.get_ticks_msec() < timeout; ++queue_index) {
+		_mesh_upload_scheduler.begin_frame();
+		VoxelMeshUpdater::OutputBlock ob;
 
-			const VoxelMeshUpdater::OutputBlock &ob = _blocks_pending_main_thread_update[queue_index];
+		while (_mesh_upload_scheduler.pop(ob)) {
 
 			VoxelBlock *block = _map->get_block(ob.position);
 			if (block == NULL) {
@@ -1015,44 +1267,29 @@ void VoxelTerrain::_process() {
 			Ref<ArrayMesh> mesh;
 			mesh.instance();
 
-			Vector<Array> collidable_surfaces; //need to put both blocky and smooth surfaces into one list
-
 			int surface_index = 0;
 			const VoxelMeshUpdater::OutputBlockData &data = ob.data;
-			for (int i = 0; i < data.blocky_surfaces.surfaces.size(); ++i) {
+			// Surfaces were packed by meshing threads, so they only need to be uploaded
+			for (int i = 0; i < data.blocky_surfaces.packed_surfaces.size(); ++i) {
 
-				Array surface = data.blocky_surfaces.surfaces[i];
-				if (surface.empty()) {
+				const RenderingServer::SurfaceData &packed_surface = data.blocky_surfaces.packed_surfaces[i];
+				if (packed_surface.vertex_count == 0) {
 					continue;
 				}
 
-				CRASH_COND(surface.size() != Mesh::ARRAY_MAX);
-				if (!is_surface_triangulated(surface)) {
-					continue;
-				}
-
-				collidable_surfaces.push_back(surface);
-
-				mesh->add_surface_from_arrays(data.blocky_surfaces.primitive_type, surface, Array(), Dictionary(), data.blocky_surfaces.compression_flags);
+				add_packed_surface(**mesh, packed_surface);
 				mesh->surface_set_material(surface_index, _materials[i]);
 				++surface_index;
 			}
 
-			for (int i = 0; i < data.smooth_surfaces.surfaces.size(); ++i) {
-
-				Array surface = data.smooth_surfaces.surfaces[i];
-				if (surface.empty()) {
-					continue;
-				}
+			for (int i = 0; i < data.smooth_surfaces.packed_surfaces.size(); ++i) {
 
-				CRASH_COND(surface.size() != Mesh::ARRAY_MAX);
-				if (!is_surface_triangulated(surface)) {
+				const RenderingServer::SurfaceData &packed_surface = data.smooth_surfaces.packed_surfaces[i];
+				if (packed_surface.vertex_count == 0) {
 					continue;
 				}
 
-				collidable_surfaces.push_back(surface);
-
-				mesh->add_surface_from_arrays(data.smooth_surfaces.primitive_type, surface, Array(), Dictionary(), data.smooth_surfaces.compression_flags);
+				add_packed_surface(**mesh, packed_surface);
 				mesh->surface_set_material(surface_index, _materials[i]);
 				++surface_index;
 			}
@@ -1061,11 +1298,19 @@ void VoxelTerrain::_process() {
 				mesh = Ref<Mesh>();
 			}
 
-			block->set_mesh(mesh, this, _generate_collisions, collidable_surfaces, get_tree()->is_debugging_collisions_hint());
+			// Creating the shape is where the physics engine builds its acceleration structure
+			const uint64_t collision_time_before = OS::get_singleton()->get_ticks_usec();
+			Ref<Shape3D> collision_shape = create_collision_shape(data.collision_faces);
+			if (collision_shape.is_valid()) {
+				_mesh_upload_scheduler.add_collision_shape_time(OS::get_singleton()->get_ticks_usec() - collision_time_before);
+			}
+
+			block->set_mesh(mesh, this, collision_shape, get_tree()->is_debugging_collisions_hint());
 			block->set_parent_visible(is_visible());
+			block->pending_edit_mesh_update = false;
 		}
 
-		shift_up(_blocks_pending_main_thread_update, queue_index);
+		_mesh_upload_scheduler.end_frame();
 	}
 
 	_stats.time_process_update_responses = profiling_clock.restart();
@@ -1109,10 +1354,25 @@ void VoxelTerrain::_bind_methods() {
 
 	ClassDB::bind_method(D_METHOD("get_generate_collisions"), &VoxelTerrain::get_generate_collisions);
 	ClassDB::bind_method(D_METHOD("set_generate_collisions", "enabled"), &VoxelTerrain::set_generate_collisions);
+	ClassDB::bind_method(D_METHOD("get_collision_max_triangles"), &VoxelTerrain::get_collision_max_triangles);
+	ClassDB::bind_method(D_METHOD("set_collision_max_triangles", "max_triangles"), &VoxelTerrain::set_collision_max_triangles);
+
+	ClassDB::bind_method(D_METHOD("set_save_channels", "channels_mask"), &VoxelTerrain::set_save_channels);
+	ClassDB::bind_method(D_METHOD("get_save_channels"), &VoxelTerrain::get_save_channels);
 
 	ClassDB::bind_method(D_METHOD("get_viewer_path"), &VoxelTerrain::get_viewer_path);
 	ClassDB::bind_method(D_METHOD("set_viewer_path", "path"), &VoxelTerrain::set_viewer_path);
 
+	ClassDB::bind_method(D_METHOD("set_prefetch_time", "seconds"), &VoxelTerrain::set_prefetch_time);
+	ClassDB::bind_method(D_METHOD("get_prefetch_time"), &VoxelTerrain::get_prefetch_time);
+
+	ClassDB::bind_method(D_METHOD("set_prefetch_max_blocks_per_second", "count"),
+			&VoxelTerrain::set_prefetch_max_blocks_per_second);
+	ClassDB::bind_method(D_METHOD("get_prefetch_max_blocks_per_second"), &VoxelTerrain::get_prefetch_max_blocks_per_second);
+
+	ClassDB::bind_method(D_METHOD("set_block_cache_max_memory", "bytes"), &VoxelTerrain::set_block_cache_max_memory);
+	ClassDB::bind_method(D_METHOD("get_block_cache_max_memory"), &VoxelTerrain::get_block_cache_max_memory);
+
 	ClassDB::bind_method(D_METHOD("voxel_to_block", "voxel_pos"), &VoxelTerrain::_b_voxel_to_block);
 	ClassDB::bind_method(D_METHOD("block_to_voxel", "block_pos"), &VoxelTerrain::_b_block_to_voxel);
 
@@ -1126,6 +1386,16 @@ void VoxelTerrain::_bind_methods() {
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "view_distance"), "set_view_distance", "get_view_distance");
 	ADD_PROPERTY(PropertyInfo(Variant::NODE_PATH, "viewer_path"), "set_viewer_path", "get_viewer_path");
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "generate_collisions"), "set_generate_collisions", "get_generate_collisions");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "collision_max_triangles"), "set_collision_max_triangles", "get_collision_max_triangles");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "save_channels", PROPERTY_HINT_FLAGS, VoxelBuffer::CHANNEL_ID_HINT_STRING),
+			"set_save_channels", "get_save_channels");
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "block_cache_max_memory"), "set_block_cache_max_memory", "get_block_cache_max_memory");
+
+	ADD_GROUP("Prefetch", "prefetch_");
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "prefetch_time"), "set_prefetch_time", "get_prefetch_time");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "prefetch_max_blocks_per_second"),
+			"set_prefetch_max_blocks_per_second", "get_prefetch_max_blocks_per_second");
 }
 
 }
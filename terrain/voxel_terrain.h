@@ -4,8 +4,10 @@
 #include "../math/rect3i.h"
 #include "../math/vector3i.h"
 #include "../util/zprofiling.h"
+#include "voxel_block_cache.h"
 #include "voxel_data_loader.h"
 #include "voxel_mesh_updater.h"
+#include "voxel_mesh_upload_scheduler.h"
 
 #include <scene/3d/node_3d.h>
 
@@ -44,12 +46,35 @@ public:
 	void set_generate_collisions(bool enabled);
 	bool get_generate_collisions() const { return _generate_collisions; }
 
+	// Collision meshes of each block are simplified to have at most this amount of triangles.
+	// 0 means render triangles are used as they are.
+	void set_collision_max_triangles(int max_triangles);
+	int get_collision_max_triangles() const;
+
+	// Channels loaded and saved in addition to those meshers use, as a mask of channel bits.
+	// Edits made in other channels are lost when blocks get unloaded.
+	void set_save_channels(int channels_mask);
+	int get_save_channels() const;
+
 	int get_view_distance() const;
 	void set_view_distance(int distance_in_voxels);
 
 	void set_viewer_path(NodePath path);
 	NodePath get_viewer_path() const;
 
+	// Blocks are loaded ahead of the viewer, where it is predicted to be after this time.
+	// 0 disables prefetching.
+	void set_prefetch_time(float seconds);
+	float get_prefetch_time() const;
+
+	// Limits how many blocks can be prefetched per second, so it doesn't take too much from regular loading
+	void set_prefetch_max_blocks_per_second(int count);
+	int get_prefetch_max_blocks_per_second() const;
+
+	// How much memory can be used to keep unloaded blocks, in case they are needed again soon
+	void set_block_cache_max_memory(int bytes);
+	int get_block_cache_max_memory() const;
+
 	void set_material(unsigned int id, Ref<Material> material);
 	Ref<Material> get_material(unsigned int id) const;
 
@@ -62,6 +87,11 @@ public:
 		int updated_blocks = 0;
 		int dropped_block_loads = 0;
 		int dropped_block_meshs = 0;
+		// Counted since the stream started
+		int prefetch_requests = 0;
+		int prefetch_hits = 0; // Prefetched blocks which ended up being needed
+		int prefetch_wasted = 0; // Prefetched blocks discarded without being used
+		int prefetch_late = 0; // Blocks needed while their prefetch was still pending, requested normally instead
 		uint64_t time_detect_required_blocks = 0;
 		uint64_t time_request_blocks_to_load = 0;
 		uint64_t time_process_load_responses = 0;
@@ -94,6 +124,11 @@ private:
 	void save_all_modified_blocks(bool with_copy);
 	void get_viewer_pos_and_direction(Vector3 &out_pos, Vector3 &out_direction) const;
 	void send_block_data_requests();
+	uint32_t get_streamed_channels_mask() const;
+
+	void update_viewer_velocity(Vector3 viewer_pos);
+	void request_prefetch(Vector3 viewer_pos, Vector3i viewer_block_pos, Rect3i view_box);
+	void clear_prefetch();
 
 	Dictionary get_statistics() const;
 
@@ -107,19 +142,36 @@ private:
 	// Voxel storage
 	Ref<VoxelMap> _map;
 
-	// How many blocks to load around the viewer
+	// How many blocks to load around the viewer.
+	// Blocks within that distance are stored in a dense grid in the map.
 	int _view_distance_blocks;
 
-	// TODO Terrains only need to handle the visible portion of voxels, which reduces the bounds blocks to handle.
-	// Therefore, could a simple grid be better to use than a hashmap?
-
 	Set<Vector3i> _loading_blocks;
 	Vector<Vector3i> _blocks_pending_load;
 	Vector<Vector3i> _blocks_pending_update;
-	Vector<VoxelMeshUpdater::OutputBlock> _blocks_pending_main_thread_update;
+	VoxelMeshUploadScheduler _mesh_upload_scheduler;
 
 	std::vector<VoxelDataLoader::InputBlock> _blocks_to_save;
 
+	// Prefetched blocks are requested with low priority, and kept aside until they enter the view distance
+	float _prefetch_time = 1.f;
+	int _prefetch_max_blocks_per_second = 64;
+	float _prefetch_budget = 0.f;
+	Vector3 _last_viewer_pos;
+	bool _last_viewer_pos_valid = false;
+	Vector3 _viewer_velocity;
+	// Requested to the stream and not received yet
+	Set<Vector3i> _prefetching_blocks;
+	// Received and not needed yet
+	Map<Vector3i, Ref<VoxelBuffer> > _prefetched_blocks;
+	std::vector<Vector3i> _blocks_pending_prefetch;
+
+	// Recently unloaded blocks
+	VoxelBlockCache _block_cache;
+
+	// Blocks obtained without the stream (prefetched or cached), handled with the next load responses
+	std::vector<VoxelDataLoader::OutputBlock> _loaded_blocks_to_apply;
+
 	Ref<VoxelStream> _stream;
 	VoxelDataLoader *_stream_thread;
 
@@ -131,6 +183,8 @@ private:
 	int _last_view_distance_blocks;
 
 	bool _generate_collisions = true;
+	unsigned int _collision_max_triangles = 0;
+	uint32_t _save_channels = 0;
 	bool _run_in_editor;
 
 	Ref<Material> _materials[VoxelMesherBlocky::MAX_MATERIALS];
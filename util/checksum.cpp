@@ -0,0 +1,134 @@
+#include "checksum.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define VOXEL_CRC32C_X86
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#define VOXEL_CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+namespace Voxel {
+
+namespace {
+
+struct Crc32cTable {
+	uint32_t values[256];
+
+	Crc32cTable() {
+		// Reversed polynomial of CRC-32C
+		const uint32_t poly = 0x82f63b78;
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) {
+				c = (c & 1) ? (poly ^ (c >> 1)) : (c >> 1);
+			}
+			values[i] = c;
+		}
+	}
+};
+
+const Crc32cTable g_crc32c_table;
+
+uint32_t crc32c_software(const uint8_t *data, size_t size, uint32_t crc) {
+	const uint32_t *table = g_crc32c_table.values;
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) {
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#if defined(VOXEL_CRC32C_X86)
+
+// SSE 4.2 has an instruction for CRC-32C. It is not enabled for the whole build, so it is checked at runtime.
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("sse4.2")))
+#endif
+uint32_t crc32c_hardware(const uint8_t *data, size_t size, uint32_t crc) {
+	crc = ~crc;
+#if defined(__x86_64__) || defined(_M_X64)
+	uint64_t crc64 = crc;
+	while (size >= sizeof(uint64_t)) {
+		uint64_t v;
+		memcpy(&v, data, sizeof(uint64_t));
+		crc64 = _mm_crc32_u64(crc64, v);
+		data += sizeof(uint64_t);
+		size -= sizeof(uint64_t);
+	}
+	crc = static_cast<uint32_t>(crc64);
+#endif
+	while (size >= sizeof(uint32_t)) {
+		uint32_t v;
+		memcpy(&v, data, sizeof(uint32_t));
+		crc = _mm_crc32_u32(crc, v);
+		data += sizeof(uint32_t);
+		size -= sizeof(uint32_t);
+	}
+	while (size > 0) {
+		crc = _mm_crc32_u8(crc, *data);
+		++data;
+		--size;
+	}
+	return ~crc;
+}
+
+bool has_hardware_crc32c() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 20)) != 0;
+#else
+	return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#elif defined(VOXEL_CRC32C_ARM)
+
+// The build targets a CPU having CRC instructions
+uint32_t crc32c_hardware(const uint8_t *data, size_t size, uint32_t crc) {
+	crc = ~crc;
+	while (size >= sizeof(uint64_t)) {
+		uint64_t v;
+		memcpy(&v, data, sizeof(uint64_t));
+		crc = __crc32cd(crc, v);
+		data += sizeof(uint64_t);
+		size -= sizeof(uint64_t);
+	}
+	while (size > 0) {
+		crc = __crc32cb(crc, *data);
+		++data;
+		--size;
+	}
+	return ~crc;
+}
+
+bool has_hardware_crc32c() {
+	return true;
+}
+
+#endif
+
+typedef uint32_t (*Crc32cFunc)(const uint8_t *, size_t, uint32_t);
+
+Crc32cFunc select_crc32c_func() {
+#if defined(VOXEL_CRC32C_X86) || defined(VOXEL_CRC32C_ARM)
+	if (has_hardware_crc32c()) {
+		return crc32c_hardware;
+	}
+#endif
+	return crc32c_software;
+}
+
+} // namespace
+
+uint32_t crc32c(const uint8_t *data, size_t size, uint32_t crc) {
+	static const Crc32cFunc func = select_crc32c_func();
+	return func(data, size, crc);
+}
+
+}
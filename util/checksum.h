@@ -0,0 +1,15 @@
+#ifndef VOXEL_CHECKSUM_H
+#define VOXEL_CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Voxel {
+
+// CRC-32C (Castagnoli), used to detect corruption in saved data.
+// Can be computed over several buffers by passing the previous result as `crc`.
+uint32_t crc32c(const uint8_t *data, size_t size, uint32_t crc = 0);
+
+}
+
+#endif // VOXEL_CHECKSUM_H
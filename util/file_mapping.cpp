@@ -0,0 +1,110 @@
+#include "file_mapping.h"
+#include <core/project_settings.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Voxel {
+
+FileMapping::FileMapping() {
+}
+
+FileMapping::~FileMapping() {
+	close();
+}
+
+bool FileMapping::is_supported() {
+#ifdef __linux__
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool FileMapping::open(const String &fpath) {
+	close();
+
+#ifdef __linux__
+	const String path = ProjectSettings::get_singleton()->globalize_path(fpath);
+	const CharString path_utf8 = path.utf8();
+
+	const int fd = ::open(path_utf8.get_data(), O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		::close(fd);
+		return false;
+	}
+
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping keeps its own reference to the file
+	::close(fd);
+
+	if (p == MAP_FAILED) {
+		return false;
+	}
+
+	_data = (const uint8_t *)p;
+	_size = st.st_size;
+	return true;
+
+#else
+	return false;
+#endif
+}
+
+bool FileMapping::resize(size_t new_size) {
+	if (_data == nullptr || new_size == 0) {
+		return false;
+	}
+	if (new_size == _size) {
+		return true;
+	}
+#ifdef __linux__
+	// Extends in place if the address space allows it, without touching pages already loaded
+	void *p = mremap((void *)_data, _size, new_size, MREMAP_MAYMOVE);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+	_data = (const uint8_t *)p;
+	_size = new_size;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void FileMapping::prefetch(size_t offset, size_t size) const {
+	if (_data == nullptr || offset >= _size) {
+		return;
+	}
+#ifdef __linux__
+	if (offset + size > _size) {
+		size = _size - offset;
+	}
+	// madvise requires an address aligned to pages
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	const size_t aligned_offset = offset - offset % page_size;
+	madvise((void *)(_data + aligned_offset), size + offset - aligned_offset, MADV_WILLNEED);
+#endif
+}
+
+void FileMapping::close() {
+	if (_data == nullptr) {
+		return;
+	}
+#ifdef __linux__
+	munmap((void *)_data, _size);
+#endif
+	_data = nullptr;
+	_size = 0;
+}
+
+}
@@ -0,0 +1,52 @@
+#ifndef VOXEL_FILE_MAPPING_H
+#define VOXEL_FILE_MAPPING_H
+
+#include <core/ustring.h>
+
+namespace Voxel {
+
+// Read-only view of a whole file mapped in memory.
+// This lets the OS page data in on demand and avoids copying it through FileAccess buffers.
+// Only implemented on Linux for now. On other platforms `open` fails, and callers should fallback on FileAccess.
+class FileMapping {
+public:
+	FileMapping();
+	~FileMapping();
+
+	// Maps the file found at the given path, which may be a `res://` or `user://` path
+	bool open(const String &fpath);
+	void close();
+
+	inline bool is_open() const {
+		return _data != nullptr;
+	}
+
+	inline const uint8_t *get_data() const {
+		return _data;
+	}
+
+	inline size_t get_size() const {
+		return _size;
+	}
+
+	// Changes the size of the mapping, typically after the file grew. The data pointer may change.
+	// If it fails, the mapping stays as it was.
+	bool resize(size_t new_size);
+
+	// Hints the OS that a range of the file will be read soon, so it can start loading it in the background.
+	// This returns immediately.
+	void prefetch(size_t offset, size_t size) const;
+
+	static bool is_supported();
+
+private:
+	FileMapping(const FileMapping &) = delete;
+	FileMapping &operator=(const FileMapping &) = delete;
+
+	const uint8_t *_data = nullptr;
+	size_t _size = 0;
+};
+
+}
+
+#endif // VOXEL_FILE_MAPPING_H
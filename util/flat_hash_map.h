@@ -0,0 +1,292 @@
+#ifndef VOXEL_FLAT_HASH_MAP_H
+#define VOXEL_FLAT_HASH_MAP_H
+
+#include <core/error_macros.h>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VOXEL_FLAT_HASH_MAP_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace Voxel {
+
+// Hash map storing keys and values in a single array, using open addressing.
+// Each slot has a control byte, holding either a state or 7 bits of the key's hash.
+// Lookups compare control bytes 16 at a time, so they only touch keys which are very likely to match,
+// and most of them find their slot without following pointers.
+// Meant for small trivially copyable keys and values. Pointers to values are invalidated by insertions.
+// Hasher::hash must return 64 bits, and all of them must be well distributed.
+template <typename K, typename V, typename Hasher>
+class FlatHashMap {
+public:
+	FlatHashMap() {}
+
+	inline unsigned int size() const {
+		return _size;
+	}
+
+	inline unsigned int get_capacity() const {
+		return _slots.size();
+	}
+
+	V *getptr(const K &key) {
+		const int i = find_slot(key);
+		return i == -1 ? nullptr : &_slots[i].value;
+	}
+
+	const V *getptr(const K &key) const {
+		const int i = find_slot(key);
+		return i == -1 ? nullptr : &_slots[i].value;
+	}
+
+	inline bool has(const K &key) const {
+		return find_slot(key) != -1;
+	}
+
+	// Inserts or replaces the value for the given key
+	void set(const K &key, const V &value) {
+		const uint64_t h = Hasher::hash(key);
+		const int existing = find_slot(key, h);
+		if (existing != -1) {
+			_slots[existing].value = value;
+			return;
+		}
+
+		unsigned int i = find_free_slot(h);
+		if (_growth_left == 0 && _ctrl[i] == CTRL_EMPTY) {
+			// Tombstones can be reused without growing, but new empty slots can't be taken anymore
+			rehash();
+			i = find_free_slot(h);
+		}
+
+		if (_ctrl[i] == CTRL_EMPTY) {
+			--_growth_left;
+		}
+		set_ctrl(i, get_h2(h));
+		Slot &slot = _slots[i];
+		slot.key = key;
+		slot.value = value;
+		++_size;
+	}
+
+	bool erase(const K &key) {
+		const int i = find_slot(key);
+		if (i == -1) {
+			return false;
+		}
+		// Leave a tombstone, so probe sequences going through this slot don't stop early
+		set_ctrl(i, CTRL_DELETED);
+		--_size;
+		return true;
+	}
+
+	void clear() {
+		_ctrl.clear();
+		_slots.clear();
+		_size = 0;
+		_growth_left = 0;
+	}
+
+	// Calls op(key, value) for every element, in no particular order.
+	// The map must not be modified during iteration.
+	template <typename Op_T>
+	void for_each(Op_T op) {
+		for (unsigned int i = 0; i < _slots.size(); ++i) {
+			if (_ctrl[i] >= 0) {
+				op(_slots[i].key, _slots[i].value);
+			}
+		}
+	}
+
+	template <typename Op_T>
+	void for_each(Op_T op) const {
+		for (unsigned int i = 0; i < _slots.size(); ++i) {
+			if (_ctrl[i] >= 0) {
+				op(_slots[i].key, _slots[i].value);
+			}
+		}
+	}
+
+private:
+	static const unsigned int GROUP_SIZE = 16;
+	static const unsigned int MIN_CAPACITY = GROUP_SIZE;
+
+	// Full slots have a positive control byte, so states can be tested with sign comparisons
+	static const int8_t CTRL_EMPTY = -128;
+	static const int8_t CTRL_DELETED = -2;
+
+	struct Slot {
+		K key;
+		V value;
+	};
+
+	// Bits are set for each of the 16 control bytes matching a condition
+	typedef uint32_t GroupMask;
+
+	struct Group {
+		const int8_t *ctrl;
+
+		GroupMask match(int8_t h2) const {
+#ifdef VOXEL_FLAT_HASH_MAP_SSE2
+			const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl));
+			return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), c));
+#else
+			GroupMask mask = 0;
+			for (unsigned int i = 0; i < GROUP_SIZE; ++i) {
+				mask |= GroupMask(ctrl[i] == h2) << i;
+			}
+			return mask;
+#endif
+		}
+
+		GroupMask match_empty_or_deleted() const {
+#ifdef VOXEL_FLAT_HASH_MAP_SSE2
+			const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl));
+			return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), c));
+#else
+			GroupMask mask = 0;
+			for (unsigned int i = 0; i < GROUP_SIZE; ++i) {
+				mask |= GroupMask(ctrl[i] < -1) << i;
+			}
+			return mask;
+#endif
+		}
+
+		inline GroupMask match_empty() const {
+			return match(CTRL_EMPTY);
+		}
+	};
+
+	static inline unsigned int lowest_bit_index(GroupMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctz(mask);
+#else
+		unsigned int i = 0;
+		while ((mask & 1) == 0) {
+			mask >>= 1;
+			++i;
+		}
+		return i;
+#endif
+	}
+
+	// The high bits of the hash are stored in control bytes, the others select where probing starts
+	static inline int8_t get_h2(uint64_t h) {
+		return static_cast<int8_t>(h >> 57);
+	}
+
+	inline Group get_group(unsigned int i) const {
+		Group g;
+		g.ctrl = _ctrl.data() + i;
+		return g;
+	}
+
+	inline void set_ctrl(unsigned int i, int8_t c) {
+		_ctrl[i] = c;
+		// The first group is mirrored after the end, so groups can be loaded from any slot without wrapping
+		if (i < GROUP_SIZE) {
+			_ctrl[_slots.size() + i] = c;
+		}
+	}
+
+	inline int find_slot(const K &key) const {
+		if (_size == 0) {
+			return -1;
+		}
+		return find_slot(key, Hasher::hash(key));
+	}
+
+	int find_slot(const K &key, uint64_t h) const {
+		if (_slots.size() == 0) {
+			return -1;
+		}
+		const unsigned int mask = _slots.size() - 1;
+		const int8_t h2 = get_h2(h);
+		unsigned int pos = h & mask;
+		// Steps grow by one group each time. With a power of two capacity, this visits every group.
+		unsigned int step = 0;
+
+		while (true) {
+			const Group g = get_group(pos);
+			GroupMask m = g.match(h2);
+			while (m != 0) {
+				const unsigned int i = (pos + lowest_bit_index(m)) & mask;
+				if (_slots[i].key == key) {
+					return i;
+				}
+				m &= m - 1;
+			}
+			if (g.match_empty() != 0) {
+				return -1;
+			}
+			step += GROUP_SIZE;
+			CRASH_COND(step > _slots.size());
+			pos = (pos + step) & mask;
+		}
+	}
+
+	unsigned int find_free_slot(uint64_t h) {
+		if (_slots.size() == 0) {
+			rehash();
+		}
+		const unsigned int mask = _slots.size() - 1;
+		unsigned int pos = h & mask;
+		unsigned int step = 0;
+
+		while (true) {
+			const GroupMask m = get_group(pos).match_empty_or_deleted();
+			if (m != 0) {
+				return (pos + lowest_bit_index(m)) & mask;
+			}
+			step += GROUP_SIZE;
+			CRASH_COND(step > _slots.size());
+			pos = (pos + step) & mask;
+		}
+	}
+
+	static inline unsigned int get_max_load(unsigned int capacity) {
+		// 7/8
+		return capacity - capacity / 8;
+	}
+
+	void rehash() {
+		unsigned int new_capacity = _slots.size() == 0 ? MIN_CAPACITY : _slots.size();
+		// If tombstones take most of the space, rebuilding at the same size is enough
+		if (_size + 1 > get_max_load(new_capacity) / 2) {
+			new_capacity *= 2;
+		}
+
+		std::vector<int8_t> old_ctrl;
+		std::vector<Slot> old_slots;
+		old_ctrl.swap(_ctrl);
+		old_slots.swap(_slots);
+
+		const int8_t empty = CTRL_EMPTY;
+		_ctrl.resize(new_capacity + GROUP_SIZE, empty);
+		_slots.resize(new_capacity);
+		_growth_left = get_max_load(new_capacity);
+
+		for (unsigned int i = 0; i < old_slots.size(); ++i) {
+			if (old_ctrl[i] >= 0) {
+				const Slot &old_slot = old_slots[i];
+				const uint64_t h = Hasher::hash(old_slot.key);
+				const unsigned int j = find_free_slot(h);
+				set_ctrl(j, get_h2(h));
+				_slots[j] = old_slot;
+				--_growth_left;
+			}
+		}
+	}
+
+	std::vector<int8_t> _ctrl;
+	std::vector<Slot> _slots;
+	unsigned int _size = 0;
+	// How many empty slots can still be taken before the table must be rehashed
+	unsigned int _growth_left = 0;
+};
+
+}
+
+#endif // VOXEL_FLAT_HASH_MAP_H
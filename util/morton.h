@@ -0,0 +1,46 @@
+#ifndef VOXEL_MORTON_H
+#define VOXEL_MORTON_H
+
+#include <cstdint>
+
+namespace Voxel {
+
+// Morton codes (Z-order curve) interleave the bits of 3D coordinates,
+// so positions close to each other in space tend to get close codes.
+
+// Spreads the 21 lowest bits of `v` so there are two zero bits between each of them
+inline uint64_t morton_spread_bits_3(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x1f00000000ffff;
+	v = (v | (v << 16)) & 0x1f0000ff0000ff;
+	v = (v | (v << 8)) & 0x100f00f00f00f00f;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3;
+	v = (v | (v << 2)) & 0x1249249249249249;
+	return v;
+}
+
+// Inverse of morton_spread_bits_3
+inline uint32_t morton_compact_bits_3(uint64_t v) {
+	v &= 0x1249249249249249;
+	v = (v | (v >> 2)) & 0x10c30c30c30c30c3;
+	v = (v | (v >> 4)) & 0x100f00f00f00f00f;
+	v = (v | (v >> 8)) & 0x1f0000ff0000ff;
+	v = (v | (v >> 16)) & 0x1f00000000ffff;
+	v = (v | (v >> 32)) & 0x1fffff;
+	return static_cast<uint32_t>(v);
+}
+
+// Only the 21 lowest bits of each coordinate are used
+inline uint64_t morton_encode_3(uint32_t x, uint32_t y, uint32_t z) {
+	return morton_spread_bits_3(x) | (morton_spread_bits_3(y) << 1) | (morton_spread_bits_3(z) << 2);
+}
+
+inline void morton_decode_3(uint64_t code, uint32_t &out_x, uint32_t &out_y, uint32_t &out_z) {
+	out_x = morton_compact_bits_3(code);
+	out_y = morton_compact_bits_3(code >> 1);
+	out_z = morton_compact_bits_3(code >> 2);
+}
+
+}
+
+#endif // VOXEL_MORTON_H
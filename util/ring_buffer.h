@@ -0,0 +1,71 @@
+#ifndef VOXEL_RING_BUFFER_H
+#define VOXEL_RING_BUFFER_H
+
+#include <core/error_macros.h>
+#include <vector>
+
+namespace Voxel {
+
+// First-in first-out queue stored in a circular array, so removing items doesn't move the others.
+// Capacity is a power of two, doubled when full.
+template <typename T>
+class RingBuffer {
+public:
+	inline unsigned int size() const {
+		return _count;
+	}
+
+	inline bool empty() const {
+		return _count == 0;
+	}
+
+	void push_back(const T &item) {
+		if (_count == _items.size()) {
+			grow();
+		}
+		_items[(_head + _count) & (_items.size() - 1)] = item;
+		++_count;
+	}
+
+	inline T &front() {
+		CRASH_COND(_count == 0);
+		return _items[_head];
+	}
+
+	inline const T &front() const {
+		CRASH_COND(_count == 0);
+		return _items[_head];
+	}
+
+	void pop_front() {
+		CRASH_COND(_count == 0);
+		// Don't keep references alive in unused slots
+		_items[_head] = T();
+		_head = (_head + 1) & (_items.size() - 1);
+		--_count;
+	}
+
+	void clear() {
+		_items.clear();
+		_head = 0;
+		_count = 0;
+	}
+
+private:
+	void grow() {
+		std::vector<T> items(_items.size() == 0 ? 16 : _items.size() * 2);
+		for (unsigned int i = 0; i < _count; ++i) {
+			items[i] = _items[(_head + i) & (_items.size() - 1)];
+		}
+		_items.swap(items);
+		_head = 0;
+	}
+
+	std::vector<T> _items;
+	unsigned int _head = 0;
+	unsigned int _count = 0;
+};
+
+}
+
+#endif // VOXEL_RING_BUFFER_H
@@ -143,6 +143,14 @@ inline bool is_surface_triangulated(Array surface) {
 	return positions.size() >= 3 && indices.size() >= 3;
 }
 
+// Adds a surface which was already converted to the format of the rendering server, so no vertex has to be processed
+inline void add_packed_surface(ArrayMesh &mesh, const RenderingServer::SurfaceData &surface) {
+	mesh.add_surface(surface.format, Mesh::PrimitiveType(surface.primitive),
+			surface.vertex_data, surface.vertex_count,
+			surface.index_data, surface.index_count,
+			surface.aabb);
+}
+
 inline bool is_mesh_empty(Ref<Mesh> mesh_ref) {
 	if (mesh_ref.is_null())
 		return true;
@@ -523,33 +523,23 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i
 				create_channel(channel_index, _size, channel.defval);
 			}
 
-			if (channel.depth == DEPTH_8_BIT) {
-				// Native format
-				// Copy row by row
-				Vector3i pos;
-				for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
-					for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
-						// Row direction is Y
-						unsigned int src_ri = other.index(pos.x + src_min.x, pos.y + src_min.y, pos.z + src_min.z);
-						unsigned int dst_ri = index(pos.x + dst_min.x, pos.y + dst_min.y, pos.z + dst_min.z);
-						memcpy(&channel.data[dst_ri], &other_channel.data[src_ri], area_size.y * sizeof(uint8_t));
-					}
-				}
-
-			} else {
-				// TODO Optimized versions
-				Vector3i pos;
-				for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
-					for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
-						for (pos.y = 0; pos.y < area_size.y; ++pos.y) {
-							uint64_t v = other.get_voxel(src_min + pos, channel_index);
-							set_voxel(v, dst_min + pos, channel_index);
-						}
-					}
+			// Both channels have the same depth, so rows can be copied as raw memory whatever the format is
+			const unsigned int item_size = Voxel::get_depth_bit_count(channel.depth) / 8;
+			const unsigned int row_size = area_size.y * item_size;
+
+			// Copy row by row
+			Vector3i pos;
+			for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
+				for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
+					// Row direction is Y
+					unsigned int src_ri = other.index(pos.x + src_min.x, pos.y + src_min.y, pos.z + src_min.z);
+					unsigned int dst_ri = index(pos.x + dst_min.x, pos.y + dst_min.y, pos.z + dst_min.z);
+					memcpy(&channel.data[dst_ri * item_size], &other_channel.data[src_ri * item_size], row_size);
 				}
 			}
 
-		} else if (channel.defval != other_channel.defval) {
+		} else if (channel.data != NULL || channel.defval != other_channel.defval) {
+			// The destination may hold other values in that area even if its default value is the same
 			if (channel.data == NULL) {
 				create_channel(channel_index, _size, channel.defval);
 			}
@@ -588,6 +578,14 @@ uint32_t VoxelBuffer::get_size_in_bytes_for_volume(Vector3i size, Depth depth) {
 	return size_in_bytes;
 }
 
+uint32_t VoxelBuffer::get_memory_usage() const {
+	uint32_t size_in_bytes = 0;
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		size_in_bytes += _channels[i].size_in_bytes;
+	}
+	return size_in_bytes;
+}
+
 void VoxelBuffer::create_channel_noinit(int i, Vector3i size) {
 	Channel &channel = _channels[i];
 	uint32_t size_in_bytes = get_size_in_bytes_for_volume(size, channel.depth);
@@ -31,6 +31,8 @@ public:
 		MAX_CHANNELS
 	};
 
+	static const uint32_t ALL_CHANNELS_MASK = (1 << MAX_CHANNELS) - 1;
+
 	// TODO use C++17 inline to initialize right here...
 	static const char *CHANNEL_ID_HINT_STRING;
 
@@ -86,6 +88,8 @@ public:
 	Compression get_channel_compression(unsigned int channel_index) const;
 
 	static uint32_t get_size_in_bytes_for_volume(Vector3i size, Depth depth);
+	// Bytes allocated for voxel data of all channels. Uniform channels don't allocate any.
+	uint32_t get_memory_usage() const;
 
 	void copy_from(const VoxelBuffer &other);
 	void copy_from(const VoxelBuffer &other, unsigned int channel_index);
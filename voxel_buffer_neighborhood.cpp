@@ -0,0 +1,109 @@
+#include "voxel_buffer_neighborhood.h"
+
+namespace Voxel {
+
+void VoxelBufferNeighborhood::create(unsigned int block_size_po2, const FixedArray<uint64_t, VoxelBuffer::MAX_CHANNELS> &default_values) {
+	clear();
+	_block_size_po2 = block_size_po2;
+	_default_values = default_values;
+}
+
+void VoxelBufferNeighborhood::clear() {
+	for (unsigned int i = 0; i < _buffers.size(); ++i) {
+		_buffers[i].unref();
+	}
+}
+
+void VoxelBufferNeighborhood::set_buffer(Vector3i offset, Ref<VoxelBuffer> buffer) {
+	ERR_FAIL_COND(offset.x < -1 || offset.y < -1 || offset.z < -1 || offset.x > 1 || offset.y > 1 || offset.z > 1);
+	if (buffer.is_valid()) {
+		ERR_FAIL_COND(buffer->get_size() != Vector3i(get_block_size()));
+	}
+	_buffers[get_buffer_index(offset)] = buffer;
+}
+
+bool VoxelBufferNeighborhood::get_area_uniform_value(
+		Vector3i min_block_pos, Vector3i max_block_pos, unsigned int channel_index, uint64_t &out_value) const {
+
+	bool first = true;
+	Vector3i bpos;
+	for (bpos.z = min_block_pos.z; bpos.z < max_block_pos.z; ++bpos.z) {
+		for (bpos.x = min_block_pos.x; bpos.x < max_block_pos.x; ++bpos.x) {
+			for (bpos.y = min_block_pos.y; bpos.y < max_block_pos.y; ++bpos.y) {
+
+				const VoxelBuffer *buffer = get_buffer(bpos);
+				uint64_t value;
+
+				if (buffer == nullptr) {
+					value = _default_values[channel_index];
+				} else if (buffer->get_channel_compression(channel_index) == VoxelBuffer::COMPRESSION_UNIFORM) {
+					value = buffer->get_voxel(0, 0, 0, channel_index);
+				} else {
+					// Not checking voxels one by one, it would cost about as much as copying them
+					return false;
+				}
+
+				if (first) {
+					out_value = value;
+					first = false;
+				} else if (value != out_value) {
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+void VoxelBufferNeighborhood::copy_to(VoxelBuffer &dst_buffer, Vector3i min_pos, unsigned int channels_mask) const {
+
+	const Vector3i max_pos = min_pos + dst_buffer.get_size();
+	ERR_FAIL_COND(dst_buffer.get_size().volume() == 0);
+
+	const Vector3i min_block_pos = min_pos >> _block_size_po2;
+	const Vector3i max_block_pos = ((max_pos - Vector3i(1)) >> _block_size_po2) + Vector3i(1);
+
+	ERR_FAIL_COND(min_block_pos.x < -1 || min_block_pos.y < -1 || min_block_pos.z < -1);
+	ERR_FAIL_COND(max_block_pos.x > 2 || max_block_pos.y > 2 || max_block_pos.z > 2);
+
+	const unsigned int block_size = get_block_size();
+	const Vector3i block_size_v(block_size);
+	const VoxelBuffer *central_buffer = get_central_buffer();
+
+	for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+		if (((1 << channel) & channels_mask) == 0) {
+			continue;
+		}
+
+		if (central_buffer != nullptr) {
+			dst_buffer.set_channel_depth(channel, central_buffer->get_channel_depth(channel));
+		}
+
+		uint64_t uniform_value;
+		if (get_area_uniform_value(min_block_pos, max_block_pos, channel, uniform_value)) {
+			// Typically air or ground. Meshers can detect it without reading voxels.
+			dst_buffer.clear_channel(channel, uniform_value);
+			continue;
+		}
+
+		Vector3i bpos;
+		for (bpos.z = min_block_pos.z; bpos.z < max_block_pos.z; ++bpos.z) {
+			for (bpos.x = min_block_pos.x; bpos.x < max_block_pos.x; ++bpos.x) {
+				for (bpos.y = min_block_pos.y; bpos.y < max_block_pos.y; ++bpos.y) {
+
+					const VoxelBuffer *buffer = get_buffer(bpos);
+					const Vector3i offset = bpos * block_size;
+
+					if (buffer != nullptr) {
+						dst_buffer.copy_from(*buffer, min_pos - offset, max_pos - offset, offset - min_pos, channel);
+					} else {
+						dst_buffer.fill_area(_default_values[channel], offset - min_pos, offset - min_pos + block_size_v, channel);
+					}
+				}
+			}
+		}
+	}
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef VOXEL_BUFFER_NEIGHBORHOOD_H
+#define VOXEL_BUFFER_NEIGHBORHOOD_H
+
+#include "voxel_buffer.h"
+
+namespace Voxel {
+
+// Read-only access to a block of voxels and its 26 neighbors, as if they were a single buffer.
+// Buffers are referenced, not copied. Terrain blocks copy their voxels before modifying them if they are referenced
+// elsewhere, so a neighborhood is a snapshot which can be read from another thread.
+class VoxelBufferNeighborhood {
+public:
+	static const unsigned int BUFFER_COUNT = 27;
+
+	// All buffers must be cubes of the same size, with the same channel depths.
+	// Default values are used where a neighbor is missing.
+	void create(unsigned int block_size_po2, const FixedArray<uint64_t, VoxelBuffer::MAX_CHANNELS> &default_values);
+	void clear();
+
+	static inline unsigned int get_buffer_index(Vector3i offset) {
+		return (offset.x + 1) + 3 * (offset.y + 1) + 9 * (offset.z + 1);
+	}
+
+	// Offset is the position of the block relative to the central one, from -1 to 1 on each axis
+	void set_buffer(Vector3i offset, Ref<VoxelBuffer> buffer);
+
+	inline const VoxelBuffer *get_buffer(Vector3i offset) const {
+		return _buffers[get_buffer_index(offset)].ptr();
+	}
+
+	inline const VoxelBuffer *get_central_buffer() const {
+		return get_buffer(Vector3i());
+	}
+
+	inline unsigned int get_block_size() const {
+		return 1 << _block_size_po2;
+	}
+
+	// Position is relative to the origin of the central block, and can reach one block further on each side.
+	inline uint64_t get_voxel(Vector3i pos, unsigned int channel_index) const {
+		const Vector3i offset = pos >> _block_size_po2;
+		ERR_FAIL_COND_V(offset.x < -1 || offset.y < -1 || offset.z < -1 || offset.x > 1 || offset.y > 1 || offset.z > 1, 0);
+		const VoxelBuffer *buffer = get_buffer(offset);
+		if (buffer == nullptr) {
+			return _default_values[channel_index];
+		}
+		const unsigned int mask = get_block_size() - 1;
+		return buffer->get_voxel(pos.x & mask, pos.y & mask, pos.z & mask, channel_index);
+	}
+
+	// Copies voxels of the area starting at min_pos and having the same size as dst_buffer.
+	// The area must be within the neighborhood, and will usually be the central block plus some padding.
+	// If all the blocks it touches are uniform with the same value, the channel is left uniform instead.
+	void copy_to(VoxelBuffer &dst_buffer, Vector3i min_pos, unsigned int channels_mask) const;
+
+private:
+	bool get_area_uniform_value(Vector3i min_block_pos, Vector3i max_block_pos, unsigned int channel_index, uint64_t &out_value) const;
+
+	FixedArray<Ref<VoxelBuffer>, BUFFER_COUNT> _buffers;
+	FixedArray<uint64_t, VoxelBuffer::MAX_CHANNELS> _default_values;
+	unsigned int _block_size_po2 = 0;
+};
+
+}
+
+#endif // VOXEL_BUFFER_NEIGHBORHOOD_H